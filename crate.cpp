@@ -14,6 +14,7 @@
 #include "storage/texture.h"
 #include "storage/shader.h"
 #include "storage/sound.h"
+#include "storage/shapecache.h"
 
 // Scene
 #include "scene/scene.h"
@@ -39,8 +40,7 @@ Crate::Crate(const Vector3f &pos, btDynamicsWorld *world, IID::Scene *scene, IID
   scene->update();
   
   // Create the crate's physical shape and body
-  Vector3f hs = crateMesh->getAABB().getHalfSize();
-  m_shape = new btBoxShape(btVector3(hs[0], hs[1], hs[2]));
+  m_shape = storage->shapes()->get(crateMesh, ShapeCache::BoxShape);
   float mass = 10.0;
   btVector3 localInertia(0, 0, 0);
   m_shape->calculateLocalInertia(mass, localInertia);
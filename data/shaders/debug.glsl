@@ -5,9 +5,20 @@ attribute vec3 Normal;
 attribute vec2 TexCoord;
 attribute vec3 Tangent;
 
+// Unpacking of compressed vertex formats (see Mesh::VertexFormat)
+uniform float QuantizedPositions;
+uniform float PackedNormals;
+uniform vec3 PositionOffset;
+uniform vec3 PositionScale;
+
+vec4 unpackVertex()
+{
+  return QuantizedPositions > 0.5 ? vec4(PositionOffset + Vertex.xyz * PositionScale, 1.0) : Vertex;
+}
+
 void main()
 {
-  gl_Position = gl_ProjectionMatrix * gl_ModelViewMatrix * Vertex;
+  gl_Position = gl_ProjectionMatrix * gl_ModelViewMatrix * unpackVertex();
 }
 
 [Fragment_Shader]
@@ -5,12 +5,28 @@ attribute vec3 Normal;
 attribute vec2 TexCoord;
 attribute vec3 Tangent;
 
+// Per-instance model-view transformation (used when Instanced is set)
+attribute mat4 InstanceModelView;
+uniform float Instanced;
+
 // Texture coordinates for the fragment shader
 varying vec2 FragTexCoord;
 
+// Unpacking of compressed vertex formats (see Mesh::VertexFormat)
+uniform float QuantizedPositions;
+uniform float PackedNormals;
+uniform vec3 PositionOffset;
+uniform vec3 PositionScale;
+
+vec4 unpackVertex()
+{
+  return QuantizedPositions > 0.5 ? vec4(PositionOffset + Vertex.xyz * PositionScale, 1.0) : Vertex;
+}
+
 void main()
 {
-  gl_Position = gl_ProjectionMatrix * gl_ModelViewMatrix * Vertex;
+  mat4 modelView = Instanced > 0.5 ? InstanceModelView : gl_ModelViewMatrix;
+  gl_Position = gl_ProjectionMatrix * modelView * unpackVertex();
   FragTexCoord = TexCoord;
   //Vertex;
   //FragTexCoord = vec2(1.0, -1.0) * TexCoord;
@@ -5,19 +5,53 @@ attribute vec3 Normal;
 attribute vec2 TexCoord;
 attribute vec3 Tangent;
 
+// Per-instance model-view transformation (used when Instanced is set)
+attribute mat4 InstanceModelView;
+uniform float Instanced;
+
 varying vec4 diffuse,ambientGlobal,ambient;
 varying vec3 normal,lightDir,halfVector;
 varying float dist;
 
+// Unpacking of compressed vertex formats (see Mesh::VertexFormat)
+uniform float QuantizedPositions;
+uniform float PackedNormals;
+uniform vec3 PositionOffset;
+uniform vec3 PositionScale;
+
+vec4 unpackVertex()
+{
+  return QuantizedPositions > 0.5 ? vec4(PositionOffset + Vertex.xyz * PositionScale, 1.0) : Vertex;
+}
+
+vec3 unpackNormal()
+{
+  if (PackedNormals < 0.5)
+    return Normal;
+  
+  // Octahedral mapping
+  vec3 n = vec3(Normal.xy, 1.0 - abs(Normal.x) - abs(Normal.y));
+  if (n.z < 0.0)
+    n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+  
+  return normalize(n);
+}
+
 void main()
 {       
   vec4 ecPos;
   vec3 aux;
+  mat4 modelView = Instanced > 0.5 ? InstanceModelView : gl_ModelViewMatrix;
+  vec3 vertexNormal = unpackNormal();
   
-  normal = normalize(gl_NormalMatrix * Normal);
+  /* instances are never scaled non-uniformly, so the normal matrix is not needed */
+  if (Instanced > 0.5)
+    normal = normalize((modelView * vec4(vertexNormal, 0.0)).xyz);
+  else
+    normal = normalize(gl_NormalMatrix * vertexNormal);
   
   /* these are the new lines of code to compute the light's direction */
-  ecPos = gl_ModelViewMatrix * Vertex;
+  ecPos = modelView * unpackVertex();
   aux = vec3(gl_LightSource[0].position - ecPos);
   lightDir = normalize(aux);
   dist = length(aux);
@@ -32,7 +66,7 @@ void main()
   ambient = gl_FrontMaterial.ambient * gl_LightSource[0].ambient;
   ambientGlobal = gl_LightModel.ambient * gl_FrontMaterial.ambient;
   
-  gl_Position = gl_ProjectionMatrix * gl_ModelViewMatrix * Vertex;
+  gl_Position = gl_ProjectionMatrix * ecPos;
 }
 
 [Fragment_Shader]
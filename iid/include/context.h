@@ -28,6 +28,8 @@ class EventDispatcher;
 class SoundContext;
 class TriggerManager;
 class GameStateManager;
+class FrameAllocator;
+class ThreadPool;
 
 namespace GUI {
   class Manager;
@@ -106,6 +108,17 @@ public:
      */
     GameStateManager *getGameStateManager() const { return m_gameStateManager; }
     
+    /**
+     * Returns the frame allocator used for per-frame scratch data. All
+     * memory obtained from it is released at the start of the next frame.
+     */
+    FrameAllocator *getFrameAllocator() const { return m_frameAllocator; }
+    
+    /**
+     * Returns the worker thread pool.
+     */
+    ThreadPool *getThreadPool() const { return m_threadPool; }
+    
     /**
      * Sets debugging flag.
      *
@@ -159,6 +172,12 @@ private:
     // Local item storage instance
     Storage *m_storage;
     
+    // Per-frame scratch memory
+    FrameAllocator *m_frameAllocator;
+    
+    // Worker threads
+    ThreadPool *m_threadPool;
+    
     // Scene instance
     Scene *m_scene;
     
@@ -180,6 +180,16 @@ public:
  */
 class DShader {
 public:
+    /**
+     * Possible vertex attribute component types.
+     */
+    enum AttributeType {
+      Float,
+      HalfFloat,
+      Short,
+      UnsignedShort
+    };
+    
     /**
      * Class constructor.
      *
@@ -214,6 +224,20 @@ public:
      */
     virtual void bindAttributePointer(const char *variable, int size, int stride, int offset) = 0;
     
+    /**
+     * Binds a vertex attribute pointer with packed components to a shader.
+     * The shader must be currently bound.
+     *
+     * @param variable Attribute variable name
+     * @param size Number of components per variable
+     * @param type Component type
+     * @param normalized Should integer components be mapped to [0, 1] or [-1, 1]
+     * @param stride Gap in bytes between consecutive records
+     * @param offset Offset into the vertex buffer
+     */
+    virtual void bindAttributePointer(const char *variable, int size, AttributeType type, bool normalized,
+                                      int stride, int offset) = 0;
+    
     /**
      * Binds a vertex attribute location to a shader. The shader must be currently
      * bound.
@@ -231,6 +255,35 @@ public:
      * @param values Values to set to the variable
      */
     virtual void setUniform(const char *name, int size, float *values) = 0;
+    
+    /**
+     * Returns true if the shader program has an active attribute variable
+     * with the specified name.
+     *
+     * @param variable Attribute variable name
+     */
+    virtual bool hasAttribute(const char *variable) = 0;
+    
+    /**
+     * Binds a per-instance matrix attribute pointer to a shader. Each matrix
+     * column occupies one vec4 attribute slot and advances once per drawn
+     * instance instead of once per vertex. The shader must be currently bound.
+     *
+     * @param variable Attribute variable name
+     * @param columns Number of vec4 columns in the matrix
+     * @param stride Gap in bytes between consecutive instance records
+     * @param offset Offset into the vertex buffer
+     */
+    virtual void bindInstanceAttributePointer(const char *variable, int columns, int stride, int offset) = 0;
+    
+    /**
+     * Disables a per-instance matrix attribute previously bound with
+     * bindInstanceAttributePointer.
+     *
+     * @param variable Attribute variable name
+     * @param columns Number of vec4 columns in the matrix
+     */
+    virtual void unbindInstanceAttributePointer(const char *variable, int columns) = 0;
 };
 
 // Used for returning font bounding box
@@ -278,6 +331,14 @@ public:
       Lines
     };
     
+    /**
+     * Type of indices in index buffers.
+     */
+    enum IndexType {
+      UnsignedShortIndex,
+      UnsignedIntIndex
+    };
+    
     /**
      * Class constructor.
      *
@@ -403,8 +464,32 @@ public:
      * @param count Number of elements to draw
      * @param offset Buffer start offset
      * @param primitive What kind of primitive to draw
+     * @param type Type of indices
      */
-    virtual void drawElements(int count, unsigned int offset, DrawPrimitive primitive) const = 0;
+    virtual void drawElements(int count, unsigned int offset, DrawPrimitive primitive, IndexType type) const = 0;
+    
+    /**
+     * Draws multiple instances of elements from the currently bound index
+     * buffer. Per-instance data must be bound via shader instance attributes.
+     *
+     * @param count Number of elements to draw
+     * @param offset Buffer start offset
+     * @param primitive What kind of primitive to draw
+     * @param type Type of indices
+     * @param instances Number of instances to draw
+     */
+    virtual void drawElementsInstanced(int count, unsigned int offset, DrawPrimitive primitive, IndexType type,
+                                       int instances) const = 0;
+    
+    /**
+     * Returns true if the driver supports instanced drawing.
+     */
+    virtual bool hasInstancing() const = 0;
+    
+    /**
+     * Returns true if the driver supports half-float vertex attributes.
+     */
+    virtual bool hasHalfFloatVertices() const = 0;
     
     /**
      * Apply given model-view transformation.
@@ -429,7 +514,7 @@ public:
      * @param emission Emission
      */
     virtual void applyMaterial(const float *ambient, const float *diffuse, const float *specular,
-                               const float *emission) const = 0;
+                               const float *emission) = 0;
     
     /**
      * Sets the ambient light.
@@ -448,6 +533,14 @@ public:
      */
     virtual void setupLights(const LightList &lights, unsigned short limit) = 0;
     
+    /**
+     * Forgets which lights are currently set up, so the next call to
+     * setupLights respecifies all of them. This must be called whenever
+     * the view transformation or light parameters change, since light
+     * positions are stored in view space.
+     */
+    virtual void invalidateLights() = 0;
+    
     /**
      * Returns the currently active shader or NULL if there is no such shader.
      */
@@ -492,13 +585,27 @@ public:
     virtual DFont *createFont(const std::string &path, unsigned short size) = 0;
     
     /**
-     * Draws the state of the given particle emitter.
+     * Sets up render state for drawing particles. Must be called once
+     * before a sequence of drawParticles calls.
+     */
+    virtual void beginParticles() = 0;
+    
+    /**
+     * Draws a batch of particle billboards using the currently bound
+     * texture and shader.
      *
-     * @param size Size of the vertex and color arrays
-     * @param vertices Array of packed vertex coordinates
-     * @param colors RGBA components for each vertex
+     * @param count Number of particles
+     * @param vertices Billboard vertices in view space; each particle has
+     *                 four vertices (top right, top left, bottom left,
+     *                 bottom right) made of a position (3 floats), texture
+     *                 coordinates (2 floats) and an RGBA color (4 floats)
      */
-    virtual void drawParticles(int size, float *vertices, float *colors) = 0;
+    virtual void drawParticles(int count, const float *vertices) = 0;
+    
+    /**
+     * Restores render state after drawing particles.
+     */
+    virtual void endParticles() = 0;
 private:
     std::string m_name;
 public:
@@ -511,7 +618,7 @@ public:
  */
 class Player {
 public:
-    
+
     enum PlayMode {
         Once,
         Looped
@@ -602,7 +709,7 @@ protected:
  */
 class Listener {
 public:
-    
+
     /**
      * Class constructor.
      */
@@ -93,6 +93,16 @@ public:
      */
     void init();
     
+    /**
+     * Creates the buffer from already decoded PCM samples.
+     *
+     * @param format OpenAL sample format
+     * @param data Sample data
+     * @param size Size of sample data in bytes
+     * @param frequency Sampling frequency
+     */
+    void initFromData(ALenum format, const void *data, ALsizei size, ALsizei frequency);
+    
     /**
      * Get the buffer id.
      */
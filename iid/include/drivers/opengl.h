@@ -18,7 +18,8 @@ class btIDebugDraw;
 namespace IID {
 
 class ParticleEmitter;
-    
+class OpenGLDriver;
+
 /**
  * OpenGL texture handle.
  */
@@ -27,9 +28,10 @@ public:
     /**
      * Class constructor.
      *
+     * @param driver OpenGL driver instance
      * @param format Texture format
      */
-    OpenGLTexture(Format format);
+    OpenGLTexture(OpenGLDriver *driver, Format format);
     
     /**
      * Class destructor.
@@ -80,6 +82,9 @@ protected:
     GLenum paramToOpenGL(Parameter param) const;
     GLenum valueToOpenGL(Value val) const;
 private:
+    // Driver instance that tracks bound state
+    OpenGLDriver *m_driver;
+    
     // OpenGL texture handle
     GLuint m_handle;
     
@@ -95,12 +100,13 @@ public:
     /**
      * Class constructor.
      *
+     * @param driver OpenGL driver instance
      * @param size Number of bytes in data
      * @param data Raw data to be stored in the buffer
      * @param usage Buffer usage hint
      * @param target Buffer bind target
      */
-    OpenGLVertexBuffer(size_t size, unsigned char *data, UsageHint usage, Target target);
+    OpenGLVertexBuffer(OpenGLDriver *driver, size_t size, unsigned char *data, UsageHint usage, Target target);
     
     /**
      * Class destructor.
@@ -125,6 +131,7 @@ protected:
     GLenum usageToOpenGL(UsageHint usage) const;
     GLenum targetToOpenGL(Target target) const;
 private:
+    OpenGLDriver *m_driver;
     GLuint m_handle;
     GLenum m_target;
 };
@@ -138,10 +145,11 @@ public:
     /**
      * Class constructor.
      *
+     * @param driver OpenGL driver instance
      * @param srcVertex Vertex shader source
      * @param srcFragment Fragment shader source
      */
-    OpenGLShader(const char *srcVertex, const char *srcFragment);
+    OpenGLShader(OpenGLDriver *driver, const char *srcVertex, const char *srcFragment);
     
     /**
      * Class destructor.
@@ -169,6 +177,20 @@ public:
      */
     void bindAttributePointer(const char *variable, int size, int stride, int offset);
     
+    /**
+     * Binds a vertex attribute pointer with packed components to a shader.
+     * The shader must be currently bound.
+     *
+     * @param variable Attribute variable name
+     * @param size Number of components per variable
+     * @param type Component type
+     * @param normalized Should integer components be mapped to [0, 1] or [-1, 1]
+     * @param stride Gap in bytes between consecutive records
+     * @param offset Offset into the vertex buffer
+     */
+    void bindAttributePointer(const char *variable, int size, AttributeType type, bool normalized,
+                              int stride, int offset);
+    
     /**
      * Binds a vertex attribute location to a shader. The shader must be currently
      * bound.
@@ -186,10 +208,65 @@ public:
      * @param values Values to set to the variable
      */
     void setUniform(const char *name, int size, float *values);
+    
+    /**
+     * Returns true if the shader program has an active attribute variable
+     * with the specified name.
+     *
+     * @param variable Attribute variable name
+     */
+    bool hasAttribute(const char *variable);
+    
+    /**
+     * Binds a per-instance matrix attribute pointer to a shader. Each matrix
+     * column occupies one vec4 attribute slot and advances once per drawn
+     * instance instead of once per vertex. The shader must be currently bound.
+     *
+     * @param variable Attribute variable name
+     * @param columns Number of vec4 columns in the matrix
+     * @param stride Gap in bytes between consecutive instance records
+     * @param offset Offset into the vertex buffer
+     */
+    void bindInstanceAttributePointer(const char *variable, int columns, int stride, int offset);
+    
+    /**
+     * Disables a per-instance matrix attribute previously bound with
+     * bindInstanceAttributePointer.
+     *
+     * @param variable Attribute variable name
+     * @param columns Number of vec4 columns in the matrix
+     */
+    void unbindInstanceAttributePointer(const char *variable, int columns);
 protected:
     GLuint compileShader(const char *source, GLenum type) const;
+    
+    /**
+     * Caches locations of all active uniforms and attributes. Must be
+     * called after the program has been linked.
+     */
+    void cacheLocations();
+    
+    /**
+     * Returns the cached location of an attribute or -1 when the
+     * program has no such active attribute.
+     *
+     * @param variable Attribute variable name
+     */
+    GLint attributeLocation(const char *variable) const;
 private:
+    OpenGLDriver *m_driver;
     GLuint m_handle;
+    
+    // Uniform locations and last uploaded values
+    struct UniformInfo {
+      GLint location;
+      int size;
+      float values[4];
+    };
+    boost::unordered_map<std::string, UniformInfo> m_uniforms;
+    
+    // Attribute locations
+    boost::unordered_map<std::string, GLint> m_attributes;
 };
 
 /**
@@ -200,9 +277,10 @@ public:
     /**
      * Class constructor.
      *
+     * @param driver OpenGL driver instance
      * @param font FTGL font object
      */
-    OpenGLFont(FTTextureFont *font);
+    OpenGLFont(OpenGLDriver *driver, FTTextureFont *font);
     
     /**
      * Class destructor.
@@ -225,6 +303,7 @@ public:
      */
     FontMetrics getBoundingBox(const std::string &text) const;
 private:
+    OpenGLDriver *m_driver;
     FTTextureFont *m_font;
 };
 
@@ -344,8 +423,31 @@ public:
      * @param count Number of elements to draw
      * @param offset Buffer start offset
      * @param primitive What kind of primitive to draw
+     * @param type Type of indices
+     */
+    void drawElements(int count, unsigned int offset, DrawPrimitive primitive, IndexType type) const;
+    
+    /**
+     * Draws multiple instances of elements from the currently bound index
+     * buffer. Per-instance data must be bound via shader instance attributes.
+     *
+     * @param count Number of elements to draw
+     * @param offset Buffer start offset
+     * @param primitive What kind of primitive to draw
+     * @param type Type of indices
+     * @param instances Number of instances to draw
+     */
+    void drawElementsInstanced(int count, unsigned int offset, DrawPrimitive primitive, IndexType type, int instances) const;
+    
+    /**
+     * Returns true if the driver supports instanced drawing.
      */
-    void drawElements(int count, unsigned int offset, DrawPrimitive primitive) const;
+    bool hasInstancing() const { return m_instancing; }
+    
+    /**
+     * Returns true if the driver supports half-float vertex attributes.
+     */
+    bool hasHalfFloatVertices() const { return m_halfFloatVertices; }
     
     /**
      * Apply given model-view transformation.
@@ -370,7 +472,7 @@ public:
      * @param emission Emission
      */
     void applyMaterial(const float *ambient, const float *diffuse, const float *specular,
-                       const float *emission) const;
+                       const float *emission);
     
     /**
      * Sets the ambient light.
@@ -389,6 +491,11 @@ public:
      */
     void setupLights(const LightList &lights, unsigned short limit);
     
+    /**
+     * Forgets which lights are currently set up.
+     */
+    void invalidateLights();
+    
     /**
      * Returns the currently active shader or NULL if there is no such shader.
      */
@@ -433,13 +540,83 @@ public:
     DFont *createFont(const std::string &path, unsigned short size);
     
     /**
-     * Draws the state of the given particle emitter.
+     * Sets up render state for drawing particles.
+     */
+    void beginParticles();
+    
+    /**
+     * Draws a batch of particle billboards.
+     *
+     * @param count Number of particles
+     * @param vertices Billboard vertices in view space
+     */
+    void drawParticles(int count, const float *vertices);
+    
+    /**
+     * Restores render state after drawing particles.
+     */
+    void endParticles();
+    
+    /**
+     * Makes the specified shader program current unless it already is.
+     *
+     * @param shader Shader to use or NULL for fixed function
+     */
+    void useProgram(OpenGLShader *shader);
+    
+    /**
+     * Binds a buffer object to a target unless it is already bound.
+     *
+     * @param target Buffer bind target
+     * @param handle Buffer object handle
+     */
+    void bindBuffer(GLenum target, GLuint handle);
+    
+    /**
+     * Binds a texture to a texture unit unless it is already bound.
+     *
+     * @param unit Texture unit
+     * @param target Texture target
+     * @param handle Texture object handle
+     */
+    void bindTexture(int unit, GLenum target, GLuint handle);
+    
+    /**
+     * Enables or disables a generic vertex attribute array unless it
+     * is already in the requested state.
      *
-     * @param size Size of the vertex and color arrays
-     * @param vertices Array of packed vertex coordinates
-     * @param colors RGBA components for each vertex
+     * @param index Attribute index
+     * @param enabled True to enable, false to disable
      */
-    void drawParticles(int size, float *vertices, float *colors);
+    void setVertexAttribArray(GLuint index, bool enabled);
+    
+    /**
+     * Removes a deleted buffer object from the state cache.
+     *
+     * @param handle Buffer object handle
+     */
+    void forgetBuffer(GLuint handle);
+    
+    /**
+     * Removes a deleted texture from the state cache.
+     *
+     * @param handle Texture object handle
+     */
+    void forgetTexture(GLuint handle);
+    
+    /**
+     * Removes a shader program about to be deleted from the state cache,
+     * deactivating it when it is in use.
+     *
+     * @param shader Shader program
+     */
+    void forgetProgram(OpenGLShader *shader);
+    
+    /**
+     * Invalidates cached texture bindings. Must be called after code outside
+     * the driver (FTGL for instance) changes texture state behind our back.
+     */
+    void invalidateTextureCache();
 protected:
     /**
      * A helper method for setting up OpenGL lights.
@@ -451,15 +628,30 @@ protected:
      */
     void setupGLLightPositionDirection(GLenum index, Light *light);
 private:
-    // A map of shader programs
-    boost::unordered_map<GLuint, OpenGLShader*> m_shaders;
-    
     // Debug drawer for Bullet dynamics
     btIDebugDraw *m_debugDrawer;
     
     // Lighting slots
     Light *m_lights[8];
     unsigned short m_currentLights;
+    
+    // Instanced drawing and half-float vertex attribute support
+    bool m_instancing;
+    bool m_halfFloatVertices;
+    
+    // Shadow copy of bound state used to skip redundant API calls
+    OpenGLShader *m_currentProgram;
+    GLuint m_arrayBuffer;
+    GLuint m_elementBuffer;
+    int m_activeTextureUnit;
+    GLuint m_boundTextures[8];
+    unsigned int m_enabledAttributes;
+    float m_material[4][4];
+    bool m_materialValid;
+    
+    // Streamed particle vertex buffer used as a ring
+    GLuint m_particleBuffer;
+    size_t m_particleBufferOffset;
 };
 
 }
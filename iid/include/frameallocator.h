@@ -0,0 +1,181 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_FRAMEALLOCATOR_H
+#define IID_FRAMEALLOCATOR_H
+
+#include <vector>
+#include <new>
+#include <stddef.h>
+
+namespace IID {
+
+/**
+ * A linear allocator for data that only lives for the duration of a
+ * single frame. Allocation simply bumps a pointer and all memory is
+ * released at once when the allocator is reset at the start of the
+ * next frame. Destructors of objects allocated here are never run.
+ */
+class FrameAllocator {
+public:
+    /**
+     * Class constructor.
+     *
+     * @param capacity Initial arena capacity in bytes
+     */
+    FrameAllocator(size_t capacity = 1 << 20);
+    
+    /**
+     * Class destructor.
+     */
+    ~FrameAllocator();
+    
+    /**
+     * Allocates a block of memory that stays valid until the next reset.
+     *
+     * @param size Size of the block in bytes
+     * @param alignment Required alignment (must be a power of two)
+     * @return A pointer to the allocated block
+     */
+    void *allocate(size_t size, size_t alignment = 16);
+    
+    /**
+     * Allocates and default-constructs an object of the given type.
+     */
+    template<typename T>
+    T *create() { return new (allocate(sizeof(T))) T(); }
+    
+    /**
+     * Releases all allocations made since the last reset. When the
+     * arena has overflown during the last frame, it is grown so the
+     * next frame fits without going to the heap.
+     */
+    void reset();
+    
+    /**
+     * Returns the number of bytes allocated since the last reset.
+     */
+    size_t getUsed() const { return m_offset + m_overflowSize; }
+    
+    /**
+     * Returns the arena capacity in bytes.
+     */
+    size_t getCapacity() const { return m_capacity; }
+    
+    /**
+     * Returns the number of blocks that did not fit into the arena and
+     * were taken from the heap since the last reset.
+     */
+    unsigned int getOverflows() const { return m_overflows; }
+    
+    /**
+     * Returns the number of bytes allocated during the last completed
+     * frame (latched by reset).
+     */
+    size_t getLastFrameUsed() const { return m_lastUsed; }
+    
+    /**
+     * Returns the number of arena overflows during the last completed
+     * frame (latched by reset).
+     */
+    unsigned int getLastFrameOverflows() const { return m_lastOverflows; }
+    
+    /**
+     * Returns the number of all heap allocations made through operator
+     * new by any thread during the last completed frame. This should be
+     * zero in steady state. Only available in debug builds.
+     */
+    unsigned long getLastFrameHeapAllocations() const { return m_lastHeapAllocations; }
+    
+    /**
+     * Returns true if heap allocations are being counted.
+     */
+    static bool countsHeapAllocations();
+private:
+    // Arena
+    unsigned char *m_buffer;
+    size_t m_capacity;
+    size_t m_offset;
+    
+    // Blocks that did not fit into the arena
+    std::vector<unsigned char*> m_overflow;
+    size_t m_overflowSize;
+    
+    // Debug counters for the current and the last completed frame
+    unsigned int m_overflows;
+    unsigned long m_heapAllocationsAtReset;
+    size_t m_lastUsed;
+    unsigned int m_lastOverflows;
+    unsigned long m_lastHeapAllocations;
+};
+
+/**
+ * STL allocator adapter that takes memory from a frame allocator, so
+ * containers holding per-frame data do not touch the heap. Deallocation
+ * is a no-op; containers using it must be emptied before the frame
+ * allocator is reset.
+ */
+template<typename T>
+class FrameStlAllocator {
+public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    
+    template<typename U>
+    struct rebind {
+      typedef FrameStlAllocator<U> other;
+    };
+    
+    /**
+     * Class constructor.
+     *
+     * @param allocator Frame allocator to take memory from
+     */
+    FrameStlAllocator(FrameAllocator *allocator)
+      : m_allocator(allocator)
+    {}
+    
+    /**
+     * Copy constructor for rebound allocators.
+     */
+    template<typename U>
+    FrameStlAllocator(const FrameStlAllocator<U> &other)
+      : m_allocator(other.m_allocator)
+    {}
+    
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+    
+    pointer allocate(size_type n, const void* = 0)
+    {
+      return static_cast<pointer>(m_allocator->allocate(n * sizeof(T)));
+    }
+    
+    void deallocate(pointer, size_type) {}
+    
+    size_type max_size() const { return size_t(-1) / sizeof(T); }
+    
+    void construct(pointer p, const T &value) { new (p) T(value); }
+    void destroy(pointer p) { p->~T(); }
+    
+    template<typename U>
+    bool operator==(const FrameStlAllocator<U> &other) const { return m_allocator == other.m_allocator; }
+    
+    template<typename U>
+    bool operator!=(const FrameStlAllocator<U> &other) const { return m_allocator != other.m_allocator; }
+    
+    // Frame allocator used for allocations
+    FrameAllocator *m_allocator;
+};
+
+}
+
+#endif
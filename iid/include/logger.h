@@ -43,9 +43,6 @@ public:
 private:
     // Currently active module identifier
     std::string m_module;
-    
-    // Time info buffer
-    char m_timeBuffer[80];
 };
 
 }
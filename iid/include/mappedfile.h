@@ -0,0 +1,80 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_MAPPEDFILE_H
+#define IID_MAPPEDFILE_H
+
+#include <string>
+#include <stddef.h>
+
+namespace IID {
+
+/**
+ * A read-only memory mapping of a whole file. The mapping is released
+ * when the instance is closed or destroyed.
+ */
+class MappedFile {
+public:
+    /**
+     * Class constructor.
+     */
+    MappedFile();
+    
+    /**
+     * Class destructor.
+     */
+    ~MappedFile();
+    
+    /**
+     * Maps the specified file into memory. Any previous mapping is
+     * released first. Writable mappings are private, so changes are never
+     * written back to the file and only modified pages are copied.
+     *
+     * @param filename Path to the file
+     * @param writable Should the mapping be writable
+     * @return True if the file has been mapped
+     */
+    bool open(const std::string &filename, bool writable = false);
+    
+    /**
+     * Releases the mapping.
+     */
+    void close();
+    
+    /**
+     * Returns true if a file is currently mapped.
+     */
+    bool isOpen() const { return m_data != 0; }
+    
+    /**
+     * Returns a pointer to the mapped contents.
+     */
+    const unsigned char *data() const { return m_data; }
+    
+    /**
+     * Returns a pointer to the mapped contents or NULL if the mapping is
+     * not writable.
+     */
+    unsigned char *writableData() const { return m_writable ? m_data : 0; }
+    
+    /**
+     * Returns the size of the mapped file in bytes.
+     */
+    size_t size() const { return m_size; }
+private:
+    // Mappings can not be copied
+    MappedFile(const MappedFile &other);
+    MappedFile &operator=(const MappedFile &other);
+    
+    // Mapped contents
+    unsigned char *m_data;
+    size_t m_size;
+    bool m_writable;
+};
+
+}
+
+#endif
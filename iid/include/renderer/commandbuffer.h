@@ -0,0 +1,163 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_RENDERER_COMMANDBUFFER_H
+#define IID_RENDERER_COMMANDBUFFER_H
+
+#include "globals.h"
+#include "scene/light.h"
+
+#include <vector>
+
+namespace IID {
+
+class Shader;
+class Texture;
+class Material;
+class Mesh;
+
+/**
+ * A single recorded render command.
+ */
+struct RenderCommand {
+    enum Type {
+      BindShader,
+      BindTexture,
+      BindMaterial,
+      BindMesh,
+      SetLights,
+      Draw,
+      DrawInstanced
+    };
+    
+    Type type;
+    
+    // Command argument
+    union {
+      Shader *shader;
+      Texture *texture;
+      Material *material;
+      Mesh *mesh;
+      const LightList *lights;
+    };
+    
+    // Index of the first world transformation and number of
+    // transformations used by draw commands
+    int transform;
+    int count;
+};
+
+/**
+ * A command buffer holds a recorded sequence of render commands that
+ * does not depend on any particular driver. Recording does not touch
+ * the driver, so buffers can be filled on worker threads and replayed
+ * later by the state batcher. World transformations are captured at
+ * record time, while the view transformation is applied on replay, so
+ * buffers of static geometry remain valid when the camera moves.
+ */
+class CommandBuffer {
+public:
+    /**
+     * Class constructor.
+     */
+    CommandBuffer();
+    
+    /**
+     * Removes all recorded commands. Allocated storage is kept for
+     * reuse.
+     */
+    void clear();
+    
+    /**
+     * Returns true if there are no recorded commands.
+     */
+    bool isEmpty() const { return m_commands.empty(); }
+    
+    /**
+     * Records a shader change.
+     *
+     * @param shader Shader instance
+     */
+    void bindShader(Shader *shader);
+    
+    /**
+     * Records a texture change.
+     *
+     * @param texture Texture instance or NULL
+     */
+    void bindTexture(Texture *texture);
+    
+    /**
+     * Records a material change.
+     *
+     * @param material Material instance or NULL
+     */
+    void bindMaterial(Material *material);
+    
+    /**
+     * Records a mesh change.
+     *
+     * @param mesh Mesh instance
+     */
+    void bindMesh(Mesh *mesh);
+    
+    /**
+     * Records a light setup. The list must stay valid until the buffer
+     * is replayed.
+     *
+     * @param lights Lights affecting the following draws
+     */
+    void setLights(const LightList *lights);
+    
+    /**
+     * Stores a world transformation for use by draw commands.
+     *
+     * @param transform World transformation
+     * @return Index of the stored transformation
+     */
+    int addTransform(const Transform3f &transform);
+    
+    /**
+     * Records a draw of the currently bound mesh.
+     *
+     * @param transform Index of the world transformation
+     */
+    void draw(int transform);
+    
+    /**
+     * Records an instanced draw of the currently bound mesh.
+     *
+     * @param transform Index of the first instance's world transformation
+     * @param count Number of instances (their transformations must be
+     *              stored consecutively)
+     */
+    void drawInstanced(int transform, int count);
+    
+    /**
+     * Returns the recorded commands.
+     */
+    const std::vector<RenderCommand> &commands() const { return m_commands; }
+    
+    /**
+     * Returns a pointer to the stored world transformation matrix.
+     *
+     * @param index Transformation index
+     */
+    const float *transform(int index) const { return &m_transforms[index * 16]; }
+private:
+    /**
+     * Appends a new command.
+     */
+    RenderCommand &push(RenderCommand::Type type);
+    
+    // Recorded commands and world transformations
+    std::vector<RenderCommand> m_commands;
+    std::vector<float> m_transforms;
+};
+
+}
+
+#endif
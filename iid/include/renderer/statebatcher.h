@@ -8,11 +8,15 @@
 #define IID_RENDERER_STATEBATCHER_H
 
 #include "globals.h"
+#include "frameallocator.h"
 #include "scene/light.h"
 #include "renderer/rendrable.h"
 
 #include <set>
 #include <list>
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
 
 namespace IID {
 
@@ -25,6 +29,8 @@ class Material;
 class Driver;
 class ParticleEmitter;
 class Light;
+class DVertexBuffer;
+class CommandBuffer;
 
 struct RenderQueueParticles {
     Shader *shader;
@@ -33,13 +39,27 @@ struct RenderQueueParticles {
     float *vertices;
     float *colors;
     Transform3f transform;
-  
+    
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
+/**
+ * A render queue entry. Affecting lights are resolved once when the
+ * rendrable is queued and identical light sets share the same id, so
+ * sorting and batching never have to compare light lists.
+ */
+struct RenderQueueEntry {
+    Rendrable *rendrable;
+    const LightList *lights;
+    unsigned int lightSet;
+};
+
 struct RenderQueueCompare {
-  bool operator()(Rendrable *n1, Rendrable *n2)
+  bool operator()(const RenderQueueEntry &e1, const RenderQueueEntry &e2) const
   {
+    Rendrable *n1 = e1.rendrable;
+    Rendrable *n2 = e2.rendrable;
+    
     // Compare shaders first
     Shader *shader1 = n1->getShader();
     Shader *shader2 = n2->getShader();
@@ -58,22 +78,30 @@ struct RenderQueueCompare {
     if (mat1 != mat2)
       return mat1 < mat2;
     
-    // Compare meshes last
+    // Compare meshes fourth
     Mesh *mesh1 = n1->getMesh();
     Mesh *mesh2 = n2->getMesh();
     if (mesh1 != mesh2)
       return mesh1 < mesh2;
     
-    return true;
+    // Compare light sets last
+    return e1.lightSet < e2.lightSet;
   }
 };
 
+// Render queue; rendrables with identical state end up adjacent
+typedef std::multiset<RenderQueueEntry, RenderQueueCompare, FrameStlAllocator<RenderQueueEntry> > RenderQueue;
+typedef std::list<RenderQueueParticles*, FrameStlAllocator<RenderQueueParticles*> > ParticleQueue;
+typedef std::vector<RenderQueueEntry> RenderQueueList;
+
 /**
  * State batcher is used to batch render requests in such a way so
  * render state changes are minimized.
  */
 class StateBatcher {
 public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    
     /**
      * Class constructor.
      *
@@ -81,6 +109,11 @@ public:
      */
     StateBatcher(Scene *scene);
     
+    /**
+     * Class destructor.
+     */
+    ~StateBatcher();
+    
     /**
      * Adds a rendrable object to the render queue.
      *
@@ -106,13 +139,130 @@ public:
      * render queue is cleared.
      */
     void render();
+protected:
+    /**
+     * Render state tracked while replaying command buffers.
+     */
+    struct RenderState {
+      Shader *shader;
+      Texture *texture;
+      Material *material;
+      Mesh *mesh;
+      
+      RenderState()
+        : shader(0), texture(0), material(0), mesh(0)
+      {}
+    };
+    
+    /**
+     * Records commands for a sorted slice of rendrables. This method
+     * does not touch the driver and may be called from worker threads.
+     *
+     * @param begin First rendrable in the slice
+     * @param end One past the last rendrable in the slice
+     * @param buffer Destination command buffer
+     */
+    void recordSlice(RenderQueueList::const_iterator begin, RenderQueueList::const_iterator end,
+                     CommandBuffer *buffer) const;
+    
+    /**
+     * Replays a command buffer against the driver.
+     *
+     * @param buffer Command buffer to replay
+     * @param state Current render state
+     * @param viewTransform Current view transformation
+     */
+    void replay(const CommandBuffer *buffer, RenderState &state, const Transform3f &viewTransform);
+    
+    /**
+     * Draws all queued particle emitters with one draw call per shader
+     * and texture combination.
+     *
+     * @param state Current render state
+     * @param viewTransform Current view transformation
+     */
+    void renderParticles(RenderState &state, const Transform3f &viewTransform);
+    
+    /**
+     * Appends view space billboards for live particles of an emitter to
+     * the particle vertex stream.
+     *
+     * @param p Particle emitter entry
+     * @param viewTransform Current view transformation
+     * @return Number of generated billboards
+     */
+    int generateBillboards(const RenderQueueParticles *p, const Transform3f &viewTransform);
+    
+    /**
+     * Returns true if two rendrables share all render state and can be
+     * drawn with a single instanced draw call. Instances must not be
+     * scaled non-uniformly, as shaders transform their normals with the
+     * model-view matrix.
+     *
+     * @param e1 First queue entry
+     * @param e2 Second queue entry
+     */
+    bool canInstance(const RenderQueueEntry &e1, const RenderQueueEntry &e2) const;
+    
+    /**
+     * Returns the id of a light set. Ids of known light sets are kept
+     * across frames.
+     *
+     * @param lights Light list
+     */
+    unsigned int lightSetId(const LightList &lights);
+    
+    /**
+     * Draws a run of rendrables sharing the same state as one instanced
+     * draw call. Shader must already be bound.
+     *
+     * @param mesh Mesh to draw
+     * @param buffer Command buffer holding the transformations
+     * @param transform Index of the first instance's transformation
+     * @param count Number of instances
+     * @param viewTransform Current view transformation
+     */
+    void renderInstanced(Mesh *mesh, const CommandBuffer *buffer, int transform, int count,
+                         const Transform3f &viewTransform);
+    
+    /**
+     * Sets up lights for the given rendrable unless the same light set
+     * is already active.
+     *
+     * @param lights Lights affecting the rendrable
+     * @param viewTransform Current view transformation
+     */
+    void setupLights(const LightList &lights, const Transform3f &viewTransform);
 private:
     Scene *m_scene;
     Context *m_context;
     
     // Render queue
-    std::set<Rendrable*, RenderQueueCompare> m_renderQueue;
-    std::list<RenderQueueParticles*> m_emitters;
+    RenderQueue m_renderQueue;
+    ParticleQueue m_emitters;
+    
+    // Sorted render queue and command buffers recorded from it (one per
+    // slice)
+    RenderQueueList m_sortedQueue;
+    std::vector<CommandBuffer*> m_commandBuffers;
+    
+    // Particle emitters sorted by state and generated billboard vertices
+    std::vector<RenderQueueParticles*> m_sortedEmitters;
+    std::vector<float> m_particleData;
+    
+    // Currently active light set and the state it was set up with
+    LightList m_activeLights;
+    unsigned long m_lightVersionCounter;
+    Transform3f m_lightViewTransform;
+    bool m_lightsValid;
+    
+    // Ids of light sets seen so far
+    boost::unordered_map<LightList, unsigned int> m_lightSetIds;
+    unsigned int m_nextLightSet;
+    
+    // Streamed per-instance transformations
+    DVertexBuffer *m_instanceBuffer;
+    std::vector<float> m_instanceData;
     
     // Pointer to the driver to avoid lookups
     Driver *m_driver;
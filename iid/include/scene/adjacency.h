@@ -0,0 +1,125 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_SCENE_ADJACENCY_H
+#define IID_SCENE_ADJACENCY_H
+
+#include "globals.h"
+
+#include <vector>
+
+class btTriangleIndexVertexArray;
+struct btIndexedMesh;
+
+namespace IID {
+
+class ThreadPool;
+
+/**
+ * Triangle adjacency of batched trimesh geometry. Vertices with equal
+ * positions are welded (also across submeshes), so edges are identified
+ * by pairs of welded vertex indices. All tables are flat arrays of plain
+ * structures, so they can be stored as-is.
+ *
+ * Faces are numbered globally, with faces of each submesh following
+ * those of the previous one (see faceOffset).
+ */
+class TriangleAdjacency {
+public:
+    /**
+     * An edge between two welded vertices and the (at most) two faces
+     * sharing it. Missing faces are -1.
+     */
+    struct Edge {
+        unsigned int vertices[2];
+        int faces[2];
+    };
+    
+    /**
+     * Class constructor.
+     */
+    TriangleAdjacency();
+    
+    /**
+     * Builds adjacency for the given geometry. Welding of submesh vertices
+     * is done in parallel when a thread pool is given.
+     *
+     * @param geometry Batched trimesh geometry
+     * @param pool Optional thread pool
+     */
+    void build(btTriangleIndexVertexArray *geometry, ThreadPool *pool = 0);
+    
+    /**
+     * Returns the total number of faces.
+     */
+    int faceCount() const { return m_faceCount; }
+    
+    /**
+     * Returns the global index of the first face of a submesh.
+     *
+     * @param part Submesh index
+     */
+    int faceOffset(int part) const { return m_faceOffsets[part]; }
+    
+    /**
+     * Returns the face sharing an edge with the given face or -1 when
+     * there is no such face.
+     *
+     * @param face Global face index
+     * @param edge Edge index (edge i connects vertices i and i + 1)
+     */
+    int neighbour(int face, int edge) const;
+    
+    /**
+     * Returns the edge table.
+     */
+    const std::vector<Edge> &edges() const { return m_edges; }
+    
+    /**
+     * Returns the edge table index of every face edge (three per face) or
+     * -1 for degenerate edges.
+     */
+    const std::vector<int> &faceEdges() const { return m_faceEdges; }
+protected:
+    /**
+     * Welds vertices of a single submesh. Submeshes are independent, so
+     * this may run concurrently for different parts.
+     *
+     * @param part Submesh index
+     */
+    void weldPart(int part);
+    
+    /**
+     * Merges welded vertices of all submeshes into global vertex indices.
+     */
+    void mergeParts();
+    
+    /**
+     * Builds the edge table.
+     */
+    void buildEdges();
+private:
+    // Geometry being processed
+    btIndexedMesh *m_parts;
+    int m_partCount;
+    
+    // Welded vertex index of every submesh vertex and the vertices that
+    // are kept by welding (only used while building)
+    std::vector<std::vector<unsigned int> > m_vertexIds;
+    std::vector<std::vector<int> > m_uniqueVertices;
+    
+    // Faces
+    int m_faceCount;
+    std::vector<int> m_faceOffsets;
+    
+    // Edge table and edges of every face
+    std::vector<Edge> m_edges;
+    std::vector<int> m_faceEdges;
+};
+
+}
+
+#endif
@@ -178,6 +178,36 @@ public:
      * Returns camera eye position.
      */
     Vector3f getEyePosition() const { return m_eye; }
+    
+    /**
+     * Returns the world to view space transformation.
+     */
+    const Transform3f &getViewTransform() const { return m_viewTransform; }
+    
+    /**
+     * Returns a world space bounding box that contains the frustum.
+     */
+    const AxisAlignedBox &getFrustumBounds() const { return m_frustumBounds; }
+    
+    /**
+     * Returns the distance to the near clipping plane.
+     */
+    float getNearDistance() const { return m_nearDist; }
+    
+    /**
+     * Returns the distance to the far clipping plane.
+     */
+    float getFarDistance() const { return m_farDist; }
+    
+    /**
+     * Returns half of the near plane width divided by its distance.
+     */
+    float getHorizontalSlope() const { return m_nearWidth / m_nearDist; }
+    
+    /**
+     * Returns half of the near plane height divided by its distance.
+     */
+    float getVerticalSlope() const { return m_nearHeight / m_nearDist; }
 private:
     // Scene instance
     Scene *m_scene;
@@ -197,8 +227,9 @@ private:
     // Number of updates the camera lags behind
     int m_lag;
     
-    // Our frustum planes
+    // Our frustum planes and their bounds
     Plane m_planes[6];
+    AxisAlignedBox m_frustumBounds;
     
     // Camera description
     float m_nearDist, m_farDist, m_ratio, m_angle;
@@ -8,17 +8,19 @@
 #define IID_SCENE_GEOMETRYMETA_H
 
 #include "globals.h"
+#include "scene/adjacency.h"
 
 #include <BulletCollision/CollisionShapes/btTriangleIndexVertexMaterialArray.h>
 #include <BulletCollision/CollisionShapes/btMaterial.h>
 
-#include <list>
 #include <vector>
 
 class btMaterialProperties;
 
 namespace IID {
 
+class ThreadPool;
+
 /**
  * This class is used to hold static geometry metadata needed for proper
  * collision detection. It provides information about triangle connectivity
@@ -39,40 +41,50 @@ public:
      * Class constructor.
      *
      * @param geometry Properly batched static trimesh geometry
+     * @param pool Optional thread pool used to process submeshes in parallel
      */
-    GeometryMetadata(btTriangleIndexVertexMaterialArray *geometry);
-
+    GeometryMetadata(btTriangleIndexVertexMaterialArray *geometry, ThreadPool *pool = 0);
+    
     /**
      * Class destructor.
      */
     ~GeometryMetadata();
+    
+    /**
+     * Returns triangle adjacency of the geometry.
+     */
+    const TriangleAdjacency &adjacency() const { return m_adjacency; }
+    
+    /**
+     * Returns face descriptors of a submesh.
+     *
+     * @param part Submesh index
+     */
+    const btMaterialProperties *faceInfos(int part) const { return m_faceInfos[part]; }
 protected:
     /**
-     * A helper method that processes mesh connectivity.
+     * A helper method that computes face normals of a submesh.
      *
-     * @param mesh A valid indexed mesh pointer
+     * @param part Submesh index
      */
-    void processConnectivity(btIndexedMesh *mesh);
+    void processNormals(int part);
     
     /**
-     * A helper method that determines "edge angles".
+     * A helper method that determines "edge angles" of a submesh.
      *
-     * @param mesh A valid indexed mesh pointer
+     * @param part Submesh index
      */
-    void processEdgeAngles(btIndexedMesh *mesh);
+    void processEdgeAngles(int part);
 private:
     // Geometry store
     btTriangleIndexVertexMaterialArray *m_geometry;
     
-    // Data for edge angle processing
-    typedef std::vector<float> Vertex;
-    typedef std::pair<Vertex, Vertex> Edge;
-    typedef std::pair<btIndexedMesh*, int> Triangle;
-    typedef boost::unordered_map<Edge, std::list<Triangle> > ConnectivityMap;
-    typedef boost::unordered_map<Triangle, Vector3f> NormalMap;
-    ConnectivityMap m_connectivity;
-    NormalMap m_normals;
-    std::list<btMaterialProperties*> m_faceInfos;
+    // Connectivity and normals of all faces
+    TriangleAdjacency m_adjacency;
+    std::vector<Vector3f> m_normals;
+    
+    // Face descriptors of every submesh
+    std::vector<btMaterialProperties*> m_faceInfos;
 };
 
 }
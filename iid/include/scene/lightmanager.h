@@ -10,7 +10,7 @@
 #include "globals.h"
 #include "scene/light.h"
 
-#include <list>
+#include <vector>
 
 namespace IID {
 
@@ -18,13 +18,45 @@ class SceneNode;
 class Light;
 class Camera;
 
+/**
+ * A cell of the light manager's spatial index.
+ */
+struct LightGridCell {
+    int x, y, z;
+    
+    /**
+     * Comparison operator.
+     */
+    bool operator==(const LightGridCell &other) const
+    {
+      return x == other.x && y == other.y && z == other.z;
+    }
+};
+
+/**
+ * Hash function for light grid cells.
+ */
+std::size_t hash_value(const LightGridCell &cell);
+
 /**
  * The light manager is responsible for computing light contributions for
  * a specific object. It is used by the scene graph to get a list of lights
  * affecting the current scene node.
+ *
+ * Registered lights are kept in a uniform grid spatial index so finding
+ * lights that affect the camera frustum only visits nearby lights. Lights
+ * in the frustum are then assigned once per frame to a clustered grid
+ * that subdivides the frustum into tiles and exponential depth slices,
+ * and objects get their lights by looking up the clusters they overlap.
+ *
+ * Each index cell remembers the version at which a light affecting it
+ * last changed, so objects only recompute their lights when a nearby
+ * light changes.
  */
 class LightManager {
 public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    
     /**
      * Class constructor.
      */
@@ -47,22 +79,25 @@ public:
     
     /**
      * Updates a light. This method should be called when a light world
-     * transformation changes.
+     * transformation, type or attenuation range changes.
      *
      * @param light Light instance
      */
     void updateLight(Light *light);
     
     /**
-     * Populates a list of lights that are affecting the camera's frustum.
+     * Populates a list of lights that are affecting the camera's frustum
+     * and assigns them to light clusters.
      *
      * @param camera A valid camera instance
      */
     void findLightsInFrustum(Camera *camera);
     
     /**
-     * Computes lights that are affecting the object ordered by their
-     * brightness.
+     * Computes the most important lights affecting the object ordered by
+     * their importance. Importance is the light's brightness scaled by its
+     * attenuation at the object and a window that fades out towards the
+     * end of the light's range.
      *
      * @param lights Destination list of affecting lights
      * @param position Object position
@@ -75,12 +110,85 @@ public:
      * used for detecting whether a node's light cache is up to date.
      */
     unsigned long getLightVersionCounter() const { return m_lightVersionCounter; }
+    
+    /**
+     * Returns true when any light that could affect the given sphere has
+     * changed after the specified light version.
+     *
+     * @param version Light version counter value
+     * @param position Object position
+     * @param radius Object radius
+     */
+    bool lightsChangedSince(unsigned long version, const Vector3f &position, float radius) const;
+protected:
+    /**
+     * Inserts a light into the spatial index.
+     *
+     * @param light Light instance
+     */
+    void indexLight(Light *light);
+    
+    /**
+     * Removes a light from the spatial index.
+     *
+     * @param light Light instance
+     */
+    void unindexLight(Light *light);
+    
+    /**
+     * Marks index cells occupied by a light as changed at the current
+     * light version.
+     *
+     * @param light Light instance
+     */
+    void touchLight(Light *light);
+    
+    /**
+     * Computes the range of clusters overlapped by a view space sphere.
+     * Returns false when the sphere lies outside the clustered depth
+     * range.
+     *
+     * @param center Sphere center in view space
+     * @param radius Sphere radius
+     * @param min Destination for minimum cluster coordinates
+     * @param max Destination for maximum cluster coordinates
+     */
+    bool getClusterRange(const Vector3f &center, float radius, int *min, int *max) const;
+    
+    /**
+     * Assigns lights in the frustum to clusters.
+     */
+    void buildClusters();
 private:
-    // A list of all lights
-    boost::unordered_map<std::string, Light*> m_lights;
+    // Spatial index entry of a light
+    struct LightRecord {
+      Vector3f position;
+      float range;
+      bool unbounded;
+      LightGridCell min;
+      LightGridCell max;
+    };
+    
+    // Spatial index cell; empty cells are kept so their versions are
+    // not lost
+    struct LightGridEntry {
+      LightList lights;
+      unsigned long version;
+      
+      LightGridEntry()
+        : version(0)
+      {}
+    };
+    
+    // All registered lights and the spatial index
+    boost::unordered_map<Light*, LightRecord> m_lights;
+    boost::unordered_map<LightGridCell, LightGridEntry> m_grid;
+    LightList m_unboundedLights;
     
     // Light version counter used to know when nodes have out-of-date lighting
     unsigned long m_lightVersionCounter;
+    unsigned long m_unboundedVersion;
+    unsigned long m_clusterVersion;
     
     // Light cache
     struct LightCacheItem {
@@ -111,8 +219,35 @@ private:
     
     typedef std::vector<LightCacheItem> LightCache;
     LightList m_lightsInFrustum;
+    LightList m_candidates;
     LightCache m_lightCache;
     LightCache m_testCache;
+    
+    // Clustered light grid; cluster items are indices of local lights
+    // stored consecutively and each cluster has an offset into the list
+    // (the last offset marks the end)
+    LightList m_directionalLights;
+    LightList m_localLights;
+    std::vector<float> m_localLightData;
+    std::vector<int> m_clusterItems;
+    std::vector<int> m_clusterOffsets;
+    
+    // Scratch buffers used while assigning lights to clusters
+    std::vector<int> m_lightRanges;
+    std::vector<int> m_clusterCursor;
+    
+    // Scratch buffers used while selecting lights for an object
+    mutable std::vector<int> m_selection;
+    mutable std::vector<unsigned long> m_selectionMarks;
+    mutable unsigned long m_selectionMark;
+    
+    // Frustum description used for cluster assignment
+    Transform3f m_clusterView;
+    float m_clusterNear;
+    float m_clusterFar;
+    float m_clusterSlopeX;
+    float m_clusterSlopeY;
+    float m_clusterDepthScale;
 };
 
 }
@@ -235,6 +235,14 @@ public:
      */
     virtual void batchStaticGeometry(btTriangleIndexVertexArray *triangles);
     
+    /**
+     * Computes a fingerprint of static geometry currently on the scene,
+     * so baked static geometry can be validated without batching.
+     *
+     * @param seed Hash value the fingerprint is combined with
+     */
+    virtual void hashStaticGeometry(size_t &seed) const;
+    
     /**
      * Moves this node so it is attached directly to the root scene
      * node, but preserving world position and orientation.
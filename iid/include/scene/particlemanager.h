@@ -0,0 +1,115 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_SCENE_PARTICLEMANAGER_H
+#define IID_SCENE_PARTICLEMANAGER_H
+
+#include "globals.h"
+
+#include <vector>
+
+namespace IID {
+
+class Scene;
+class ParticleEmitter;
+class Explosion;
+
+/**
+ * The particle manager creates particle emitters, owns their particle
+ * buffers and advances all of them once per simulation step. Buffers of
+ * destroyed emitters are kept in a pool and reused by new emitters of
+ * the same size.
+ */
+class ParticleManager {
+public:
+    /**
+     * Class constructor.
+     *
+     * @param scene Scene instance
+     */
+    ParticleManager(Scene *scene);
+    
+    /**
+     * Class destructor.
+     */
+    ~ParticleManager();
+    
+    /**
+     * Creates a new continuous particle emitter.
+     *
+     * @param name Node name
+     * @param maxParticles Number of particles
+     */
+    ParticleEmitter *createEmitter(const std::string &name, int maxParticles);
+    
+    /**
+     * Creates a new explosion.
+     *
+     * @param name Node name
+     * @param maxParticles Number of particles
+     */
+    Explosion *createExplosion(const std::string &name, int maxParticles);
+    
+    /**
+     * Advances all active emitters. Emitters that were not visible in
+     * the last frame are updated at a lower rate. Finished emitters that
+     * were marked for automatic release are queued for destruction.
+     *
+     * @param dt Time step in seconds
+     */
+    void update(float dt);
+    
+    /**
+     * Returns a particle buffer able to hold the given number of
+     * particles.
+     *
+     * @param maxParticles Number of particles
+     */
+    float *acquireBuffer(int maxParticles);
+    
+    /**
+     * Returns a particle buffer to the pool.
+     *
+     * @param maxParticles Number of particles the buffer holds
+     * @param buffer Buffer previously returned by acquireBuffer
+     */
+    void releaseBuffer(int maxParticles, float *buffer);
+    
+    /**
+     * Registers an emitter for updates.
+     *
+     * @param emitter Particle emitter
+     */
+    void addEmitter(ParticleEmitter *emitter);
+    
+    /**
+     * Unregisters an emitter.
+     *
+     * @param emitter Particle emitter
+     */
+    void removeEmitter(ParticleEmitter *emitter);
+protected:
+    /**
+     * Updates a range of emitters. May be called from worker threads.
+     *
+     * @param begin Index of the first emitter
+     * @param end Index one past the last emitter
+     * @param dt Time step in seconds
+     */
+    void updateRange(int begin, int end, float dt);
+private:
+    Scene *m_scene;
+    
+    // Registered emitters
+    std::vector<ParticleEmitter*> m_emitters;
+    
+    // Pool of free particle buffers by particle count
+    boost::unordered_map<int, std::vector<float*> > m_freeBuffers;
+};
+
+}
+
+#endif
@@ -8,28 +8,12 @@
 #define IID_SCENE_PARTICLES_H
 
 #include "scene/node.h"
-#include <vector>
 
-// Some hacky random functions
-#define RANDOM_SPEED() float((rand()%50)-26.0f)
-#define RANDOM_COLOR() ((float) random() / 1) * 0.5f + 0.5f
-#define RANDOM_FADE() float(rand()%100) / 1000.0f+0.003f
-#define RANDOM_TIME() RANDOM_SPEED()
+#include <vector>
 
 namespace IID {
 
-/**
- * A structure representing one particle.
- */
-struct Particle {
-    bool m_active;
-    float m_life;
-    float m_fade;
-    float *m_position;
-    float *m_rgba;
-    Vector3f m_velocity;
-    Vector3f m_gravity;
-};
+class ParticleManager;
 
 /**
  * A node emitting particles.
@@ -37,12 +21,15 @@ struct Particle {
 class ParticleEmitter : public SceneNode {
 public:
     /**
-     * Class constructor.
+     * Class constructor. Emitters should be created through the particle
+     * manager.
      *
+     * @param manager Particle manager that owns the particle buffers
      * @param name Node name
+     * @param maxParticles Number of particles
      * @param parent Parent node
      */
-    ParticleEmitter(const std::string &name, int maxParticles, SceneNode *parent = 0);
+    ParticleEmitter(ParticleManager *manager, const std::string &name, int maxParticles, SceneNode *parent = 0);
     
     /**
      * Class destructor.
@@ -77,8 +64,48 @@ public:
      *
      * This calculates the new parameters (position, color, speed, ...) of 
      * all the particles in the system.
+     *
+     * @param dt Time step in seconds
+     */
+    virtual void animate(float dt);
+    
+    /**
+     * Called by the particle manager once per simulation step. Emitters
+     * that were not visible in the last frame only accumulate time and
+     * are advanced at a lower rate.
+     *
+     * @param dt Time step in seconds
      */
-    void animate();
+    void update(float dt);
+    
+    /**
+     * Advances the simulation by any time accumulated while the emitter
+     * was not being updated.
+     */
+    void fastForward();
+    
+    /**
+     * Returns true when the emitter has finished emitting.
+     */
+    bool isFinished() const { return m_finished; }
+    
+    /**
+     * Sets whether the particle manager should delete this emitter once
+     * it has finished.
+     *
+     * @param value True to enable automatic release
+     */
+    void setAutoRelease(bool value) { m_autoRelease = value; }
+    
+    /**
+     * Returns true if this emitter is deleted once finished.
+     */
+    bool getAutoRelease() const { return m_autoRelease; }
+    
+    /**
+     * Returns the number of particles in this emitter.
+     */
+    int getMaxParticles() const { return m_maxParticles; }
     
     /**
      * Set the particle texture.
@@ -136,13 +163,45 @@ public:
     void setColors(std::vector<Vector3f> colors);
 protected:
     /**
-     * Reset's all the particles' parameters.
+     * Reset's all the particle's parameters.
+     *
+     * @param i Particle index
      */
-    void reset(Particle *p);
+    void reset(int i);
+    
+    /**
+     * Advances all particles by the given time step and writes their
+     * positions and alpha values into the render arrays.
+     *
+     * @param dt Time step in seconds
+     * @return Number of particles that are still alive
+     */
+    int simulate(float dt);
+    
+    /**
+     * Returns a pseudo-random number in [0, 1).
+     */
+    inline float random()
+    {
+      // Xorshift generator
+      m_random ^= m_random << 13;
+      m_random ^= m_random >> 17;
+      m_random ^= m_random << 5;
+      return (m_random >> 8) * (1.0f / 16777216.0f);
+    }
+    
+    // Particle manager
+    ParticleManager *m_manager;
     
     // If true the simulation is continued
     bool m_animate;
     bool m_render;
+    bool m_finished;
+    bool m_autoRelease;
+    
+    // Visibility in the last frame and time not yet simulated
+    bool m_visible;
+    float m_pendingTime;
     
     // Size of the vertex array
     int m_maxParticles;
@@ -150,12 +209,24 @@ protected:
     float m_slowdown;
     float m_zoom;
     Vector3f m_gravity;
-    Particle *m_particles;
+    
+    // Particle state stored as separate arrays
+    float *m_positionX;
+    float *m_positionY;
+    float *m_positionZ;
+    float *m_velocityX;
+    float *m_velocityY;
+    float *m_velocityZ;
+    float *m_life;
+    float *m_fade;
 
-    // Data
+    // Render data written by the simulation
     float *m_vertices;
     float *m_colors;
     
+    // Random generator state
+    unsigned int m_random;
+    
     // Particle texture
     Texture *m_texture;
     
@@ -176,27 +247,24 @@ protected:
 class Explosion : public ParticleEmitter {
 public:
   /**
-   * Class constructor.
+   * Class constructor. Explosions should be created through the particle
+   * manager.
    *
+   * @param manager Particle manager that owns the particle buffers
    * @param name Node name
+   * @param maxParticles Number of particles
    * @param parent Parent node
    */
-  Explosion(const std::string &name, int maxParticles, SceneNode *parent = 0);
-  
-  /**
-   * Move one step forward in the simulation of particles.
-   *
-   * This calculates the new parameters (position, color, speed, ...) of 
-   * all the particles in the system.
-   */
-  void animate();
+  Explosion(ParticleManager *manager, const std::string &name, int maxParticles, SceneNode *parent = 0);
   
   /**
-   * Renders this node.
+   * Move one step forward in the simulation of particles. Unlike the
+   * base emitter, dead particles are not respawned and the explosion
+   * hides itself once all particles are dead.
    *
-   * @param batcher State batcher that holds the render queue
+   * @param dt Time step in seconds
    */
-  void render(StateBatcher *batcher);
+  void animate(float dt);
 };
 
 }
@@ -10,6 +10,7 @@
 #include "globals.h"
 #include "scene/node.h"
 #include "renderer/rendrable.h"
+#include "storage/geometry.h"
 
 class btIndexedMesh;
 
@@ -101,6 +102,13 @@ public:
      */
     void batchStaticGeometry(btTriangleIndexVertexArray *triangles);
     
+    /**
+     * Computes a fingerprint of static geometry currently on the scene.
+     *
+     * @param seed Hash value the fingerprint is combined with
+     */
+    void hashStaticGeometry(size_t &seed) const;
+    
     /**
      * Returns this node's world transformation. This needs to be here because
      * the Rendrable interface requires worldTransform to be implemented.
@@ -118,21 +126,29 @@ public:
      * @param batcher State batcher that holds the render queue
      */
     void render(StateBatcher *batcher);
+protected:
+    /**
+     * Marks the affecting light list as out of date since the node has
+     * moved.
+     */
+    void updateNodeSpecific();
 private:
     // Resources used for rendering this node
     Mesh *m_mesh;
     Texture *m_texture;
     Shader *m_shader;
     Material *m_material;
-
+    
     // Bounding box display
     bool m_showBoundingBox;
     
-    // Indexed mesh for static geometry batching
+    // Indexed mesh for static geometry batching and the geometry it views
     btIndexedMesh *m_staticGeomMesh;
+    GeometryPtr m_staticGeometry;
     
     // Lighting
-    unsigned long m_lightVersionCounter;
+    mutable unsigned long m_lightVersionCounter;
+    mutable bool m_lightsDirty;
     mutable LightList m_affectingLights;
 };
 
@@ -9,6 +9,10 @@
 
 #include "globals.h"
 
+#include <boost/thread/mutex.hpp>
+
+#include <vector>
+
 namespace IID {
 
 class Context;
@@ -19,6 +23,7 @@ class Item;
 class Octree;
 class Camera;
 class LightManager;
+class ParticleManager;
 class Driver;
 
 /**
@@ -32,6 +37,22 @@ struct ScenePerspective {
     float far;
 };
 
+/**
+ * A deferred scene graph modification.
+ */
+struct SceneCommand {
+    enum Type {
+      Attach,
+      Detach,
+      Destroy,
+      Reparent
+    };
+    
+    Type type;
+    SceneNode *node;
+    SceneNode *parent;
+};
+
 /**
  * Represents the 3D scene.
  */
@@ -111,6 +132,48 @@ public:
      */
     void detachNode(SceneNode *node);
     
+    /**
+     * Queues attachment of a node under the given parent. Queued changes
+     * are applied by applyPendingChanges, so this method may be called
+     * while the scene is being traversed or simulated. It is safe to call
+     * from worker threads.
+     *
+     * @param parent Parent node (or NULL for the root node)
+     * @param node Node to attach
+     */
+    void queueAttach(SceneNode *parent, SceneNode *node);
+    
+    /**
+     * Queues detachment of a node from its parent.
+     *
+     * @param node Node to detach
+     */
+    void queueDetach(SceneNode *node);
+    
+    /**
+     * Queues destruction of a node. The node is detached from its parent
+     * and deleted together with all of its children.
+     *
+     * @param node Node to destroy
+     */
+    void queueDestroy(SceneNode *node);
+    
+    /**
+     * Queues moving a node under a different parent. Local position and
+     * orientation are preserved.
+     *
+     * @param node Node to move
+     * @param parent New parent node (or NULL for the root node)
+     */
+    void queueReparent(SceneNode *node, SceneNode *parent);
+    
+    /**
+     * Applies all queued scene graph changes in the order they were
+     * recorded. Must only be called at a sync point where no traversal
+     * or simulation is in progress.
+     */
+    void applyPendingChanges();
+    
     /**
      * Sets scene active camera.
      *
@@ -152,6 +215,11 @@ public:
      * Returns the light manager instance.
      */
     LightManager *getLightManager() const { return m_lightManager; }
+    
+    /**
+     * Returns the particle manager instance.
+     */
+    ParticleManager *getParticleManager() const { return m_particleManager; }
 private:
     Context *m_context;
     Driver *m_driver;
@@ -177,6 +245,17 @@ private:
     // Light manager
     LightManager *m_lightManager;
     Vector3f m_ambientLight;
+    
+    // Particle manager
+    ParticleManager *m_particleManager;
+    
+    // Queued scene graph changes and buffers used while applying them
+    // (kept between frames to avoid allocations)
+    boost::mutex m_commandMutex;
+    std::vector<SceneCommand> m_commands;
+    std::vector<SceneCommand> m_appliedCommands;
+    std::vector<SceneNode*> m_destroyedNodes;
+    std::vector<SceneNode*> m_destroyedRoots;
 };
 
 }
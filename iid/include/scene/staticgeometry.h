@@ -0,0 +1,111 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_SCENE_STATICGEOMETRY_H
+#define IID_SCENE_STATICGEOMETRY_H
+
+#include "globals.h"
+#include "mappedfile.h"
+
+#include <string>
+
+class btTriangleIndexVertexMaterialArray;
+class btMultimaterialTriangleMeshShape;
+
+namespace IID {
+
+class Context;
+class Logger;
+class SceneNode;
+class GeometryMetadata;
+
+/**
+ * Collision shape of all static geometry on the scene. Batched triangle
+ * arrays, face edge angles and Bullet's optimized BVH are baked into a
+ * single cache file when the shape is first built. Later builds of the
+ * same geometry map that file and create the shape straight from it,
+ * without batching, metadata processing or BVH construction.
+ */
+class StaticGeometry {
+public:
+    /**
+     * Class constructor.
+     *
+     * @param context Engine context
+     * @param directory Directory holding the cache files
+     */
+    StaticGeometry(Context *context, const std::string &directory = "cache");
+    
+    /**
+     * Class destructor. The shape must no longer be used by any rigid
+     * bodies.
+     */
+    ~StaticGeometry();
+    
+    /**
+     * Builds the collision shape for static nodes under the given node.
+     *
+     * @param root Root node
+     * @param name Name of the geometry (used for cache file naming)
+     */
+    void build(SceneNode *root, const std::string &name);
+    
+    /**
+     * Returns the collision shape.
+     */
+    btMultimaterialTriangleMeshShape *shape() const { return m_shape; }
+protected:
+    /**
+     * Returns the cache filename for the given geometry.
+     *
+     * @param name Name of the geometry
+     */
+    std::string filename(const std::string &name) const;
+    
+    /**
+     * Attempts to create the shape from a baked cache file.
+     *
+     * @param name Name of the geometry
+     * @param fingerprint Fingerprint of the static geometry
+     * @return True if a valid cache file has been found
+     */
+    bool load(const std::string &name, size_t fingerprint);
+    
+    /**
+     * Batches static geometry and creates the shape from scratch.
+     *
+     * @param root Root node
+     */
+    void create(SceneNode *root);
+    
+    /**
+     * Writes the current shape into a cache file.
+     *
+     * @param name Name of the geometry
+     * @param fingerprint Fingerprint of the static geometry
+     */
+    void bake(const std::string &name, size_t fingerprint) const;
+private:
+    Context *m_context;
+    Logger *m_logger;
+    std::string m_directory;
+    
+    // Triangle arrays, the shape built from them and its bounds
+    btTriangleIndexVertexMaterialArray *m_geometry;
+    btMultimaterialTriangleMeshShape *m_shape;
+    float m_aabbMin[3];
+    float m_aabbMax[3];
+    
+    // Metadata of freshly batched geometry
+    GeometryMetadata *m_metadata;
+    
+    // Mapped cache file that loaded geometry points into
+    MappedFile m_file;
+};
+
+}
+
+#endif
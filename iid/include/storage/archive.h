@@ -0,0 +1,154 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_STORAGE_ARCHIVE_H
+#define IID_STORAGE_ARCHIVE_H
+
+#include "mappedfile.h"
+
+#include <string>
+#include <vector>
+
+namespace IID {
+
+/**
+ * Describes a single archive entry. The index is an array of these
+ * sorted by path hash, so it can be searched directly in the mapping.
+ */
+struct ArchiveEntry {
+    // Hash of the entry path
+    unsigned long long hash;
+    
+    // Offset of the payload from the start of the archive
+    unsigned long long offset;
+    
+    // Stored payload size and size after decompression (these differ
+    // only for compressed entries)
+    unsigned int size;
+    unsigned int rawSize;
+    
+    // Location of the entry path in the path table
+    unsigned int pathOffset;
+    unsigned int pathLength;
+};
+
+/**
+ * An archive contains the manifest and preprocessed payloads of all
+ * items it references, as produced by importers' compile methods. It is
+ * memory mapped when mounted and entries are resolved by a hashed path
+ * index. Uncompressed payloads are used straight from the mapping.
+ */
+class Archive {
+public:
+    /**
+     * Class constructor.
+     */
+    Archive();
+    
+    /**
+     * Maps the specified archive and validates its index.
+     *
+     * @param filename Archive filename
+     * @return True if the archive has been mounted
+     */
+    bool mount(const std::string &filename);
+    
+    /**
+     * Returns true if an archive is mounted.
+     */
+    bool isMounted() const { return m_entries != 0; }
+    
+    /**
+     * Returns the number of entries in the archive.
+     */
+    unsigned int size() const { return m_entryCount; }
+    
+    /**
+     * Returns true if the archive contains the specified path.
+     *
+     * @param path Entry path
+     */
+    bool contains(const std::string &path) const;
+    
+    /**
+     * Retrieves the payload of an entry. Compressed payloads are
+     * decompressed into the buffer, others point into the mapping.
+     *
+     * @param path Entry path
+     * @param buffer Buffer used for decompression
+     * @param data Pointer to the payload
+     * @param size Payload size
+     * @return True if the entry has been found
+     */
+    bool read(const std::string &path, std::vector<unsigned char> &buffer, const unsigned char *&data, size_t &size) const;
+    
+    /**
+     * Computes the hash of an entry path. This hash is stored in archives
+     * and must not change between versions.
+     *
+     * @param path Entry path
+     */
+    static unsigned long long hashPath(const std::string &path);
+protected:
+    /**
+     * Returns the index entry for the specified path or NULL when there
+     * is no such entry.
+     *
+     * @param path Entry path
+     */
+    const ArchiveEntry *find(const std::string &path) const;
+private:
+    // Mapped archive
+    MappedFile m_file;
+    
+    // Index and path table inside the mapping
+    const ArchiveEntry *m_entries;
+    unsigned int m_entryCount;
+    const char *m_paths;
+};
+
+/**
+ * Builds archives that can be mounted by the storage.
+ */
+class ArchiveWriter {
+public:
+    /**
+     * Class constructor.
+     */
+    ArchiveWriter();
+    
+    /**
+     * Adds an entry to the archive. When an entry with the same path has
+     * already been added, it is replaced.
+     *
+     * @param path Entry path
+     * @param data Payload
+     * @param compress Should the payload be compressed
+     */
+    void add(const std::string &path, const std::vector<unsigned char> &data, bool compress = false);
+    
+    /**
+     * Writes the archive.
+     *
+     * @param filename Archive filename
+     * @return True if the archive has been written
+     */
+    bool write(const std::string &filename) const;
+private:
+    // A pending archive entry
+    struct PendingEntry {
+      std::string path;
+      std::vector<unsigned char> data;
+      unsigned int rawSize;
+    };
+    
+    // Entries by order of addition
+    std::vector<PendingEntry> m_entries;
+};
+
+}
+
+#endif
@@ -9,17 +9,42 @@
 
 #include "globals.h"
 
+#include <string>
+
 namespace IID {
 
 class Storage;
 class Item;
 
+/**
+ * Resolves a file path relative to the container paths of an item.
+ *
+ * @param item Storage item
+ * @param path Path as given in the manifest
+ */
+std::string resolveFilePath(Item *item, const std::string &path);
+
+/**
+ * Returns the storage path of an item. Packed archives use this path to
+ * identify item payloads.
+ *
+ * @param item Storage item
+ */
+std::string storagePath(Item *item);
+
 /**
  * An argument handler for loading data files into storage items. This
- * just calls a valid importer.
+ * queues the file for a valid importer; preprocessed data from a mounted
+ * archive is used when available.
  */
 void argumentLoadFile(Storage *storage, Item *item, StringMap arguments);
 
+/**
+ * An argument handler for declaring that an item must be loaded after
+ * another item.
+ */
+void argumentDepends(Storage *storage, Item *item, StringMap arguments);
+
 /**
  * An argument handler for setting storage item attributes.
  */
@@ -0,0 +1,117 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_STORAGE_GEOMETRY_H
+#define IID_STORAGE_GEOMETRY_H
+
+#include "globals.h"
+
+#include <boost/shared_ptr.hpp>
+#include <boost/shared_array.hpp>
+
+#include <stddef.h>
+
+namespace IID {
+
+class Geometry;
+
+// Geometry is immutable once shared, so it is always handed out as const
+typedef boost::shared_ptr<const Geometry> GeometryPtr;
+
+/**
+ * Reference counted CPU-side triangle geometry (vertex positions and
+ * indices). A single copy is shared by meshes, static geometry batches
+ * used by physics and metadata builders, which all view it through
+ * pointers and strides instead of copying it.
+ */
+class Geometry {
+public:
+    // Strides of the position and index arrays in bytes
+    static const int VertexStride = 3 * sizeof(float);
+    static const int IndexStride = sizeof(unsigned int);
+    
+    /**
+     * Class constructor. Allocates uninitialized position and index
+     * arrays that must be filled in before the geometry is shared.
+     *
+     * @param vertexCount Number of vertices
+     * @param indexCount Number of indices
+     */
+    Geometry(int vertexCount, int indexCount);
+    
+    /**
+     * Creates geometry out of interleaved vertex records.
+     *
+     * @param vertexCount Number of vertices
+     * @param indexCount Number of indices
+     * @param records Vertex records starting with a position
+     * @param recordStride Size of a vertex record in bytes
+     * @param indices Index data
+     */
+    static GeometryPtr fromRecords(int vertexCount, int indexCount, const unsigned char *records,
+                                   int recordStride, const unsigned int *indices);
+    
+    /**
+     * Returns a copy of this geometry with positions transformed by the
+     * given transformation. Indices are shared with this geometry.
+     *
+     * @param transform Transformation
+     */
+    GeometryPtr transformed(const Transform3f &transform) const;
+    
+    /**
+     * Returns the number of vertices.
+     */
+    int vertexCount() const { return m_vertexCount; }
+    
+    /**
+     * Returns the number of indices.
+     */
+    int indexCount() const { return m_indexCount; }
+    
+    /**
+     * Returns the position array (VertexStride bytes per vertex).
+     */
+    const float *positions() const { return m_positions.get(); }
+    float *positions() { return m_positions.get(); }
+    
+    /**
+     * Returns the position of a vertex.
+     *
+     * @param index Vertex index
+     */
+    const float *position(int index) const { return m_positions.get() + 3*index; }
+    
+    /**
+     * Returns the index array.
+     */
+    const unsigned int *indices() const { return m_indices.get(); }
+    unsigned int *indices() { return m_indices.get(); }
+    
+    /**
+     * Returns a hash of the positions and indices.
+     */
+    size_t hash() const;
+    
+    /**
+     * Returns the number of bytes used by this geometry. Index arrays
+     * shared with other geometry are counted by each of them.
+     */
+    size_t memoryUsage() const;
+private:
+    // Vertex and index count
+    int m_vertexCount;
+    int m_indexCount;
+    
+    // Positions and indices; index arrays may be shared between
+    // differently transformed copies of the same geometry
+    boost::shared_array<float> m_positions;
+    boost::shared_array<unsigned int> m_indices;
+};
+
+}
+
+#endif
@@ -29,13 +29,37 @@ public:
     ThreeDSMeshImporter(Context *context);
     
     /**
-     * Loads a 3DS mesh file into the respective Mesh/CompositeMesh item.
+     * Parses a 3DS mesh file into submesh objects.
      *
-     * @param storage Item's storage
-     * @param item Item to load the data into
+     * @param item Item the data will be loaded into
      * @param filename Already resolved filename
+     * @param objects List to append parsed submesh objects to
+     * @return True if the file has been parsed
      */
-    void load(Storage *storage, Item *item, const std::string &filename);
+    bool parse(Item *item, const std::string &filename, std::list<SubmeshObject*> &objects);
+protected:
+    /**
+     * Walks a block of consecutive chunks inside the mapped file. Data
+     * is read straight from the mapping and unknown chunks are skipped
+     * by their length.
+     *
+     * @param begin Start of the block
+     * @param end End of the block
+     * @param name Name of the enclosing object
+     * @param obj Enclosing submesh object or NULL
+     * @param objects List to append parsed submesh objects to
+     * @return False if the block is malformed
+     */
+    bool parseChunks(const unsigned char *begin, const unsigned char *end, const std::string &name,
+                     SubmeshObject *obj, std::list<SubmeshObject*> &objects) const;
+    
+    /**
+     * Checks that all faces of an object reference existing vertices.
+     *
+     * @param obj Submesh object
+     * @return True if the object is valid
+     */
+    bool validateObject(SubmeshObject *obj) const;
 };
 
 }
@@ -36,6 +36,26 @@ public:
     * @param filename Already resolved filename
     */
     void load(Storage *storage, Item *item, const std::string &filename);
+    
+    /**
+     * Decodes a sound file into PCM samples. ALUT must be initialized.
+     *
+     * @param item Item the data will be loaded into
+     * @param filename Already resolved filename
+     * @param data Destination buffer
+     * @return True if the payload has been produced
+     */
+    bool compile(Item *item, const std::string &filename, std::vector<unsigned char> &data);
+    
+    /**
+     * Loads decoded PCM samples into the respective Sound item.
+     *
+     * @param storage Item's storage
+     * @param item Item to load the data into
+     * @param data Payload
+     * @param size Payload size
+     */
+    void loadCompiled(Storage *storage, Item *item, const unsigned char *data, size_t size);
 };
 
 }
@@ -8,6 +8,8 @@
 #define IID_IMPORTERS_BASE_H
 
 #include <string>
+#include <vector>
+#include <stddef.h>
 
 namespace IID {
 
@@ -15,6 +17,7 @@ class Storage;
 class Item;
 class Context;
 class Logger;
+class MappedFile;
 
 /**
  * An abstract base class for importers.
@@ -24,7 +27,8 @@ public:
     /**
      * Class constructor.
      *
-     * @param context A valid IID context
+     * @param context A valid IID context or NULL when the importer is
+     *                only used to compile assets offline
      */
     Importer(Context *context);
     
@@ -42,6 +46,50 @@ public:
      * @param filename Already resolved filename
      */
     virtual void load(Storage *storage, Item *item, const std::string &filename) = 0;
+    
+    /**
+     * Converts the specified file into a preprocessed payload that can be
+     * loaded without parsing the source format again. This must not use
+     * the driver or any other context facility, as it is also invoked by
+     * offline tools. The default implementation does not support
+     * compilation.
+     *
+     * @param item Item the data will be loaded into
+     * @param filename Already resolved filename
+     * @param data Destination buffer
+     * @return True if the payload has been produced
+     */
+    virtual bool compile(Item *item, const std::string &filename, std::vector<unsigned char> &data);
+    
+    /**
+     * Imports a payload previously produced by compile into the specified
+     * storage item.
+     *
+     * @param storage Item's storage
+     * @param item Item to load the data into
+     * @param data Payload
+     * @param size Payload size
+     */
+    virtual void loadCompiled(Storage *storage, Item *item, const unsigned char *data, size_t size);
+    
+    /**
+     * Produces the payload that loadCompiled imports for the specified
+     * file. The storage calls this from worker threads, so it must not
+     * use the driver or modify shared state. The default implementation
+     * calls compile.
+     *
+     * Payloads that already exist on disk may be mapped into file instead
+     * of being copied into data; the mapping is kept open until the
+     * payload has been loaded.
+     *
+     * @param item Item the data will be loaded into
+     * @param filename Already resolved filename
+     * @param data Destination buffer
+     * @param file Destination file mapping
+     * @return True if the payload has been produced, otherwise the file
+     *         is loaded on the main thread
+     */
+    virtual bool prepare(Item *item, const std::string &filename, std::vector<unsigned char> &data, MappedFile &file);
 protected:
     Context *m_context;
     Logger *m_logger;
@@ -8,6 +8,7 @@
 #define IID_IMPORTERS_COLLADA_H
 
 #include <string>
+#include <vector>
 
 #include "storage/importers/mesh.h"
 
@@ -15,6 +16,7 @@ namespace IID {
 
 class Item;
 class Storage;
+class XmlReader;
 
 /**
  * This class implements COLLADA mesh import.
@@ -29,13 +31,57 @@ public:
     ColladaMeshImporter(Context *context);
     
     /**
-     * Loads a COLLADA mesh file into the respective Mesh/CompositeMesh item.
+     * Parses a COLLADA mesh file into submesh objects.
      *
-     * @param storage Item's storage
-     * @param item Item to load the data into
+     * @param item Item the data will be loaded into
      * @param filename Already resolved filename
+     * @param objects List to append parsed submesh objects to
+     * @return True if the file has been parsed
      */
-    void load(Storage *storage, Item *item, const std::string &filename);
+    bool parse(Item *item, const std::string &filename, std::list<SubmeshObject*> &objects);
+protected:
+    /**
+     * A float array source.
+     */
+    struct Source {
+      std::vector<float> data;
+      int stride;
+    };
+    
+    /**
+     * An input of a vertices or triangles element.
+     */
+    struct Input {
+      std::string semantic;
+      std::string source;
+      int offset;
+    };
+    
+    /**
+     * Parses a geometry element whose start token was just read.
+     *
+     * @param reader XML reader
+     * @param objectIdx Index of the next object (used for naming)
+     * @param objects List to append parsed submesh objects to
+     * @return True if the geometry has been parsed
+     */
+    bool parseGeometry(XmlReader &reader, int &objectIdx, std::list<SubmeshObject*> &objects) const;
+    
+    /**
+     * Creates a submesh object out of a triangles element.
+     *
+     * @param name Object name
+     * @param faceCount Number of triangles
+     * @param inputs Triangle inputs
+     * @param primitives Contents of the p element
+     * @param sources Sources by identifier
+     * @param vertices Inputs of vertices elements by identifier
+     * @return A submesh object or NULL when indices are invalid
+     */
+    SubmeshObject *createObject(const std::string &name, int faceCount, const std::vector<Input> &inputs,
+                                const std::vector<unsigned int> &primitives,
+                                const boost::unordered_map<std::string, Source> &sources,
+                                const boost::unordered_map<std::string, std::vector<Input> > &vertices) const;
 };
 
 }
@@ -8,6 +8,7 @@
 #define IID_IMPORTERS_MESH_H
 
 #include "storage/importers/base.h"
+#include "storage/importers/meshcache.h"
 #include "globals.h"
 
 #include <string>
@@ -28,6 +29,7 @@ public:
   std::string name;
   int vertexCount;
   int faceCount;
+  int texCount;
   float *vertices;
   float *tex;
   float *normals;
@@ -43,6 +45,7 @@ public:
   SubmeshObject()
     : vertexCount(0),
       faceCount(0),
+      texCount(0),
       vertices(0),
       tex(0),
       normals(0),
@@ -64,14 +67,58 @@ public:
     MeshImporter(Context *context);
     
     /**
-     * Loads a 3DS mesh file into the respective Mesh/CompositeMesh item.
+     * Loads a mesh file into the respective Mesh/CompositeMesh item. The
+     * mesh cache is consulted first and updated after import.
      *
      * @param storage Item's storage
      * @param item Item to load the data into
      * @param filename Already resolved filename
      */
-    virtual void load(Storage *storage, Item *item, const std::string &filename) = 0;
+    void load(Storage *storage, Item *item, const std::string &filename);
+    
+    /**
+     * Parses and post-processes a mesh file into the mesh cache format.
+     *
+     * @param item Item the data will be loaded into
+     * @param filename Already resolved filename
+     * @param data Destination buffer
+     * @return True if the payload has been produced
+     */
+    bool compile(Item *item, const std::string &filename, std::vector<unsigned char> &data);
+    
+    /**
+     * Creates mesh items from a payload in the mesh cache format.
+     *
+     * @param storage Item's storage
+     * @param item Item to load the data into
+     * @param data Payload
+     * @param size Payload size
+     */
+    void loadCompiled(Storage *storage, Item *item, const unsigned char *data, size_t size);
+    
+    /**
+     * Produces the mesh payload, either from the mesh cache or by
+     * compiling the file and storing the result into the cache.
+     *
+     * @param item Item the data will be loaded into
+     * @param filename Already resolved filename
+     * @param data Destination buffer
+     * @param file Destination mapping of a cached mesh
+     * @return True if the payload has been produced
+     */
+    bool prepare(Item *item, const std::string &filename, std::vector<unsigned char> &data, MappedFile &file);
 protected:
+    /**
+     * Parses a mesh file into submesh objects. Implemented by actual
+     * mesh importers.
+     *
+     * @param item Item the data will be loaded into
+     * @param filename Already resolved filename
+     * @param objects List to append parsed submesh objects to
+     * @return True if the file has been parsed
+     */
+    virtual bool parse(Item *item, const std::string &filename, std::list<SubmeshObject*> &objects) = 0;
+    
     /**
      * Computes vertex normals.
      *
@@ -83,6 +130,27 @@ protected:
      */
     float *computeNormals(int vertexCount, int faceCount, float *vertices, unsigned int *faces) const;
     
+    /**
+     * Merges vertices with equal positions, normals and texture
+     * coordinates and rewrites the index list to reference the merged
+     * vertices. Arrays of the object are replaced.
+     *
+     * @param obj Submesh object
+     * @param tolerance Maximum difference of attributes that are
+     *                  still considered equal or zero for exact matches
+     */
+    void weldVertices(SubmeshObject *obj, float tolerance) const;
+    
+    /**
+     * Reorders triangles of a submesh object for the post-transform
+     * vertex cache (and for less overdraw when the Mesh.OptimizeOverdraw
+     * attribute is set) and vertices in order of first use.
+     *
+     * @param item Storage item to load into
+     * @param obj Submesh object
+     */
+    void optimizeSubmeshObject(Item *item, SubmeshObject *obj) const;
+    
     /**
      * Scales the 3D mesh.
      *
@@ -124,12 +192,45 @@ protected:
     Vector3f geometricCenter(const Vector3f &mind, const Vector3f &maxd) const;
     
     /**
-     * Performs submesh object postprocessing after import.
+     * Performs submesh object postprocessing after import and serializes
+     * the result in the mesh cache format. Submesh objects are freed.
      *
      * @param item Storage item to load into
      * @param objects A list of imported submesh objects.
+     * @param key Cache key
+     * @param data Destination buffer
+     */
+    void postProcessSubmeshObjects(Item *item, std::list<SubmeshObject*> objects, const std::string &key, std::vector<unsigned char> &data) const;
+    
+    /**
+     * Attempts to load an already processed mesh from the mesh cache.
+     *
+     * @param item Storage item to load into
+     * @param filename Source filename
+     * @return True if the mesh has been loaded from cache
+     */
+    bool loadFromCache(Item *item, const std::string &filename) const;
+    
+    /**
+     * Returns the cache key for importing a file into an item. The key
+     * covers the source file, its modification time and all attributes
+     * that affect post-processing.
+     *
+     * @param item Storage item to load into
+     * @param filename Source filename
+     */
+    std::string cacheKey(Item *item, const std::string &filename) const;
+    
+    /**
+     * Creates mesh items from processed submeshes.
+     *
+     * @param item Storage item to load into
+     * @param mesh Processed mesh
      */
-    void postProcessSubmeshObjects(Item *item, std::list<SubmeshObject*> objects) const;
+    void createMeshItems(Item *item, const CachedMesh &mesh) const;
+private:
+    // Cache of processed meshes
+    MeshCache m_cache;
 };
 
 }
@@ -0,0 +1,126 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_IMPORTERS_MESHCACHE_H
+#define IID_IMPORTERS_MESHCACHE_H
+
+#include "globals.h"
+
+#include <string>
+#include <vector>
+
+namespace IID {
+
+class Logger;
+class MappedFile;
+
+/**
+ * A processed submesh ready to be uploaded. Vertex data is stored as
+ * interleaved mesh records.
+ */
+struct CachedSubmesh {
+    std::string name;
+    int vertexCount;
+    int indexCount;
+    const unsigned char *records;
+    const unsigned int *indices;
+    Vector3f mind;
+    Vector3f maxd;
+    Vector3f relative;
+};
+
+/**
+ * A processed mesh together with its global bounds and center.
+ */
+struct CachedMesh {
+    Vector3f center;
+    Vector3f mind;
+    Vector3f maxd;
+    std::vector<CachedSubmesh> submeshes;
+};
+
+/**
+ * The mesh cache stores post-processed meshes in a versioned binary
+ * format so they can be memory mapped and uploaded directly on the next
+ * run instead of being imported again. Cache files are named after a
+ * hash of the cache key and also contain the full key, so collisions
+ * are detected.
+ */
+class MeshCache {
+public:
+    /**
+     * Class constructor.
+     *
+     * @param logger Logger instance
+     * @param directory Directory holding the cache files
+     */
+    MeshCache(Logger *logger, const std::string &directory = "cache");
+    
+    /**
+     * Loads a mesh from the cache. Pointers in the returned mesh point
+     * into the mapped file and remain valid while it stays open.
+     *
+     * @param key Cache key
+     * @param file File mapping to use
+     * @param mesh Destination mesh description
+     * @return True if a valid cache entry has been found
+     */
+    bool load(const std::string &key, MappedFile &file, CachedMesh &mesh) const;
+    
+    /**
+     * Maps a cache file without parsing it. Only the header and the key
+     * are verified, the rest is checked when the data is parsed.
+     *
+     * @param key Cache key
+     * @param file File mapping to use
+     * @return True if a cache entry for the key has been found
+     */
+    bool open(const std::string &key, MappedFile &file) const;
+    
+    /**
+     * Stores a serialized mesh into the cache. Failures are logged but
+     * otherwise ignored.
+     *
+     * @param key Cache key
+     * @param data Serialized mesh
+     */
+    void store(const std::string &key, const std::vector<unsigned char> &data) const;
+    
+    /**
+     * Serializes a mesh into the cache file format.
+     *
+     * @param key Cache key
+     * @param mesh Mesh description
+     * @param data Destination buffer
+     */
+    static void serialize(const std::string &key, const CachedMesh &mesh, std::vector<unsigned char> &data);
+    
+    /**
+     * Parses a serialized mesh. Pointers in the returned mesh point into
+     * the serialized data.
+     *
+     * @param data Serialized mesh
+     * @param size Size of serialized data
+     * @param key Expected cache key or NULL to accept any key
+     * @param mesh Destination mesh description
+     * @return True if the data is valid
+     */
+    static bool parse(const unsigned char *data, size_t size, const std::string *key, CachedMesh &mesh);
+protected:
+    /**
+     * Returns the cache filename for the given key.
+     *
+     * @param key Cache key
+     */
+    std::string filename(const std::string &key) const;
+private:
+    Logger *m_logger;
+    std::string m_directory;
+};
+
+}
+
+#endif
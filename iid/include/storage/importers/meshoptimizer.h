@@ -0,0 +1,74 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_IMPORTERS_MESHOPTIMIZER_H
+#define IID_IMPORTERS_MESHOPTIMIZER_H
+
+#include <vector>
+
+namespace IID {
+
+/**
+ * Reorders indexed triangle lists at import time so they render faster.
+ * All methods work on plain triangle index lists.
+ */
+class MeshOptimizer {
+public:
+    /**
+     * Computes the average cache miss ratio (transformed vertices per
+     * triangle) of an index list on a FIFO post-transform cache.
+     *
+     * @param indices Index list
+     * @param faceCount Number of triangles
+     * @param vertexCount Number of vertices
+     * @param cacheSize Number of cache entries
+     * @return Average cache miss ratio (0.5 is ideal, 3 is the worst)
+     */
+    static float computeACMR(const unsigned int *indices, int faceCount, int vertexCount, int cacheSize = 16);
+    
+    /**
+     * Reorders triangles for post-transform vertex cache locality using
+     * Forsyth's linear-speed algorithm.
+     *
+     * @param indices Index list to reorder in place
+     * @param faceCount Number of triangles
+     * @param vertexCount Number of vertices
+     */
+    static void optimizeVertexCache(unsigned int *indices, int faceCount, int vertexCount);
+    
+    /**
+     * Reorders clusters of an already cache-optimized index list so that
+     * triangles facing outwards are drawn first, which reduces overdraw.
+     * Clusters are split where the cache efficiency of the original order
+     * would not suffer much.
+     *
+     * @param indices Index list to reorder in place
+     * @param faceCount Number of triangles
+     * @param vertices Vertex positions (three floats per vertex)
+     * @param vertexCount Number of vertices
+     * @param threshold Allowed ACMR degradation (1.05 allows 5%)
+     */
+    static void optimizeOverdraw(unsigned int *indices, int faceCount, const float *vertices, int vertexCount,
+                                 float threshold = 1.05f);
+    
+    /**
+     * Computes a vertex order in which vertices are first referenced by
+     * the index list and rewrites the index list accordingly.
+     * Unreferenced vertices are dropped.
+     *
+     * @param indices Index list to rewrite in place
+     * @param faceCount Number of triangles
+     * @param vertexCount Number of vertices
+     * @param remap Destination for the new position of each old vertex
+     *              (or -1 for dropped vertices)
+     * @return Number of remaining vertices
+     */
+    static int optimizeVertexFetch(unsigned int *indices, int faceCount, int vertexCount, std::vector<int> &remap);
+};
+
+}
+
+#endif
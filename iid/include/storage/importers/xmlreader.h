@@ -0,0 +1,137 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_IMPORTERS_XMLREADER_H
+#define IID_IMPORTERS_XMLREADER_H
+
+#include <string>
+#include <vector>
+
+namespace IID {
+
+/**
+ * A minimal streaming XML pull parser that works directly on a buffer
+ * (usually a memory mapped file). No document tree is built and text is
+ * returned as ranges into the buffer. Entities are not decoded, so it is
+ * only meant for data formats such as COLLADA geometry.
+ */
+class XmlReader {
+public:
+    /**
+     * Possible tokens.
+     */
+    enum Token {
+      StartElement,
+      EndElement,
+      Text,
+      EndOfDocument,
+      Error
+    };
+    
+    /**
+     * Class constructor.
+     *
+     * @param begin Start of the document
+     * @param end End of the document
+     */
+    XmlReader(const char *begin, const char *end);
+    
+    /**
+     * Advances to the next token. Self-closing elements produce both a
+     * start and an end token. Comments, processing instructions and
+     * declarations are skipped.
+     */
+    Token next();
+    
+    /**
+     * Skips the rest of the element whose start token was just read.
+     *
+     * @return False if the document ended or is malformed
+     */
+    bool skipElement();
+    
+    /**
+     * Returns the name of the current element.
+     */
+    const std::string &name() const { return m_name; }
+    
+    /**
+     * Returns an attribute of the current start element.
+     *
+     * @param name Attribute name
+     * @param defaultValue Value to return when there is no such attribute
+     */
+    std::string attribute(const std::string &name, const std::string &defaultValue = "") const;
+    
+    /**
+     * Returns the start of the current text.
+     */
+    const char *textBegin() const { return m_textBegin; }
+    
+    /**
+     * Returns the end of the current text.
+     */
+    const char *textEnd() const { return m_textEnd; }
+    
+    /**
+     * Returns the current element nesting depth.
+     */
+    int depth() const { return m_depth; }
+protected:
+    /**
+     * Parses a start tag; the position must be just after '<'.
+     */
+    Token parseStartTag();
+    
+    /**
+     * Moves the position after the specified terminator.
+     *
+     * @param terminator Terminating string
+     * @return False if the terminator can not be found
+     */
+    bool skipPast(const char *terminator);
+private:
+    // Position in the document
+    const char *m_position;
+    const char *m_end;
+    int m_depth;
+    
+    // Current element name and attributes
+    std::string m_name;
+    std::vector<std::pair<std::string, std::string> > m_attributes;
+    bool m_selfClosing;
+    
+    // Current text
+    const char *m_textBegin;
+    const char *m_textEnd;
+};
+
+/**
+ * Parses whitespace separated decimal numbers into a preallocated array.
+ *
+ * @param begin Start of the text
+ * @param end End of the text
+ * @param values Destination array
+ * @param count Maximum number of values to parse
+ * @return Number of values parsed
+ */
+int readFloats(const char *begin, const char *end, float *values, int count);
+
+/**
+ * Parses whitespace separated unsigned integers into a preallocated
+ * array.
+ *
+ * @param begin Start of the text
+ * @param end End of the text
+ * @param values Destination array
+ * @param count Maximum number of values to parse
+ * @return Number of values parsed
+ */
+int readIndices(const char *begin, const char *end, unsigned int *values, int count);
+
+}
+
+#endif
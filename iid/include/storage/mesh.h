@@ -8,6 +8,8 @@
 #define IID_STORAGE_MESH_H
 
 #include "storage.h"
+#include "residency.h"
+#include "geometry.h"
 #include "scene/aabb.h"
 #include "drivers/base.h"
 
@@ -19,10 +21,31 @@ class DVertexBuffer;
 class Driver;
 
 /**
- * This class represents a 3D mesh object backed by a VBO.
+ * This class represents a 3D mesh object backed by a VBO. The CPU-side
+ * geometry and the vertex buffers may be evicted by the residency
+ * manager, in which case the mesh is reloaded when they are next used.
  */
-class Mesh : public Item {
+class Mesh : public Item, public Resident {
 public:
+    // Size of an interleaved vertex record (position, normal and texture
+    // coordinates) in bytes
+    static const int RecordSize = 32;
+    
+    /**
+     * Vertex layouts used for vertex buffers. Meshes are always specified
+     * with full records and converted when uploaded.
+     */
+    enum VertexFormat {
+      // Float positions, normals and texture coordinates (32 bytes)
+      FullFormat,
+      // Float positions, octahedral normals and half-float texture
+      // coordinates (20 bytes)
+      CompressedFormat,
+      // Like compressed, but with 16-bit positions relative to the
+      // bounding box (16 bytes)
+      QuantizedFormat
+    };
+    
     /**
      * Class constructor.
      *
@@ -39,9 +62,16 @@ public:
     ~Mesh();
     
     /**
-     * Specifies a mesh (this creates vertex buffers). Vertices and indices arrays
-     * should NOT be freed after this function is done, since they are used internaly.
-     * They will be freed when mesh object is destroyed.
+     * Sets the vertex layout used for vertex buffers. This must be
+     * called before the mesh is specified.
+     *
+     * @param format Vertex format
+     */
+    void setVertexFormat(VertexFormat format) { m_vertexFormat = format; }
+    
+    /**
+     * Specifies a mesh (this creates vertex buffers). The data is copied, so
+     * it may be freed afterwards.
      *
      * @param vertexCount Number of vertices
      * @param indexCount Number of indices
@@ -53,6 +83,31 @@ public:
     void setMesh(int vertexCount, int indexCount, unsigned char *vertices, unsigned char *normals,
                  unsigned char *tex, unsigned char *indices, Driver::DrawPrimitive primitive = Driver::Triangles);
     
+    /**
+     * Specifies a mesh from already interleaved vertex records. The data
+     * is copied, so it may be freed or unmapped afterwards.
+     *
+     * @param vertexCount Number of vertices
+     * @param indexCount Number of indices
+     * @param records Vertex records (RecordSize bytes per vertex)
+     * @param indices Index data
+     */
+    void setMeshRecords(int vertexCount, int indexCount, const unsigned char *records,
+                        const unsigned int *indices, Driver::DrawPrimitive primitive = Driver::Triangles);
+    
+    /**
+     * Interleaves separate vertex attribute arrays into vertex records.
+     * Missing normals or texture coordinates are set to zero.
+     *
+     * @param vertexCount Number of vertices
+     * @param vertices Vertex data
+     * @param normals Normal data or NULL
+     * @param tex Texture coordinate data or NULL
+     * @param records Destination buffer (RecordSize bytes per vertex)
+     */
+    static void interleaveRecords(int vertexCount, const unsigned char *vertices, const unsigned char *normals,
+                                  const unsigned char *tex, unsigned char *records);
+    
     /**
      * Specifies mesh boundaries.
      *
@@ -68,7 +123,8 @@ public:
     
     /**
      * Binds associated index and vertex buffers. This also configures shader
-     * attributes.
+     * attributes. Meshes whose evicted buffers could not be restored are
+     * not bound and drawing them does nothing.
      */
     void bind() const;
     
@@ -82,6 +138,14 @@ public:
      */
     void draw() const;
     
+    /**
+     * Draws multiple instances of the mesh. Per-instance transformations
+     * must already be bound by the caller.
+     *
+     * @param instances Number of instances to draw
+     */
+    void drawInstanced(int instances) const;
+    
     /**
      * Returns number of vertices in this mesh.
      */
@@ -93,14 +157,10 @@ public:
     int indexCount() const { return m_indexCount; }
     
     /**
-     * Returns a vertex list associated with this mesh.
-     */
-    float *vertices() const { return m_rawVertices; }
-    
-    /**
-     * Returns an index list associated with this mesh.
+     * Returns the CPU-side geometry of this mesh. Holding on to it keeps
+     * the data alive even when the mesh evicts its own reference.
      */
-    unsigned int *indices() const { return m_rawIndices; }
+    GeometryPtr geometry() const;
     
     /**
      * Builds a convex hull shape out of this mesh.
@@ -108,17 +168,68 @@ public:
      * @param shape Destination hull shape
      */
     void getConvexHullShape(btConvexHullShape *shape) const;
+    
+    /**
+     * Returns the size of the CPU-side geometry in bytes.
+     */
+    size_t cpuMemoryUsage() const;
+    
+    /**
+     * Returns the size of the vertex buffers in bytes.
+     */
+    size_t gpuMemoryUsage() const;
+    
+    /**
+     * Releases the CPU-side geometry.
+     */
+    void evictCpu();
+    
+    /**
+     * Frees the vertex buffers.
+     */
+    void evictGpu();
+protected:
+    /**
+     * Reloads evicted mesh data.
+     */
+    void restore() const;
+    
+    /**
+     * Determines attribute offsets and record size of the vertex format.
+     */
+    void setupLayout();
+    
+    /**
+     * Converts full vertex records into the vertex format.
+     *
+     * @param records Full vertex records
+     * @param encoded Destination buffer (m_vertexSize bytes per vertex)
+     */
+    void encodeRecords(const unsigned char *records, unsigned char *encoded);
 private:
     // Vertex buffers
     DVertexBuffer *m_attributes;
     DVertexBuffer *m_indices;
     Driver *m_driver;
     
+    // Vertex layout
+    VertexFormat m_vertexFormat;
+    int m_vertexSize;
+    int m_normalOffset;
+    int m_texOffset;
+    bool m_halfTexCoords;
+    Driver::IndexType m_indexType;
+    
+    // Position dequantization parameters
+    float m_positionOffset[3];
+    float m_positionScale[3];
+    
     // Vertex and index count
     int m_vertexCount;
     int m_indexCount;
-    float *m_rawVertices;
-    unsigned int *m_rawIndices;
+    
+    // CPU-side geometry
+    GeometryPtr m_geometry;
     
     // Boundaries
     AxisAlignedBox m_boundAABB;
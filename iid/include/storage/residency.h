@@ -0,0 +1,198 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_STORAGE_RESIDENCY_H
+#define IID_STORAGE_RESIDENCY_H
+
+#include "globals.h"
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <boost/functional/hash.hpp>
+
+namespace IID {
+
+class ResidencyManager;
+class Logger;
+
+/**
+ * A base class for storage items whose CPU-side and GPU-side copies can
+ * be evicted by the residency manager. Items must transparently reload
+ * evicted copies when they are used again.
+ */
+class Resident {
+public:
+    /**
+     * Class constructor.
+     *
+     * @param manager Residency manager or NULL
+     * @param type Type name used for budgets and reporting
+     */
+    Resident(ResidencyManager *manager, const std::string &type);
+    
+    /**
+     * Class destructor.
+     */
+    virtual ~Resident();
+    
+    /**
+     * Returns the type name used for budgets and reporting.
+     */
+    const std::string &residentType() const { return m_residentType; }
+    
+    /**
+     * Returns the number of bytes currently used by the CPU-side copy.
+     */
+    virtual size_t cpuMemoryUsage() const = 0;
+    
+    /**
+     * Returns the number of bytes currently used by the GPU-side copy.
+     */
+    virtual size_t gpuMemoryUsage() const = 0;
+    
+    /**
+     * Frees the CPU-side copy.
+     */
+    virtual void evictCpu() = 0;
+    
+    /**
+     * Frees the GPU-side copy.
+     */
+    virtual void evictGpu() = 0;
+    
+    /**
+     * Adds a reference. Referenced items are never evicted; this must be
+     * used by anyone holding on to raw data pointers.
+     */
+    void acquire() { m_references++; }
+    
+    /**
+     * Removes a reference.
+     */
+    void release() { m_references--; }
+    
+    /**
+     * Returns the number of references.
+     */
+    int references() const { return m_references; }
+    
+    /**
+     * Returns the frame in which this item was last used.
+     */
+    unsigned long lastUse() const { return m_lastUse; }
+protected:
+    /**
+     * Marks this item as used in the current frame.
+     */
+    void touch() const;
+private:
+    ResidencyManager *m_manager;
+    std::string m_residentType;
+    int m_references;
+    mutable unsigned long m_lastUse;
+};
+
+/**
+ * Memory usage of a single resident type.
+ */
+struct ResidencyUsage {
+    std::string type;
+    int items;
+    size_t cpuBytes;
+    size_t gpuBytes;
+    size_t cpuBudget;
+    size_t gpuBudget;
+};
+
+/**
+ * The residency manager keeps memory used by resident storage items
+ * within per-type budgets by evicting least recently used copies.
+ */
+class ResidencyManager {
+public:
+    // Budget value that disables eviction
+    static const size_t Unlimited;
+    
+    /**
+     * Class constructor.
+     *
+     * @param logger Logger instance
+     */
+    ResidencyManager(Logger *logger);
+    
+    /**
+     * Sets memory budgets for a resident type.
+     *
+     * @param type Type name
+     * @param cpuBytes CPU-side budget in bytes
+     * @param gpuBytes GPU-side budget in bytes
+     */
+    void setBudget(const std::string &type, size_t cpuBytes, size_t gpuBytes);
+    
+    /**
+     * Registers a resident item.
+     *
+     * @param resident Resident item
+     */
+    void add(Resident *resident);
+    
+    /**
+     * Unregisters a resident item.
+     *
+     * @param resident Resident item
+     */
+    void remove(Resident *resident);
+    
+    /**
+     * Returns the current frame number.
+     */
+    unsigned long frame() const { return m_frame; }
+    
+    /**
+     * Advances the frame counter and periodically evicts least recently
+     * used copies of types that exceed their budgets.
+     */
+    void update();
+    
+    /**
+     * Returns memory usage by resident type.
+     *
+     * @param usage Destination list
+     */
+    void getUsage(std::vector<ResidencyUsage> &usage) const;
+    
+    /**
+     * Writes memory usage by resident type to the log.
+     */
+    void logUsage() const;
+protected:
+    /**
+     * Evicts copies of a type until it is within its budget.
+     *
+     * @param type Type name
+     * @param gpu True to evict GPU-side copies, false for CPU-side ones
+     * @param budget Budget in bytes
+     */
+    void evict(const std::string &type, bool gpu, size_t budget);
+private:
+    Logger *m_logger;
+    
+    // Registered items and budgets by type
+    std::vector<Resident*> m_residents;
+    boost::unordered_map<std::string, std::pair<size_t, size_t> > m_budgets;
+    
+    // Budgets (by type and GPU flag) currently exceeded, so the warning is
+    // only logged once when usage crosses the budget
+    boost::unordered_map<std::pair<std::string, bool>, bool> m_overBudget;
+    
+    // Current frame
+    unsigned long m_frame;
+};
+
+}
+
+#endif
@@ -50,6 +50,11 @@ public:
      * Deactivate this shader program.
      */
     void deactivate() const;
+    
+    /**
+     * Returns the underlying driver shader program.
+     */
+    DShader *getProgram() const { return m_shader; }
 private:
     DShader *m_shader;
 };
@@ -0,0 +1,117 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_STORAGE_SHAPECACHE_H
+#define IID_STORAGE_SHAPECACHE_H
+
+#include "globals.h"
+
+#include <string>
+#include <boost/functional/hash.hpp>
+
+class btCollisionShape;
+class btConvexHullShape;
+
+namespace IID {
+
+class Item;
+class Logger;
+
+/**
+ * The shape cache builds collision shapes of meshes and composite meshes
+ * once and shares them between all bodies using the same mesh. Shapes are
+ * owned by the cache and must not be deleted by their users. Convex hulls
+ * are also stored on disk, so they are not computed again on the next
+ * run unless the mesh changes.
+ */
+class ShapeCache {
+public:
+    /**
+     * Available collision shape types.
+     */
+    enum ShapeType {
+      // Box with the half extents of the mesh bounding box
+      BoxShape,
+      // Convex hull of all mesh vertices
+      HullShape,
+      // Convex hull reduced to a small number of vertices
+      SimplifiedHullShape
+    };
+    
+    /**
+     * Class constructor.
+     *
+     * @param logger Logger instance
+     * @param directory Directory holding persisted hulls
+     */
+    ShapeCache(Logger *logger, const std::string &directory = "cache");
+    
+    /**
+     * Class destructor. Shapes must no longer be used by any bodies.
+     */
+    ~ShapeCache();
+    
+    /**
+     * Returns the collision shape of a mesh, building it on first use.
+     *
+     * @param mesh Mesh or CompositeMesh item
+     * @param type Shape type
+     * @return A shared collision shape or NULL for other items
+     */
+    btCollisionShape *get(Item *mesh, ShapeType type);
+protected:
+    /**
+     * Builds a convex hull out of mesh vertices.
+     *
+     * @param mesh Mesh or CompositeMesh item
+     * @param simplified Should the hull be simplified
+     */
+    btConvexHullShape *buildHull(Item *mesh, bool simplified) const;
+    
+    /**
+     * Computes a fingerprint of mesh contents, identifying persisted hulls.
+     *
+     * @param mesh Mesh or CompositeMesh item
+     */
+    size_t fingerprint(Item *mesh) const;
+    
+    /**
+     * Returns the filename of a persisted hull.
+     *
+     * @param mesh Mesh or CompositeMesh item
+     * @param type Shape type
+     */
+    std::string filename(Item *mesh, ShapeType type) const;
+    
+    /**
+     * Loads a persisted hull.
+     *
+     * @param filename Hull filename
+     * @param fingerprint Expected mesh fingerprint
+     * @return A valid hull or NULL when there is no valid file
+     */
+    btConvexHullShape *loadHull(const std::string &filename, size_t fingerprint) const;
+    
+    /**
+     * Persists a hull. Failures are logged but otherwise ignored.
+     *
+     * @param filename Hull filename
+     * @param fingerprint Mesh fingerprint
+     * @param hull Hull shape
+     */
+    void storeHull(const std::string &filename, size_t fingerprint, btConvexHullShape *hull) const;
+private:
+    Logger *m_logger;
+    std::string m_directory;
+    
+    // Shapes by mesh and type
+    typedef std::pair<Item*, int> ShapeKey;
+    boost::unordered_map<ShapeKey, btCollisionShape*> m_shapes;
+};
+
+}
+
+#endif
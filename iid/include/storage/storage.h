@@ -8,9 +8,14 @@
 #define IID_STORAGE_H
 
 #include <string>
+#include <vector>
+#include <deque>
 #include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #include "globals.h"
+#include "mappedfile.h"
 
 namespace ticpp {
   class Element;
@@ -23,6 +28,9 @@ class Storage;
 class Importer;
 class Context;
 class Logger;
+class Archive;
+class ResidencyManager;
+class ShapeCache;
 
 /**
  * An abstract class for storage items.
@@ -143,6 +151,78 @@ public:
     virtual Item *create(Storage *storage, const std::string &itemId, Item *parent) = 0;
 };
 
+/**
+ * A file import requested while walking the manifest. Importers first
+ * prepare a payload on a worker thread, which is then loaded on the
+ * main thread.
+ */
+struct PendingLoad {
+    Item *item;
+    Importer *importer;
+    std::string filename;
+    
+    // Payload produced by the CPU stage, either in the buffer or mapped
+    std::vector<unsigned char> buffer;
+    MappedFile file;
+    const unsigned char *data;
+    size_t size;
+    
+    // Has the file been submitted to the thread pool, has the CPU stage
+    // completed and did it produce a payload
+    bool submitted;
+    bool prepared;
+    bool compiled;
+};
+
+/**
+ * A handle to a storage item that may still be loading in the
+ * background. Handles can be copied freely.
+ */
+class AssetHandle {
+public:
+    /**
+     * Constructs an invalid handle.
+     */
+    AssetHandle();
+    
+    /**
+     * Class constructor.
+     *
+     * @param storage Storage instance
+     * @param item Storage item
+     */
+    AssetHandle(Storage *storage, Item *item);
+    
+    /**
+     * Returns true if the handle refers to an item.
+     */
+    bool isValid() const { return m_item != 0; }
+    
+    /**
+     * Returns true if the item and all its children have been loaded.
+     * Loading progresses on Storage::update, so this may be polled once
+     * per frame.
+     */
+    bool isReady() const;
+    
+    /**
+     * Blocks until the item and all its children have been loaded. Must
+     * be called from the main thread.
+     *
+     * @return Storage item
+     */
+    Item *wait();
+    
+    /**
+     * Waits for the item and returns it cast to the specified type.
+     */
+    template<typename T>
+    T *get() { return static_cast<T*>(wait()); }
+private:
+    Storage *m_storage;
+    Item *m_item;
+};
+
 // Argument handler function
 typedef boost::function<void (Storage *storage, Item *item, StringMap arguments)> StorageArgumentHandler;
 
@@ -154,7 +234,8 @@ public:
     /**
      * Class constructor.
      *
-     * @param context A valid IID context
+     * @param context A valid IID context or NULL when the storage is only
+     *                used to walk the manifest offline
      */
     Storage(Context *context);
     
@@ -173,6 +254,117 @@ public:
      */
     void load();
     
+    /**
+     * Controls whether items are loaded on first use (the default) or
+     * all at once by load. Items marked with preload="true" in the
+     * manifest are always loaded by load.
+     *
+     * @param lazy True to enable lazy loading
+     */
+    void setLazyLoading(bool lazy);
+    
+    /**
+     * Mounts a packed archive. The manifest and all files referenced by
+     * it are then resolved from the archive before the filesystem.
+     *
+     * @param filename Archive filename
+     * @return True if the archive has been mounted
+     */
+    bool mount(const std::string &filename);
+    
+    /**
+     * Returns the mounted archive or NULL if no archive is mounted.
+     */
+    Archive *archive() const { return m_archive; }
+    
+    /**
+     * Returns the residency manager that keeps loaded items within
+     * their memory budgets.
+     */
+    ResidencyManager *residency() const { return m_residency; }
+    
+    /**
+     * Returns the storage logger.
+     */
+    Logger *logger() const { return m_logger; }
+    
+    /**
+     * Returns the cache of collision shapes shared between all bodies
+     * using the same mesh.
+     */
+    ShapeCache *shapes() const { return m_shapes; }
+    
+    /**
+     * Queues a file to be imported into an item. Queued files are
+     * prepared on the thread pool and loaded in dependency order when the
+     * item is first used or prefetched.
+     *
+     * @param item Item to load the data into
+     * @param importer Importer to use
+     * @param filename Already resolved filename
+     */
+    void queueLoad(Item *item, Importer *importer, const std::string &filename);
+    
+    /**
+     * Loads the files of an item again. This is used by items that
+     * had their data evicted by the residency manager. When the item
+     * itself has no files (such as submeshes), the files of the nearest
+     * ancestor that has them are loaded instead.
+     *
+     * @param item Storage item
+     * @return True if files have been loaded
+     */
+    bool reload(Item *item);
+    
+    /**
+     * Starts loading an item, its dependencies and all its children in
+     * the background.
+     *
+     * @param path Item or container path
+     * @return Handle for the item or an invalid handle if there is no
+     *         such item
+     */
+    AssetHandle prefetch(const std::string &path);
+    
+    /**
+     * Starts loading an item, its dependencies and all its children in
+     * the background.
+     *
+     * @param item Storage item
+     * @return Handle for the item
+     */
+    AssetHandle prefetch(Item *item);
+    
+    /**
+     * Returns true if an item and all its children have been loaded.
+     *
+     * @param item Storage item
+     */
+    bool isLoaded(Item *item);
+    
+    /**
+     * Loads an item and all its children, waiting for any files that are
+     * still being prepared.
+     *
+     * @param item Storage item
+     */
+    void waitLoaded(Item *item);
+    
+    /**
+     * Finishes loading of prefetched files that have been prepared in
+     * the background. Should be called once per frame from the main
+     * thread.
+     */
+    void update();
+    
+    /**
+     * Declares that an item must be loaded after another item.
+     *
+     * @param item Dependent item
+     * @param path Path of the item it depends on
+     */
+    void addDependency(Item *item, const std::string &path);
+    
     /**
      * Registers an item type.
      *
@@ -202,7 +394,7 @@ public:
     
     /**
      * Returns an item identified by path or NULL when an item
-     * cannot be found.
+     * cannot be found. The item is loaded first if needed.
      *
      * @param path Item path in the virtual hierarchy
      * @return A valid Item descendant pointer or NULL
@@ -212,7 +404,7 @@ public:
     
     /**
      * Returns an item identified by path or NULL when an item
-     * cannot be found.
+     * cannot be found. The item is loaded first if needed.
      *
      * @param path Item path in the virtual hierarchy
      * @return A valid Item pointer or NULL
@@ -232,6 +424,69 @@ protected:
      * Loads the specified container element.
      */
     void loadContainer(Item *item, ticpp::Element *element);
+    
+    /**
+     * Adds a file to the list of files that have not been loaded yet.
+     *
+     * @param item Item to load the data into
+     * @param importer Importer to use
+     * @param filename Already resolved filename
+     */
+    void addPendingLoad(Item *item, Importer *importer, const std::string &filename);
+    
+    /**
+     * Returns an item identified by path.
+     *
+     * @param path Item path in the virtual hierarchy
+     * @param load Should items along the path be loaded
+     */
+    Item *lookup(const std::string &path, bool load);
+    
+    /**
+     * Runs the CPU stage of a queued file. Called from worker threads.
+     *
+     * @param load Queued file
+     */
+    void prepareLoad(PendingLoad *load);
+    
+    /**
+     * Appends files of an item that have not been submitted yet to the
+     * load order after the files of all items it depends on.
+     *
+     * @param item Storage item
+     * @param order Load order
+     * @param state Visit state by item
+     */
+    void orderLoads(Item *item, std::vector<PendingLoad*> &order, boost::unordered_map<Item*, int> &state);
+    
+    /**
+     * Submits files of an item and its dependencies to the thread pool.
+     *
+     * @param item Storage item
+     */
+    void submitLoads(Item *item);
+    
+    /**
+     * Submits already ordered files to the thread pool.
+     *
+     * @param order Files in load order
+     */
+    void submitLoads(const std::vector<PendingLoad*> &order);
+    
+    /**
+     * Finishes loading of a submitted file, waiting for its CPU stage
+     * to complete.
+     *
+     * @param load Submitted file
+     */
+    void finishLoad(PendingLoad *load);
+    
+    /**
+     * Loads all files of an item (but not of its children).
+     *
+     * @param item Storage item
+     */
+    void ensureLoaded(Item *item);
 private:
     // IID context pointer
     Context *m_context;
@@ -240,6 +495,26 @@ private:
     // Root item
     Item *m_root;
     
+    // Mounted archive
+    Archive *m_archive;
+    
+    // Residency manager and files of each item, used for reloading
+    ResidencyManager *m_residency;
+    boost::unordered_map<Item*, std::vector<std::pair<Importer*, std::string> > > m_sources;
+    
+    // Collision shapes of meshes
+    ShapeCache *m_shapes;
+    
+    // Files that have not been loaded yet by item, submitted files in
+    // submission order, items marked for preloading and dependencies
+    boost::unordered_map<Item*, std::vector<PendingLoad*> > m_pendingLoads;
+    std::deque<PendingLoad*> m_submittedLoads;
+    std::vector<Item*> m_preloadItems;
+    boost::unordered_map<Item*, std::vector<std::string> > m_dependencies;
+    bool m_lazyLoading;
+    boost::mutex m_loadMutex;
+    boost::condition_variable m_loadPrepared;
+    
     // Registered types
     boost::unordered_map<std::string, ItemFactory*> m_types;
     
@@ -8,15 +8,18 @@
 #define IID_STORAGE_TEXTURE_H
 
 #include "storage.h"
+#include "residency.h"
 
 namespace IID {
 
 class DTexture;
 
 /**
- * This class represents a texture.
+ * This class represents a texture. Both the image and the texture
+ * object may be evicted by the residency manager; the texture is then
+ * recreated from the image or reloaded when it is next bound.
  */
-class Texture : public Item {
+class Texture : public Item, public Resident {
 public:
     /**
      * Possible image formats.
@@ -64,9 +67,47 @@ public:
     void unbind() const;
     
     /**
-     * Returns the underlying texture instance.
+     * Returns the underlying texture instance or NULL when it has been
+     * evicted and could not be restored.
      */
     DTexture *getTexture() const;
+    
+    /**
+     * Returns the size of the image in bytes.
+     */
+    size_t cpuMemoryUsage() const;
+    
+    /**
+     * Returns the estimated size of the texture object in bytes.
+     */
+    size_t gpuMemoryUsage() const;
+    
+    /**
+     * Frees the image.
+     */
+    void evictCpu();
+    
+    /**
+     * Frees the texture object.
+     */
+    void evictGpu();
+protected:
+    /**
+     * Creates the texture object from image data.
+     *
+     * @param image Image data
+     */
+    void upload(const unsigned char *image);
+    
+    /**
+     * Recreates an evicted texture object.
+     */
+    void restore();
+    
+    /**
+     * Returns the number of components per pixel.
+     */
+    int components() const { return m_format == RGBA ? 4 : 3; }
 private:
     // Image data
     Format m_format;
@@ -0,0 +1,132 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#ifndef IID_THREADPOOL_H
+#define IID_THREADPOOL_H
+
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <deque>
+#include <utility>
+
+namespace IID {
+
+class ThreadPool;
+
+/**
+ * A group of jobs that can be waited upon.
+ */
+class JobGroup {
+friend class ThreadPool;
+public:
+    /**
+     * Class constructor.
+     */
+    JobGroup();
+    
+    /**
+     * Blocks until all jobs submitted as part of this group have
+     * completed. While waiting, the calling thread executes queued
+     * normal priority jobs, so groups never wait behind background
+     * jobs occupying the workers.
+     */
+    void wait();
+protected:
+    /**
+     * Registers a newly submitted job.
+     */
+    void jobSubmitted();
+    
+    /**
+     * Marks a job as completed.
+     */
+    void jobFinished();
+private:
+    boost::mutex m_mutex;
+    boost::condition_variable m_finished;
+    int m_pending;
+    ThreadPool *m_pool;
+};
+
+/**
+ * A fixed pool of worker threads that execute submitted jobs. Jobs
+ * must not throw exceptions and must not call into the driver, since
+ * rendering contexts are bound to the main thread.
+ */
+class ThreadPool {
+friend class JobGroup;
+public:
+    typedef boost::function<void ()> Job;
+    
+    /**
+     * Job priorities. Background jobs are only started when no normal
+     * jobs are queued and never occupy all worker threads.
+     */
+    enum Priority {
+      Normal,
+      Background
+    };
+    
+    /**
+     * Class constructor.
+     *
+     * @param threads Number of worker threads or 0 to use one thread per
+     *                hardware core
+     */
+    ThreadPool(unsigned int threads = 0);
+    
+    /**
+     * Class destructor. Waits for queued jobs to complete.
+     */
+    ~ThreadPool();
+    
+    /**
+     * Queues a job for execution on one of the worker threads.
+     *
+     * @param job Job to execute
+     * @param group Optional group the job belongs to
+     * @param priority Job priority
+     */
+    void submit(const Job &job, JobGroup *group = 0, Priority priority = Normal);
+    
+    /**
+     * Returns the number of worker threads.
+     */
+    unsigned int size() const { return m_size; }
+protected:
+    /**
+     * Worker thread main loop.
+     */
+    void worker();
+    
+    /**
+     * Executes one queued normal priority job on the calling thread.
+     *
+     * @return False when no such job was queued
+     */
+    bool runJob();
+private:
+    // Worker threads
+    boost::thread_group m_threads;
+    unsigned int m_size;
+    
+    // Job queues
+    typedef std::pair<Job, JobGroup*> QueuedJob;
+    std::deque<QueuedJob> m_jobs;
+    std::deque<QueuedJob> m_backgroundJobs;
+    unsigned int m_backgroundRunning;
+    unsigned int m_backgroundLimit;
+    boost::mutex m_mutex;
+    boost::condition_variable m_jobAvailable;
+    bool m_shutdown;
+};
+
+}
+
+#endif
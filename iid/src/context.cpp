@@ -6,10 +6,13 @@
  */
 #include "context.h"
 #include "logger.h"
+#include "frameallocator.h"
+#include "threadpool.h"
 
 // Storage
 #include "storage/storage.h"
 #include "storage/arguments.h"
+#include "storage/residency.h"
 #include "storage/mesh.h"
 #include "storage/compositemesh.h"
 #include "storage/texture.h"
@@ -29,6 +32,7 @@
 // Scene
 #include "scene/scene.h"
 #include "scene/viewtransform.h"
+#include "scene/particlemanager.h"
 #include "renderer/statebatcher.h"
 
 // Drivers
@@ -55,6 +59,20 @@
 #include <GL/glu.h>
 #include <GL/gl.h>
 #include <iostream>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+
+namespace fs = boost::filesystem;
+using boost::format;
+
+// Packed archive that is mounted automatically when present
+#define STORAGE_ARCHIVE "data.iidpak"
+
+// Default memory budgets of resident storage item types in MiB
+#define TEXTURE_CPU_BUDGET 16
+#define TEXTURE_GPU_BUDGET 256
+#define MESH_CPU_BUDGET 64
+#define MESH_GPU_BUDGET 128
 
 namespace IID {
 
@@ -63,6 +81,8 @@ static Context *gContext = 0;
 Context::Context()
   : m_logger(new Logger("iid.context")),
     m_storage(new Storage(this)),
+    m_frameAllocator(new FrameAllocator()),
+    m_threadPool(new ThreadPool()),
     m_debug(false),
     m_viewportDimensions(1024, 768)
 {
@@ -107,14 +127,18 @@ Context::Context()
 
 Context::~Context()
 {
+  delete m_threadPool;
   delete m_gameStateManager;
   delete m_guiManager;
   delete m_triggerManager;
   delete m_soundContext;
-  delete m_driver;
   delete m_eventDispatcher;
   delete m_scene;
+  delete m_frameAllocator;
   delete m_storage;
+  
+  // Scene and storage resources unregister from the driver when deleted
+  delete m_driver;
   delete m_logger;
   
   // Delete physics stuff
@@ -153,6 +177,9 @@ void Context::initPhysics()
 
 void Context::moveAndDisplay()
 {
+  // Release scratch memory of the previous frame
+  m_frameAllocator->reset();
+  
   // Get delta time in microseconds and reset timer
   float dt = m_clock.getTimeMicroseconds();
   m_clock.reset();
@@ -183,7 +210,8 @@ void Context::moveAndDisplay()
     }
   }
   
-  m_triggerManager->update();
+  // Finish assets that have been prefetched in the background
+  m_storage->update();
   
   // Update GUI (needed for animations)
   m_guiManager->update(dt);
@@ -191,6 +219,14 @@ void Context::moveAndDisplay()
   // Update game state
   m_gameStateManager->update(dt);
   
+  // Advance particle simulation
+  m_scene->getParticleManager()->update(dt);
+  
+  // Apply scene graph changes queued during simulation; entities pending
+  // deletion are released afterwards as queued changes may refer to them
+  m_scene->applyPendingChanges();
+  m_triggerManager->update();
+  
   // Render the scene
   display();
 }
@@ -201,6 +237,13 @@ void Context::display()
   float dt = m_frameClock.getTimeMilliseconds();
   if (dt > 10000) {
     std::cout << "fps = " << (1000.*m_frameCounter / dt) << std::endl;
+    
+    // Memory statistics of the last completed frame
+    std::string heap = FrameAllocator::countsHeapAllocations() ?
+      str(format(", %d heap allocations") % m_frameAllocator->getLastFrameHeapAllocations()) : "";
+    m_logger->info(str(format("Frame arena used %d of %d bytes with %d overflows%s.") % m_frameAllocator->getLastFrameUsed() %
+      m_frameAllocator->getCapacity() % m_frameAllocator->getLastFrameOverflows() % heap));
+    
     m_frameCounter = 0;
     m_frameClock.reset();
   }
@@ -267,6 +310,11 @@ void Context::registerBasicStorageTypes()
   m_storage->registerType("Sound", new SoundFactory());
   m_storage->registerType("Font", new FontFactory());
   
+  // Keep loaded textures and meshes within memory budgets
+  ResidencyManager *residency = m_storage->residency();
+  residency->setBudget("Texture", TEXTURE_CPU_BUDGET << 20, TEXTURE_GPU_BUDGET << 20);
+  residency->setBudget("Mesh", MESH_CPU_BUDGET << 20, MESH_GPU_BUDGET << 20);
+  
   m_logger->info("Type registration completed.");
 }
 
@@ -277,6 +325,7 @@ void Context::registerBasicArgumentHandlers()
   // Register some basic argument handlers that are implemented inside IID
   m_storage->registerArgument("load_file", &argumentLoadFile);
   m_storage->registerArgument("attribute", &argumentAttribute);
+  m_storage->registerArgument("depends", &argumentDepends);
   
   m_logger->info("Argument handler registration completed.");
 }
@@ -298,6 +347,10 @@ void Context::registerBasicImporters()
 
 void Context::init()
 {
+  // Prefer preprocessed assets from a packed archive
+  if (fs::exists(STORAGE_ARCHIVE))
+    m_storage->mount(STORAGE_ARCHIVE);
+  
   // Load storage items from the manifest file
   m_storage->load();
   m_logger->info("IID initialized and ready.");
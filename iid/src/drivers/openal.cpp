@@ -137,6 +137,17 @@ void OpenALBuffer::init()
   }
 }
 
+void OpenALBuffer::initFromData(ALenum format, const void *data, ALsizei size, ALsizei frequency)
+{
+  alGenBuffers(1, m_buffer);
+  alBufferData(*m_buffer, format, data, size, frequency);
+  
+  // Clear error
+  if (alGetError() != AL_NO_ERROR) {
+    throw Exception("OpenAL: Couldn't create a buffer.");
+  }
+}
+
 ALuint *OpenALBuffer::getBufferId()
 {
     return m_buffer;
@@ -19,12 +19,21 @@
 #include <LinearMath/btIDebugDraw.h>
 
 #include <iostream>
+#include <vector>
+#include <cstring>
 
 namespace IID {
 
 // Global OpenGL driver instance
 static OpenGLDriver *gOpenGLDriver = 0;
 
+// Size of the streamed particle vertex buffer in bytes
+#define PARTICLE_BUFFER_SIZE (1 << 20)
+
+// Particle billboard vertex layout (position, texture coordinates, color)
+#define PARTICLE_VERTEX_SIZE (9 * sizeof(float))
+#define PARTICLE_SIZE (4 * PARTICLE_VERTEX_SIZE)
+
 /**
  * An OpenGL debug drawer for Bullet dynamics physics simulation.
  */
@@ -185,8 +194,9 @@ private:
     int m_debugMode;
 };
 
-OpenGLTexture::OpenGLTexture(Format format)
+OpenGLTexture::OpenGLTexture(OpenGLDriver *driver, Format format)
   : DTexture(format),
+    m_driver(driver),
     m_oglFormat(formatToOpenGL())
 {
   glGenTextures(1, &m_handle);
@@ -198,6 +208,7 @@ OpenGLTexture::OpenGLTexture(Format format)
 
 OpenGLTexture::~OpenGLTexture()
 {
+  m_driver->forgetTexture(m_handle);
   glDeleteTextures(1, &m_handle);
 }
 
@@ -213,18 +224,12 @@ void OpenGLTexture::setParameter(Parameter param, float value)
 
 void OpenGLTexture::bind(int textureUnit)
 {
-  glActiveTexture(GL_TEXTURE0 + textureUnit);
-  glBindTexture(m_oglFormat, m_handle);
-  
-  // Check for errors
-  if (glGetError() != GL_NO_ERROR)
-    throw Exception("OpenGL: Texture bind has failed!");
+  m_driver->bindTexture(textureUnit, m_oglFormat, m_handle);
 }
 
 void OpenGLTexture::unbind(int textureUnit)
 {
-  glActiveTexture(GL_TEXTURE0 + textureUnit);
-  glBindTexture(m_oglFormat, 0);
+  m_driver->bindTexture(textureUnit, m_oglFormat, 0);
 }
 
 void OpenGLTexture::buildMipMaps2D(int components, int width, int height, PixelFormat format, unsigned char *data)
@@ -266,17 +271,19 @@ GLenum OpenGLTexture::valueToOpenGL(Value val) const
   }
 }
 
-OpenGLVertexBuffer::OpenGLVertexBuffer(size_t size, unsigned char *data, UsageHint usage, Target target)
+OpenGLVertexBuffer::OpenGLVertexBuffer(OpenGLDriver *driver, size_t size, unsigned char *data, UsageHint usage, Target target)
   : DVertexBuffer(size, data, usage, target),
+    m_driver(driver),
     m_target(targetToOpenGL(target))
 {
   glGenBuffers(1, &m_handle);
-  glBindBuffer(m_target, m_handle);
+  m_driver->bindBuffer(m_target, m_handle);
   glBufferData(m_target, size, data, usageToOpenGL(usage));
 }
 
 OpenGLVertexBuffer::~OpenGLVertexBuffer()
 {
+  m_driver->forgetBuffer(m_handle);
   glDeleteBuffers(1, &m_handle);
 }
 
@@ -305,23 +312,25 @@ GLenum OpenGLVertexBuffer::targetToOpenGL(Target target) const
 
 void OpenGLVertexBuffer::bind() const
 {
-  glBindBuffer(m_target, m_handle);
+  m_driver->bindBuffer(m_target, m_handle);
 }
 
 void OpenGLVertexBuffer::unbind() const
 {
-  glBindBuffer(m_target, 0);
+  m_driver->bindBuffer(m_target, 0);
 }
 
 void OpenGLVertexBuffer::update(size_t size, unsigned char *data, UsageHint usage, Target target)
 {
     // Update target type
     m_target = targetToOpenGL(target);
+    m_driver->bindBuffer(m_target, m_handle);
     glBufferData(m_target, size, data, usageToOpenGL(usage));
 }
 
-OpenGLShader::OpenGLShader(const char *srcVertex, const char *srcFragment)
-  : DShader(srcVertex, srcFragment)
+OpenGLShader::OpenGLShader(OpenGLDriver *driver, const char *srcVertex, const char *srcFragment)
+  : DShader(srcVertex, srcFragment),
+    m_driver(driver)
 {
   GLuint vshader = 0;
   GLuint fshader = 0;
@@ -345,10 +354,59 @@ OpenGLShader::OpenGLShader(const char *srcVertex, const char *srcFragment)
     glDeleteShader(vshader);
   if (fshader)
     glDeleteShader(fshader);
+  
+  GLint status;
+  glGetProgramiv(m_handle, GL_LINK_STATUS, &status);
+  if (!status) {
+    glDeleteProgram(m_handle);
+    throw Exception("OpenGL: Shader program linking has failed!");
+  }
+  
+  cacheLocations();
 }
 
 OpenGLShader::~OpenGLShader()
 {
+  m_driver->forgetProgram(this);
+  glDeleteProgram(m_handle);
+}
+
+void OpenGLShader::cacheLocations()
+{
+  GLint count, maxLength;
+  GLint size;
+  GLenum type;
+  
+  // Uniforms
+  glGetProgramiv(m_handle, GL_ACTIVE_UNIFORMS, &count);
+  glGetProgramiv(m_handle, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+  std::vector<GLchar> name(maxLength + 1);
+  for (GLint i = 0; i < count; i++) {
+    glGetActiveUniform(m_handle, i, name.size(), 0, &size, &type, &name[0]);
+    
+    UniformInfo info;
+    info.location = glGetUniformLocation(m_handle, &name[0]);
+    info.size = 0;
+    m_uniforms[&name[0]] = info;
+  }
+  
+  // Attributes
+  glGetProgramiv(m_handle, GL_ACTIVE_ATTRIBUTES, &count);
+  glGetProgramiv(m_handle, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+  name.resize(maxLength + 1);
+  for (GLint i = 0; i < count; i++) {
+    glGetActiveAttrib(m_handle, i, name.size(), 0, &size, &type, &name[0]);
+    m_attributes[&name[0]] = glGetAttribLocation(m_handle, &name[0]);
+  }
+}
+
+GLint OpenGLShader::attributeLocation(const char *variable) const
+{
+  boost::unordered_map<std::string, GLint>::const_iterator i = m_attributes.find(variable);
+  if (i == m_attributes.end())
+    return -1;
+  
+  return i->second;
 }
 
 GLuint OpenGLShader::compileShader(const char *source, GLenum type) const
@@ -371,21 +429,66 @@ GLuint OpenGLShader::compileShader(const char *source, GLenum type) const
 
 void OpenGLShader::bindAttributePointer(const char *variable, int size, int stride, int offset)
 {
-  GLint attribId = glGetAttribLocation(m_handle, variable);
+  bindAttributePointer(variable, size, Float, false, stride, offset);
+}
+
+void OpenGLShader::bindAttributePointer(const char *variable, int size, AttributeType type, bool normalized,
+                                        int stride, int offset)
+{
+  GLint attribId = attributeLocation(variable);
   if (attribId != -1) {
-    glVertexAttribPointer(attribId, size, GL_FLOAT, 0, stride, (GLvoid*) offset);
-    glEnableVertexAttribArray(attribId);
+    GLenum glType;
+    switch (type) {
+      case HalfFloat: glType = GL_HALF_FLOAT_ARB; break;
+      case Short: glType = GL_SHORT; break;
+      case UnsignedShort: glType = GL_UNSIGNED_SHORT; break;
+      default: glType = GL_FLOAT; break;
+    }
+    
+    glVertexAttribPointer(attribId, size, glType, normalized, stride, (GLvoid*) offset);
+    m_driver->setVertexAttribArray(attribId, true);
+  }
+}
+
+bool OpenGLShader::hasAttribute(const char *variable)
+{
+  return attributeLocation(variable) != -1;
+}
+
+void OpenGLShader::bindInstanceAttributePointer(const char *variable, int columns, int stride, int offset)
+{
+  GLint attribId = attributeLocation(variable);
+  if (attribId == -1)
+    return;
+  
+  // Matrix attributes occupy consecutive locations, one per column
+  for (int i = 0; i < columns; i++) {
+    glVertexAttribPointer(attribId + i, 4, GL_FLOAT, 0, stride, (GLvoid*) (offset + i*4*sizeof(float)));
+    m_driver->setVertexAttribArray(attribId + i, true);
+    glVertexAttribDivisorARB(attribId + i, 1);
+  }
+}
+
+void OpenGLShader::unbindInstanceAttributePointer(const char *variable, int columns)
+{
+  GLint attribId = attributeLocation(variable);
+  if (attribId == -1)
+    return;
+  
+  for (int i = 0; i < columns; i++) {
+    glVertexAttribDivisorARB(attribId + i, 0);
+    m_driver->setVertexAttribArray(attribId + i, false);
   }
 }
 
 void OpenGLShader::activate() const
 {
-  glUseProgram(m_handle);
+  m_driver->useProgram(const_cast<OpenGLShader*>(this));
 }
 
 void OpenGLShader::deactivate() const
 {
-  glUseProgram(0);
+  m_driver->useProgram(0);
 }
 
 void OpenGLShader::bindAttributeLocation(int index, const char *name)
@@ -395,7 +498,18 @@ void OpenGLShader::bindAttributeLocation(int index, const char *name)
 
 void OpenGLShader::setUniform(const char *name, int size, float *values)
 {
-  GLint location = glGetUniformLocation(m_handle, name);
+  boost::unordered_map<std::string, UniformInfo>::iterator i = m_uniforms.find(name);
+  if (i == m_uniforms.end())
+    return;
+  
+  // Skip the upload when the uniform already holds these values
+  UniformInfo &info = i->second;
+  if (info.size == size && memcmp(info.values, values, size * sizeof(float)) == 0)
+    return;
+  
+  info.size = size;
+  memcpy(info.values, values, size * sizeof(float));
+  GLint location = info.location;
 
   switch(size) {
     case 1:
@@ -412,8 +526,9 @@ void OpenGLShader::setUniform(const char *name, int size, float *values)
   }
 }
 
-OpenGLFont::OpenGLFont(FTTextureFont *font)
-  : m_font(font)
+OpenGLFont::OpenGLFont(OpenGLDriver *driver, FTTextureFont *font)
+  : m_driver(driver),
+    m_font(font)
 {
 }
 
@@ -428,6 +543,9 @@ void OpenGLFont::render(int x, int y, int z, const std::string &text)
     glTranslatef(x, y, z);
     m_font->Render(text.c_str());
   glPopMatrix();
+  
+  // FTGL binds its glyph textures directly
+  m_driver->invalidateTextureCache();
 }
 
 FontMetrics OpenGLFont::getBoundingBox(const std::string &text) const
@@ -440,13 +558,32 @@ FontMetrics OpenGLFont::getBoundingBox(const std::string &text) const
 
 OpenGLDriver::OpenGLDriver()
   : Driver("OpenGL"),
-    m_debugDrawer(0)
+    m_debugDrawer(0),
+    m_currentLights(0),
+    m_instancing(false),
+    m_halfFloatVertices(false),
+    m_currentProgram(0),
+    m_arrayBuffer(0),
+    m_elementBuffer(0),
+    m_activeTextureUnit(0),
+    m_enabledAttributes(0),
+    m_materialValid(false),
+    m_particleBuffer(0),
+    m_particleBufferOffset(0)
 {
   gOpenGLDriver = this;
+  
+  for (int i = 0; i < 8; i++) {
+    m_boundTextures[i] = 0;
+    m_lights[i] = 0;
+  }
 }
 
 OpenGLDriver::~OpenGLDriver()
 {
+  if (m_particleBuffer)
+    glDeleteBuffers(1, &m_particleBuffer);
+  
   delete m_debugDrawer;
 }
 
@@ -468,6 +605,14 @@ void OpenGLDriver::init()
   glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
   
   glViewport(0, 0, 1024, 768);
+  
+  // Check for instanced drawing support
+  std::string extensions = (const char*) glGetString(GL_EXTENSIONS);
+  m_instancing = extensions.find("GL_ARB_instanced_arrays") != std::string::npos &&
+                 extensions.find("GL_ARB_draw_instanced") != std::string::npos;
+  
+  // Check for half-float vertex attribute support
+  m_halfFloatVertices = extensions.find("GL_ARB_half_float_vertex") != std::string::npos;
 }
 
 static void __glutKeyboardCallback(unsigned char key, int, int)
@@ -686,12 +831,25 @@ void OpenGLDriver::drawImage(const Vector3f &pos, const Vector3f &dim, DTexture
   glDisable(GL_TEXTURE_2D);
 }
 
-void OpenGLDriver::drawElements(int count, unsigned int offset, DrawPrimitive primitive) const
+void OpenGLDriver::drawElements(int count, unsigned int offset, DrawPrimitive primitive, IndexType type) const
+{
+  GLenum glType = type == UnsignedShortIndex ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+  
+  switch (primitive) {
+    case Triangles: glDrawElements(GL_TRIANGLES, count, glType, (GLvoid*) offset); break;
+    case TriangleStrip: glDrawElements(GL_TRIANGLE_STRIP, count, glType, (GLvoid*) offset); break;
+    case Lines: glDrawElements(GL_LINES, count, glType, (GLvoid*) offset); break;
+  }
+}
+
+void OpenGLDriver::drawElementsInstanced(int count, unsigned int offset, DrawPrimitive primitive, IndexType type, int instances) const
 {
+  GLenum glType = type == UnsignedShortIndex ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+  
   switch (primitive) {
-    case Triangles: glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, (GLvoid*) offset); break;
-    case TriangleStrip: glDrawElements(GL_TRIANGLE_STRIP, count, GL_UNSIGNED_INT, (GLvoid*) offset); break;
-    case Lines: glDrawElements(GL_LINES, count, GL_UNSIGNED_INT, (GLvoid*) offset); break;
+    case Triangles: glDrawElementsInstancedARB(GL_TRIANGLES, count, glType, (GLvoid*) offset, instances); break;
+    case TriangleStrip: glDrawElementsInstancedARB(GL_TRIANGLE_STRIP, count, glType, (GLvoid*) offset, instances); break;
+    case Lines: glDrawElementsInstancedARB(GL_LINES, count, glType, (GLvoid*) offset, instances); break;
   }
 }
 
@@ -707,12 +865,28 @@ void OpenGLDriver::applyProjectionTransform(const float *transform) const
   glMatrixMode(GL_MODELVIEW);
 }
 
-void OpenGLDriver::applyMaterial(const float *ambient, const float *diffuse, const float *specular, const float *emission) const
+void OpenGLDriver::applyMaterial(const float *ambient, const float *diffuse, const float *specular, const float *emission)
 {
-  glMaterialfv(GL_FRONT, GL_AMBIENT, ambient);
-  glMaterialfv(GL_FRONT, GL_DIFFUSE, diffuse);
-  glMaterialfv(GL_FRONT, GL_SPECULAR, specular);
-  glMaterialfv(GL_FRONT, GL_EMISSION, emission);
+  // Materials are specified as RGB, but OpenGL expects RGBA
+  const float *components[4] = {ambient, diffuse, specular, emission};
+  float material[4][4];
+  for (int i = 0; i < 4; i++) {
+    material[i][0] = components[i][0];
+    material[i][1] = components[i][1];
+    material[i][2] = components[i][2];
+    material[i][3] = 1.0;
+  }
+  
+  if (m_materialValid && memcmp(material, m_material, sizeof(material)) == 0)
+    return;
+  
+  glMaterialfv(GL_FRONT, GL_AMBIENT, material[0]);
+  glMaterialfv(GL_FRONT, GL_DIFFUSE, material[1]);
+  glMaterialfv(GL_FRONT, GL_SPECULAR, material[2]);
+  glMaterialfv(GL_FRONT, GL_EMISSION, material[3]);
+  
+  memcpy(m_material, material, sizeof(material));
+  m_materialValid = true;
 }
 
 void OpenGLDriver::setAmbientLight(float r, float g, float b) const
@@ -727,8 +901,11 @@ void OpenGLDriver::setupLights(const LightList &lights, unsigned short limit)
   iend = lights.end();
   unsigned short num = 0;
   
-  // Configure lights
+  // Configure lights, skipping slots that already hold the same light
   for (i = lights.begin(); i != iend && num < limit; ++i, ++num) {
+    if (m_lights[num] == *i)
+      continue;
+    
     setupGLLight(num, *i);
     m_lights[num] = *i;
   }
@@ -742,6 +919,12 @@ void OpenGLDriver::setupLights(const LightList &lights, unsigned short limit)
   m_currentLights = std::min(limit, (unsigned short) lights.size());
 }
 
+void OpenGLDriver::invalidateLights()
+{
+  for (unsigned short i = 0; i < m_currentLights; i++)
+    m_lights[i] = 0;
+}
+
 void OpenGLDriver::setupGLLight(unsigned short index, Light *light)
 {
   GLenum glIndex = GL_LIGHT0 + index;
@@ -783,38 +966,33 @@ void OpenGLDriver::setupGLLight(unsigned short index, Light *light)
 
 void OpenGLDriver::setupGLLightPositionDirection(GLenum index, Light *light)
 {
-  glLightfv(index, GL_POSITION, light->getWorldPosition().data());
+  Vector3f position = light->getWorldPosition();
+  GLfloat p[4] = {position[0], position[1], position[2], 1.0};
+  glLightfv(index, GL_POSITION, p);
   
   // TODO handle spotlights
 }
 
 DShader *OpenGLDriver::currentShader()
 {
-  GLint programId;
-  glGetIntegerv(GL_CURRENT_PROGRAM, &programId);
-  if (!programId)
-    return 0;
-  
-  return m_shaders[programId];
+  return m_currentProgram;
 }
 
 DShader *OpenGLDriver::createShader(const char *srcVertex, const char *srcFragment)
 {
-  OpenGLShader *shader = new OpenGLShader(srcVertex, srcFragment);
-  m_shaders[shader->m_handle] = shader;
-  return shader;
+  return new OpenGLShader(this, srcVertex, srcFragment);
 }
 
 DTexture *OpenGLDriver::createTexture(DTexture::Format format)
 {
-  return new OpenGLTexture(format);
+  return new OpenGLTexture(this, format);
 }
 
 DVertexBuffer *OpenGLDriver::createVertexBuffer(size_t size, unsigned char *data, 
                                                 DVertexBuffer::UsageHint usage,
                                                 DVertexBuffer::Target target)
 {
-  return new OpenGLVertexBuffer(size, data, usage, target);
+  return new OpenGLVertexBuffer(this, size, data, usage, target);
 }
 
 DFont *OpenGLDriver::createFont(const std::string &path, unsigned short size)
@@ -825,59 +1003,161 @@ DFont *OpenGLDriver::createFont(const std::string &path, unsigned short size)
     return 0;
   
   font->FaceSize(size);
-  return new OpenGLFont(font);
+  return new OpenGLFont(this, font);
 }
 
-void OpenGLDriver::drawParticles(int size, float *vertices, float *colors)
+void OpenGLDriver::useProgram(OpenGLShader *shader)
 {
-  float modelview[16];
+  if (m_currentProgram == shader)
+    return;
+  
+  glUseProgram(shader ? shader->m_handle : 0);
+  m_currentProgram = shader;
+}
 
-  glDepthMask(0);
-  glShadeModel(GL_SMOOTH);                            // Enables Smooth Shading
-  glClearColor(0.0f,0.0f,0.0f,0.0f);                  // Black Background
-  glClearDepth(1.0f);                                 // Depth Buffer Setup
-  glEnable(GL_BLEND);                                 // Enable Blending
-  glBlendFunc(GL_SRC_ALPHA,GL_ONE);                   // Type Of Blending To Perform
-  glHint(GL_PERSPECTIVE_CORRECTION_HINT,GL_NICEST);   // Really Nice Perspective Calculations
-  glHint(GL_POINT_SMOOTH_HINT,GL_NICEST);             // Really Nice Point Smoothing
-  glEnable(GL_TEXTURE_2D);
+void OpenGLDriver::bindBuffer(GLenum target, GLuint handle)
+{
+  GLuint *bound = (target == GL_ELEMENT_ARRAY_BUFFER) ? &m_elementBuffer : &m_arrayBuffer;
+  if (*bound == handle)
+    return;
+  
+  glBindBuffer(target, handle);
+  *bound = handle;
+}
 
-  // Save the current modelview matrix
-  glPushMatrix();
+void OpenGLDriver::bindTexture(int unit, GLenum target, GLuint handle)
+{
+  if (m_boundTextures[unit] == handle)
+    return;
+  
+  if (m_activeTextureUnit != unit) {
+    glActiveTexture(GL_TEXTURE0 + unit);
+    m_activeTextureUnit = unit;
+  }
+  
+  glBindTexture(target, handle);
+  m_boundTextures[unit] = handle;
+  
+  // Check for errors
+  if (handle && glGetError() != GL_NO_ERROR)
+    throw Exception("OpenGL: Texture bind has failed!");
+}
 
-  // Get the current modelview matrix
-  glGetFloatv(GL_MODELVIEW_MATRIX , modelview);
+void OpenGLDriver::setVertexAttribArray(GLuint index, bool enabled)
+{
+  unsigned int mask = 1 << index;
+  if (((m_enabledAttributes & mask) != 0) == enabled)
+    return;
+  
+  if (enabled) {
+    glEnableVertexAttribArray(index);
+    m_enabledAttributes |= mask;
+  } else {
+    glDisableVertexAttribArray(index);
+    m_enabledAttributes &= ~mask;
+  }
+}
 
-  for(int i=0; i<3; i+=2) {
-    for(int j = 0; j<3; j++) {
-      if ( i==j )
-        modelview[i*4+j] = 1.0;
-      else
-        modelview[i*4+j] = 0.0;
-    }
+void OpenGLDriver::forgetBuffer(GLuint handle)
+{
+  // Deleted buffers are unbound by OpenGL
+  if (m_arrayBuffer == handle)
+    m_arrayBuffer = 0;
+  if (m_elementBuffer == handle)
+    m_elementBuffer = 0;
+}
+
+void OpenGLDriver::forgetTexture(GLuint handle)
+{
+  // Deleted textures are unbound by OpenGL
+  for (int i = 0; i < 8; i++) {
+    if (m_boundTextures[i] == handle)
+      m_boundTextures[i] = 0;
   }
+}
 
-  // Set the modelview matrix
-  glLoadMatrixf(modelview);
+void OpenGLDriver::forgetProgram(OpenGLShader *shader)
+{
+  // Programs in use are only deleted once they are no longer active
+  if (m_currentProgram == shader)
+    useProgram(0);
+}
 
-  for (int i = 0; i < size; i++) 
-  {
-    float x = vertices[3*i];
-    float y = vertices[3*i+1];
-    float z = vertices[3*i+2];
+void OpenGLDriver::invalidateTextureCache()
+{
+  // Use a handle that can never be bound so the next bind always goes through
+  for (int i = 0; i < 8; i++)
+    m_boundTextures[i] = (GLuint) -1;
+  
+  m_activeTextureUnit = -1;
+}
 
-    glColor4f(colors[4*i], colors[4*i+1], colors[4*i+2], colors[4*i+3]);
-    glBegin(GL_TRIANGLE_STRIP);
-      glTexCoord2d(1,1); glVertex3f(x+0.1f,y+0.1f,z); // Top Right
-      glTexCoord2d(0,1); glVertex3f(x-0.1f,y+0.1f,z); // Top Left
-      glTexCoord2d(1,0); glVertex3f(x+0.1f,y-0.1f,z); // Bottom Right
-      glTexCoord2d(0,0); glVertex3f(x-0.1f,y-0.1f,z); // Bottom Left
-    glEnd();
+void OpenGLDriver::beginParticles()
+{
+  // Particles are not affected by generic attributes of previous meshes
+  for (GLuint i = 0; m_enabledAttributes; i++)
+    setVertexAttribArray(i, false);
+  
+  if (!m_particleBuffer) {
+    glGenBuffers(1, &m_particleBuffer);
+    bindBuffer(GL_ARRAY_BUFFER, m_particleBuffer);
+    glBufferData(GL_ARRAY_BUFFER, PARTICLE_BUFFER_SIZE, 0, GL_STREAM_DRAW);
+  } else {
+    bindBuffer(GL_ARRAY_BUFFER, m_particleBuffer);
   }
   
+  glDepthMask(0);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+  glEnable(GL_TEXTURE_2D);
+  
+  // Billboards are already in view space
+  glPushMatrix();
+  glLoadIdentity();
+  
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+}
+
+void OpenGLDriver::drawParticles(int count, const float *vertices)
+{
+  const int maxBatch = PARTICLE_BUFFER_SIZE / PARTICLE_SIZE;
+  
+  while (count > 0) {
+    int batch = std::min(count, maxBatch);
+    size_t size = batch * PARTICLE_SIZE;
+    
+    // When the ring is full, orphan the buffer so we don't have to wait
+    // for pending draws that still use it
+    if (m_particleBufferOffset + size > PARTICLE_BUFFER_SIZE) {
+      glBufferData(GL_ARRAY_BUFFER, PARTICLE_BUFFER_SIZE, 0, GL_STREAM_DRAW);
+      m_particleBufferOffset = 0;
+    }
+    
+    glBufferSubData(GL_ARRAY_BUFFER, m_particleBufferOffset, size, vertices);
+    
+    unsigned char *base = (unsigned char*) m_particleBufferOffset;
+    glVertexPointer(3, GL_FLOAT, PARTICLE_VERTEX_SIZE, base);
+    glTexCoordPointer(2, GL_FLOAT, PARTICLE_VERTEX_SIZE, base + 3 * sizeof(float));
+    glColorPointer(4, GL_FLOAT, PARTICLE_VERTEX_SIZE, base + 5 * sizeof(float));
+    glDrawArrays(GL_QUADS, 0, batch * 4);
+    
+    m_particleBufferOffset += size;
+    vertices += batch * 4 * 9;
+    count -= batch;
+  }
+}
+
+void OpenGLDriver::endParticles()
+{
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_COLOR_ARRAY);
+  
   glPopMatrix();
+  
   // Reset settings
-  glEnable(GL_DEPTH_TEST);
   glDisable(GL_BLEND);
   glDisable(GL_TEXTURE_2D);
   glDepthMask(1);
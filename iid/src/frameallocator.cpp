@@ -0,0 +1,143 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "frameallocator.h"
+
+#include <boost/foreach.hpp>
+
+#include <stdlib.h>
+#include <new>
+
+// Count all heap allocations made through operator new in debug builds,
+// so per-frame allocations outside the arena can be detected
+#ifndef NDEBUG
+#define COUNT_HEAP_ALLOCATIONS
+#endif
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+static volatile unsigned long gHeapAllocations = 0;
+
+void *operator new(size_t size)
+{
+  __sync_fetch_and_add(&gHeapAllocations, 1);
+  void *p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  
+  return p;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *p) throw()
+{
+  free(p);
+}
+
+void operator delete[](void *p) throw()
+{
+  free(p);
+}
+#endif
+
+/**
+ * Returns the number of heap allocations made so far.
+ */
+static unsigned long heapAllocations()
+{
+#ifdef COUNT_HEAP_ALLOCATIONS
+  return gHeapAllocations;
+#else
+  return 0;
+#endif
+}
+
+namespace IID {
+
+FrameAllocator::FrameAllocator(size_t capacity)
+  : m_buffer((unsigned char*) malloc(capacity)),
+    m_capacity(capacity),
+    m_offset(0),
+    m_overflowSize(0),
+    m_overflows(0),
+    m_heapAllocationsAtReset(heapAllocations()),
+    m_lastUsed(0),
+    m_lastOverflows(0),
+    m_lastHeapAllocations(0)
+{
+}
+
+FrameAllocator::~FrameAllocator()
+{
+  reset();
+  free(m_buffer);
+}
+
+void *FrameAllocator::allocate(size_t size, size_t alignment)
+{
+  // Align the actual address since malloc only guarantees 8-byte alignment
+  size_t address = (size_t) (m_buffer + m_offset);
+  size_t padding = (alignment - (address & (alignment - 1))) & (alignment - 1);
+  
+  if (m_offset + padding + size <= m_capacity) {
+    void *p = m_buffer + m_offset + padding;
+    m_offset += padding + size;
+    return p;
+  }
+  
+  // Arena is exhausted, fall back to the heap until the next reset
+  unsigned char *block = (unsigned char*) malloc(size + alignment);
+  m_overflow.push_back(block);
+  m_overflowSize += size + alignment;
+  m_overflows++;
+  
+  address = (size_t) block;
+  padding = (alignment - (address & (alignment - 1))) & (alignment - 1);
+  return block + padding;
+}
+
+bool FrameAllocator::countsHeapAllocations()
+{
+#ifdef COUNT_HEAP_ALLOCATIONS
+  return true;
+#else
+  return false;
+#endif
+}
+
+void FrameAllocator::reset()
+{
+  // Keep statistics of the finished frame for reporting
+  unsigned long allocations = heapAllocations();
+  m_lastUsed = getUsed();
+  m_lastOverflows = m_overflows;
+  m_lastHeapAllocations = allocations - m_heapAllocationsAtReset;
+  m_heapAllocationsAtReset = allocations;
+  m_overflows = 0;
+  m_offset = 0;
+  
+  if (m_overflow.empty())
+    return;
+  
+  BOOST_FOREACH(unsigned char *block, m_overflow) {
+    free(block);
+  }
+  
+  // Grow the arena so that next frame fits completely
+  size_t needed = m_capacity + m_overflowSize;
+  while (m_capacity < needed)
+    m_capacity *= 2;
+  
+  free(m_buffer);
+  m_buffer = (unsigned char*) malloc(m_capacity);
+  m_overflow.clear();
+  m_overflowSize = 0;
+}
+
+}
@@ -10,10 +10,15 @@
 #include <time.h>
 #include <stdlib.h>
 
+#include <boost/thread/mutex.hpp>
+
 using namespace std;
 
 namespace IID {
 
+// Serializes output of all loggers
+static boost::mutex gLogMutex;
+
 Logger::Logger(const std::string &name)
   : m_module(name)
 {
@@ -38,15 +43,17 @@ void Logger::info(const std::string &message)
 void Logger::log(const std::string &type, const std::string &message)
 {
   time_t rawtime;
-  struct tm *timeinfo;
+  struct tm timeinfo;
+  char timeBuffer[80];
   
   // Grab formatted date and time
   time(&rawtime);
-  timeinfo = localtime(&rawtime);
-  strftime(m_timeBuffer, 80, "%a, %d %b %Y %H:%M:%S", timeinfo);
+  localtime_r(&rawtime, &timeinfo);
+  strftime(timeBuffer, 80, "%a, %d %b %Y %H:%M:%S", &timeinfo);
   
-  // Output string to stdout
-  cout << m_timeBuffer << " " << type << " [" << m_module << "] " << message << endl;
+  // Output string to stdout; importers log from worker threads
+  boost::mutex::scoped_lock lock(gLogMutex);
+  cout << timeBuffer << " " << type << " [" << m_module << "] " << message << endl;
 }
 
 
@@ -0,0 +1,67 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "mappedfile.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace IID {
+
+MappedFile::MappedFile()
+  : m_data(0),
+    m_size(0),
+    m_writable(false)
+{
+}
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+bool MappedFile::open(const std::string &filename, bool writable)
+{
+  close();
+  
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  
+  // Empty files can not be mapped
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+  
+  void *data = mmap(0, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+  
+  // The mapping stays valid after the descriptor is closed
+  ::close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  
+  m_data = static_cast<unsigned char*>(data);
+  m_size = st.st_size;
+  m_writable = writable;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (!m_data)
+    return;
+  
+  munmap(m_data, m_size);
+  m_data = 0;
+  m_size = 0;
+  m_writable = false;
+}
+
+}
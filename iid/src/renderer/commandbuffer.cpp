@@ -0,0 +1,80 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "renderer/commandbuffer.h"
+
+#include <string.h>
+
+namespace IID {
+
+CommandBuffer::CommandBuffer()
+{
+}
+
+void CommandBuffer::clear()
+{
+  m_commands.clear();
+  m_transforms.clear();
+}
+
+RenderCommand &CommandBuffer::push(RenderCommand::Type type)
+{
+  m_commands.resize(m_commands.size() + 1);
+  RenderCommand &cmd = m_commands.back();
+  cmd.type = type;
+  cmd.transform = 0;
+  cmd.count = 0;
+  return cmd;
+}
+
+void CommandBuffer::bindShader(Shader *shader)
+{
+  push(RenderCommand::BindShader).shader = shader;
+}
+
+void CommandBuffer::bindTexture(Texture *texture)
+{
+  push(RenderCommand::BindTexture).texture = texture;
+}
+
+void CommandBuffer::bindMaterial(Material *material)
+{
+  push(RenderCommand::BindMaterial).material = material;
+}
+
+void CommandBuffer::bindMesh(Mesh *mesh)
+{
+  push(RenderCommand::BindMesh).mesh = mesh;
+}
+
+void CommandBuffer::setLights(const LightList *lights)
+{
+  push(RenderCommand::SetLights).lights = lights;
+}
+
+int CommandBuffer::addTransform(const Transform3f &transform)
+{
+  int index = m_transforms.size() / 16;
+  m_transforms.resize(m_transforms.size() + 16);
+  memcpy(&m_transforms[index * 16], transform.data(), 16 * sizeof(float));
+  return index;
+}
+
+void CommandBuffer::draw(int transform)
+{
+  RenderCommand &cmd = push(RenderCommand::Draw);
+  cmd.transform = transform;
+  cmd.count = 1;
+}
+
+void CommandBuffer::drawInstanced(int transform, int count)
+{
+  RenderCommand &cmd = push(RenderCommand::DrawInstanced);
+  cmd.transform = transform;
+  cmd.count = count;
+}
+
+}
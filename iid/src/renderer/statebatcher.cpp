@@ -5,36 +5,99 @@
  * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
  */
 #include "renderer/statebatcher.h"
+#include "renderer/commandbuffer.h"
 #include "scene/scene.h"
 #include "scene/viewtransform.h"
 #include "scene/particles.h"
+#include "scene/lightmanager.h"
 #include "storage/mesh.h"
 #include "storage/texture.h"
 #include "storage/material.h"
 #include "storage/shader.h"
 #include "drivers/base.h"
 #include "context.h"
+#include "threadpool.h"
 
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+// Minimum number of identical rendrables that get drawn as instances
+#define INSTANCING_MIN_BATCH 2
+
+// Relative tolerance when checking that an instance scales uniformly
+#define INSTANCING_SCALE_TOLERANCE 1e-3f
+
+// Maximum number of lights affecting a single rendrable
+#define LIGHTS_PER_RENDRABLE 3
+
+// Minimum number of rendrables recorded by a single worker thread
+#define RECORD_MIN_SLICE 256
+
+// Maximum number of remembered light sets
+#define LIGHT_SET_CACHE_SIZE 4096
+
+// Half of the particle billboard edge length
+#define PARTICLE_HALF_SIZE 0.1f
 
 namespace IID {
 
 StateBatcher::StateBatcher(Scene *scene)
   : m_scene(scene),
     m_context(scene->context()),
+    m_renderQueue(RenderQueueCompare(), FrameStlAllocator<RenderQueueEntry>(m_context->getFrameAllocator())),
+    m_emitters(FrameStlAllocator<RenderQueueParticles*>(m_context->getFrameAllocator())),
+    m_lightVersionCounter(0),
+    m_lightsValid(false),
+    m_nextLightSet(0),
+    m_instanceBuffer(0),
     m_driver(m_context->driver())
 {
 }
 
+StateBatcher::~StateBatcher()
+{
+  BOOST_FOREACH(CommandBuffer *buffer, m_commandBuffers) {
+    delete buffer;
+  }
+  
+  delete m_instanceBuffer;
+}
+
 void StateBatcher::addToQueue(Rendrable *rendrable)
 {
-  m_renderQueue.insert(rendrable);
+  // Resolve affecting lights here as computing them is not thread safe
+  // and command recording might happen on worker threads
+  RenderQueueEntry entry;
+  entry.rendrable = rendrable;
+  entry.lights = &rendrable->getLights();
+  entry.lightSet = lightSetId(*entry.lights);
+  m_renderQueue.insert(entry);
+}
+
+unsigned int StateBatcher::lightSetId(const LightList &lights)
+{
+  boost::unordered_map<LightList, unsigned int>::const_iterator i = m_lightSetIds.find(lights);
+  if (i != m_lightSetIds.end())
+    return i->second;
+  
+  // Forgetting known sets only costs some batching, as new ids are never
+  // reused for a different set
+  if (m_lightSetIds.size() >= LIGHT_SET_CACHE_SIZE)
+    m_lightSetIds.clear();
+  
+  m_lightSetIds[lights] = m_nextLightSet;
+  return m_nextLightSet++;
 }
 
 void StateBatcher::addParticleEmitter(Shader *shader, Texture *texture, int size, float *vertices, float *colors,
                                       const Transform3f &transform)
 {
-  RenderQueueParticles *p = new RenderQueueParticles();
+  // Queue entries only live until the end of the frame
+  RenderQueueParticles *p = m_context->getFrameAllocator()->create<RenderQueueParticles>();
   p->shader = shader;
   p->texture = texture;
   p->size = size;
@@ -46,96 +109,394 @@ void StateBatcher::addParticleEmitter(Shader *shader, Texture *texture, int size
   m_emitters.push_back(p);
 }
 
-void StateBatcher::render()
+/**
+ * Returns true if the transformation only rotates, translates and scales
+ * uniformly, so normals can be transformed without a normal matrix.
+ */
+static bool isUniformlyScaled(const Transform3f &transform)
+{
+  Matrix3f m = transform.linear().transpose() * transform.linear();
+  float scale = m(0, 0);
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      if (fabs(m(i, j) - (i == j ? scale : 0.0f)) > INSTANCING_SCALE_TOLERANCE * scale)
+        return false;
+    }
+  }
+  
+  return true;
+}
+
+bool StateBatcher::canInstance(const RenderQueueEntry &e1, const RenderQueueEntry &e2) const
+{
+  Rendrable *n1 = e1.rendrable;
+  Rendrable *n2 = e2.rendrable;
+  return n1->getShader() == n2->getShader() &&
+         n1->getTexture() == n2->getTexture() &&
+         n1->getMaterial() == n2->getMaterial() &&
+         n1->getMesh() == n2->getMesh() &&
+         e1.lightSet == e2.lightSet &&
+         isUniformlyScaled(n2->worldTransform());
+}
+
+void StateBatcher::renderInstanced(Mesh *mesh, const CommandBuffer *buffer, int transform, int count,
+                                   const Transform3f &viewTransform)
+{
+  // Pack model-view transformations of all instances
+  m_instanceData.resize(count * 16);
+  float *data = &m_instanceData[0];
+  Transform3f world;
+  for (int i = 0; i < count; i++, data += 16) {
+    memcpy(world.data(), buffer->transform(transform + i), 16 * sizeof(float));
+    Transform3f modelView = viewTransform * world;
+    memcpy(data, modelView.data(), 16 * sizeof(float));
+  }
+  
+  // Stream transformations into the instance buffer
+  size_t size = m_instanceData.size() * sizeof(float);
+  if (!m_instanceBuffer) {
+    m_instanceBuffer = m_driver->createVertexBuffer(size, (unsigned char*) &m_instanceData[0],
+      DVertexBuffer::StreamDraw, DVertexBuffer::VertexArray);
+  } else {
+    m_instanceBuffer->bind();
+    m_instanceBuffer->update(size, (unsigned char*) &m_instanceData[0],
+      DVertexBuffer::StreamDraw, DVertexBuffer::VertexArray);
+  }
+  
+  DShader *shader = m_driver->currentShader();
+  float instanced = 1.0;
+  shader->bindInstanceAttributePointer("InstanceModelView", 4, 16 * sizeof(float), 0);
+  shader->setUniform("Instanced", 1, &instanced);
+  
+  mesh->drawInstanced(count);
+  
+  instanced = 0.0;
+  shader->setUniform("Instanced", 1, &instanced);
+  shader->unbindInstanceAttributePointer("InstanceModelView", 4);
+  m_instanceBuffer->unbind();
+}
+
+void StateBatcher::setupLights(const LightList &lights, const Transform3f &viewTransform)
+{
+  // Only the first few lights are actually used, so compare just those
+  size_t count = std::min(lights.size(), (size_t) LIGHTS_PER_RENDRABLE);
+  if (m_lightsValid && m_activeLights.size() == count &&
+      std::equal(m_activeLights.begin(), m_activeLights.end(), lights.begin()))
+    return;
+  
+  // Light positions are specified in view space
+  m_driver->applyModelViewTransform(viewTransform.data());
+  m_driver->setupLights(lights, LIGHTS_PER_RENDRABLE);
+  
+  m_activeLights.assign(lights.begin(), lights.begin() + count);
+  m_lightsValid = true;
+}
+
+void StateBatcher::recordSlice(RenderQueueList::const_iterator begin, RenderQueueList::const_iterator end,
+                               CommandBuffer *buffer) const
 {
   Shader *currentShader = 0;
   Texture *currentTexture = 0;
   Material *currentMaterial = 0;
   Mesh *currentMesh = 0;
-  Transform3f viewTransform = m_scene->viewTransform()->transform();
+  unsigned int currentLightSet = 0;
+  bool instancing = false;
+  bool initial = true;
   
-  // Render objects in the render queue
-  BOOST_FOREACH(Rendrable *n, m_renderQueue) {
+  // Each slice starts with a full state setup; redundant changes across
+  // slice boundaries are filtered out on replay
+  buffer->clear();
+  
+  RenderQueueList::const_iterator i = begin;
+  while (i != end) {
+    Rendrable *n = i->rendrable;
+    
     // Check if shader has changed
     Shader *shader = n->getShader();
-    if (currentShader != shader) {
-      if (currentShader)
-        currentShader->deactivate();
-      
-      shader->activate();
+    if (initial || currentShader != shader) {
+      buffer->bindShader(shader);
       currentShader = shader;
+      
+      // Only shaders that consume per-instance transformations can be instanced
+      DShader *program = shader ? shader->getProgram() : 0;
+      instancing = m_driver->hasInstancing() && program && program->hasAttribute("InstanceModelView");
     }
     
     // Check if texture has changed
     Texture *texture = n->getTexture();
-    if (currentTexture != texture) {
-      if (currentTexture)
-        currentTexture->unbind();
-      
-      if (texture)
-        texture->bind();
+    if (initial || currentTexture != texture) {
+      buffer->bindTexture(texture);
       currentTexture = texture;
     }
     
     // Check if material has changed
     Material *material = n->getMaterial();
-    if (currentMaterial != material) {
-      if (currentMaterial)
-        currentMaterial->unbind();
-      
-      if (material)
-        material->bind();
+    if (initial || currentMaterial != material) {
+      buffer->bindMaterial(material);
       currentMaterial = material;
     }
     
     // Check if mesh has changed
     Mesh *mesh = n->getMesh();
-    if (currentMesh != mesh) {
-      if (currentMesh)
-        currentMesh->unbind();
-      
-      mesh->bind();
+    if (initial || currentMesh != mesh) {
+      buffer->bindMesh(mesh);
       currentMesh = mesh;
     }
     
-    // Apply lighting
-    m_driver->applyModelViewTransform(viewTransform.data());
-    m_driver->setupLights(n->getLights(), 3);
+    // Check if lights have changed
+    if (initial || currentLightSet != i->lightSet) {
+      buffer->setLights(i->lights);
+      currentLightSet = i->lightSet;
+    }
+    
+    // Find a run of rendrables that share all state with this one
+    RenderQueueList::const_iterator runEnd = i;
+    int runLength = 1;
+    if (instancing && isUniformlyScaled(n->worldTransform())) {
+      for (++runEnd; runEnd != end && canInstance(*i, *runEnd); ++runEnd)
+        runLength++;
+    } else {
+      ++runEnd;
+    }
     
-    // Apply the transformation and draw the thingie
-    m_driver->applyModelViewTransform((viewTransform * n->worldTransform()).data());
-    currentMesh->draw();
+    if (runLength >= INSTANCING_MIN_BATCH) {
+      // Draw the whole run with a single call
+      int first = buffer->addTransform(n->worldTransform());
+      for (RenderQueueList::const_iterator j = i + 1; j != runEnd; ++j)
+        buffer->addTransform(j->rendrable->worldTransform());
+      
+      buffer->drawInstanced(first, runLength);
+    } else {
+      buffer->draw(buffer->addTransform(n->worldTransform()));
+    }
+    
+    initial = false;
+    i = runEnd;
+  }
+}
+
+void StateBatcher::replay(const CommandBuffer *buffer, RenderState &state, const Transform3f &viewTransform)
+{
+  BOOST_FOREACH(const RenderCommand &cmd, buffer->commands()) {
+    switch (cmd.type) {
+      case RenderCommand::BindShader: {
+        if (state.shader != cmd.shader) {
+          if (state.shader)
+            state.shader->deactivate();
+          
+          if (cmd.shader)
+            cmd.shader->activate();
+          state.shader = cmd.shader;
+        }
+        break;
+      }
+      case RenderCommand::BindTexture: {
+        if (state.texture != cmd.texture) {
+          if (state.texture)
+            state.texture->unbind();
+          
+          if (cmd.texture)
+            cmd.texture->bind();
+          state.texture = cmd.texture;
+        }
+        break;
+      }
+      case RenderCommand::BindMaterial: {
+        if (state.material != cmd.material) {
+          if (state.material)
+            state.material->unbind();
+          
+          if (cmd.material)
+            cmd.material->bind();
+          state.material = cmd.material;
+        }
+        break;
+      }
+      case RenderCommand::BindMesh: {
+        if (state.mesh != cmd.mesh) {
+          if (state.mesh)
+            state.mesh->unbind();
+          
+          cmd.mesh->bind();
+          state.mesh = cmd.mesh;
+        }
+        break;
+      }
+      case RenderCommand::SetLights: {
+        setupLights(*cmd.lights, viewTransform);
+        break;
+      }
+      case RenderCommand::Draw: {
+        // Apply the transformation and draw the thingie
+        Transform3f world;
+        memcpy(world.data(), buffer->transform(cmd.transform), 16 * sizeof(float));
+        m_driver->applyModelViewTransform((viewTransform * world).data());
+        state.mesh->draw();
+        break;
+      }
+      case RenderCommand::DrawInstanced: {
+        renderInstanced(state.mesh, buffer, cmd.transform, cmd.count, viewTransform);
+        break;
+      }
+    }
   }
+}
+
+inline bool compareParticlesLessThan(const RenderQueueParticles *p1, const RenderQueueParticles *p2)
+{
+  if (p1->shader != p2->shader)
+    return p1->shader < p2->shader;
   
-  // Draw particle emitters
-  BOOST_FOREACH(RenderQueueParticles *p, m_emitters) {
+  return p1->texture < p2->texture;
+}
+
+void StateBatcher::renderParticles(RenderState &state, const Transform3f &viewTransform)
+{
+  if (m_emitters.empty())
+    return;
+  
+  // Group emitters by shader and texture, so each group is a single draw
+  m_sortedEmitters.assign(m_emitters.begin(), m_emitters.end());
+  std::stable_sort(m_sortedEmitters.begin(), m_sortedEmitters.end(), compareParticlesLessThan);
+  
+  m_driver->beginParticles();
+  
+  std::vector<RenderQueueParticles*>::const_iterator i = m_sortedEmitters.begin();
+  while (i != m_sortedEmitters.end()) {
+    RenderQueueParticles *first = *i;
+    
     // Check if shader has changed
-    if (currentShader != p->shader) {
-      if (currentShader)
-        currentShader->deactivate();
+    if (state.shader != first->shader) {
+      if (state.shader)
+        state.shader->deactivate();
+      
+      if (first->shader)
+        first->shader->activate();
+      state.shader = first->shader;
+    }
     
-      if(p->shader)
-        p->shader->activate();
-      currentShader = p->shader;
+    // Check if texture has changed
+    if (state.texture != first->texture) {
+      if (state.texture)
+        state.texture->unbind();
+      
+      if (first->texture)
+        first->texture->bind();
+      state.texture = first->texture;
     }
+    
+    // Generate view space billboards for all emitters in the group
+    m_particleData.clear();
+    int count = 0;
+    for (; i != m_sortedEmitters.end() && !compareParticlesLessThan(first, *i); ++i)
+      count += generateBillboards(*i, viewTransform);
+    
+    if (count > 0)
+      m_driver->drawParticles(count, &m_particleData[0]);
+  }
+  
+  m_driver->endParticles();
+}
 
-    // Check if texture has changed
-    if (currentTexture != p->texture) {
-      if (currentTexture)
-        currentTexture->unbind();
+int StateBatcher::generateBillboards(const RenderQueueParticles *p, const Transform3f &viewTransform)
+{
+  // Billboards keep the emitter's up axis and face the camera otherwise
+  Transform3f modelView = viewTransform * p->transform;
+  const float *m = modelView.data();
+  const float up[3] = { m[4], m[5], m[6] };
+  const float h = PARTICLE_HALF_SIZE;
+  
+  // Corner offsets in the order expected by the driver
+  const float corners[4][2] = { {h, h}, {-h, h}, {-h, -h}, {h, -h} };
+  const float texCoords[4][2] = { {1, 1}, {0, 1}, {0, 0}, {1, 0} };
+  
+  int count = 0;
+  size_t offset = m_particleData.size();
+  m_particleData.resize(offset + p->size * 36);
+  float *out = &m_particleData[offset];
+  
+  for (int i = 0; i < p->size; i++) {
+    const float *v = &p->vertices[3*i];
+    const float *c = &p->colors[4*i];
+    
+    // Dead particles would not contribute anything with additive blending
+    if (c[3] <= 0.0)
+      continue;
+    
+    float center[3] = {
+      v[0] + m[12] + v[1]*up[0],
+      m[13] + v[1]*up[1],
+      v[2] + m[14] + v[1]*up[2]
+    };
     
-      if (p->texture)
-        p->texture->bind();
-      currentTexture = p->texture;
+    for (int k = 0; k < 4; k++, out += 9) {
+      out[0] = center[0] + corners[k][0] + corners[k][1]*up[0];
+      out[1] = center[1] + corners[k][1]*up[1];
+      out[2] = center[2] + corners[k][1]*up[2];
+      out[3] = texCoords[k][0];
+      out[4] = texCoords[k][1];
+      out[5] = c[0];
+      out[6] = c[1];
+      out[7] = c[2];
+      out[8] = c[3];
     }
-
-    // Draw the particle emitter
-    m_driver->applyModelViewTransform((viewTransform * p->transform).data());
-    m_driver->drawParticles(p->size, p->vertices, p->colors);
+    
+    count++;
   }
+  
+  m_particleData.resize(offset + count * 36);
+  return count;
+}
 
-  if (currentShader)
-    currentShader->deactivate();
+void StateBatcher::render()
+{
+  RenderState state;
+  Transform3f viewTransform = m_scene->viewTransform()->transform();
+  
+  // Lights uploaded in previous frames stay valid unless the camera has
+  // moved or the lights themselves have changed
+  unsigned long lightVersion = m_scene->getLightManager()->getLightVersionCounter();
+  if (!m_lightsValid || lightVersion != m_lightVersionCounter ||
+      !(m_lightViewTransform.matrix() == viewTransform.matrix())) {
+    m_driver->invalidateLights();
+    m_lightVersionCounter = lightVersion;
+    m_lightViewTransform = viewTransform;
+    m_lightsValid = false;
+  }
+  
+  // Split the sorted render queue into slices and record them in parallel
+  m_sortedQueue.assign(m_renderQueue.begin(), m_renderQueue.end());
+  ThreadPool *pool = m_context->getThreadPool();
+  int slices = std::min((int) pool->size(), (int) m_sortedQueue.size() / RECORD_MIN_SLICE);
+  if (slices < 1)
+    slices = 1;
+  
+  while ((int) m_commandBuffers.size() < slices)
+    m_commandBuffers.push_back(new CommandBuffer());
+  
+  if (slices == 1) {
+    recordSlice(m_sortedQueue.begin(), m_sortedQueue.end(), m_commandBuffers[0]);
+  } else {
+    JobGroup group;
+    int sliceSize = (m_sortedQueue.size() + slices - 1) / slices;
+    for (int s = 0; s < slices; s++) {
+      RenderQueueList::const_iterator begin = m_sortedQueue.begin() + std::min(s * sliceSize, (int) m_sortedQueue.size());
+      RenderQueueList::const_iterator end = m_sortedQueue.begin() + std::min((s + 1) * sliceSize, (int) m_sortedQueue.size());
+      pool->submit(boost::bind(&StateBatcher::recordSlice, this, begin, end, m_commandBuffers[s]), &group);
+    }
+    
+    group.wait();
+  }
+  
+  // Replay buffers in slice order
+  for (int s = 0; s < slices; s++)
+    replay(m_commandBuffers[s], state, viewTransform);
+  
+  // Draw particle emitters
+  renderParticles(state, viewTransform);
+  
+  if (state.shader)
+    state.shader->deactivate();
 
   m_renderQueue.clear();
   m_emitters.clear();
@@ -0,0 +1,246 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "scene/adjacency.h"
+#include "threadpool.h"
+
+// Bullet
+#include <BulletCollision/CollisionShapes/btTriangleIndexVertexArray.h>
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
+#include <string.h>
+
+namespace IID {
+
+/**
+ * Returns the position of a vertex of an indexed mesh.
+ */
+static inline const float *vertexPosition(const btIndexedMesh &mesh, int vertex)
+{
+  return (const float*) (mesh.m_vertexBase + vertex * mesh.m_vertexStride);
+}
+
+/**
+ * Returns the vertex indices of a triangle of an indexed mesh.
+ */
+static inline const unsigned int *triangleIndices(const btIndexedMesh &mesh, int triangle)
+{
+  return (const unsigned int*) (mesh.m_triangleIndexBase + triangle * mesh.m_triangleIndexStride);
+}
+
+static inline bool equalPositions(const float *a, const float *b)
+{
+  return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+static inline size_t hashPosition(const float *p)
+{
+  unsigned int bits[3];
+  for (int j = 0; j < 3; j++) {
+    // Adding zero turns negative zero into positive zero, so positions
+    // that compare equal also hash equally
+    float value = p[j] + 0.0f;
+    memcpy(&bits[j], &value, 4);
+  }
+  
+  size_t hash = (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+  return hash ^ (hash >> 16);
+}
+
+static inline size_t hashEdge(unsigned int a, unsigned int b)
+{
+  unsigned long long key = ((unsigned long long) a << 32) | b;
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (size_t) key;
+}
+
+/**
+ * Returns the size of an open-addressed table for the given number of
+ * entries (a power of two, at most half full).
+ */
+static size_t tableSize(size_t entries)
+{
+  size_t size = 16;
+  while (size < 2 * entries)
+    size <<= 1;
+  
+  return size;
+}
+
+TriangleAdjacency::TriangleAdjacency()
+  : m_parts(0),
+    m_partCount(0),
+    m_faceCount(0)
+{
+}
+
+void TriangleAdjacency::build(btTriangleIndexVertexArray *geometry, ThreadPool *pool)
+{
+  m_partCount = geometry->getNumSubParts();
+  m_parts = m_partCount ? &geometry->getIndexedMeshArray()[0] : 0;
+  m_vertexIds.assign(m_partCount, std::vector<unsigned int>());
+  m_uniqueVertices.assign(m_partCount, std::vector<int>());
+  
+  // Submeshes are welded independently
+  if (pool) {
+    JobGroup group;
+    for (int i = 0; i < m_partCount; i++)
+      pool->submit(boost::bind(&TriangleAdjacency::weldPart, this, i), &group);
+    
+    group.wait();
+  } else {
+    for (int i = 0; i < m_partCount; i++)
+      weldPart(i);
+  }
+  
+  mergeParts();
+  buildEdges();
+  
+  // Welding data is no longer needed
+  std::vector<std::vector<unsigned int> >().swap(m_vertexIds);
+  std::vector<std::vector<int> >().swap(m_uniqueVertices);
+  m_parts = 0;
+}
+
+void TriangleAdjacency::weldPart(int part)
+{
+  const btIndexedMesh &mesh = m_parts[part];
+  std::vector<unsigned int> &ids = m_vertexIds[part];
+  std::vector<int> &unique = m_uniqueVertices[part];
+  ids.resize(mesh.m_numVertices);
+  
+  // Open-addressed table of unique vertices by position
+  std::vector<int> table(tableSize(mesh.m_numVertices), -1);
+  size_t mask = table.size() - 1;
+  
+  for (int v = 0; v < mesh.m_numVertices; v++) {
+    const float *p = vertexPosition(mesh, v);
+    size_t slot = hashPosition(p) & mask;
+    while (table[slot] != -1 && !equalPositions(vertexPosition(mesh, unique[table[slot]]), p))
+      slot = (slot + 1) & mask;
+    
+    if (table[slot] == -1) {
+      table[slot] = unique.size();
+      unique.push_back(v);
+    }
+    
+    ids[v] = table[slot];
+  }
+}
+
+void TriangleAdjacency::mergeParts()
+{
+  size_t total = 0;
+  for (int i = 0; i < m_partCount; i++)
+    total += m_uniqueVertices[i].size();
+  
+  // Only vertices that survived welding within their submesh are merged
+  std::vector<int> table(tableSize(total), -1);
+  std::vector<const float*> positions;
+  positions.reserve(total);
+  size_t mask = table.size() - 1;
+  
+  for (int i = 0; i < m_partCount; i++) {
+    const btIndexedMesh &mesh = m_parts[i];
+    const std::vector<int> &unique = m_uniqueVertices[i];
+    std::vector<unsigned int> globalIds(unique.size());
+    
+    for (size_t u = 0; u < unique.size(); u++) {
+      const float *p = vertexPosition(mesh, unique[u]);
+      size_t slot = hashPosition(p) & mask;
+      while (table[slot] != -1 && !equalPositions(positions[table[slot]], p))
+        slot = (slot + 1) & mask;
+      
+      if (table[slot] == -1) {
+        table[slot] = positions.size();
+        positions.push_back(p);
+      }
+      
+      globalIds[u] = table[slot];
+    }
+    
+    std::vector<unsigned int> &ids = m_vertexIds[i];
+    for (size_t v = 0; v < ids.size(); v++)
+      ids[v] = globalIds[ids[v]];
+  }
+}
+
+void TriangleAdjacency::buildEdges()
+{
+  m_faceCount = 0;
+  m_faceOffsets.resize(m_partCount);
+  for (int i = 0; i < m_partCount; i++) {
+    m_faceOffsets[i] = m_faceCount;
+    m_faceCount += m_parts[i].m_numTriangles;
+  }
+  
+  m_edges.clear();
+  m_edges.reserve(3 * m_faceCount / 2);
+  m_faceEdges.assign(3 * m_faceCount, -1);
+  
+  // Open-addressed table of edges by welded vertex pair
+  std::vector<int> table(tableSize(3 * m_faceCount), -1);
+  size_t mask = table.size() - 1;
+  
+  for (int i = 0; i < m_partCount; i++) {
+    const btIndexedMesh &mesh = m_parts[i];
+    const std::vector<unsigned int> &ids = m_vertexIds[i];
+    
+    for (int t = 0; t < mesh.m_numTriangles; t++) {
+      const unsigned int *indices = triangleIndices(mesh, t);
+      int face = m_faceOffsets[i] + t;
+      
+      for (int j = 0; j < 3; j++) {
+        unsigned int a = ids[indices[j]];
+        unsigned int b = ids[indices[(j + 1) % 3]];
+        if (a == b)
+          continue;
+        
+        if (a > b)
+          std::swap(a, b);
+        
+        size_t slot = hashEdge(a, b) & mask;
+        while (table[slot] != -1 && (m_edges[table[slot]].vertices[0] != a || m_edges[table[slot]].vertices[1] != b))
+          slot = (slot + 1) & mask;
+        
+        if (table[slot] == -1) {
+          Edge edge;
+          edge.vertices[0] = a;
+          edge.vertices[1] = b;
+          edge.faces[0] = face;
+          edge.faces[1] = -1;
+          
+          table[slot] = m_edges.size();
+          m_edges.push_back(edge);
+        } else {
+          // Further faces of non-manifold edges are only linked to the
+          // first one
+          Edge &edge = m_edges[table[slot]];
+          if (edge.faces[1] == -1 && edge.faces[0] != face)
+            edge.faces[1] = face;
+        }
+        
+        m_faceEdges[3*face + j] = table[slot];
+      }
+    }
+  }
+}
+
+int TriangleAdjacency::neighbour(int face, int edge) const
+{
+  int index = m_faceEdges[3*face + edge];
+  if (index == -1)
+    return -1;
+  
+  const Edge &e = m_edges[index];
+  return e.faces[0] == face ? e.faces[1] : e.faces[0];
+}
+
+}
@@ -70,6 +70,15 @@ void Camera::lookAt(const Vector3f &eye, const Vector3f &center, const Vector3f
   norm = y.cross(aux);
   m_planes[Right] = Plane(norm, nearCenter + x * m_nearWidth);
   
+  // Compute frustum bounds from the corners of near and far planes
+  m_frustumBounds = AxisAlignedBox();
+  for (int i = 0; i < 4; i++) {
+    float sx = (i & 1) ? 1.0 : -1.0;
+    float sy = (i & 2) ? 1.0 : -1.0;
+    m_frustumBounds.merge(nearCenter + x * (sx * m_nearWidth) + y * (sy * m_nearHeight));
+    m_frustumBounds.merge(farCenter + x * (sx * m_farWidth) + y * (sy * m_farHeight));
+  }
+  
   // Update local stuff
   m_eye = eye;
   m_center = center;
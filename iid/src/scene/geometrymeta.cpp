@@ -5,76 +5,87 @@
  * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
  */
 #include "scene/geometrymeta.h"
+#include "threadpool.h"
 
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 
+#include <cmath>
+
 namespace IID {
 
-GeometryMetadata::GeometryMetadata(btTriangleIndexVertexMaterialArray *geometry)
+GeometryMetadata::GeometryMetadata(btTriangleIndexVertexMaterialArray *geometry, ThreadPool *pool)
   : m_geometry(geometry)
 {
+  int parts = m_geometry->getNumSubParts();
+  
   // Process connectivity
-  for (int i = 0; i < m_geometry->getNumSubParts(); i++) {
-    btIndexedMesh *mesh = &m_geometry->getIndexedMeshArray()[i];
-    processConnectivity(mesh);
-  }
+  m_adjacency.build(m_geometry, pool);
+  m_normals.resize(m_adjacency.faceCount());
+  m_faceInfos.resize(parts);
   
-  // Process edge angles
-  for (int i = 0; i < m_geometry->getNumSubParts(); i++) {
-    btIndexedMesh *mesh = &m_geometry->getIndexedMeshArray()[i];
-    processEdgeAngles(mesh);
+  // Normals and edge angles of submeshes are independent of each other
+  // once connectivity is known
+  if (pool) {
+    JobGroup normals;
+    for (int i = 0; i < parts; i++)
+      pool->submit(boost::bind(&GeometryMetadata::processNormals, this, i), &normals);
+    normals.wait();
+    
+    JobGroup angles;
+    for (int i = 0; i < parts; i++)
+      pool->submit(boost::bind(&GeometryMetadata::processEdgeAngles, this, i), &angles);
+    angles.wait();
+  } else {
+    for (int i = 0; i < parts; i++)
+      processNormals(i);
+    
+    for (int i = 0; i < parts; i++)
+      processEdgeAngles(i);
   }
+  
+  // Register descriptors with the geometry (in submesh order)
+  for (int i = 0; i < parts; i++)
+    m_geometry->addMaterialProperties(*m_faceInfos[i]);
 }
 
 GeometryMetadata::~GeometryMetadata()
 {
   BOOST_FOREACH(btMaterialProperties *info, m_faceInfos) {
-    delete info->m_materialBase;
-    delete info->m_triangleMaterialsBase;
+    delete[] (FaceInfo*) info->m_materialBase;
+    delete[] (int*) info->m_triangleMaterialsBase;
     delete info;
   }
 }
 
-void GeometryMetadata::processConnectivity(btIndexedMesh *mesh)
+void GeometryMetadata::processNormals(int part)
 {
-  unsigned int *triangles = (unsigned int*) mesh->m_triangleIndexBase;
-  float *vertices = (float*) mesh->m_vertexBase;
+  const btIndexedMesh &mesh = m_geometry->getIndexedMeshArray()[part];
+  int offset = m_adjacency.faceOffset(part);
   
-  for (int i = 0; i < mesh->m_numTriangles; i++) {
-    Triangle t(mesh, i);
-    Vertex tri[3];
-    
+  for (int i = 0; i < mesh.m_numTriangles; i++) {
+    const unsigned int *indices = (const unsigned int*) (mesh.m_triangleIndexBase + i * mesh.m_triangleIndexStride);
+    Vector3f tri[3];
     for (int j = 0; j < 3; j++) {
-      int k = 3*triangles[3*i + j];
-      tri[j].push_back(vertices[k]);
-      tri[j].push_back(vertices[k + 1]);
-      tri[j].push_back(vertices[k + 2]);
+      const float *p = (const float*) (mesh.m_vertexBase + indices[j] * mesh.m_vertexStride);
+      tri[j] = Vector3f(p[0], p[1], p[2]);
     }
     
     // Compute triangle normal
-    Vector3f side0, side1;
-    side0 << tri[0][0] - tri[1][0], tri[0][1] - tri[1][1], tri[0][2] - tri[1][2];
-    side1 << tri[0][2] - tri[1][0], tri[2][1] - tri[1][1], tri[2][2] - tri[1][2];
-    m_normals[t] = side1.cross(side0).normalized();
-    
-    for (int j = 0; j < 3; j++) {
-      Vertex a = tri[j];
-      Vertex b = tri[(j + 1) % 3];
-      Edge e = a < b ? Edge(a, b) : Edge(b, a);
-      
-      m_connectivity[e].push_back(t);
-    }
+    Vector3f side0 = tri[0] - tri[1];
+    Vector3f side1 = tri[2] - tri[1];
+    m_normals[offset + i] = side1.cross(side0).normalized();
   }
 }
 
-void GeometryMetadata::processEdgeAngles(btIndexedMesh *mesh)
+void GeometryMetadata::processEdgeAngles(int part)
 {
-  unsigned int *triangles = (unsigned int*) mesh->m_triangleIndexBase;
-  float *vertices = (float*) mesh->m_vertexBase;
+  const btIndexedMesh &mesh = m_geometry->getIndexedMeshArray()[part];
+  int offset = m_adjacency.faceOffset(part);
   
   btMaterialProperties *faceInfo = new btMaterialProperties();
-  faceInfo->m_numMaterials = mesh->m_numTriangles;
-  faceInfo->m_numTriangles = mesh->m_numTriangles;
+  faceInfo->m_numMaterials = mesh.m_numTriangles;
+  faceInfo->m_numTriangles = mesh.m_numTriangles;
   faceInfo->m_materialStride = sizeof(FaceInfo);
   faceInfo->m_triangleMaterialStride = sizeof(unsigned int);
   
@@ -83,48 +94,31 @@ void GeometryMetadata::processEdgeAngles(btIndexedMesh *mesh)
   faceInfo->m_materialBase = (unsigned char*) infos;
   faceInfo->m_triangleMaterialsBase = (unsigned char*) indices;
   
-  for (int i = 0; i < mesh->m_numTriangles; i++) {
-    Triangle t(mesh, i);
-    Vertex tri[3];
-    
-    for (int j = 0; j < 3; j++) {
-      int k = 3*triangles[3*i + j];
-      tri[j].push_back(vertices[k]);
-      tri[j].push_back(vertices[k + 1]);
-      tri[j].push_back(vertices[k + 2]);
-    }
-    
+  for (int i = 0; i < mesh.m_numTriangles; i++) {
     // Save normal and map triangle to info descriptor
-    Vector3f myNormal = m_normals[t];
+    const Vector3f &myNormal = m_normals[offset + i];
     indices[i] = i;
     
-    // Initialize all angles to 360°
-    infos[i].edgeAngles[0] = 2.0 * M_PI;
-    infos[i].edgeAngles[1] = 2.0 * M_PI;
-    infos[i].edgeAngles[2] = 2.0 * M_PI;
-    
     for (int j = 0; j < 3; j++) {
-      Vertex a = tri[j];
-      Vertex b = tri[(j + 1) % 3];
-      Edge e = a < b ? Edge(a, b) : Edge(b, a);
+      // Edges without a neighbour have an angle of 360°
+      infos[i].edgeAngles[j] = 2.0 * M_PI;
+      
+      int n = m_adjacency.neighbour(offset + i, j);
+      if (n == -1)
+        continue;
+      
+      // Compute angle between triangle normals bordering this edge
+      const Vector3f &normal = m_normals[n];
+      infos[i].edgeAngles[j] = std::acos(myNormal.dot(normal) / (myNormal.norm() * normal.norm()));
       
-      BOOST_FOREACH(Triangle n, m_connectivity[e]) {
-        if (n != t) {
-          // Compute angle between triangle normals bordering this edge
-          infos[i].edgeAngles[j] = std::acos(myNormal.dot(m_normals[n]) / (myNormal.norm() * m_normals[n].norm()));
-          
-          if (infos[i].edgeAngles[j] >= M_PI) {
-            // Angle is greater than or equal to 180°, this probably means that the normals are inverted
-            infos[i].edgeAngles[j] -= M_PI;
-          }
-        }
+      if (infos[i].edgeAngles[j] >= M_PI) {
+        // Angle is greater than or equal to 180°, this probably means that the normals are inverted
+        infos[i].edgeAngles[j] -= M_PI;
       }
     }
   }
   
-  // Register descriptors for later collection and also with the geometry
-  m_faceInfos.push_back(faceInfo);
-  m_geometry->addMaterialProperties(*faceInfo);
+  m_faceInfos[part] = faceInfo;
 }
 
 }
@@ -13,6 +13,12 @@ namespace IID {
 
 Light::Light(const std::string &name, SceneNode *parent)
   : SceneNode(name, parent),
+    m_diffuse(1.0, 1.0, 1.0),
+    m_specular(0.0, 0.0, 0.0),
+    m_attConst(1.0),
+    m_attLin(0.0),
+    m_attQuad(0.0),
+    m_range(0.0),
     m_type(PointLight),
     m_visible(true)
 {
@@ -36,6 +42,10 @@ float Light::getSquaredDistanceTo(const Vector3f &point) const
 void Light::setType(Type type)
 {
   m_type = type;
+  
+  // Directional lights are indexed differently
+  if (m_lightManager)
+    m_lightManager->updateLight(this);
 }
 
 void Light::setVisible(bool value)
@@ -49,6 +59,10 @@ void Light::setAttenuation(float range, float constant, float linear, float quad
   m_attConst = constant;
   m_attLin = linear;
   m_attQuad = quadratic;
+  
+  // Range determines which index cells the light occupies
+  if (m_lightManager)
+    m_lightManager->updateLight(this);
 }
 
 void Light::setDiffuseColor(float r, float g, float b)
@@ -56,6 +70,10 @@ void Light::setDiffuseColor(float r, float g, float b)
   m_diffuse[0] = r;
   m_diffuse[1] = g;
   m_diffuse[2] = b;
+  
+  // Nearby objects may select different lights
+  if (m_lightManager)
+    m_lightManager->updateLight(this);
 }
 
 void Light::setSpecularColor(float r, float g, float b)
@@ -63,6 +81,10 @@ void Light::setSpecularColor(float r, float g, float b)
   m_specular[0] = r;
   m_specular[1] = g;
   m_specular[2] = b;
+  
+  // Light state must be specified again
+  if (m_lightManager)
+    m_lightManager->updateLight(this);
 }
 
 void Light::updateNodeSpecific()
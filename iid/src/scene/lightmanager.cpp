@@ -9,78 +9,492 @@
 #include "scene/camera.h"
 
 #include <boost/foreach.hpp>
+#include <boost/functional/hash.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+// Size of a spatial index cell in world units
+#define LIGHT_GRID_CELL_SIZE 16.0f
+
+// Lights covering more cells than this are not indexed and are always
+// considered when searching for lights in the frustum
+#define LIGHT_GRID_MAX_CELLS 64
+
+// Number of light clusters along each axis of the frustum
+#define LIGHT_CLUSTERS_X 16
+#define LIGHT_CLUSTERS_Y 8
+#define LIGHT_CLUSTERS_Z 24
+#define LIGHT_CLUSTERS (LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y * LIGHT_CLUSTERS_Z)
+
+// Number of lights selected for each object (must match the number of
+// lights the state batcher sets up)
+#define AFFECTING_LIGHTS 3
+
+// Per-light data used for scoring: position, range, attenuation factors
+// and brightness
+#define LIGHT_DATA_FLOATS 8
 
 namespace IID {
 
+std::size_t hash_value(const LightGridCell &cell)
+{
+  std::size_t seed = 0;
+  boost::hash_combine(seed, cell.x);
+  boost::hash_combine(seed, cell.y);
+  boost::hash_combine(seed, cell.z);
+  return seed;
+}
+
+inline int gridCoordinate(float value)
+{
+  return (int) std::floor(value / LIGHT_GRID_CELL_SIZE);
+}
+
+inline int clampCluster(int value, int count)
+{
+  return value < 0 ? 0 : (value >= count ? count - 1 : value);
+}
+
+inline int clusterIndex(int x, int y, int z)
+{
+  return (z * LIGHT_CLUSTERS_Y + y) * LIGHT_CLUSTERS_X + x;
+}
+
+// Scoring data of a light that never contributes; used to pad the last
+// block of lights
+static const float emptyLightData[LIGHT_DATA_FLOATS] = { 0, 0, 0, 1, 1, 0, 0, 0 };
+
+/**
+ * Returns the perceived brightness of a light's diffuse color.
+ */
+inline float lightBrightness(const Light *light)
+{
+  Vector3f diffuse = light->getDiffuseColor();
+  return 0.2126 * diffuse[0] + 0.7152 * diffuse[1] + 0.0722 * diffuse[2];
+}
+
+/**
+ * Inserts a light into a list of the most important lights ordered by
+ * decreasing importance, dropping the least important one when the list
+ * is full.
+ */
+inline void selectLight(Light **lights, float *scores, int &count, Light *light, float score)
+{
+  if (count == AFFECTING_LIGHTS && score <= scores[count - 1])
+    return;
+  
+  int i = count < AFFECTING_LIGHTS ? count++ : count - 1;
+  for (; i > 0 && scores[i - 1] < score; i--) {
+    lights[i] = lights[i - 1];
+    scores[i] = scores[i - 1];
+  }
+  
+  lights[i] = light;
+  scores[i] = score;
+}
+
 LightManager::LightManager()
-  : m_lightVersionCounter(0)
+  : m_lightVersionCounter(0),
+    m_unboundedVersion(0),
+    m_clusterVersion(0),
+    m_clusterNear(0),
+    m_clusterFar(0),
+    m_clusterSlopeX(0),
+    m_clusterSlopeY(0),
+    m_clusterDepthScale(0),
+    m_selectionMark(0)
 {
+  m_clusterView.setIdentity();
 }
-    
+
 void LightManager::addLight(Light *light)
 {
-  if (m_lights.find(light->getName()) != m_lights.end())
+  if (m_lights.find(light) != m_lights.end())
     return;
   
-  m_lights[light->getName()] = light;
+  m_lightVersionCounter++;
+  indexLight(light);
 }
 
 void LightManager::removeLight(Light *light)
 {
-  m_lights.erase(light->getName());
+  if (m_lights.find(light) == m_lights.end())
+    return;
+  
+  m_lightVersionCounter++;
+  unindexLight(light);
 }
 
 void LightManager::updateLight(Light *light)
 {
+  if (m_lights.find(light) == m_lights.end())
+    return;
+  
+  // Lights are few and rarely move, so simply reinsert them; this marks
+  // both the old and the new cells as changed
+  m_lightVersionCounter++;
+  unindexLight(light);
+  indexLight(light);
+}
+
+void LightManager::indexLight(Light *light)
+{
+  LightRecord &record = m_lights[light];
+  record.position = light->getWorldPosition();
+  record.range = light->getAttenuationRange();
+  record.unbounded = true;
+  
+  if (light->getType() != Light::DirectionalLight) {
+    Vector3f extent(record.range, record.range, record.range);
+    Vector3f min = record.position - extent;
+    Vector3f max = record.position + extent;
+    
+    record.min.x = gridCoordinate(min[0]);
+    record.min.y = gridCoordinate(min[1]);
+    record.min.z = gridCoordinate(min[2]);
+    record.max.x = gridCoordinate(max[0]);
+    record.max.y = gridCoordinate(max[1]);
+    record.max.z = gridCoordinate(max[2]);
+    
+    double cells = (double) (record.max.x - record.min.x + 1) *
+                   (double) (record.max.y - record.min.y + 1) *
+                   (double) (record.max.z - record.min.z + 1);
+    record.unbounded = cells > LIGHT_GRID_MAX_CELLS;
+  }
+  
+  if (record.unbounded) {
+    m_unboundedLights.push_back(light);
+    m_unboundedVersion = m_lightVersionCounter;
+    return;
+  }
+  
+  // Insert the light into all cells its range overlaps
+  LightGridCell cell;
+  for (cell.z = record.min.z; cell.z <= record.max.z; cell.z++) {
+    for (cell.y = record.min.y; cell.y <= record.max.y; cell.y++) {
+      for (cell.x = record.min.x; cell.x <= record.max.x; cell.x++) {
+        LightGridEntry &entry = m_grid[cell];
+        entry.lights.push_back(light);
+        entry.version = m_lightVersionCounter;
+      }
+    }
+  }
 }
 
-inline bool compareLightsLessThan(const Light *l1, const Light *l2)
+void LightManager::unindexLight(Light *light)
 {
-  // FIXME this should compare brightness
-  return l1->getLastSquaredDistance() < l2->getLastSquaredDistance();
+  boost::unordered_map<Light*, LightRecord>::iterator i = m_lights.find(light);
+  const LightRecord &record = i->second;
+  
+  if (record.unbounded) {
+    m_unboundedLights.erase(std::find(m_unboundedLights.begin(), m_unboundedLights.end(), light));
+    m_unboundedVersion = m_lightVersionCounter;
+  } else {
+    LightGridCell cell;
+    for (cell.z = record.min.z; cell.z <= record.max.z; cell.z++) {
+      for (cell.y = record.min.y; cell.y <= record.max.y; cell.y++) {
+        for (cell.x = record.min.x; cell.x <= record.max.x; cell.x++) {
+          LightGridEntry &entry = m_grid[cell];
+          entry.lights.erase(std::find(entry.lights.begin(), entry.lights.end(), light));
+          entry.version = m_lightVersionCounter;
+        }
+      }
+    }
+  }
+  
+  m_lights.erase(i);
 }
 
-void LightManager::computeAffectingLights(LightList &lights, const Vector3f &position, float radius) const
+void LightManager::touchLight(Light *light)
+{
+  // The light might have been removed in the meantime
+  boost::unordered_map<Light*, LightRecord>::const_iterator i = m_lights.find(light);
+  if (i == m_lights.end())
+    return;
+  
+  const LightRecord &record = i->second;
+  if (record.unbounded) {
+    m_unboundedVersion = m_lightVersionCounter;
+    return;
+  }
+  
+  LightGridCell cell;
+  for (cell.z = record.min.z; cell.z <= record.max.z; cell.z++) {
+    for (cell.y = record.min.y; cell.y <= record.max.y; cell.y++) {
+      for (cell.x = record.min.x; cell.x <= record.max.x; cell.x++) {
+        m_grid[cell].version = m_lightVersionCounter;
+      }
+    }
+  }
+}
+
+bool LightManager::lightsChangedSince(unsigned long version, const Vector3f &position, float radius) const
+{
+  if (m_unboundedVersion > version)
+    return true;
+  
+  // Any light that reaches the object shares at least one cell with it
+  Vector3f extent(radius, radius, radius);
+  Vector3f lo = position - extent;
+  Vector3f hi = position + extent;
+  
+  LightGridCell min, max;
+  min.x = gridCoordinate(lo[0]);
+  min.y = gridCoordinate(lo[1]);
+  min.z = gridCoordinate(lo[2]);
+  max.x = gridCoordinate(hi[0]);
+  max.y = gridCoordinate(hi[1]);
+  max.z = gridCoordinate(hi[2]);
+  
+  double cells = (double) (max.x - min.x + 1) *
+                 (double) (max.y - min.y + 1) *
+                 (double) (max.z - min.z + 1);
+  
+  // Large objects just check for any change
+  if (cells > LIGHT_GRID_MAX_CELLS)
+    return m_lightVersionCounter > version;
+  
+  LightGridCell cell;
+  for (cell.z = min.z; cell.z <= max.z; cell.z++) {
+    for (cell.y = min.y; cell.y <= max.y; cell.y++) {
+      for (cell.x = min.x; cell.x <= max.x; cell.x++) {
+        boost::unordered_map<LightGridCell, LightGridEntry>::const_iterator c = m_grid.find(cell);
+        if (c != m_grid.end() && c->second.version > version)
+          return true;
+      }
+    }
+  }
+  
+  return false;
+}
+
+bool LightManager::getClusterRange(const Vector3f &center, float radius, int *min, int *max) const
 {
-  const LightList &candidateLights = m_lightsInFrustum;
+  // View space looks down the negative Z axis
+  float depth = -center[2];
+  float nearDepth = std::max(depth - radius, m_clusterNear);
+  float farDepth = std::min(depth + radius, m_clusterFar);
+  if (nearDepth > farDepth)
+    return false;
+  
+  // Depth slices are exponential so clusters stay roughly cubic
+  min[2] = clampCluster((int) (std::log(nearDepth / m_clusterNear) * m_clusterDepthScale), LIGHT_CLUSTERS_Z);
+  max[2] = clampCluster((int) (std::log(farDepth / m_clusterNear) * m_clusterDepthScale), LIGHT_CLUSTERS_Z);
   
-  lights.clear();
-  lights.reserve(candidateLights.size());
+  // Project the sphere's extent onto tiles; coordinates moving away from
+  // the view axis use the nearest depth and the others use the farthest
+  // one, which keeps the range conservative
+  const float slopes[2] = { m_clusterSlopeX, m_clusterSlopeY };
+  const int tiles[2] = { LIGHT_CLUSTERS_X, LIGHT_CLUSTERS_Y };
   
-  BOOST_FOREACH(Light *l, candidateLights) {
-    // Calculate distance to light source
-    float distance = l->getSquaredDistanceTo(position);
+  for (int i = 0; i < 2; i++) {
+    float lo = center[i] - radius;
+    float hi = center[i] + radius;
+    float ndcMin = lo / ((lo < 0 ? nearDepth : farDepth) * slopes[i]);
+    float ndcMax = hi / ((hi > 0 ? nearDepth : farDepth) * slopes[i]);
     
+    min[i] = clampCluster((int) std::floor((ndcMin + 1.0) * 0.5 * tiles[i]), tiles[i]);
+    max[i] = clampCluster((int) std::floor((ndcMax + 1.0) * 0.5 * tiles[i]), tiles[i]);
+  }
+  
+  return true;
+}
+
+void LightManager::buildClusters()
+{
+  m_directionalLights.clear();
+  m_localLights.clear();
+  m_localLightData.clear();
+  m_lightRanges.clear();
+  m_clusterOffsets.assign(LIGHT_CLUSTERS + 1, 0);
+  
+  // Compute cluster ranges of all local lights and count lights per cluster
+  BOOST_FOREACH(Light *l, m_lightsInFrustum) {
     if (l->getType() == Light::DirectionalLight) {
-      // Directional lights are always included
-      //l->computeBrightnessTo(position);
-      lights.push_back(l);
-    } else {
-      // Check if the light is in range
-      float range = l->getAttenuationRange() + radius;
-      if (distance <= range*range) {
-        //l->computeBrightnessTo(position);
-        lights.push_back(l);
+      m_directionalLights.push_back(l);
+      continue;
+    }
+    
+    Vector3f position = l->getWorldPosition();
+    int min[3], max[3];
+    if (!getClusterRange(m_clusterView * position, l->getAttenuationRange(), min, max))
+      continue;
+    
+    m_localLights.push_back(l);
+    m_lightRanges.insert(m_lightRanges.end(), min, min + 3);
+    m_lightRanges.insert(m_lightRanges.end(), max, max + 3);
+    
+    // Store data needed for scoring
+    float data[LIGHT_DATA_FLOATS] = {
+      position[0], position[1], position[2],
+      l->getAttenuationRange(),
+      l->getConstantAttenuation(),
+      l->getLinearAttenuation(),
+      l->getQuadraticAttenuation(),
+      lightBrightness(l)
+    };
+    m_localLightData.insert(m_localLightData.end(), data, data + LIGHT_DATA_FLOATS);
+    
+    for (int z = min[2]; z <= max[2]; z++) {
+      for (int y = min[1]; y <= max[1]; y++) {
+        for (int x = min[0]; x <= max[0]; x++) {
+          m_clusterOffsets[clusterIndex(x, y, z) + 1]++;
+        }
+      }
+    }
+  }
+  
+  for (int i = 0; i < LIGHT_CLUSTERS; i++)
+    m_clusterOffsets[i + 1] += m_clusterOffsets[i];
+  
+  // Place light indices into their clusters
+  m_clusterItems.resize(m_clusterOffsets[LIGHT_CLUSTERS]);
+  m_clusterCursor.assign(m_clusterOffsets.begin(), m_clusterOffsets.end() - 1);
+  
+  for (int i = 0; i < (int) m_localLights.size(); i++) {
+    const int *min = &m_lightRanges[i * 6];
+    const int *max = min + 3;
+    
+    for (int z = min[2]; z <= max[2]; z++) {
+      for (int y = min[1]; y <= max[1]; y++) {
+        for (int x = min[0]; x <= max[0]; x++) {
+          m_clusterItems[m_clusterCursor[clusterIndex(x, y, z)]++] = i;
+        }
+      }
+    }
+  }
+  
+  m_selectionMarks.assign(m_localLights.size(), 0);
+  m_selectionMark = 0;
+}
+
+void LightManager::computeAffectingLights(LightList &lights, const Vector3f &position, float radius) const
+{
+  Light *selected[AFFECTING_LIGHTS];
+  float scores[AFFECTING_LIGHTS];
+  int count = 0;
+  
+  // Directional lights are not attenuated
+  BOOST_FOREACH(Light *l, m_directionalLights) {
+    selectLight(selected, scores, count, l, lightBrightness(l));
+  }
+  
+  // Gather local lights from all clusters the object overlaps, each only once
+  int min[3], max[3];
+  m_selection.clear();
+  
+  if (!m_clusterOffsets.empty() && getClusterRange(m_clusterView * position, radius, min, max)) {
+    m_selectionMark++;
+    
+    for (int z = min[2]; z <= max[2]; z++) {
+      for (int y = min[1]; y <= max[1]; y++) {
+        for (int x = min[0]; x <= max[0]; x++) {
+          int cluster = clusterIndex(x, y, z);
+          for (int i = m_clusterOffsets[cluster]; i < m_clusterOffsets[cluster + 1]; i++) {
+            int light = m_clusterItems[i];
+            if (m_selectionMarks[light] == m_selectionMark)
+              continue;
+            
+            m_selectionMarks[light] = m_selectionMark;
+            m_selection.push_back(light);
+          }
+        }
       }
     }
   }
   
-  // Sort lights
-  std::stable_sort(lights.begin(), lights.end(), compareLightsLessThan);
+  // Score local lights four at a time
+  Vector4f objectX = Vector4f::Constant(position[0]);
+  Vector4f objectY = Vector4f::Constant(position[1]);
+  Vector4f objectZ = Vector4f::Constant(position[2]);
+  Vector4f objectRadius = Vector4f::Constant(radius);
+  
+  for (size_t i = 0; i < m_selection.size(); i += 4) {
+    Vector4f v[LIGHT_DATA_FLOATS];
+    for (int j = 0; j < 4; j++) {
+      const float *data = i + j < m_selection.size() ?
+        &m_localLightData[m_selection[i + j] * LIGHT_DATA_FLOATS] : emptyLightData;
+      
+      for (int k = 0; k < LIGHT_DATA_FLOATS; k++)
+        v[k][j] = data[k];
+    }
+    
+    // Distance from the light to the object's bounding sphere
+    Vector4f dx = v[0] - objectX;
+    Vector4f dy = v[1] - objectY;
+    Vector4f dz = v[2] - objectZ;
+    Vector4f distance = (dx.cwise().square() + dy.cwise().square() + dz.cwise().square()).cwise().sqrt();
+    distance = (distance - objectRadius).cwise().max(Vector4f::Zero());
+    
+    // Attenuation as computed by the fixed pipeline and a window that
+    // fades the light out at the end of its range
+    Vector4f attenuation = (v[4] + v[5].cwise() * distance + v[6].cwise() * distance.cwise().square()).cwise().inverse();
+    Vector4f window = (Vector4f::Ones() - (distance.cwise() / v[3]).cwise().square()).cwise().max(Vector4f::Zero());
+    Vector4f score = (v[7].cwise() * attenuation).cwise() * window;
+    
+    for (int j = 0; j < 4 && i + j < m_selection.size(); j++) {
+      if (score[j] > 0)
+        selectLight(selected, scores, count, m_localLights[m_selection[i + j]], score[j]);
+    }
+  }
+  
+  lights.assign(selected, selected + count);
 }
 
 void LightManager::findLightsInFrustum(Camera *camera)
 {
-  // First iterate through the lights and find if they are within the frustum;
-  // currently this is just a simple walk through all the registred lights,
-  // we should implement this using an octree later
-  m_testCache.clear();
-  m_testCache.reserve(m_lights.size());
+  // Gather candidate lights from spatial index cells that overlap the
+  // frustum bounds; unbounded lights are always candidates
+  m_candidates.assign(m_unboundedLights.begin(), m_unboundedLights.end());
   
-  typedef std::pair<std::string, Light*> Item;
-  BOOST_FOREACH(Item i, m_lights) {
-    Light *l = i.second;
+  const AxisAlignedBox &bounds = camera->getFrustumBounds();
+  if (!bounds.isNull()) {
+    LightGridCell min, max;
+    min.x = gridCoordinate(bounds.getMinimum()[0]);
+    min.y = gridCoordinate(bounds.getMinimum()[1]);
+    min.z = gridCoordinate(bounds.getMinimum()[2]);
+    max.x = gridCoordinate(bounds.getMaximum()[0]);
+    max.y = gridCoordinate(bounds.getMaximum()[1]);
+    max.z = gridCoordinate(bounds.getMaximum()[2]);
+    
+    double cells = (double) (max.x - min.x + 1) *
+                   (double) (max.y - min.y + 1) *
+                   (double) (max.z - min.z + 1);
     
+    if (cells > m_grid.size()) {
+      // The frustum spans more cells than are occupied, so walk occupied cells
+      typedef boost::unordered_map<LightGridCell, LightGridEntry>::value_type Cell;
+      BOOST_FOREACH(const Cell &cell, m_grid) {
+        if (cell.first.x >= min.x && cell.first.x <= max.x &&
+            cell.first.y >= min.y && cell.first.y <= max.y &&
+            cell.first.z >= min.z && cell.first.z <= max.z)
+          m_candidates.insert(m_candidates.end(), cell.second.lights.begin(), cell.second.lights.end());
+      }
+    } else {
+      LightGridCell cell;
+      for (cell.z = min.z; cell.z <= max.z; cell.z++) {
+        for (cell.y = min.y; cell.y <= max.y; cell.y++) {
+          for (cell.x = min.x; cell.x <= max.x; cell.x++) {
+            boost::unordered_map<LightGridCell, LightGridEntry>::const_iterator c = m_grid.find(cell);
+            if (c != m_grid.end())
+              m_candidates.insert(m_candidates.end(), c->second.lights.begin(), c->second.lights.end());
+          }
+        }
+      }
+    }
+  }
+  
+  // Lights spanning multiple cells were found more than once; sorting also
+  // keeps the order stable between frames
+  std::sort(m_candidates.begin(), m_candidates.end());
+  m_candidates.erase(std::unique(m_candidates.begin(), m_candidates.end()), m_candidates.end());
+  
+  // Now check which candidates are within the frustum
+  m_testCache.clear();
+  m_testCache.reserve(m_candidates.size());
+  
+  BOOST_FOREACH(Light *l, m_candidates) {
     if (l->isVisible()) {
       LightCacheItem cache;
       cache.light = l;
@@ -103,21 +517,52 @@ void LightManager::findLightsInFrustum(Camera *camera)
     }
   }
   
-  // Now check if lights have changed (this is separated, because sorting
-  // may be expensive)
+  // Now check if lights have changed
   if (m_lightCache != m_testCache) {
+    // Objects near lights that entered or left the frustum must recompute
+    // their lights; both caches are ordered by light
+    m_lightVersionCounter++;
+    LightCache::const_iterator a = m_lightCache.begin();
+    LightCache::const_iterator b = m_testCache.begin();
+    
+    while (a != m_lightCache.end() || b != m_testCache.end()) {
+      if (b == m_testCache.end() || (a != m_lightCache.end() && a->light < b->light)) {
+        touchLight((a++)->light);
+      } else if (a == m_lightCache.end() || b->light < a->light) {
+        touchLight((b++)->light);
+      } else {
+        ++a;
+        ++b;
+      }
+    }
+    
     m_lightsInFrustum.resize(m_testCache.size());
     LightList::iterator i = m_lightsInFrustum.begin();
     
     BOOST_FOREACH(LightCacheItem item, m_testCache) {
-      *i = item.light;
+      *i++ = item.light;
     }
     
     // Update cache
     m_lightCache.swap(m_testCache);
-    
-    // Increment version number
-    m_lightVersionCounter++;
+  }
+  
+  // Clusters depend on the view as well, so they are rebuilt whenever the
+  // camera moves; this does not require objects to recompute their lights
+  if (m_clusterVersion != m_lightVersionCounter || m_clusterOffsets.empty() ||
+      !(m_clusterView.matrix() == camera->getViewTransform().matrix()) ||
+      m_clusterNear != camera->getNearDistance() ||
+      m_clusterFar != camera->getFarDistance() ||
+      m_clusterSlopeX != camera->getHorizontalSlope() ||
+      m_clusterSlopeY != camera->getVerticalSlope()) {
+    m_clusterView = camera->getViewTransform();
+    m_clusterNear = camera->getNearDistance();
+    m_clusterFar = camera->getFarDistance();
+    m_clusterSlopeX = camera->getHorizontalSlope();
+    m_clusterSlopeY = camera->getVerticalSlope();
+    m_clusterDepthScale = LIGHT_CLUSTERS_Z / std::log(m_clusterFar / m_clusterNear);
+    m_clusterVersion = m_lightVersionCounter;
+    buildClusters();
   }
 }
 
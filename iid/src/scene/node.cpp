@@ -293,6 +293,13 @@ void SceneNode::batchStaticGeometry(btTriangleIndexVertexArray *triangles)
   }
 }
 
+void SceneNode::hashStaticGeometry(size_t &seed) const
+{
+  BOOST_FOREACH(Child child, m_children) {
+    child.second->hashStaticGeometry(seed);
+  }
+}
+
 void SceneNode::separateNodeFromParent()
 {
   if (!m_scene)
@@ -0,0 +1,130 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "scene/particlemanager.h"
+#include "scene/particles.h"
+#include "scene/scene.h"
+#include "context.h"
+#include "threadpool.h"
+
+#include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+
+#include <algorithm>
+
+#include <stdlib.h>
+
+// Number of floats needed per particle (simulation state, vertex and color)
+#define PARTICLE_BUFFER_FLOATS 15
+
+// Minimum number of particles simulated by a single worker thread
+#define PARALLEL_MIN_PARTICLES 2048
+
+namespace IID {
+
+ParticleManager::ParticleManager(Scene *scene)
+  : m_scene(scene)
+{
+}
+
+ParticleManager::~ParticleManager()
+{
+  typedef std::pair<int, std::vector<float*> > Pool;
+  BOOST_FOREACH(Pool &pool, m_freeBuffers) {
+    BOOST_FOREACH(float *buffer, pool.second) {
+      free(buffer);
+    }
+  }
+}
+
+ParticleEmitter *ParticleManager::createEmitter(const std::string &name, int maxParticles)
+{
+  return new ParticleEmitter(this, name, maxParticles);
+}
+
+Explosion *ParticleManager::createExplosion(const std::string &name, int maxParticles)
+{
+  return new Explosion(this, name, maxParticles);
+}
+
+float *ParticleManager::acquireBuffer(int maxParticles)
+{
+  std::vector<float*> &pool = m_freeBuffers[maxParticles];
+  if (pool.empty())
+    return (float*) malloc(maxParticles * PARTICLE_BUFFER_FLOATS * sizeof(float));
+  
+  float *buffer = pool.back();
+  pool.pop_back();
+  return buffer;
+}
+
+void ParticleManager::releaseBuffer(int maxParticles, float *buffer)
+{
+  m_freeBuffers[maxParticles].push_back(buffer);
+}
+
+void ParticleManager::addEmitter(ParticleEmitter *emitter)
+{
+  m_emitters.push_back(emitter);
+}
+
+void ParticleManager::removeEmitter(ParticleEmitter *emitter)
+{
+  std::vector<ParticleEmitter*>::iterator i = std::find(m_emitters.begin(), m_emitters.end(), emitter);
+  if (i == m_emitters.end())
+    return;
+  
+  *i = m_emitters.back();
+  m_emitters.pop_back();
+}
+
+void ParticleManager::updateRange(int begin, int end, float dt)
+{
+  for (int i = begin; i < end; i++)
+    m_emitters[i]->update(dt);
+}
+
+void ParticleManager::update(float dt)
+{
+  // Split emitters into ranges of roughly equal particle counts
+  ThreadPool *pool = m_scene->context()->getThreadPool();
+  int particles = 0;
+  BOOST_FOREACH(ParticleEmitter *emitter, m_emitters) {
+    particles += emitter->getMaxParticles();
+  }
+  
+  int jobs = std::min((int) pool->size(), particles / PARALLEL_MIN_PARTICLES);
+  if (jobs <= 1) {
+    updateRange(0, m_emitters.size(), dt);
+  } else {
+    JobGroup group;
+    int perJob = particles / jobs;
+    int begin = 0;
+    int count = 0;
+    for (int i = 0; i < (int) m_emitters.size(); i++) {
+      count += m_emitters[i]->getMaxParticles();
+      if (count >= perJob || i == (int) m_emitters.size() - 1) {
+        pool->submit(boost::bind(&ParticleManager::updateRange, this, begin, i + 1, dt), &group);
+        begin = i + 1;
+        count = 0;
+      }
+    }
+    
+    group.wait();
+  }
+  
+  // Queue finished emitters for destruction; the scene applies this at its
+  // sync point and deleting the emitter unregisters it
+  BOOST_FOREACH(ParticleEmitter *emitter, m_emitters) {
+    if (!emitter->isFinished() || !emitter->getAutoRelease())
+      continue;
+    
+    emitter->setAutoRelease(false);
+    m_scene->queueDestroy(emitter);
+  }
+}
+
+}
@@ -5,6 +5,7 @@
  * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
  */
 #include "scene/particles.h"
+#include "scene/particlemanager.h"
 #include "scene/scene.h"
 #include "renderer/statebatcher.h"
 #include "storage/mesh.h"
@@ -13,73 +14,75 @@
 #include "drivers/base.h"
 #include "context.h"
 
+#include <algorithm>
+
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
+
+// Rate of simulation steps per second the particle parameters were tuned for
+#define PARTICLE_STEP_RATE 120.0f
+
+// Maximum time step in seconds (longer pauses are not simulated)
+#define PARTICLE_MAX_STEP 0.1f
+
+// Time step for emitters that are not visible
+#define PARTICLE_CULLED_STEP 0.1f
 
 namespace IID {
 
-ParticleEmitter::ParticleEmitter(const std::string &name, int maxParticles, SceneNode *parent)
+ParticleEmitter::ParticleEmitter(ParticleManager *manager, const std::string &name, int maxParticles,
+                                 SceneNode *parent)
   : SceneNode(name, parent),
+    m_manager(manager),
     m_animate(false),
     m_render(false),
+    m_finished(false),
+    m_autoRelease(false),
+    m_visible(false),
+    m_pendingTime(0),
     m_maxParticles(maxParticles),
     m_speedFactor(1.0),
     m_slowdown(2.0f),
     m_zoom(-40.0f),
     m_gravity(Vector3f(0.0,-0.8,0.0)),
-    m_particles(0),
     m_vertices(0),
     m_colors(0),
+    m_random(rand() | 1),
     m_texture(0),
     m_shader(0),
     m_colorList(0),
     m_showBoundingBox(false)
 {
-  m_particles  = (Particle*) malloc(m_maxParticles * sizeof(Particle));
-  m_vertices   = (float*) malloc(m_maxParticles * 3 * sizeof(float));
-  m_colors   = (float*) malloc(m_maxParticles * 4 * sizeof(float));
+  // All particle state and render arrays live in a single pooled block
+  float *state = m_manager->acquireBuffer(m_maxParticles);
+  m_positionX = state;
+  m_positionY = state + m_maxParticles;
+  m_positionZ = state + 2*m_maxParticles;
+  m_velocityX = state + 3*m_maxParticles;
+  m_velocityY = state + 4*m_maxParticles;
+  m_velocityZ = state + 5*m_maxParticles;
+  m_life      = state + 6*m_maxParticles;
+  m_fade      = state + 7*m_maxParticles;
+  
+  m_vertices  = state + 8*m_maxParticles;
+  m_colors    = state + 11*m_maxParticles;
   m_localBounds = AxisAlignedBox();
+  
+  m_manager->addEmitter(this);
 }
 
 ParticleEmitter::~ParticleEmitter()
 {
-  free(m_particles);
-  free(m_vertices);
-  free(m_colors);
+  m_manager->removeEmitter(this);
+  m_manager->releaseBuffer(m_maxParticles, m_positionX);
 }
 
 void ParticleEmitter::init()
 {
-  // Some temporary pointers for easier setup
-  float *vertices = m_vertices;
-  float *colors = m_colors;
-  
-  for (int i = 0; i < m_maxParticles; i++) 
-  {
-    Particle *p = &m_particles[i];
-    
-    // Point to the data array
-    p->m_position = vertices;
-    p->m_rgba = colors;
-    p->m_gravity = m_gravity;
-    
+  for (int i = 0; i < m_maxParticles; i++) {
     // Set initial parameters
-    reset(p);
-    
-    // Increment the pointers
-    vertices += 3;
-    colors += 4;
-  }
-  
-  if (m_shader) {
-    Driver *driver = m_scene->context()->driver();
-    
-    // Setup shader stuff
-    m_shader->activate();
-    DShader *program = driver->currentShader();
-    // Set initial uniform values
-
-    m_shader->deactivate();
+    reset(i);
   }
 }
 
@@ -91,6 +94,8 @@ void ParticleEmitter::show(bool value)
 void ParticleEmitter::start()
 {
   m_animate = true;
+  m_finished = false;
+  m_pendingTime = 0;
 }
 
 void ParticleEmitter::stop()
@@ -98,43 +103,77 @@ void ParticleEmitter::stop()
   m_animate = false;
 }
 
-void ParticleEmitter::animate() 
+int ParticleEmitter::simulate(float dt)
 {
-    if (!m_animate)
-      return;
-    
-    // Update the parameters
-  for (int i = 0; i < m_maxParticles; i++) 
-  {
-    Particle *p = &m_particles[i];
-
-    // Skip dead particles
-    if (!p->m_active)
-      continue;
-
-    p->m_position[0] += p->m_velocity[0] / (m_slowdown * 1000);
-    p->m_position[1] += p->m_velocity[1] / (m_slowdown * 1000);
-    p->m_position[2] += p->m_velocity[2] / (m_slowdown * 1000);
-    
-    Vector3f point = Vector3f(p->m_position[0], p->m_position[1], p->m_position[2]);
-    
-    // Check for bounds
-    if(!m_localBounds.contains(point))
-    {
-      // Kill the particle
-      p->m_life = 0;
-    }
+  // The simulation was originally tuned to advance by one step per frame
+  // at the maximum framerate
+  float steps = dt * PARTICLE_STEP_RATE;
+  float scale = steps / (m_slowdown * 1000);
+  float gx = m_gravity[0] * steps;
+  float gy = m_gravity[1] * steps;
+  float gz = m_gravity[2] * steps;
+  
+  // Particles leaving the bounds are killed
+  float minX = -FLT_MAX, minY = -FLT_MAX, minZ = -FLT_MAX;
+  float maxX = FLT_MAX, maxY = FLT_MAX, maxZ = FLT_MAX;
+  if (!m_localBounds.isNull() && !m_localBounds.isInfinite()) {
+    const Vector3f &min = m_localBounds.getMinimum();
+    const Vector3f &max = m_localBounds.getMaximum();
+    minX = min[0]; minY = min[1]; minZ = min[2];
+    maxX = max[0]; maxY = max[1]; maxZ = max[2];
+  }
+  
+  float *px = m_positionX;
+  float *py = m_positionY;
+  float *pz = m_positionZ;
+  float *vx = m_velocityX;
+  float *vy = m_velocityY;
+  float *vz = m_velocityZ;
+  float *life = m_life;
+  const float *fade = m_fade;
+  
+  // Branch-free kernel over all particles so the compiler can vectorize it
+  int alive = 0;
+  for (int i = 0; i < m_maxParticles; i++) {
+    float x = px[i] + vx[i] * scale;
+    float y = py[i] + vy[i] * scale;
+    float z = pz[i] + vz[i] * scale;
+    px[i] = x;
+    py[i] = y;
+    pz[i] = z;
     
-    p->m_velocity += p->m_gravity;
+    vx[i] += gx;
+    vy[i] += gy;
+    vz[i] += gz;
     
     // Reduce life by fade (alpha component of the color)
-    p->m_life -= p->m_fade;
-    p->m_rgba[3] = p->m_life;
+    bool inside = (x >= minX) & (x <= maxX) & (y >= minY) & (y <= maxY) & (z >= minZ) & (z <= maxZ);
+    float l = (inside ? life[i] : 0.0f) - fade[i] * steps;
+    life[i] = l;
+    alive += (l >= 0.0f);
+    
+    // Write render data directly
+    m_vertices[3*i] = x;
+    m_vertices[3*i + 1] = y;
+    m_vertices[3*i + 2] = z;
+    m_colors[4*i + 3] = l;
+  }
+  
+  return alive;
+}
 
-    if (p->m_life < 0.0f) {
-      // Reset the particle's parameters
-      reset(p);
-    }
+void ParticleEmitter::animate(float dt)
+{
+  if (!m_animate)
+    return;
+  
+  if (simulate(dt) == m_maxParticles)
+    return;
+  
+  // Respawn dead particles
+  for (int i = 0; i < m_maxParticles; i++) {
+    if (m_life[i] < 0.0f)
+      reset(i);
   }
 }
 
@@ -170,10 +209,36 @@ void ParticleEmitter::boostSpeed(float sfactor)
   m_speedFactor = sfactor;
 }
 
+void ParticleEmitter::update(float dt)
+{
+  bool visible = m_visible;
+  m_visible = false;
+  
+  if (!m_animate)
+    return;
+  
+  m_pendingTime += dt;
+  if (!visible && m_pendingTime < PARTICLE_CULLED_STEP)
+    return;
+  
+  fastForward();
+}
+
+void ParticleEmitter::fastForward()
+{
+  if (m_pendingTime <= 0 || !m_animate)
+    return;
+  
+  animate(std::min(m_pendingTime, PARTICLE_MAX_STEP));
+  m_pendingTime = 0;
+}
+
 void ParticleEmitter::render(StateBatcher *batcher)
 {
-  // Step in the simulation
-  animate();
+  // Simulation is advanced by the particle manager; only catch up on time
+  // that passed while we were culled
+  m_visible = true;
+  fastForward();
   
   if (m_render) {
     batcher->addParticleEmitter(
@@ -187,95 +252,49 @@ void ParticleEmitter::render(StateBatcher *batcher)
   }
 }
 
-void ParticleEmitter::reset(Particle *p)
+void ParticleEmitter::reset(int i)
 {
-  p->m_active = true;
-  p->m_life = 1.0f;
-  p->m_fade = RANDOM_FADE();
+  m_life[i] = 1.0f;
+  m_fade[i] = random() * 0.1f + 0.003f;
   
-  p->m_position[0] = 0.0;
-  p->m_position[1] = 0.0;
-  p->m_position[2] = 0.0;
+  m_positionX[i] = 0.0;
+  m_positionY[i] = 0.0;
+  m_positionZ[i] = 0.0;
   
-  Vector3f color = m_colorList[(int)(m_colorList.size()*(float)rand()/(float)RAND_MAX)];
-  p->m_rgba[0] = color[0];
-  p->m_rgba[1] = color[1];
-  p->m_rgba[2] = color[2];
+  m_velocityX[i] = (random() * 50.0f - 26.0f) * m_speedFactor;
+  m_velocityY[i] = (random() * 50.0f - 26.0f) * m_speedFactor;
+  m_velocityZ[i] = (random() * 50.0f - 26.0f) * m_speedFactor;
   
-  p->m_velocity[0] = RANDOM_SPEED() * m_speedFactor;
-  p->m_velocity[1] = RANDOM_SPEED() * m_speedFactor;
-  p->m_velocity[2] = RANDOM_SPEED() * m_speedFactor;
+  float *vertex = &m_vertices[3*i];
+  vertex[0] = 0.0;
+  vertex[1] = 0.0;
+  vertex[2] = 0.0;
   
-  p->m_rgba[3] = p->m_life;
+  float *rgba = &m_colors[4*i];
+  if (!m_colorList.empty()) {
+    const Vector3f &color = m_colorList[std::min((size_t) (random() * m_colorList.size()), m_colorList.size() - 1)];
+    rgba[0] = color[0];
+    rgba[1] = color[1];
+    rgba[2] = color[2];
+  }
+  rgba[3] = m_life[i];
 }
 
-Explosion::Explosion(const std::string &name, int maxParticles, SceneNode *parent)
-  : ParticleEmitter(name, maxParticles, parent)
+Explosion::Explosion(ParticleManager *manager, const std::string &name, int maxParticles, SceneNode *parent)
+  : ParticleEmitter(manager, name, maxParticles, parent)
 {
 }
 
-void Explosion::animate() 
+void Explosion::animate(float dt)
 {
   if (!m_animate)
     return;
   
-  bool allDead = true;
-  
-    // Update the parameters
-  for (int i = 0; i < m_maxParticles; i++) 
-  {
-    Particle *p = &m_particles[i];
-
-    // Skip dead particles
-    if (!p->m_active)
-      continue;
-
-    allDead = false;
-    
-    p->m_position[0] += p->m_velocity[0] / (m_slowdown * 1000);
-    p->m_position[1] += p->m_velocity[1] / (m_slowdown * 1000);
-    p->m_position[2] += p->m_velocity[2] / (m_slowdown * 1000);
-    
-    Vector3f point = Vector3f(p->m_position[0], p->m_position[1], p->m_position[2]);
-    
-    // Check for bounds
-    if(!m_localBounds.contains(point))
-    {
-      // Kill the particle
-      p->m_life = 0;
-    }
-    
-    p->m_velocity += p->m_gravity;
-    
-    // Reduce life by fade (alpha component of the color)
-    p->m_life -= p->m_fade;
-    p->m_rgba[3] = p->m_life;
-  }
-  
-  if (allDead) {
+  if (simulate(dt) == 0) {
+    // All particles are dead, stop the explosion
     m_render = false;
     m_animate = false;
-    
-    // Detach this node and remove it
-    getParent()->detachChild(this);
-    delete this;
-  }
-}
-
-void Explosion::render(StateBatcher *batcher)
-{
-  // Step in the simulation
-  animate();
-  
-  if (m_render) {
-    batcher->addParticleEmitter(
-      m_shader,
-      m_texture,
-      m_maxParticles,
-      m_vertices,
-      m_colors,
-      m_worldTransform
-    );
+    m_finished = true;
   }
 }
 
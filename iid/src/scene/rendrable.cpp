@@ -14,6 +14,8 @@
 #include "storage/material.h"
 #include "drivers/base.h"
 
+#include <boost/functional/hash.hpp>
+
 // Bullet
 #include <BulletCollision/CollisionShapes/btTriangleIndexVertexArray.h>
 
@@ -26,16 +28,15 @@ RendrableNode::RendrableNode(const std::string &name, SceneNode *parent)
     m_shader(0),
     m_material(0),
     m_showBoundingBox(false),
-    m_staticGeomMesh(0)
+    m_staticGeomMesh(0),
+    m_lightVersionCounter(0),
+    m_lightsDirty(true)
 {
 }
 
 RendrableNode::~RendrableNode()
 {
-  if (m_staticGeomMesh) {
-    delete m_staticGeomMesh->m_vertexBase;
-    delete m_staticGeomMesh;
-  }
+  delete m_staticGeomMesh;
 }
 
 void RendrableNode::setMesh(Mesh *mesh)
@@ -73,40 +74,60 @@ void RendrableNode::batchStaticGeometry(btTriangleIndexVertexArray *triangles)
   
   // Add transformed vertices
   if (m_static && m_mesh) {
-    m_staticGeomMesh = new btIndexedMesh();
-    m_staticGeomMesh->m_numVertices = m_mesh->vertexCount();
-    m_staticGeomMesh->m_numTriangles = m_mesh->indexCount() / 3;
-    m_staticGeomMesh->m_triangleIndexBase = (unsigned char*) m_mesh->indices();
-    m_staticGeomMesh->m_triangleIndexStride = 3*sizeof(unsigned int);
-    
-    // Transform original vertices using node's world transformation
-    float *orig = m_mesh->vertices();
-    float *vertices = new float[3 * m_mesh->vertexCount()];
-    for (int i = 0; i < m_mesh->vertexCount(); i++) {
-      Vector3f p = m_worldTransform * Vector3f(orig + 3*i);
-      vertices[3*i] = p[0];
-      vertices[3*i + 1] = p[1];
-      vertices[3*i + 2] = p[2];
-    }
+    // Geometry is shared with the mesh when the node is not transformed;
+    // otherwise only positions are copied and indices stay shared. Either
+    // way, our reference keeps the data alive if the mesh is evicted.
+    m_staticGeometry = m_mesh->geometry();
+    if (!m_worldTransform.matrix().isIdentity())
+      m_staticGeometry = m_staticGeometry->transformed(m_worldTransform);
     
-    m_staticGeomMesh->m_vertexBase = (unsigned char*) vertices;
-    m_staticGeomMesh->m_vertexStride = 3*sizeof(float);
+    m_staticGeomMesh = new btIndexedMesh();
+    m_staticGeomMesh->m_numVertices = m_staticGeometry->vertexCount();
+    m_staticGeomMesh->m_numTriangles = m_staticGeometry->indexCount() / 3;
+    m_staticGeomMesh->m_triangleIndexBase = (unsigned char*) m_staticGeometry->indices();
+    m_staticGeomMesh->m_triangleIndexStride = 3 * Geometry::IndexStride;
+    m_staticGeomMesh->m_vertexBase = (unsigned char*) m_staticGeometry->positions();
+    m_staticGeomMesh->m_vertexStride = Geometry::VertexStride;
     triangles->addIndexedMesh(*m_staticGeomMesh);
   }
 }
 
+void RendrableNode::hashStaticGeometry(size_t &seed) const
+{
+  SceneNode::hashStaticGeometry(seed);
+  
+  // Static geometry is identified by mesh contents and the transformation
+  if (m_static && m_mesh) {
+    const float *transform = m_worldTransform.matrix().data();
+    boost::hash_combine(seed, m_mesh->geometry()->hash());
+    boost::hash_range(seed, transform, transform + 16);
+  }
+}
+
 const LightList &RendrableNode::getLights() const
 {
   if (m_lightManager) {
-    // Check whether our light cache is up to date
-    if (m_lightManager->getLightVersionCounter() != m_lightVersionCounter) {
-      m_lightManager->computeAffectingLights(m_affectingLights, m_worldPosition, m_localBounds.getRadius());
+    // Check whether our light cache is up to date; only lights near the
+    // node are considered
+    float radius = m_localBounds.getRadius();
+    if (m_lightsDirty || m_lightManager->lightsChangedSince(m_lightVersionCounter, m_worldPosition, radius)) {
+      m_lightManager->computeAffectingLights(m_affectingLights, m_worldPosition, radius);
+      m_lightVersionCounter = m_lightManager->getLightVersionCounter();
+      m_lightsDirty = false;
     }
   }
   
   return m_affectingLights;
 }
 
+void RendrableNode::updateNodeSpecific()
+{
+  SceneNode::updateNodeSpecific();
+  
+  // Lights need to be recomputed for the new position
+  m_lightsDirty = true;
+}
+
 void RendrableNode::render(StateBatcher *batcher)
 {
   batcher->addToQueue(this);
@@ -11,6 +11,7 @@
 #include "scene/octree.h"
 #include "scene/camera.h"
 #include "scene/lightmanager.h"
+#include "scene/particlemanager.h"
 #include "renderer/statebatcher.h"
 #include "storage/storage.h"
 #include "storage/mesh.h"
@@ -20,11 +21,25 @@
 
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
+#include <algorithm>
 
 #define USE_FRUSTUM_CULLING
 
 namespace IID {
 
+/**
+ * Returns true when the node or any of its ancestors is in the given list.
+ */
+static bool isDestroyed(SceneNode *node, const std::vector<SceneNode*> &destroyed)
+{
+  for (; node; node = node->getParent()) {
+    if (std::find(destroyed.begin(), destroyed.end(), node) != destroyed.end())
+      return true;
+  }
+  
+  return false;
+}
+
 Scene::Scene(Context *context)
   : m_context(context),
     m_driver(context->driver()),
@@ -34,7 +49,8 @@ Scene::Scene(Context *context)
     m_octree(new Octree()),
     m_camera(0),
     m_lightManager(new LightManager()),
-    m_ambientLight(0.2, 0.2, 0.2)
+    m_ambientLight(0.2, 0.2, 0.2),
+    m_particleManager(new ParticleManager(this))
 {
   m_root->m_scene = this;
 }
@@ -46,6 +62,9 @@ Scene::~Scene()
   delete m_root;
   delete m_viewTransform;
   delete m_stateBatcher;
+  
+  // Emitters return their buffers to the particle manager on deletion
+  delete m_particleManager;
 }
 
 void Scene::update()
@@ -74,7 +93,8 @@ void Scene::render()
 #ifdef USE_FRUSTUM_CULLING
   m_octree->walkAndCull(m_camera, m_stateBatcher);
 #else
-  std::list<SceneNode*> n;
+  FrameStlAllocator<SceneNode*> allocator(m_context->getFrameAllocator());
+  std::list<SceneNode*, FrameStlAllocator<SceneNode*> > n(allocator);
   n.push_back(m_root);
   
   while (!n.empty()) {
@@ -110,6 +130,100 @@ void Scene::detachNode(SceneNode *node)
   m_root->detachChild(node);
 }
 
+void Scene::queueAttach(SceneNode *parent, SceneNode *node)
+{
+  SceneCommand cmd = { SceneCommand::Attach, node, parent };
+  boost::mutex::scoped_lock lock(m_commandMutex);
+  m_commands.push_back(cmd);
+}
+
+void Scene::queueDetach(SceneNode *node)
+{
+  SceneCommand cmd = { SceneCommand::Detach, node, 0 };
+  boost::mutex::scoped_lock lock(m_commandMutex);
+  m_commands.push_back(cmd);
+}
+
+void Scene::queueDestroy(SceneNode *node)
+{
+  SceneCommand cmd = { SceneCommand::Destroy, node, 0 };
+  boost::mutex::scoped_lock lock(m_commandMutex);
+  m_commands.push_back(cmd);
+}
+
+void Scene::queueReparent(SceneNode *node, SceneNode *parent)
+{
+  SceneCommand cmd = { SceneCommand::Reparent, node, parent };
+  boost::mutex::scoped_lock lock(m_commandMutex);
+  m_commands.push_back(cmd);
+}
+
+void Scene::applyPendingChanges()
+{
+  // Take the queued commands so that any commands recorded while applying
+  // (for example by node destructors) are handled in the next frame
+  {
+    boost::mutex::scoped_lock lock(m_commandMutex);
+    m_appliedCommands.swap(m_commands);
+  }
+  
+  // Nodes are only deleted once all other commands have been applied;
+  // commands that refer to nodes destroyed earlier in the batch (directly
+  // or through an ancestor) are dropped
+  std::vector<SceneNode*> &destroyed = m_destroyedNodes;
+  BOOST_FOREACH(SceneCommand &cmd, m_appliedCommands) {
+    SceneNode *node = cmd.node;
+    SceneNode *parent = cmd.parent ? cmd.parent : m_root;
+    
+    if (isDestroyed(node, destroyed) || isDestroyed(parent, destroyed))
+      continue;
+    
+    switch (cmd.type) {
+      case SceneCommand::Attach: {
+        parent->attachChild(node);
+        break;
+      }
+      case SceneCommand::Detach: {
+        if (node->getParent())
+          node->getParent()->detachChild(node);
+        break;
+      }
+      case SceneCommand::Destroy: {
+        destroyed.push_back(node);
+        break;
+      }
+      case SceneCommand::Reparent: {
+        if (node->getParent() == parent)
+          break;
+        
+        if (node->getParent())
+          node->getParent()->detachChild(node);
+        
+        parent->attachChild(node);
+        break;
+      }
+    }
+  }
+  
+  // Nodes whose ancestor is also destroyed are deleted together with it
+  BOOST_FOREACH(SceneNode *node, destroyed) {
+    if (!node->getParent() || !isDestroyed(node->getParent(), destroyed))
+      m_destroyedRoots.push_back(node);
+  }
+  
+  BOOST_FOREACH(SceneNode *node, m_destroyedRoots) {
+    if (node->getParent())
+      node->getParent()->detachChild(node);
+    
+    delete node;
+  }
+  
+  // Clearing keeps the capacity for the next frame
+  m_appliedCommands.clear();
+  m_destroyedNodes.clear();
+  m_destroyedRoots.clear();
+}
+
 SceneNode *Scene::createNodeFromStorage(Item *mesh, const std::string &name)
 {
   if (mesh->getType() == "Mesh") {
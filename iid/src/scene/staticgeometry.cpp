@@ -0,0 +1,338 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "scene/staticgeometry.h"
+#include "scene/geometrymeta.h"
+#include "scene/node.h"
+#include "context.h"
+#include "logger.h"
+
+// Bullet
+#include <BulletCollision/CollisionShapes/btTriangleIndexVertexMaterialArray.h>
+#include <BulletCollision/CollisionShapes/btMultimaterialTriangleMeshShape.h>
+#include <BulletCollision/CollisionShapes/btOptimizedBvh.h>
+
+#include <boost/format.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <string.h>
+#include <stdio.h>
+
+namespace fs = boost::filesystem;
+using boost::format;
+
+// Cache file identification; the version must be incremented whenever the
+// layout or the processing of static geometry changes
+#define STATIC_GEOMETRY_MAGIC 0x53444949
+#define STATIC_GEOMETRY_VERSION 1
+
+// Alignment of blocks inside the cache file (the BVH needs 16 bytes)
+#define STATIC_GEOMETRY_ALIGNMENT 16
+
+// Margin added around geometry bounds for BVH quantization
+#define STATIC_GEOMETRY_AABB_MARGIN 1.0f
+
+namespace IID {
+
+/**
+ * Cache file header.
+ */
+struct StaticGeometryHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long fingerprint;
+    float aabbMin[3];
+    float aabbMax[3];
+    unsigned int partCount;
+    unsigned int faceInfoSize;
+    unsigned long long bvhOffset;
+    unsigned long long bvhSize;
+};
+
+/**
+ * Describes a single submesh in the cache file. Vertices are packed
+ * positions, indices are three per triangle and every triangle has a
+ * face descriptor and a descriptor index.
+ */
+struct StaticGeometryPart {
+    unsigned int triangleCount;
+    unsigned int vertexCount;
+    unsigned long long vertexOffset;
+    unsigned long long indexOffset;
+    unsigned long long faceInfoOffset;
+    unsigned long long faceIndexOffset;
+};
+
+/**
+ * Returns true if a block lies within a file of the given size.
+ */
+inline bool blockFits(size_t size, unsigned long long offset, unsigned long long length)
+{
+  return offset <= size && size - offset >= length && offset % STATIC_GEOMETRY_ALIGNMENT == 0;
+}
+
+/**
+ * Appends an aligned block of the given size and returns its offset.
+ */
+inline size_t appendBlock(std::vector<unsigned char> &data, size_t size)
+{
+  size_t offset = (data.size() + STATIC_GEOMETRY_ALIGNMENT - 1) & ~(STATIC_GEOMETRY_ALIGNMENT - 1);
+  data.resize(offset + size, 0);
+  return offset;
+}
+
+StaticGeometry::StaticGeometry(Context *context, const std::string &directory)
+  : m_context(context),
+    m_logger(context->logger("iid.staticgeometry")),
+    m_directory(directory),
+    m_geometry(0),
+    m_shape(0),
+    m_metadata(0)
+{
+}
+
+StaticGeometry::~StaticGeometry()
+{
+  // The mapping is released afterwards, as the shape points into it
+  delete m_shape;
+  delete m_metadata;
+  delete m_geometry;
+  delete m_logger;
+}
+
+std::string StaticGeometry::filename(const std::string &name) const
+{
+  boost::hash<std::string> hasher;
+  return (fs::path(m_directory) / str(format("%016x.physics") % (unsigned long long) hasher(name))).string();
+}
+
+void StaticGeometry::build(SceneNode *root, const std::string &name)
+{
+  // Fingerprinting only hashes mesh contents, no geometry is batched
+  size_t fingerprint = 0;
+  root->hashStaticGeometry(fingerprint);
+  
+  if (load(name, fingerprint)) {
+    m_logger->info("Loaded static geometry '" + name + "' from cache.");
+    return;
+  }
+  
+  create(root);
+  bake(name, fingerprint);
+}
+
+bool StaticGeometry::load(const std::string &name, size_t fingerprint)
+{
+  // The BVH is fixed up in place, so the mapping must be writable
+  if (!m_file.open(filename(name), true))
+    return false;
+  
+  // Validate header, part table and all blocks
+  const unsigned char *data = m_file.data();
+  size_t size = m_file.size();
+  const StaticGeometryHeader *header = reinterpret_cast<const StaticGeometryHeader*>(data);
+  const StaticGeometryPart *parts = reinterpret_cast<const StaticGeometryPart*>(header + 1);
+  bool valid = size >= sizeof(StaticGeometryHeader) && header->magic == STATIC_GEOMETRY_MAGIC &&
+               header->version == STATIC_GEOMETRY_VERSION && header->fingerprint == fingerprint &&
+               header->faceInfoSize == sizeof(GeometryMetadata::FaceInfo) &&
+               (size - sizeof(StaticGeometryHeader)) / sizeof(StaticGeometryPart) >= header->partCount &&
+               blockFits(size, header->bvhOffset, header->bvhSize);
+  
+  for (unsigned int i = 0; valid && i < header->partCount; i++) {
+    const StaticGeometryPart &part = parts[i];
+    unsigned long long triangles = part.triangleCount;
+    valid = blockFits(size, part.vertexOffset, part.vertexCount * 12ULL) &&
+            blockFits(size, part.indexOffset, triangles * 12) &&
+            blockFits(size, part.faceInfoOffset, triangles * sizeof(GeometryMetadata::FaceInfo)) &&
+            blockFits(size, part.faceIndexOffset, triangles * sizeof(int));
+    
+    // Indices must refer to existing vertices
+    const unsigned int *indices = reinterpret_cast<const unsigned int*>(data + part.indexOffset);
+    for (unsigned long long j = 0; valid && j < triangles * 3; j++)
+      valid = indices[j] < part.vertexCount;
+  }
+  
+  if (!valid) {
+    // Stale or invalid files are overwritten by the next bake
+    m_file.close();
+    return false;
+  }
+  
+  // Triangle arrays and face descriptors point into the mapping
+  m_geometry = new btTriangleIndexVertexMaterialArray();
+  for (unsigned int i = 0; i < header->partCount; i++) {
+    const StaticGeometryPart &part = parts[i];
+    
+    btIndexedMesh mesh;
+    mesh.m_numTriangles = part.triangleCount;
+    mesh.m_triangleIndexBase = (unsigned char*) data + part.indexOffset;
+    mesh.m_triangleIndexStride = 3*sizeof(unsigned int);
+    mesh.m_numVertices = part.vertexCount;
+    mesh.m_vertexBase = (unsigned char*) data + part.vertexOffset;
+    mesh.m_vertexStride = 3*sizeof(float);
+    m_geometry->addIndexedMesh(mesh);
+    
+    btMaterialProperties faceInfo = btMaterialProperties();
+    faceInfo.m_numMaterials = part.triangleCount;
+    faceInfo.m_numTriangles = part.triangleCount;
+    faceInfo.m_materialStride = sizeof(GeometryMetadata::FaceInfo);
+    faceInfo.m_triangleMaterialStride = sizeof(unsigned int);
+    faceInfo.m_materialBase = (unsigned char*) data + part.faceInfoOffset;
+    faceInfo.m_triangleMaterialsBase = (unsigned char*) data + part.faceIndexOffset;
+    m_geometry->addMaterialProperties(faceInfo);
+  }
+  
+  btOptimizedBvh *bvh = static_cast<btOptimizedBvh*>(btOptimizedBvh::deSerializeInPlace(
+    m_file.writableData() + header->bvhOffset, header->bvhSize, false
+  ));
+  if (!bvh) {
+    m_logger->warning("Ignoring static geometry cache file with an invalid BVH for '" + name + "'.");
+    delete m_geometry;
+    m_geometry = 0;
+    m_file.close();
+    return false;
+  }
+  
+  for (int j = 0; j < 3; j++) {
+    m_aabbMin[j] = header->aabbMin[j];
+    m_aabbMax[j] = header->aabbMax[j];
+  }
+  
+  btVector3 aabbMin(m_aabbMin[0], m_aabbMin[1], m_aabbMin[2]);
+  btVector3 aabbMax(m_aabbMax[0], m_aabbMax[1], m_aabbMax[2]);
+  m_shape = new btMultimaterialTriangleMeshShape(m_geometry, true, aabbMin, aabbMax, false);
+  m_shape->setOptimizedBvh(bvh);
+  return true;
+}
+
+void StaticGeometry::create(SceneNode *root)
+{
+  m_geometry = new btTriangleIndexVertexMaterialArray();
+  root->batchStaticGeometry(m_geometry);
+  m_metadata = new GeometryMetadata(m_geometry, m_context->getThreadPool());
+  
+  // Quantization bounds enclose all of the geometry
+  for (int j = 0; j < 3; j++) {
+    m_aabbMin[j] = 0.0f;
+    m_aabbMax[j] = 0.0f;
+  }
+  
+  bool first = true;
+  for (int i = 0; i < m_geometry->getNumSubParts(); i++) {
+    const btIndexedMesh &mesh = m_geometry->getIndexedMeshArray()[i];
+    for (int v = 0; v < mesh.m_numVertices; v++) {
+      const float *p = (const float*) (mesh.m_vertexBase + v * mesh.m_vertexStride);
+      for (int j = 0; j < 3; j++) {
+        m_aabbMin[j] = first ? p[j] : std::min(m_aabbMin[j], p[j]);
+        m_aabbMax[j] = first ? p[j] : std::max(m_aabbMax[j], p[j]);
+      }
+      first = false;
+    }
+  }
+  
+  for (int j = 0; j < 3; j++) {
+    m_aabbMin[j] -= STATIC_GEOMETRY_AABB_MARGIN;
+    m_aabbMax[j] += STATIC_GEOMETRY_AABB_MARGIN;
+  }
+  
+  btVector3 aabbMin(m_aabbMin[0], m_aabbMin[1], m_aabbMin[2]);
+  btVector3 aabbMax(m_aabbMax[0], m_aabbMax[1], m_aabbMax[2]);
+  m_shape = new btMultimaterialTriangleMeshShape(m_geometry, true, aabbMin, aabbMax);
+}
+
+void StaticGeometry::bake(const std::string &name, size_t fingerprint) const
+{
+  StaticGeometryHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = STATIC_GEOMETRY_MAGIC;
+  header.version = STATIC_GEOMETRY_VERSION;
+  header.fingerprint = fingerprint;
+  header.partCount = m_geometry->getNumSubParts();
+  header.faceInfoSize = sizeof(GeometryMetadata::FaceInfo);
+  for (int j = 0; j < 3; j++) {
+    header.aabbMin[j] = m_aabbMin[j];
+    header.aabbMax[j] = m_aabbMax[j];
+  }
+  
+  std::vector<StaticGeometryPart> parts(header.partCount);
+  std::vector<unsigned char> data(sizeof(StaticGeometryHeader) + header.partCount * sizeof(StaticGeometryPart), 0);
+  
+  for (unsigned int i = 0; i < header.partCount; i++) {
+    const btIndexedMesh &mesh = m_geometry->getIndexedMeshArray()[i];
+    const btMaterialProperties *faceInfo = m_metadata->faceInfos(i);
+    StaticGeometryPart &part = parts[i];
+    part.triangleCount = mesh.m_numTriangles;
+    part.vertexCount = mesh.m_numVertices;
+    
+    // Vertices and indices are packed regardless of batching strides
+    part.vertexOffset = appendBlock(data, part.vertexCount * 12);
+    for (int v = 0; v < mesh.m_numVertices; v++)
+      memcpy(&data[part.vertexOffset + v*12], mesh.m_vertexBase + v * mesh.m_vertexStride, 12);
+    
+    part.indexOffset = appendBlock(data, part.triangleCount * 12);
+    for (int t = 0; t < mesh.m_numTriangles; t++)
+      memcpy(&data[part.indexOffset + t*12], mesh.m_triangleIndexBase + t * mesh.m_triangleIndexStride, 12);
+    
+    part.faceInfoOffset = appendBlock(data, part.triangleCount * sizeof(GeometryMetadata::FaceInfo));
+    if (part.triangleCount)
+      memcpy(&data[part.faceInfoOffset], faceInfo->m_materialBase, part.triangleCount * sizeof(GeometryMetadata::FaceInfo));
+    
+    part.faceIndexOffset = appendBlock(data, part.triangleCount * sizeof(int));
+    if (part.triangleCount)
+      memcpy(&data[part.faceIndexOffset], faceInfo->m_triangleMaterialsBase, part.triangleCount * sizeof(int));
+  }
+  
+  // Serialize the optimized BVH (this needs an aligned buffer)
+  btOptimizedBvh *bvh = m_shape->getOptimizedBvh();
+  header.bvhSize = bvh->calculateSerializeBufferSize();
+  void *buffer = btAlignedAlloc(header.bvhSize, STATIC_GEOMETRY_ALIGNMENT);
+  bool serialized = bvh->serialize(buffer, header.bvhSize, false);
+  header.bvhOffset = appendBlock(data, header.bvhSize);
+  memcpy(&data[header.bvhOffset], buffer, header.bvhSize);
+  btAlignedFree(buffer);
+  
+  if (!serialized) {
+    m_logger->warning("Unable to serialize static geometry BVH for '" + name + "'!");
+    return;
+  }
+  
+  memcpy(&data[0], &header, sizeof(header));
+  if (header.partCount)
+    memcpy(&data[sizeof(header)], &parts[0], header.partCount * sizeof(StaticGeometryPart));
+  
+  // Write into a temporary file first so a partially written file is never
+  // picked up by the loader
+  std::string path = filename(name);
+  std::string tmpPath = path + ".tmp";
+  
+  try {
+    fs::create_directories(m_directory);
+  } catch (fs::filesystem_error &e) {
+    m_logger->warning("Unable to create static geometry cache directory '" + m_directory + "'!");
+    return;
+  }
+  
+  std::ofstream out(tmpPath.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out) {
+    m_logger->warning("Unable to write static geometry cache file '" + tmpPath + "'!");
+    return;
+  }
+  
+  out.write((const char*) &data[0], data.size());
+  out.close();
+  if (!out || rename(tmpPath.c_str(), path.c_str()) != 0) {
+    m_logger->warning("Unable to write static geometry cache file '" + path + "'!");
+    remove(tmpPath.c_str());
+    return;
+  }
+  
+  m_logger->info(str(format("Baked static geometry '%s' (%d parts, %d bytes).") % name % header.partCount % data.size()));
+}
+
+}
@@ -0,0 +1,264 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "storage/archive.h"
+
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <string.h>
+#include <stdio.h>
+
+// zlib for entry compression
+#include <zlib.h>
+
+// Archive identification; the version must be incremented whenever the
+// layout changes
+#define ARCHIVE_MAGIC 0x50444949
+#define ARCHIVE_VERSION 1
+
+// Alignment of payloads inside the archive
+#define ARCHIVE_ALIGNMENT 16
+
+namespace IID {
+
+/**
+ * Archive file header.
+ */
+struct ArchiveHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int entryCount;
+    unsigned int pathTableSize;
+    unsigned long long indexOffset;
+};
+
+/**
+ * Orders index entries by path hash.
+ */
+struct ArchiveEntryLess {
+    bool operator()(const ArchiveEntry &a, const ArchiveEntry &b) const
+    {
+      return a.hash < b.hash;
+    }
+    
+    bool operator()(const ArchiveEntry &a, unsigned long long hash) const
+    {
+      return a.hash < hash;
+    }
+    
+    bool operator()(unsigned long long hash, const ArchiveEntry &b) const
+    {
+      return hash < b.hash;
+    }
+};
+
+/**
+ * Returns the number of padding bytes needed after a block of the given
+ * size to keep the next block aligned.
+ */
+inline size_t alignmentPadding(size_t size)
+{
+  return (ARCHIVE_ALIGNMENT - size % ARCHIVE_ALIGNMENT) % ARCHIVE_ALIGNMENT;
+}
+
+Archive::Archive()
+  : m_entries(0),
+    m_entryCount(0),
+    m_paths(0)
+{
+}
+
+unsigned long long Archive::hashPath(const std::string &path)
+{
+  // 64-bit FNV-1a
+  unsigned long long hash = 14695981039346656037ULL;
+  for (std::string::const_iterator i = path.begin(); i != path.end(); i++) {
+    hash ^= (unsigned char) *i;
+    hash *= 1099511628211ULL;
+  }
+  
+  return hash;
+}
+
+bool Archive::mount(const std::string &filename)
+{
+  m_entries = 0;
+  m_entryCount = 0;
+  m_paths = 0;
+  
+  if (!m_file.open(filename))
+    return false;
+  
+  // Validate header and make sure the index lies within the file
+  const ArchiveHeader *header = reinterpret_cast<const ArchiveHeader*>(m_file.data());
+  size_t size = m_file.size();
+  if (size < sizeof(ArchiveHeader) || header->magic != ARCHIVE_MAGIC || header->version != ARCHIVE_VERSION ||
+      header->indexOffset > size ||
+      (size - header->indexOffset) / sizeof(ArchiveEntry) < header->entryCount ||
+      size - header->indexOffset - header->entryCount * sizeof(ArchiveEntry) < header->pathTableSize) {
+    m_file.close();
+    return false;
+  }
+  
+  const ArchiveEntry *entries = reinterpret_cast<const ArchiveEntry*>(m_file.data() + header->indexOffset);
+  for (unsigned int i = 0; i < header->entryCount; i++) {
+    const ArchiveEntry &entry = entries[i];
+    if (entry.offset > size || size - entry.offset < entry.size ||
+        entry.pathOffset > header->pathTableSize || header->pathTableSize - entry.pathOffset < entry.pathLength) {
+      m_file.close();
+      return false;
+    }
+  }
+  
+  m_entries = entries;
+  m_entryCount = header->entryCount;
+  m_paths = reinterpret_cast<const char*>(entries + header->entryCount);
+  return true;
+}
+
+const ArchiveEntry *Archive::find(const std::string &path) const
+{
+  if (!m_entries)
+    return 0;
+  
+  // Entries with equal hashes are checked against the stored path
+  std::pair<const ArchiveEntry*, const ArchiveEntry*> range = std::equal_range(
+    m_entries, m_entries + m_entryCount, hashPath(path), ArchiveEntryLess()
+  );
+  
+  for (const ArchiveEntry *entry = range.first; entry != range.second; entry++) {
+    if (entry->pathLength == path.size() && memcmp(m_paths + entry->pathOffset, path.data(), path.size()) == 0)
+      return entry;
+  }
+  
+  return 0;
+}
+
+bool Archive::contains(const std::string &path) const
+{
+  return find(path) != 0;
+}
+
+bool Archive::read(const std::string &path, std::vector<unsigned char> &buffer, const unsigned char *&data, size_t &size) const
+{
+  const ArchiveEntry *entry = find(path);
+  if (!entry)
+    return false;
+  
+  if (entry->size == entry->rawSize) {
+    data = m_file.data() + entry->offset;
+    size = entry->size;
+    return true;
+  }
+  
+  // Compressed entry
+  uLongf length = entry->rawSize;
+  buffer.resize(entry->rawSize);
+  if (uncompress(&buffer[0], &length, m_file.data() + entry->offset, entry->size) != Z_OK || length != entry->rawSize)
+    return false;
+  
+  data = &buffer[0];
+  size = buffer.size();
+  return true;
+}
+
+ArchiveWriter::ArchiveWriter()
+{
+}
+
+void ArchiveWriter::add(const std::string &path, const std::vector<unsigned char> &data, bool compress)
+{
+  PendingEntry *entry = 0;
+  BOOST_FOREACH(PendingEntry &existing, m_entries) {
+    if (existing.path == path)
+      entry = &existing;
+  }
+  
+  if (!entry) {
+    m_entries.resize(m_entries.size() + 1);
+    entry = &m_entries.back();
+    entry->path = path;
+  }
+  
+  entry->data = data;
+  entry->rawSize = data.size();
+  
+  if (compress && !data.empty()) {
+    // Only keep the compressed payload when it is actually smaller
+    uLongf length = compressBound(data.size());
+    std::vector<unsigned char> compressed(length);
+    if (compress2(&compressed[0], &length, &data[0], data.size(), Z_BEST_COMPRESSION) == Z_OK && length < data.size()) {
+      compressed.resize(length);
+      entry->data.swap(compressed);
+    }
+  }
+}
+
+bool ArchiveWriter::write(const std::string &filename) const
+{
+  std::vector<ArchiveEntry> index;
+  std::string paths;
+  unsigned long long offset = sizeof(ArchiveHeader) + alignmentPadding(sizeof(ArchiveHeader));
+  
+  // Lay out payloads
+  BOOST_FOREACH(const PendingEntry &pending, m_entries) {
+    ArchiveEntry entry;
+    entry.hash = Archive::hashPath(pending.path);
+    entry.offset = offset;
+    entry.size = pending.data.size();
+    entry.rawSize = pending.rawSize;
+    entry.pathOffset = paths.size();
+    entry.pathLength = pending.path.size();
+    index.push_back(entry);
+    
+    paths += pending.path;
+    offset += entry.size + alignmentPadding(entry.size);
+  }
+  
+  std::sort(index.begin(), index.end(), ArchiveEntryLess());
+  
+  ArchiveHeader header;
+  header.magic = ARCHIVE_MAGIC;
+  header.version = ARCHIVE_VERSION;
+  header.entryCount = index.size();
+  header.pathTableSize = paths.size();
+  header.indexOffset = offset;
+  
+  // Write into a temporary file first so a mounted archive is never
+  // replaced by a partially written one
+  std::string tmpFilename = filename + ".tmp";
+  std::ofstream out(tmpFilename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out)
+    return false;
+  
+  std::vector<char> padding(ARCHIVE_ALIGNMENT, 0);
+  out.write((const char*) &header, sizeof(header));
+  out.write(&padding[0], alignmentPadding(sizeof(header)));
+  
+  BOOST_FOREACH(const PendingEntry &pending, m_entries) {
+    if (!pending.data.empty())
+      out.write((const char*) &pending.data[0], pending.data.size());
+    
+    out.write(&padding[0], alignmentPadding(pending.data.size()));
+  }
+  
+  if (!index.empty())
+    out.write((const char*) &index[0], index.size() * sizeof(ArchiveEntry));
+  
+  out.write(paths.data(), paths.size());
+  out.close();
+  
+  if (!out || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    remove(tmpFilename.c_str());
+    return false;
+  }
+  
+  return true;
+}
+
+}
@@ -16,6 +16,27 @@ namespace fs = boost::filesystem;
 
 namespace IID {
 
+std::string resolveFilePath(Item *item, const std::string &path)
+{
+  fs::path result(path);
+  Item *x = item->parent();
+  while (x) {
+    result = fs::path(x->getPath()) / result;
+    x = x->parent();
+  }
+  
+  return result.string();
+}
+
+std::string storagePath(Item *item)
+{
+  std::string path = item->getId();
+  for (Item *x = item->parent(); x && x->parent(); x = x->parent())
+    path = x->getId() + "/" + path;
+  
+  return path;
+}
+
 void argumentLoadFile(Storage *storage, Item *item, StringMap arguments)
 {
   if (arguments.find("loader") == arguments.end())
@@ -28,15 +49,16 @@ void argumentLoadFile(Storage *storage, Item *item, StringMap arguments)
   if (!importer)
     throw Exception("No importer named '" + arguments["loader"] + "' can be found!");
   
-  // Determine object path
-  fs::path path(arguments["path"]);
-  Item *x = item->parent();
-  while (x) {
-    path = fs::path(x->getPath()) / path;
-    x = x->parent();
-  }
+  // Files are imported once the whole manifest has been processed
+  storage->queueLoad(item, importer, resolveFilePath(item, arguments["path"]));
+}
+
+void argumentDepends(Storage *storage, Item *item, StringMap arguments)
+{
+  if (arguments.find("item") == arguments.end())
+    throw Exception("Missing 'item' parameter for depends!");
   
-  importer->load(storage, item, path.string());
+  storage->addDependency(item, arguments["item"]);
 }
 
 void argumentAttribute(Storage *storage, Item *item, StringMap arguments)
@@ -0,0 +1,73 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "storage/geometry.h"
+
+#include <boost/functional/hash.hpp>
+
+#include <string.h>
+
+namespace IID {
+
+const int Geometry::VertexStride;
+const int Geometry::IndexStride;
+
+Geometry::Geometry(int vertexCount, int indexCount)
+  : m_vertexCount(vertexCount),
+    m_indexCount(indexCount),
+    m_positions(new float[3 * vertexCount]),
+    m_indices(new unsigned int[indexCount])
+{
+}
+
+GeometryPtr Geometry::fromRecords(int vertexCount, int indexCount, const unsigned char *records,
+                                  int recordStride, const unsigned int *indices)
+{
+  Geometry *geometry = new Geometry(vertexCount, indexCount);
+  float *positions = geometry->positions();
+  for (int i = 0; i < vertexCount; i++)
+    memcpy(positions + 3*i, records + i*recordStride, VertexStride);
+  
+  memcpy(geometry->indices(), indices, indexCount * IndexStride);
+  return GeometryPtr(geometry);
+}
+
+GeometryPtr Geometry::transformed(const Transform3f &transform) const
+{
+  Geometry *geometry = new Geometry(m_vertexCount, 0);
+  geometry->m_indexCount = m_indexCount;
+  geometry->m_indices = m_indices;
+  
+  float *positions = geometry->positions();
+  for (int i = 0; i < m_vertexCount; i++) {
+    Vector3f p = transform * Vector3f(position(i));
+    positions[3*i] = p[0];
+    positions[3*i + 1] = p[1];
+    positions[3*i + 2] = p[2];
+  }
+  
+  return GeometryPtr(geometry);
+}
+
+size_t Geometry::hash() const
+{
+  // Positions are hashed by their bit patterns, which is much faster than
+  // hashing floats
+  const unsigned int *positions = reinterpret_cast<const unsigned int*>(m_positions.get());
+  size_t seed = 0;
+  boost::hash_combine(seed, m_vertexCount);
+  boost::hash_combine(seed, m_indexCount);
+  boost::hash_range(seed, positions, positions + 3 * m_vertexCount);
+  boost::hash_range(seed, m_indices.get(), m_indices.get() + m_indexCount);
+  return seed;
+}
+
+size_t Geometry::memoryUsage() const
+{
+  return m_vertexCount * VertexStride + m_indexCount * IndexStride;
+}
+
+}
@@ -6,149 +6,262 @@
  */
 #include "storage/importers/3ds.h"
 #include "storage/storage.h"
+#include "mappedfile.h"
 #include "logger.h"
 
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+
 #include <list>
-#include <stdio.h>
+#include <string.h>
+
+// 3DS chunk identifiers
+#define CHUNK_MAIN 0x4d4d
+#define CHUNK_EDITOR 0x3d3d
+#define CHUNK_OBJECT 0x4000
+#define CHUNK_TRIMESH 0x4100
+#define CHUNK_VERTICES 0x4110
+#define CHUNK_FACES 0x4120
+#define CHUNK_TEXCOORDS 0x4140
+
+// Size of a chunk header (identifier and length)
+#define CHUNK_HEADER_SIZE 6
+
+using boost::format;
 
 namespace IID {
 
+/**
+ * Iterates over consecutive 3DS chunks inside a block of the mapped
+ * file. Every chunk header stores the length of the whole chunk, so
+ * chunks are skipped without looking at their contents.
+ */
+class ThreeDSChunkReader {
+public:
+    ThreeDSChunkReader(const unsigned char *begin, const unsigned char *end)
+      : m_position(begin),
+        m_end(end),
+        m_malformed(false)
+    {}
+    
+    /**
+     * Advances to the next chunk.
+     *
+     * @param id Chunk identifier
+     * @param data Start of chunk data (after the header)
+     * @param end End of chunk data
+     * @return True if there is another chunk
+     */
+    bool next(unsigned short &id, const unsigned char *&data, const unsigned char *&end)
+    {
+      if (m_position == m_end)
+        return false;
+      
+      // Fields may be unaligned, so they are copied out
+      unsigned int length;
+      if (m_end - m_position < CHUNK_HEADER_SIZE) {
+        m_malformed = true;
+        return false;
+      }
+      
+      memcpy(&id, m_position, 2);
+      memcpy(&length, m_position + 2, 4);
+      if (length < CHUNK_HEADER_SIZE || length > (size_t) (m_end - m_position)) {
+        m_malformed = true;
+        return false;
+      }
+      
+      data = m_position + CHUNK_HEADER_SIZE;
+      end = m_position + length;
+      m_position = end;
+      return true;
+    }
+    
+    /**
+     * Returns true if a chunk header was invalid.
+     */
+    bool malformed() const { return m_malformed; }
+private:
+    const unsigned char *m_position;
+    const unsigned char *m_end;
+    bool m_malformed;
+};
+
 ThreeDSMeshImporter::ThreeDSMeshImporter(Context *context)
   : MeshImporter(context)
 {
 }
 
-void ThreeDSMeshImporter::load(Storage *storage, Item *item, const std::string &filename)
+bool ThreeDSMeshImporter::parse(Item *item, const std::string &filename, std::list<SubmeshObject*> &objects)
 {
   if (item->getType() != "Mesh" && item->getType() != "CompositeMesh") {
     m_logger->error("3DS files can only be imported into Mesh/CompositeMesh items!");
-    return;
+    return false;
   }
   
-  FILE *f = fopen(filename.c_str(), "rb");
-  if (!f) {
+  MappedFile file;
+  if (!file.open(filename)) {
     m_logger->error("Unable to open 3DS file '" + filename + "'!");
-    return;
+    return false;
   }
   
-  // Should only the first object be imported or should all be imported
-  bool composite = item->getType() == "CompositeMesh";
-  
-  // Determine file size
-  int fileSize;
-  fseek(f, 0, SEEK_END);
-  fileSize = ftell(f);
-  rewind(f);
+  // Traverse the 3DS chunk tree and parse out stuff
+  std::list<SubmeshObject*> parsed;
+  if (!parseChunks(file.data(), file.data() + file.size(), "", 0, parsed)) {
+    m_logger->warning("3DS file '" + filename + "' is malformed!");
+    
+    BOOST_FOREACH(SubmeshObject *obj, parsed) {
+      delete[] obj->vertices;
+      delete[] obj->tex;
+      delete[] obj->indices;
+      delete obj;
+    }
+    return false;
+  }
   
-  // Traverse the 3DS hierarchy and parse out stuff
+  objects.splice(objects.end(), parsed);
+  return true;
+}
+
+bool ThreeDSMeshImporter::parseChunks(const unsigned char *begin, const unsigned char *end, const std::string &name,
+                                      SubmeshObject *obj, std::list<SubmeshObject*> &objects) const
+{
+  ThreeDSChunkReader reader(begin, end);
   unsigned short chunkId;
-  unsigned int chunkLength;
-  unsigned short vertexCount;
-  unsigned short faceCount;
-  float *vertices = 0;
-  float *tex = 0;
-  unsigned int *indices = 0;
-  std::list<SubmeshObject*> objects;
-  SubmeshObject *obj;
+  const unsigned char *data;
+  const unsigned char *dataEnd;
   
-  while (ftell(f) < fileSize) {
-    fread(&chunkId, 2, 1, f);
-    fread(&chunkLength, 4, 1, f);
+  while (reader.next(chunkId, data, dataEnd)) {
+    size_t length = dataEnd - data;
     
     // Check chunk type
     switch (chunkId) {
-      case 0x4d4d: {
-        // Skip main chunk header
-        break;
-      }
-      case 0x3d3d: {
-        // Skip 3D editor chunk header
+      case CHUNK_MAIN:
+      case CHUNK_EDITOR: {
+        // Descend into main and 3D editor chunks
+        if (!parseChunks(data, dataEnd, name, obj, objects))
+          return false;
         break;
       }
-      case 0x4000: {
-        // Object chunk - parse object name and create a new mesh object if needed
-        std::string objectId;
-        char ch;
-        do {
-          fread(&ch, 1, 1, f);
-          if (ch)
-            objectId.push_back(ch);
-        } while (ch);
+      case CHUNK_OBJECT: {
+        // Object chunk - the name is followed by subchunks
+        const unsigned char *nameEnd = (const unsigned char*) memchr(data, 0, length);
+        if (!nameEnd)
+          return false;
         
+        std::string objectId((const char*) data, nameEnd - data);
         m_logger->info("Found object named '" + objectId + "' in 3DS file!");
         
-        obj = new SubmeshObject();
-        obj->name = objectId;
-        objects.push_back(obj);
+        if (!parseChunks(nameEnd + 1, dataEnd, objectId, 0, objects))
+          return false;
         break;
       }
-      case 0x4100: {
-        // Skip triangular mesh chunk header
+      case CHUNK_TRIMESH: {
+        // Only objects that contain a triangular mesh become submeshes
+        SubmeshObject *mesh = new SubmeshObject();
+        mesh->name = name;
+        objects.push_back(mesh);
+        
+        if (!parseChunks(data, dataEnd, name, mesh, objects))
+          return false;
+        
+        // Meshes without vertices or faces are of no use
+        if (!mesh->vertexCount || !mesh->faceCount) {
+          m_logger->warning("Skipping object '" + name + "' without vertices or faces!");
+          objects.remove(mesh);
+          delete[] mesh->vertices;
+          delete[] mesh->tex;
+          delete[] mesh->indices;
+          delete mesh;
+          break;
+        }
+        
+        // Coordinates must match vertices one to one; this is checked here
+        // as the chunks may come in any order
+        if (mesh->tex && mesh->texCount != mesh->vertexCount) {
+          m_logger->warning(str(format("Ignoring %d texture coordinates for %d vertices of object '%s'!") % mesh->texCount % mesh->vertexCount % name));
+          delete[] mesh->tex;
+          mesh->tex = 0;
+        }
+        
+        if (!validateObject(mesh))
+          return false;
         break;
       }
-      case 0x4110: {
-        // Process vertex list
-        fread(&vertexCount, sizeof(unsigned short), 1, f);
-        vertices = new float[vertexCount * 3];
-        obj->vertexCount = vertexCount;
-        obj->vertices = vertices;
+      case CHUNK_VERTICES: {
+        // Process vertex list; records are three packed floats
+        unsigned short count;
+        if (!obj || obj->vertices || length < 2)
+          return false;
         
-        for (int i = 0; i < vertexCount; i++) {
-          fread(&vertices[i*3], sizeof(float), 1, f);
-          fread(&vertices[i*3 + 1], sizeof(float), 1, f);
-          fread(&vertices[i*3 + 2], sizeof(float), 1, f);
-        }
+        memcpy(&count, data, 2);
+        if (length - 2 < count * 12u)
+          return false;
+        
+        obj->vertexCount = count;
+        obj->vertices = new float[count * 3];
+        memcpy(obj->vertices, data + 2, count * 12);
         break;
       }
-      case 0x4120: {
-        // Process face list
-        unsigned short flags;
-        fread(&faceCount, sizeof(unsigned short), 1, f);
-        indices = new unsigned int[faceCount * 3];
-        obj->faceCount = faceCount;
-        obj->indices = indices;
+      case CHUNK_FACES: {
+        // Process face list; each face has three indices and a flags word
+        // and is followed by subchunks we have no use for
+        unsigned short count;
+        if (!obj || obj->indices || length < 2)
+          return false;
+        
+        memcpy(&count, data, 2);
+        if (length - 2 < count * 8u)
+          return false;
         
-        for (int i = 0; i < faceCount; i++) {
-          unsigned short a;
-          unsigned short b;
-          unsigned short c;
-          
-          fread(&a, sizeof(unsigned short), 1, f);
-          fread(&b, sizeof(unsigned short), 1, f);
-          fread(&c, sizeof(unsigned short), 1, f);
-          fread(&flags, sizeof(unsigned short), 1, f);
-          
-          indices[i*3] = a;
-          indices[i*3 + 1] = b;
-          indices[i*3 + 2] = c;
+        obj->faceCount = count;
+        obj->indices = new unsigned int[count * 3];
+        
+        const unsigned char *faces = data + 2;
+        for (int i = 0; i < count; i++) {
+          unsigned short face[4];
+          memcpy(face, faces + i*8, 8);
+          obj->indices[i*3] = face[0];
+          obj->indices[i*3 + 1] = face[1];
+          obj->indices[i*3 + 2] = face[2];
         }
         break;
       }
-      case 0x4140: {
-        // Process texture mapping data
-        fread(&vertexCount, sizeof(unsigned short), 1, f);
-        tex = new float[vertexCount * 2];
-        obj->tex = tex;
+      case CHUNK_TEXCOORDS: {
+        // Process texture mapping data; pairs of packed floats
+        unsigned short count;
+        if (!obj || obj->tex || length < 2)
+          return false;
         
-        for (int i = 0; i < vertexCount; i++) {
-          fread(&tex[i*2], sizeof(float), 1, f);
-          fread(&tex[i*2 + 1], sizeof(float), 1, f);
-        }
+        memcpy(&count, data, 2);
+        if (length - 2 < count * 8u)
+          return false;
+        
+        obj->texCount = count;
+        obj->tex = new float[count * 2];
+        memcpy(obj->tex, data + 2, count * 8);
         break;
       }
       default: {
-        // Unknown chunk, skip its header and data block
-        fseek(f, chunkLength - 6, SEEK_CUR);
+        // Unknown chunk, skip it
         break;
       }
     }
   }
   
-  fclose(f);
-  
-  // Perform submesh post-processing and generate storage items
-  postProcessSubmeshObjects(item, objects);
+  return !reader.malformed();
 }
 
+bool ThreeDSMeshImporter::validateObject(SubmeshObject *obj) const
+{
+  for (int i = 0; i < obj->faceCount * 3; i++) {
+    if (obj->indices[i] >= (unsigned int) obj->vertexCount) {
+      m_logger->warning("Object '" + obj->name + "' has faces referencing missing vertices!");
+      return false;
+    }
+  }
+  
+  return true;
 }
 
+}
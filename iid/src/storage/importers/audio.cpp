@@ -12,6 +12,8 @@
 
 #include <string>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 namespace IID {
 
@@ -48,4 +50,66 @@ void SoundImporter::load(Storage *storage, Item *item, const std::string &filena
     m_logger->info("Loaded sound: " + filename);
 }
 
+bool SoundImporter::compile(Item *item, const std::string &filename, std::vector<unsigned char> &data)
+{
+    if (item->getType() != "Sound") {
+        m_logger->error("Sounds can only be imported into Sound items!");
+        return false;
+    }
+    
+    // Decode the file into PCM samples; this requires ALUT to be initialized
+    ALenum format;
+    ALsizei size;
+    ALfloat frequency;
+    ALvoid *samples = alutLoadMemoryFromFile(filename.c_str(), &format, &size, &frequency);
+    if (!samples) {
+        m_logger->error("Unable to decode sound file '" + filename + "'!");
+        return false;
+    }
+    
+    // Header contains sample format, frequency and data size
+    unsigned int header[3];
+    header[0] = format;
+    header[1] = (unsigned int) frequency;
+    header[2] = size;
+    
+    data.resize(sizeof(header) + size);
+    memcpy(&data[0], header, sizeof(header));
+    memcpy(&data[sizeof(header)], samples, size);
+    free(samples);
+    return true;
+}
+
+void SoundImporter::loadCompiled(Storage *storage, Item *item, const unsigned char *data, size_t size)
+{
+    // Default type
+    std::string type = "Effect";
+    OpenALBuffer *buffer;
+    
+    if (item->getType() != "Sound") {
+        m_logger->error("Sounds can only be imported into Sound items!");
+        return;
+    }
+    
+    const unsigned int *header = reinterpret_cast<const unsigned int*>(data);
+    if (size < 12 || size - 12 < header[2]) {
+        m_logger->error("Invalid preprocessed sound data!");
+        return;
+    }
+    
+    Sound *sound = static_cast<Sound*>(item);
+    
+    // Try to get the sound type
+    if (item->hasAttribute("Sound.Type")) 
+    {
+        type = item->getAttribute("Sound.Type") ["value"];
+    }
+    
+    // Create the buffer directly from decoded samples
+    buffer = new OpenALBuffer("");
+    buffer->initFromData(header[0], data + 12, header[2], header[1]);
+    sound->setSoundBuffer(buffer);
+    sound->setType(type);
+}
+
 }
@@ -12,7 +12,7 @@ namespace IID {
 
 Importer::Importer(Context *context)
   : m_context(context),
-    m_logger(context->logger("iid.importer"))
+    m_logger(context ? context->logger("iid.importer") : new Logger("iid.importer"))
 {
 }
 
@@ -21,4 +21,19 @@ Importer::~Importer()
   delete m_logger;
 }
 
+bool Importer::compile(Item *item, const std::string &filename, std::vector<unsigned char> &data)
+{
+  return false;
+}
+
+bool Importer::prepare(Item *item, const std::string &filename, std::vector<unsigned char> &data, MappedFile &file)
+{
+  return compile(item, filename, data);
+}
+
+void Importer::loadCompiled(Storage *storage, Item *item, const unsigned char *data, size_t size)
+{
+  m_logger->error("This importer does not support preprocessed data!");
+}
+
 }
@@ -5,15 +5,19 @@
  * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
  */
 #include "storage/importers/collada.h"
+#include "storage/importers/xmlreader.h"
 #include "storage/storage.h"
+#include "mappedfile.h"
 #include "logger.h"
 
-// TinyXML parser
-#include "tinyxml/ticpp.h"
-
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
+#include <algorithm>
 #include <list>
-#include <stdio.h>
+#include <stdlib.h>
+
+using boost::format;
 
 namespace IID {
 
@@ -22,166 +26,319 @@ ColladaMeshImporter::ColladaMeshImporter(Context *context)
 {
 }
 
-void ColladaMeshImporter::load(Storage *storage, Item *item, const std::string &filename)
+bool ColladaMeshImporter::parse(Item *item, const std::string &filename, std::list<SubmeshObject*> &objects)
 {
   if (item->getType() != "CompositeMesh") {
     m_logger->error("COLLADA files can only be imported into CompositeMesh items!");
-    return;
+    return false;
+  }
+  
+  MappedFile file;
+  if (!file.open(filename)) {
+    m_logger->error("Unable to open specified COLLADA model!");
+    return false;
   }
   
-  // List of final parsed meshes
-  std::list<SubmeshObject*> objects;
+  // Stream through the document; only geometries are of interest
+  const char *data = (const char*) file.data();
+  XmlReader reader(data, data + file.size());
+  XmlReader::Token token;
+  std::list<SubmeshObject*> parsed;
   int objectIdx = 0;
   
-  try {
-    ticpp::Document collada(filename.c_str());
-    collada.LoadFile();
-    std::string version;
+  while ((token = reader.next()) == XmlReader::Text) {}
+  if (token != XmlReader::StartElement || reader.name() != "COLLADA") {
+    m_logger->error("Not a valid COLLADA file format!");
+    return false;
+  }
+  
+  if (reader.attribute("version") != "1.4.1") {
+    m_logger->error("Unsupported COLLADA format version!");
+    return false;
+  }
+  
+  bool valid = true;
+  for (;;) {
+    token = reader.next();
+    if (token == XmlReader::EndOfDocument)
+      break;
+    
+    if (token == XmlReader::Error) {
+      m_logger->warning("COLLADA file '" + filename + "' is malformed!");
+      valid = false;
+      break;
+    }
+    
+    if (token != XmlReader::StartElement)
+      continue;
     
-    if (collada.FirstChildElement()->Value() != "COLLADA") {
-      m_logger->error("Not a valid COLLADA file format!");
-      return;
+    if (reader.name() == "geometry") {
+      if (!parseGeometry(reader, objectIdx, parsed)) {
+        m_logger->warning("Invalid geometry in COLLADA file '" + filename + "'!");
+        valid = false;
+        break;
+      }
+    } else if (reader.depth() == 2 && reader.name() != "library_geometries") {
+      // Skip everything else (scenes, materials, animations ...)
+      if (!reader.skipElement()) {
+        m_logger->warning("COLLADA file '" + filename + "' is malformed!");
+        valid = false;
+        break;
+      }
     }
+  }
+  
+  // Partially parsed files must not end up in the mesh cache
+  if (!valid) {
+    BOOST_FOREACH(SubmeshObject *obj, parsed) {
+      delete[] obj->indices;
+      delete[] obj->vertices;
+      delete[] obj->normals;
+      delete[] obj->tex;
+      delete obj;
+    }
+    return false;
+  }
+  
+  // Triangle corners are emitted separately, so shared vertices must be
+  // merged to get a real index list
+  float tolerance = 0;
+  if (item->hasAttribute("Mesh.WeldTolerance"))
+    tolerance = boost::lexical_cast<float>(item->getAttribute("Mesh.WeldTolerance")["value"]);
+  
+  int cornerCount = 0;
+  int vertexCount = 0;
+  BOOST_FOREACH(SubmeshObject *obj, parsed) {
+    cornerCount += obj->vertexCount;
+    weldVertices(obj, tolerance);
+    vertexCount += obj->vertexCount;
+  }
+  
+  m_logger->info(str(format("Welded %d triangle corners into %d vertices.") % cornerCount % vertexCount));
+  objects.splice(objects.end(), parsed);
+  return true;
+}
+
+bool ColladaMeshImporter::parseGeometry(XmlReader &reader, int &objectIdx, std::list<SubmeshObject*> &objects) const
+{
+  boost::unordered_map<std::string, Source> sources;
+  boost::unordered_map<std::string, std::vector<Input> > vertices;
+  
+  // Current source, vertices and triangles state
+  std::string sourceId;
+  std::string verticesId;
+  bool inTriangles = false;
+  int faceCount = 0;
+  std::vector<Input> inputs;
+  std::vector<unsigned int> primitives;
+  int depth = reader.depth();
+  
+  for (;;) {
+    XmlReader::Token token = reader.next();
+    if (token == XmlReader::EndOfDocument || token == XmlReader::Error)
+      return false;
+    
+    if (token == XmlReader::EndElement) {
+      if (reader.depth() < depth)
+        return true;
+      
+      if (reader.name() == "source") {
+        sourceId.clear();
+      } else if (reader.name() == "vertices") {
+        verticesId.clear();
+      } else if (reader.name() == "triangles") {
+        // Create the object once all inputs and indices are known
+        std::string name = "object" + boost::lexical_cast<std::string>(objectIdx++);
+        SubmeshObject *obj = createObject(name, faceCount, inputs, primitives, sources, vertices);
+        if (!obj)
+          return false;
+        
+        objects.push_back(obj);
+        inTriangles = false;
+        inputs.clear();
+        primitives.clear();
+      }
+      continue;
+    }
+    
+    if (token != XmlReader::StartElement)
+      continue;
     
-    collada.FirstChildElement()->GetAttribute("version", &version);
-    if (version != "1.4.1") {
-      m_logger->error("Unsupported COLLADA format version!");
-      return;
+    const std::string &name = reader.name();
+    if (name == "source") {
+      sourceId = reader.attribute("id");
+      sources[sourceId].stride = 1;
+    } else if (name == "float_array" && !sourceId.empty()) {
+      // Numbers are parsed straight from the document into the array
+      int count = atoi(reader.attribute("count", "0").c_str());
+      Source &source = sources[sourceId];
+      source.data.resize(count);
+      
+      if (count > 0) {
+        if (reader.next() != XmlReader::Text || readFloats(reader.textBegin(), reader.textEnd(), &source.data[0], count) != count) {
+          m_logger->warning("Source '" + sourceId + "' has fewer values than declared!");
+          return false;
+        }
+      }
+    } else if (name == "accessor" && !sourceId.empty()) {
+      sources[sourceId].stride = std::max(1, atoi(reader.attribute("stride", "1").c_str()));
+    } else if (name == "vertices") {
+      verticesId = reader.attribute("id");
+      vertices[verticesId].clear();
+    } else if (name == "triangles") {
+      inTriangles = true;
+      faceCount = atoi(reader.attribute("count", "0").c_str());
+    } else if (name == "input" && (inTriangles || !verticesId.empty())) {
+      Input input;
+      input.semantic = reader.attribute("semantic");
+      input.source = reader.attribute("source");
+      input.offset = atoi(reader.attribute("offset", "0").c_str());
+      if (!input.source.empty() && input.source[0] == '#')
+        input.source.erase(0, 1);
+      
+      if (inTriangles)
+        inputs.push_back(input);
+      else
+        vertices[verticesId].push_back(input);
+    } else if (name == "p" && inTriangles) {
+      // Each triangle corner has one index per input offset
+      int stride = 0;
+      BOOST_FOREACH(const Input &input, inputs) {
+        stride = std::max(stride, input.offset + 1);
+      }
+      
+      int count = faceCount * 3 * stride;
+      primitives.resize(count);
+      if (count > 0) {
+        if (reader.next() != XmlReader::Text || readIndices(reader.textBegin(), reader.textEnd(), &primitives[0], count) != count) {
+          m_logger->warning("Triangle list has fewer indices than declared!");
+          return false;
+        }
+      }
+    } else if (name == "polylist" || name == "polygons" || name == "tristrips" || name == "trifans") {
+      m_logger->warning("Skipping unsupported COLLADA primitive '" + name + "'!");
+      if (!reader.skipElement())
+        return false;
     }
+  }
+}
+
+SubmeshObject *ColladaMeshImporter::createObject(const std::string &name, int faceCount, const std::vector<Input> &inputs,
+                                                 const std::vector<unsigned int> &primitives,
+                                                 const boost::unordered_map<std::string, Source> &sources,
+                                                 const boost::unordered_map<std::string, std::vector<Input> > &vertices) const
+{
+  // Resolve sources of positions, normals and the first texture coordinate set
+  const Source *position = 0;
+  const Source *normal = 0;
+  const Source *texcoord = 0;
+  int positionOffset = 0;
+  int normalOffset = 0;
+  int texcoordOffset = 0;
+  int stride = 0;
+  
+  BOOST_FOREACH(const Input &input, inputs) {
+    stride = std::max(stride, input.offset + 1);
     
-    // Parse out geometries
-    ticpp::Iterator<ticpp::Element> child;
-    for (child = child.begin(collada.FirstChildElement()); child != child.end(); child++) {
-      if ((*child).Value() == "library_geometries") {
-        // Handle each geometry
-        ticpp::Iterator<ticpp::Element> geom;
-        for (geom = geom.begin(&*child); geom != geom.end(); geom++) {
-          if ((*geom).Value() == "geometry") {
-            float *vertices = 0;
-            int vertexCount;
-            float *normals = 0;
-            int normalCount;
-            float *tex = 0;
-            int texCount;
-            
-            // Handle subcomponents (sources and faces)
-            ticpp::Iterator<ticpp::Element> subcomp;
-            for (subcomp = subcomp.begin((*geom).FirstChild()); subcomp != subcomp.end(); subcomp++) {
-              if ((*subcomp).Value() == "source") {
-                // It is a source, determine what kind of source (this is actually hack since mappings
-                // are actually specified lower in the COLLADA file, but it will do for SketchUp exported files)
-                std::string id = (*subcomp).GetAttributeOrDefault("id", "");
-                int count = boost::lexical_cast<int>((*subcomp).FirstChild()->ToElement()->GetAttributeOrDefault("count", "0"));
-                
-                if (id.find("-position") != std::string::npos) {
-                  // Vertex definition
-                  vertices = new float[count];
-                  std::string data = (*subcomp).FirstChild()->ToElement()->GetText();
-                  size_t pos = -1;
-                  
-                  for (int i = 0; i < count; i++) {
-                    size_t oldp = pos + 1;
-                    pos = data.find(' ', pos + 1);
-                    vertices[i] = boost::lexical_cast<float>(data.substr(oldp, pos - oldp));
-                  }
-                  
-                  vertexCount = count / 3;
-                } else if (id.find("-normal") != std::string::npos) {
-                  // Normal definition
-                  normals = new float[count];
-                  std::string data = (*subcomp).FirstChild()->ToElement()->GetText();
-                  size_t pos = -1;
-                  
-                  for (int i = 0; i < count; i++) {
-                    size_t oldp = pos + 1;
-                    pos = data.find(' ', pos + 1);
-                    normals[i] = boost::lexical_cast<float>(data.substr(oldp, pos - oldp));
-                  }
-                  
-                  normalCount = count / 3;
-                } else if (id.find("-uv") != std::string::npos) {
-                  // Texture coordinate mappings
-                  tex = new float[count];
-                  std::string data = (*subcomp).FirstChild()->ToElement()->GetText();
-                  size_t pos = -1;
-                  
-                  for (int i = 0; i < count; i++) {
-                    size_t oldp = pos + 1;
-                    pos = data.find(' ', pos + 1);
-                    tex[i] = boost::lexical_cast<float>(data.substr(oldp, pos - oldp));
-                  }
-                  
-                  texCount = count / 2;
-                }
-              } else if ((*subcomp).Value() == "triangles") {
-                // Face definitions per-material
-                int faceCount = boost::lexical_cast<int>((*subcomp).GetAttributeOrDefault("count", "0"));
-                bool hasTextures = false;
-                
-                // Create an object
-                SubmeshObject *obj = new SubmeshObject();
-                obj->name = "object" + boost::lexical_cast<std::string>(objectIdx++);
-                obj->faceCount = faceCount;
-                obj->indices = new unsigned int[faceCount * 3];
-                obj->vertexCount = faceCount * 3;
-                obj->vertices = new float[obj->vertexCount * 3];
-                obj->normals = new float[obj->vertexCount * 3];
-                obj->tex = new float[obj->vertexCount * 3];
-                objects.push_back(obj);
-                
-                ticpp::Iterator<ticpp::Element> tri;
-                for (tri = tri.begin(&*subcomp); tri != tri.end(); tri++) {
-                  if ((*tri).Value() == "input") {
-                    if ((*tri).GetAttributeOrDefault("semantic", "") == "TEXCOORD")
-                      hasTextures = true;
-                  } else if ((*tri).Value() == "p") {
-                    std::stringstream ss((*tri).GetText());
-                    int idx;
-                    
-                    // An array of stuff
-                    for (int vidx = 0; vidx < faceCount * 3; vidx++) {
-                      // Vertex
-                      ss >> idx;
-                      obj->vertices[3*vidx] = vertices[3*idx];
-                      obj->vertices[3*vidx + 1] = vertices[3*idx + 1];
-                      obj->vertices[3*vidx + 2] = vertices[3*idx + 2];
-                      
-                      // Normal
-                      ss >> idx;
-                      obj->normals[3*vidx] = normals[3*idx];
-                      obj->normals[3*vidx + 1] = normals[3*idx + 1];
-                      obj->normals[3*vidx + 2] = normals[3*idx + 2];
-                      
-                      // Texture coordinates
-                      if (hasTextures) {
-                        ss >> idx;
-                        obj->tex[2*vidx] = tex[2*idx];
-                        obj->tex[2*vidx + 1] = tex[2*idx + 1];
-                      }
-                      
-                      obj->indices[vidx] = vidx;
-                    }
-                  }
-                }
-              }
-            }
-            
-            // Free stuff
-            delete vertices;
-            delete normals;
-            delete tex;
-          }
+    if (input.semantic == "VERTEX" && vertices.find(input.source) != vertices.end()) {
+      // Vertices may carry normals as well
+      BOOST_FOREACH(const Input &vertexInput, vertices.at(input.source)) {
+        if (sources.find(vertexInput.source) == sources.end())
+          continue;
+        
+        if (vertexInput.semantic == "POSITION") {
+          position = &sources.at(vertexInput.source);
+          positionOffset = input.offset;
+        } else if (vertexInput.semantic == "NORMAL" && !normal) {
+          normal = &sources.at(vertexInput.source);
+          normalOffset = input.offset;
         }
       }
+    } else if (sources.find(input.source) == sources.end()) {
+      continue;
+    } else if (input.semantic == "NORMAL") {
+      normal = &sources.at(input.source);
+      normalOffset = input.offset;
+    } else if (input.semantic == "TEXCOORD" && !texcoord) {
+      texcoord = &sources.at(input.source);
+      texcoordOffset = input.offset;
     }
-  } catch (ticpp::Exception &e) {
-    // Failed to open collada file or parse error
-    m_logger->error("Unable to open specified COLLADA model!");
   }
   
-  // Perform submesh post-processing and generate storage items
-  postProcessSubmeshObjects(item, objects);
+  if (primitives.size() < (size_t) faceCount * 3 * stride) {
+    m_logger->warning("Triangles of object '" + name + "' have no index list!");
+    return 0;
+  }
+  
+  if (!position || position->stride < 3 || (normal && normal->stride < 3) || (texcoord && texcoord->stride < 2)) {
+    m_logger->warning("Triangles of object '" + name + "' have no usable positions!");
+    return 0;
+  }
+  
+  SubmeshObject *obj = new SubmeshObject();
+  obj->name = name;
+  obj->faceCount = faceCount;
+  obj->vertexCount = faceCount * 3;
+  obj->indices = new unsigned int[faceCount * 3];
+  obj->vertices = new float[obj->vertexCount * 3];
+  obj->normals = normal ? new float[obj->vertexCount * 3] : 0;
+  obj->tex = texcoord ? new float[obj->vertexCount * 2] : 0;
+  
+  // Missing normals are computed during post-processing
+  size_t positionCount = position->data.size() / position->stride;
+  size_t normalCount = normal ? normal->data.size() / normal->stride : 0;
+  size_t texcoordCount = texcoord ? texcoord->data.size() / texcoord->stride : 0;
+  
+  for (int vidx = 0; vidx < obj->vertexCount; vidx++) {
+    const unsigned int *corner = &primitives[vidx * stride];
+    
+    // Vertex
+    unsigned int idx = corner[positionOffset];
+    bool valid = idx < positionCount;
+    if (valid) {
+      const float *v = &position->data[idx * position->stride];
+      obj->vertices[3*vidx] = v[0];
+      obj->vertices[3*vidx + 1] = v[1];
+      obj->vertices[3*vidx + 2] = v[2];
+    }
+    
+    // Normal
+    if (normal) {
+      idx = corner[normalOffset];
+      valid = valid && idx < normalCount;
+      if (valid) {
+        const float *n = &normal->data[idx * normal->stride];
+        obj->normals[3*vidx] = n[0];
+        obj->normals[3*vidx + 1] = n[1];
+        obj->normals[3*vidx + 2] = n[2];
+      }
+    }
+    
+    // Texture coordinates
+    if (texcoord) {
+      idx = corner[texcoordOffset];
+      valid = valid && idx < texcoordCount;
+      if (valid) {
+        const float *t = &texcoord->data[idx * texcoord->stride];
+        obj->tex[2*vidx] = t[0];
+        obj->tex[2*vidx + 1] = t[1];
+      }
+    }
+    
+    if (!valid) {
+      m_logger->warning("Triangles of object '" + name + "' reference missing source values!");
+      delete[] obj->indices;
+      delete[] obj->vertices;
+      delete[] obj->normals;
+      delete[] obj->tex;
+      delete obj;
+      return 0;
+    }
+    
+    obj->indices[vidx] = vidx;
+  }
+  
+  return obj;
 }
 
 }
-
@@ -13,6 +13,8 @@
 #include <fstream>
 #include <boost/algorithm/string/trim.hpp>
 
+#include <string.h>
+
 namespace IID {
 
 GLSLImporter::GLSLImporter(Context *context)
@@ -21,21 +23,25 @@ GLSLImporter::GLSLImporter(Context *context)
 }
 
 void GLSLImporter::load(Storage *storage, Item *item, const std::string &filename)
+{
+  std::vector<unsigned char> data;
+  if (compile(item, filename, data))
+    loadCompiled(storage, item, &data[0], data.size());
+}
+
+bool GLSLImporter::compile(Item *item, const std::string &filename, std::vector<unsigned char> &data)
 {
   if (item->getType() != "Shader") {
     m_logger->error("GLSL source can only be imported into Shader items!");
-    return;
+    return false;
   }
   
-  // We have a shader
-  Shader *shader = static_cast<Shader*>(item);
-  
   // Parse the GLSL source file and extract vertex/fragment shaders
   std::ifstream file;
   file.open(filename.c_str());
   if (!file.is_open()) {
     m_logger->error("Unable to open GLSL file '" + filename + "'!");
-    return;
+    return false;
   }
   
   std::string line;
@@ -65,13 +71,38 @@ void GLSLImporter::load(Storage *storage, Item *item, const std::string &filenam
   
   file.close();
   
-  // Configure shaders
   if (!shaderType) {
     m_logger->error("Missing shader declarations in GLSL source file!");
+    return false;
+  }
+  
+  // Both sources are stored as null-terminated strings
+  data.assign(vertexShader.begin(), vertexShader.end());
+  data.push_back(0);
+  data.insert(data.end(), fragmentShader.begin(), fragmentShader.end());
+  data.push_back(0);
+  return true;
+}
+
+void GLSLImporter::loadCompiled(Storage *storage, Item *item, const unsigned char *data, size_t size)
+{
+  if (item->getType() != "Shader") {
+    m_logger->error("GLSL source can only be imported into Shader items!");
+    return;
+  }
+  
+  // We have a shader
+  Shader *shader = static_cast<Shader*>(item);
+  
+  const char *vertexShader = (const char*) data;
+  const char *end = (const char*) memchr(vertexShader, 0, size);
+  if (!end || !memchr(end + 1, 0, size - (end + 1 - vertexShader))) {
+    m_logger->error("Invalid preprocessed GLSL data!");
     return;
   }
   
-  shader->setSource(vertexShader, fragmentShader);
+  // Configure shaders
+  shader->setSource(vertexShader, end + 1);
 }
 
 }
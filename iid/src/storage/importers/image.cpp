@@ -12,6 +12,8 @@
 // SDL image library
 #include "SDL_image.h"
 
+#include <string.h>
+
 namespace IID {
 
 ImageImporter::ImageImporter(Context *context)
@@ -20,45 +22,64 @@ ImageImporter::ImageImporter(Context *context)
 }
 
 void ImageImporter::load(Storage *storage, Item *item, const std::string &filename)
+{
+  std::vector<unsigned char> data;
+  if (compile(item, filename, data))
+    loadCompiled(storage, item, &data[0], data.size());
+}
+
+bool ImageImporter::compile(Item *item, const std::string &filename, std::vector<unsigned char> &data)
 {
   if (item->getType() != "Texture") {
     m_logger->error("Images can only be imported into Texture items!");
-    return;
+    return false;
   }
   
-  // We have a texture
-  Texture *texture = static_cast<Texture*>(item);
-  
   // Use SDL_image to import the image
   SDL_Surface *image = IMG_Load(filename.c_str());
   if (!image) {
     m_logger->error("Unable to load image file from '" + filename + "'!");
-    return;
+    return false;
   }
   
+  // Header contains format and dimensions, followed by tightly packed rows
+  unsigned int header[3];
+  header[0] = image->format->BytesPerPixel == 3 ? Texture::RGB : Texture::RGBA;
+  header[1] = image->w;
+  header[2] = image->h;
+  
+  unsigned int lineSize = image->w * (header[0] == Texture::RGB ? 3 : 4);
+  data.resize(sizeof(header) + lineSize * image->h);
+  memcpy(&data[0], header, sizeof(header));
+  
   // Flip the image since SDL convention is broken
-  unsigned char line[image->pitch];
   unsigned char *pixels = (unsigned char*) image->pixels;
-  unsigned int pitch = image->pitch;
-  int ybegin = 0;
-  int yend = image->h - 1;
+  unsigned char *out = &data[sizeof(header)];
+  for (int y = 0; y < image->h; y++)
+    memcpy(out + lineSize*y, pixels + image->pitch*(image->h - 1 - y), lineSize);
   
-  while (ybegin < yend) {
-    memcpy(line, pixels + pitch*ybegin, pitch);
-    memcpy(pixels + pitch*ybegin, pixels + pitch*yend, pitch);
-    memcpy(pixels + pitch*yend, line, pitch);
-    ybegin++;
-    yend--;
+  SDL_FreeSurface(image);
+  return true;
+}
+
+void ImageImporter::loadCompiled(Storage *storage, Item *item, const unsigned char *data, size_t size)
+{
+  if (item->getType() != "Texture") {
+    m_logger->error("Images can only be imported into Texture items!");
+    return;
   }
   
-  // Copy image into the texture item
-  if (image->format->BytesPerPixel == 3)
-    texture->setImage(Texture::RGB, image->w, image->h, (unsigned char*) image->pixels);
-  else
-    texture->setImage(Texture::RGBA, image->w, image->h, (unsigned char*) image->pixels);
+  // We have a texture
+  Texture *texture = static_cast<Texture*>(item);
   
-  SDL_FreeSurface(image);
+  const unsigned int *header = reinterpret_cast<const unsigned int*>(data);
+  if (size < 12 || size - 12 < (size_t) header[1] * header[2] * (header[0] == Texture::RGB ? 3 : 4)) {
+    m_logger->error("Invalid preprocessed image data!");
+    return;
+  }
+  
+  // Copy image into the texture item
+  texture->setImage((Texture::Format) header[0], header[1], header[2], const_cast<unsigned char*>(data + 12));
 }
 
 }
-
@@ -8,19 +8,29 @@
 #include "storage/storage.h"
 #include "storage/mesh.h"
 #include "storage/compositemesh.h"
+#include "storage/importers/meshoptimizer.h"
+#include "mappedfile.h"
 #include "logger.h"
 
 #include <boost/format.hpp>
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/functional/hash.hpp>
 #include <iostream>
+#include <map>
+#include <set>
+#include <math.h>
+#include <string.h>
 
 using boost::format;
+namespace fs = boost::filesystem;
 
 namespace IID {
 
 MeshImporter::MeshImporter(Context *context)
-  : Importer(context)
+  : Importer(context),
+    m_cache(m_logger)
 {
 }
 
@@ -78,11 +88,148 @@ float *MeshImporter::computeNormals(int vertexCount, int faceCount, float *verti
   }
   
   // Free temporary memory
-  delete tmp;
+  delete[] tmp;
   
   return normals;
 }
 
+/**
+ * Vertex attributes used to find duplicate vertices. Attributes are
+ * either raw float bits or coordinates on a grid of tolerance size.
+ */
+struct WeldKey {
+    long long values[8];
+    
+    bool operator==(const WeldKey &other) const
+    {
+      return memcmp(values, other.values, sizeof(values)) == 0;
+    }
+};
+
+inline size_t hash_value(const WeldKey &key)
+{
+  return boost::hash_range(key.values, key.values + 8);
+}
+
+void MeshImporter::weldVertices(SubmeshObject *obj, float tolerance) const
+{
+  boost::unordered_map<WeldKey, unsigned int> unique;
+  unique.rehash(obj->vertexCount);
+  
+  unsigned int *remap = new unsigned int[obj->vertexCount];
+  int uniqueCount = 0;
+  
+  for (int i = 0; i < obj->vertexCount; i++) {
+    float attributes[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    memcpy(attributes, &obj->vertices[3*i], 12);
+    if (obj->normals)
+      memcpy(attributes + 3, &obj->normals[3*i], 12);
+    if (obj->tex)
+      memcpy(attributes + 6, &obj->tex[2*i], 8);
+    
+    WeldKey key;
+    for (int j = 0; j < 8; j++) {
+      if (tolerance > 0) {
+        key.values[j] = (long long) floor(attributes[j] / tolerance + 0.5f);
+      } else {
+        // Positive and negative zero are the same vertex
+        unsigned int bits;
+        float value = attributes[j] == 0 ? 0 : attributes[j];
+        memcpy(&bits, &value, 4);
+        key.values[j] = bits;
+      }
+    }
+    
+    // The first vertex in a cell represents all the others
+    std::pair<boost::unordered_map<WeldKey, unsigned int>::iterator, bool> result = unique.insert(std::make_pair(key, uniqueCount));
+    if (result.second) {
+      memmove(&obj->vertices[3*uniqueCount], &obj->vertices[3*i], 12);
+      if (obj->normals)
+        memmove(&obj->normals[3*uniqueCount], &obj->normals[3*i], 12);
+      if (obj->tex)
+        memmove(&obj->tex[2*uniqueCount], &obj->tex[2*i], 8);
+      
+      uniqueCount++;
+    }
+    
+    remap[i] = result.first->second;
+  }
+  
+  for (int i = 0; i < obj->faceCount * 3; i++)
+    obj->indices[i] = remap[obj->indices[i]];
+  
+  delete[] remap;
+  
+  // Shrink arrays to the number of unique vertices
+  float *vertices = new float[uniqueCount * 3];
+  memcpy(vertices, obj->vertices, uniqueCount * 12);
+  delete[] obj->vertices;
+  obj->vertices = vertices;
+  
+  if (obj->normals) {
+    float *normals = new float[uniqueCount * 3];
+    memcpy(normals, obj->normals, uniqueCount * 12);
+    delete[] obj->normals;
+    obj->normals = normals;
+  }
+  
+  if (obj->tex) {
+    float *tex = new float[uniqueCount * 2];
+    memcpy(tex, obj->tex, uniqueCount * 8);
+    delete[] obj->tex;
+    obj->tex = tex;
+  }
+  
+  obj->vertexCount = uniqueCount;
+}
+
+/**
+ * Moves vertex attributes to their new positions.
+ *
+ * @param data Attribute array (replaced)
+ * @param components Number of floats per vertex
+ * @param remap New position of each vertex or -1
+ * @param count Number of remaining vertices
+ */
+static void remapAttribute(float *&data, int components, const std::vector<int> &remap, int count)
+{
+  if (!data)
+    return;
+  
+  float *result = new float[count * components];
+  for (size_t i = 0; i < remap.size(); i++) {
+    if (remap[i] >= 0)
+      memcpy(&result[remap[i] * components], &data[i * components], components * sizeof(float));
+  }
+  
+  delete[] data;
+  data = result;
+}
+
+void MeshImporter::optimizeSubmeshObject(Item *item, SubmeshObject *obj) const
+{
+  if (!obj->faceCount)
+    return;
+  
+  float before = MeshOptimizer::computeACMR(obj->indices, obj->faceCount, obj->vertexCount);
+  MeshOptimizer::optimizeVertexCache(obj->indices, obj->faceCount, obj->vertexCount);
+  
+  if (item->hasAttribute("Mesh.OptimizeOverdraw"))
+    MeshOptimizer::optimizeOverdraw(obj->indices, obj->faceCount, obj->vertices, obj->vertexCount);
+  
+  float after = MeshOptimizer::computeACMR(obj->indices, obj->faceCount, obj->vertexCount);
+  
+  // Store vertices in the order they are first used
+  std::vector<int> remap;
+  int count = MeshOptimizer::optimizeVertexFetch(obj->indices, obj->faceCount, obj->vertexCount, remap);
+  remapAttribute(obj->vertices, 3, remap, count);
+  remapAttribute(obj->normals, 3, remap, count);
+  remapAttribute(obj->tex, 2, remap, count);
+  obj->vertexCount = count;
+  
+  m_logger->info(str(format("Optimized object '%s', ACMR %.3f -> %.3f.") % obj->name % before % after));
+}
+
 void MeshImporter::scaleMesh(float factorX, float factorY, float factorZ, int vertexCount, float *vertices) const
 {
   for (int i = 0; i < vertexCount; i++) {
@@ -121,15 +268,173 @@ Vector3f MeshImporter::geometricCenter(const Vector3f &mind, const Vector3f &max
   return (mind + maxd) * 0.5;
 }
 
-void MeshImporter::postProcessSubmeshObjects(Item *item, std::list<SubmeshObject*> objects) const
+std::string MeshImporter::cacheKey(Item *item, const std::string &filename) const
 {
-  int totalVertexCount = 0;
-  int totalFaceCount = 0;
-  int totalObjectCount = 0;
+  std::string key = item->getType() + ":" + filename;
+  
+  try {
+    key += ":" + boost::lexical_cast<std::string>(fs::last_write_time(filename));
+  } catch (fs::filesystem_error &e) {
+    // Missing files are reported by the importers themselves
+  }
+  
+  // Include attributes that affect post-processing (in a stable order)
+  const char *attributes[] = { "Mesh.Rotation", "Mesh.ScaleFactor", "Mesh.WeldTolerance", "Mesh.OptimizeOverdraw" };
+  for (int i = 0; i < 4; i++) {
+    if (!item->hasAttribute(attributes[i]))
+      continue;
+    
+    StringMap values = item->getAttribute(attributes[i]);
+    std::map<std::string, std::string> sorted(values.begin(), values.end());
+    key += std::string(":") + attributes[i];
+    
+    typedef std::pair<std::string, std::string> Value;
+    BOOST_FOREACH(Value value, sorted) {
+      key += "," + value.first + "=" + value.second;
+    }
+  }
   
+  return key;
+}
+
+bool MeshImporter::loadFromCache(Item *item, const std::string &filename) const
+{
+  MappedFile file;
+  CachedMesh mesh;
+  if (!m_cache.load(cacheKey(item, filename), file, mesh))
+    return false;
+  
+  // Records are uploaded straight from the mapping
+  createMeshItems(item, mesh);
+  m_logger->info("Loaded '" + filename + "' from mesh cache.");
+  return true;
+}
+
+void MeshImporter::createMeshItems(Item *item, const CachedMesh &mesh) const
+{
   // Should only the first object be imported or should all be imported
   bool composite = item->getType() == "CompositeMesh";
   
+  // Set global mesh bounding box (needed for composites)
+  if (composite)
+    static_cast<CompositeMesh*>(item)->setBounds(mesh.mind, mesh.maxd);
+  
+  // Vertex buffers use compressed vertices unless configured otherwise
+  Mesh::VertexFormat format = Mesh::CompressedFormat;
+  if (item->hasAttribute("Mesh.VertexFormat")) {
+    std::string name = item->getAttribute("Mesh.VertexFormat")["value"];
+    if (name == "full")
+      format = Mesh::FullFormat;
+    else if (name == "quantized")
+      format = Mesh::QuantizedFormat;
+  }
+  
+  std::set<std::string> names;
+  BOOST_FOREACH(const CachedSubmesh &submesh, mesh.submeshes) {
+    Mesh *m;
+    if (composite) {
+      // We are loading into a composite mesh, so we create new subitems;
+      // existing ones are refilled when the mesh is reloaded after eviction
+      m = static_cast<Mesh*>(item->child(submesh.name));
+      if (!m || names.count(submesh.name))
+        m = new Mesh(item->storage(), submesh.name, item);
+      
+      names.insert(submesh.name);
+    } else {
+      // We are only interested in the last object
+      m = static_cast<Mesh*>(item);
+    }
+    
+    // Setup our mesh
+    m->setVertexFormat(format);
+    m->setMeshRecords(submesh.vertexCount, submesh.indexCount, submesh.records, submesh.indices);
+    
+    // Setup mesh bounds
+    m->setBounds(submesh.mind, submesh.maxd);
+    
+    // Configure parent-relative position hint
+    StringMap relative;
+    relative["x"] = boost::lexical_cast<std::string>(submesh.relative[0]);
+    relative["y"] = boost::lexical_cast<std::string>(submesh.relative[1]);
+    relative["z"] = boost::lexical_cast<std::string>(submesh.relative[2]);
+    m->setAttribute("Mesh.RelativePosition", relative);
+  }
+  
+  // Save mesh center coordinate when Mesh.PreserveCoordinates attribute is
+  // present. This is extremely useful for placing level static geometry
+  // meshes (together with a proper rotation setup) to align coordinates with
+  // those present in the level editor.
+  if (item->hasAttribute("Mesh.PreserveCoordinates")) {
+    StringMap relative;
+    relative["x"] = boost::lexical_cast<std::string>(mesh.center[0]);
+    relative["y"] = boost::lexical_cast<std::string>(mesh.center[1]);
+    relative["z"] = boost::lexical_cast<std::string>(mesh.center[2]);
+    item->setAttribute("Mesh.Center", relative);
+  }
+}
+
+void MeshImporter::load(Storage *storage, Item *item, const std::string &filename)
+{
+  // Use an already processed mesh when available
+  if (loadFromCache(item, filename))
+    return;
+  
+  std::vector<unsigned char> data;
+  if (!compile(item, filename, data))
+    return;
+  
+  // Store the result, so the next run does not have to import it again
+  m_cache.store(cacheKey(item, filename), data);
+  loadCompiled(storage, item, &data[0], data.size());
+}
+
+bool MeshImporter::prepare(Item *item, const std::string &filename, std::vector<unsigned char> &data, MappedFile &file)
+{
+  // Cached meshes are loaded straight from the mapping, which is only
+  // parsed once by loadCompiled
+  std::string key = cacheKey(item, filename);
+  if (m_cache.open(key, file))
+    return true;
+  
+  if (!compile(item, filename, data))
+    return false;
+  
+  m_cache.store(key, data);
+  return true;
+}
+
+bool MeshImporter::compile(Item *item, const std::string &filename, std::vector<unsigned char> &data)
+{
+  std::list<SubmeshObject*> objects;
+  if (!parse(item, filename, objects))
+    return false;
+  
+  if (objects.empty()) {
+    m_logger->warning("No geometry found in '" + filename + "'!");
+    return false;
+  }
+  
+  postProcessSubmeshObjects(item, objects, cacheKey(item, filename), data);
+  return true;
+}
+
+void MeshImporter::loadCompiled(Storage *storage, Item *item, const unsigned char *data, size_t size)
+{
+  CachedMesh mesh;
+  if (!MeshCache::parse(data, size, 0, mesh)) {
+    m_logger->error("Invalid preprocessed mesh data!");
+    return;
+  }
+  
+  createMeshItems(item, mesh);
+}
+
+void MeshImporter::postProcessSubmeshObjects(Item *item, std::list<SubmeshObject*> objects, const std::string &key, std::vector<unsigned char> &data) const
+{
+  int totalVertexCount = 0;
+  int totalFaceCount = 0;
+  int totalObjectCount = 0;
+  
   // Compute normals and apply scaling
   BOOST_FOREACH(SubmeshObject *obj, objects) {
     // Apply rotation when requested
@@ -149,6 +454,9 @@ void MeshImporter::postProcessSubmeshObjects(Item *item, std::list<SubmeshObject
     if (!obj->normals)
      obj->normals = computeNormals(obj->vertexCount, obj->faceCount, obj->vertices, obj->indices);
     
+    // Reorder triangles and vertices for rendering
+    optimizeSubmeshObject(item, obj);
+    
     // Scale mesh if needed
     if (item->hasAttribute("Mesh.ScaleFactor")) {
       StringMap factors = item->getAttribute("Mesh.ScaleFactor");
@@ -218,10 +526,6 @@ void MeshImporter::postProcessSubmeshObjects(Item *item, std::list<SubmeshObject
   center = geometricCenter(globalMind, globalMaxd);
   dimensions = globalMaxd - globalMind;
   
-  // Set global mesh bounding box (needed for composites)
-  if (composite)
-    static_cast<CompositeMesh*>(item)->setBounds(globalMind, globalMaxd);
-  
   // Move all objects to (0, 0, 0) and update relative hints
   BOOST_FOREACH(SubmeshObject *obj, objects) {
     translateMesh(-obj->center, obj->vertexCount, obj->vertices);
@@ -230,59 +534,51 @@ void MeshImporter::postProcessSubmeshObjects(Item *item, std::list<SubmeshObject
     obj->relative = obj->center - center;
   }
   
-  // Create all objects
+  // Interleave vertex attributes into records that are uploaded directly
+  CachedMesh mesh;
+  mesh.center = center;
+  mesh.mind = globalMind;
+  mesh.maxd = globalMaxd;
+  
   BOOST_FOREACH(SubmeshObject *obj, objects) {
-    Mesh *mesh;
-    if (composite) {
-      // We are loading into a composite mesh, so we create new subitems
-      mesh = new Mesh(item->storage(), obj->name, item);
-    } else {
-      // We are only interested in the last object
-      mesh = static_cast<Mesh*>(item);
-    }
-    
-    // Setup our mesh
-    mesh->setMesh(
+    unsigned char *records = new unsigned char[obj->vertexCount * Mesh::RecordSize];
+    Mesh::interleaveRecords(
       obj->vertexCount,
-      obj->faceCount * 3,
       (unsigned char*) obj->vertices,
       (unsigned char*) obj->normals,
       (unsigned char*) obj->tex,
-      (unsigned char*) obj->indices
+      records
     );
     
-    // Setup mesh bounds
-    mesh->setBounds(obj->mind, obj->maxd);
-    
-    // Configure parent-relative position hint
-    StringMap relative;
-    relative["x"] = boost::lexical_cast<std::string>(obj->relative[0]);
-    relative["y"] = boost::lexical_cast<std::string>(obj->relative[1]);
-    relative["z"] = boost::lexical_cast<std::string>(obj->relative[2]);
-    mesh->setAttribute("Mesh.RelativePosition", relative);
-    
-    // Free object resources
-    delete obj->vertices;
-    delete obj->normals;
-    delete obj->tex;
-    delete obj->indices;
-    delete obj;
+    CachedSubmesh submesh;
+    submesh.name = obj->name;
+    submesh.vertexCount = obj->vertexCount;
+    submesh.indexCount = obj->faceCount * 3;
+    submesh.records = records;
+    submesh.indices = obj->indices;
+    submesh.mind = obj->mind;
+    submesh.maxd = obj->maxd;
+    submesh.relative = obj->relative;
+    mesh.submeshes.push_back(submesh);
   }
   
-  // Save mesh center coordinate when Mesh.PreserveCoordinates attribute is
-  // present. This is extremely useful for placing level static geometry
-  // meshes (together with a proper rotation setup) to align coordinates with
-  // those present in the level editor.
-  if (item->hasAttribute("Mesh.PreserveCoordinates")) {
-    StringMap relative;
-    relative["x"] = boost::lexical_cast<std::string>(center[0]);
-    relative["y"] = boost::lexical_cast<std::string>(center[1]);
-    relative["z"] = boost::lexical_cast<std::string>(center[2]);
-    item->setAttribute("Mesh.Center", relative);
+  MeshCache::serialize(key, mesh, data);
+  
+  // Free object resources
+  BOOST_FOREACH(const CachedSubmesh &submesh, mesh.submeshes) {
+    delete[] submesh.records;
+  }
+  
+  BOOST_FOREACH(SubmeshObject *obj, objects) {
+    delete[] obj->vertices;
+    delete[] obj->normals;
+    delete[] obj->tex;
+    delete[] obj->indices;
+    delete obj;
   }
   
   // Log some statistics
-  m_logger->info(str(format("Loaded %d objects containing %d vertices and %d faces.") % totalObjectCount % totalVertexCount % totalFaceCount));
+  m_logger->info(str(format("Processed %d objects containing %d vertices and %d faces.") % totalObjectCount % totalVertexCount % totalFaceCount));
 }
 
 }
@@ -0,0 +1,241 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "storage/importers/meshcache.h"
+#include "storage/mesh.h"
+#include "mappedfile.h"
+#include "logger.h"
+
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <stdio.h>
+
+namespace fs = boost::filesystem;
+using boost::format;
+
+// Cache file identification; the version must be incremented whenever the
+// layout or the mesh post-processing changes
+#define MESH_CACHE_MAGIC 0x4d444949
+#define MESH_CACHE_VERSION 3
+
+namespace IID {
+
+/**
+ * Reads consecutive values from a mapped cache file. All values are four
+ * byte aligned.
+ */
+class MeshCacheReader {
+public:
+    MeshCacheReader(const unsigned char *data, size_t size)
+      : m_data(data),
+        m_size(size),
+        m_offset(0),
+        m_valid(true)
+    {}
+    
+    const unsigned char *read(size_t size)
+    {
+      size_t padded = (size + 3) & ~3;
+      if (!m_valid || m_size - m_offset < padded) {
+        m_valid = false;
+        return 0;
+      }
+      
+      const unsigned char *data = m_data + m_offset;
+      m_offset += padded;
+      return data;
+    }
+    
+    unsigned int readInt()
+    {
+      const unsigned char *data = read(4);
+      return data ? *reinterpret_cast<const unsigned int*>(data) : 0;
+    }
+    
+    std::string readString()
+    {
+      unsigned int length = readInt();
+      const unsigned char *data = read(length);
+      return data ? std::string((const char*) data, length) : std::string();
+    }
+    
+    Vector3f readVector()
+    {
+      const float *data = reinterpret_cast<const float*>(read(12));
+      return data ? Vector3f(data[0], data[1], data[2]) : Vector3f::Zero();
+    }
+    
+    bool isValid() const { return m_valid; }
+private:
+    const unsigned char *m_data;
+    size_t m_size;
+    size_t m_offset;
+    bool m_valid;
+};
+
+/**
+ * Appends values in the cache file layout.
+ */
+inline void writeData(std::vector<unsigned char> &out, const void *data, size_t size)
+{
+  const unsigned char *bytes = (const unsigned char*) data;
+  out.insert(out.end(), bytes, bytes + size);
+  out.resize((out.size() + 3) & ~3, 0);
+}
+
+inline void writeInt(std::vector<unsigned char> &out, unsigned int value)
+{
+  writeData(out, &value, 4);
+}
+
+inline void writeString(std::vector<unsigned char> &out, const std::string &value)
+{
+  writeInt(out, value.size());
+  writeData(out, value.data(), value.size());
+}
+
+inline void writeVector(std::vector<unsigned char> &out, const Vector3f &value)
+{
+  writeData(out, value.data(), 12);
+}
+
+MeshCache::MeshCache(Logger *logger, const std::string &directory)
+  : m_logger(logger),
+    m_directory(directory)
+{
+}
+
+std::string MeshCache::filename(const std::string &key) const
+{
+  boost::hash<std::string> hasher;
+  return (fs::path(m_directory) / str(format("%016x.mesh") % (unsigned long long) hasher(key))).string();
+}
+
+bool MeshCache::load(const std::string &key, MappedFile &file, CachedMesh &mesh) const
+{
+  if (!file.open(filename(key)))
+    return false;
+  
+  if (!parse(file.data(), file.size(), &key, mesh)) {
+    // Invalid or stale files are ignored and will be overwritten
+    m_logger->warning("Ignoring invalid mesh cache file for '" + key + "'.");
+    file.close();
+    return false;
+  }
+  
+  return true;
+}
+
+bool MeshCache::open(const std::string &key, MappedFile &file) const
+{
+  if (!file.open(filename(key)))
+    return false;
+  
+  MeshCacheReader reader(file.data(), file.size());
+  if (reader.readInt() != MESH_CACHE_MAGIC || reader.readInt() != MESH_CACHE_VERSION ||
+      reader.readString() != key) {
+    m_logger->warning("Ignoring invalid mesh cache file for '" + key + "'.");
+    file.close();
+    return false;
+  }
+  
+  return true;
+}
+
+bool MeshCache::parse(const unsigned char *data, size_t size, const std::string *key, CachedMesh &mesh)
+{
+  MeshCacheReader reader(data, size);
+  if (reader.readInt() != MESH_CACHE_MAGIC || reader.readInt() != MESH_CACHE_VERSION)
+    return false;
+  
+  std::string storedKey = reader.readString();
+  if (key && storedKey != *key)
+    return false;
+  
+  unsigned int count = reader.readInt();
+  mesh.center = reader.readVector();
+  mesh.mind = reader.readVector();
+  mesh.maxd = reader.readVector();
+  mesh.submeshes.clear();
+  
+  for (unsigned int i = 0; i < count && reader.isValid(); i++) {
+    CachedSubmesh submesh;
+    submesh.name = reader.readString();
+    submesh.vertexCount = reader.readInt();
+    submesh.indexCount = reader.readInt();
+    submesh.mind = reader.readVector();
+    submesh.maxd = reader.readVector();
+    submesh.relative = reader.readVector();
+    submesh.records = reader.read((size_t) submesh.vertexCount * Mesh::RecordSize);
+    submesh.indices = reinterpret_cast<const unsigned int*>(reader.read((size_t) submesh.indexCount * 4));
+    mesh.submeshes.push_back(submesh);
+  }
+  
+  return reader.isValid();
+}
+
+void MeshCache::serialize(const std::string &key, const CachedMesh &mesh, std::vector<unsigned char> &data)
+{
+  data.clear();
+  writeInt(data, MESH_CACHE_MAGIC);
+  writeInt(data, MESH_CACHE_VERSION);
+  writeString(data, key);
+  writeInt(data, mesh.submeshes.size());
+  writeVector(data, mesh.center);
+  writeVector(data, mesh.mind);
+  writeVector(data, mesh.maxd);
+  
+  BOOST_FOREACH(const CachedSubmesh &submesh, mesh.submeshes) {
+    writeString(data, submesh.name);
+    writeInt(data, submesh.vertexCount);
+    writeInt(data, submesh.indexCount);
+    writeVector(data, submesh.mind);
+    writeVector(data, submesh.maxd);
+    writeVector(data, submesh.relative);
+    writeData(data, submesh.records, (size_t) submesh.vertexCount * Mesh::RecordSize);
+    writeData(data, submesh.indices, (size_t) submesh.indexCount * 4);
+  }
+}
+
+void MeshCache::store(const std::string &key, const std::vector<unsigned char> &data) const
+{
+  std::string path = filename(key);
+  
+  // Temporary files are per thread, as meshes are imported in parallel
+  std::ostringstream tmpPath;
+  tmpPath << path << "." << boost::this_thread::get_id() << ".tmp";
+  
+  try {
+    fs::create_directories(m_directory);
+  } catch (fs::filesystem_error &e) {
+    m_logger->warning("Unable to create mesh cache directory '" + m_directory + "'!");
+    return;
+  }
+  
+  // Write into a temporary file first so a partially written file is never
+  // picked up by the loader
+  std::ofstream out(tmpPath.str().c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out) {
+    m_logger->warning("Unable to write mesh cache file '" + tmpPath.str() + "'!");
+    return;
+  }
+  
+  out.write((const char*) &data[0], data.size());
+  out.close();
+  if (!out || rename(tmpPath.str().c_str(), path.c_str()) != 0) {
+    m_logger->warning("Unable to write mesh cache file '" + path + "'!");
+    remove(tmpPath.str().c_str());
+  }
+}
+
+}
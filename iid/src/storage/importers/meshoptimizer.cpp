@@ -0,0 +1,295 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "storage/importers/meshoptimizer.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+// Size of the simulated LRU cache used for scoring vertices
+#define FORSYTH_CACHE_SIZE 32
+
+// Score weights from Tom Forsyth's "Linear-Speed Vertex Cache Optimisation"
+#define FORSYTH_CACHE_DECAY_POWER 1.5f
+#define FORSYTH_LAST_TRIANGLE_SCORE 0.75f
+#define FORSYTH_VALENCE_BOOST_SCALE 2.0f
+#define FORSYTH_VALENCE_BOOST_POWER 0.5f
+
+// Cache size used for splitting overdraw clusters
+#define OVERDRAW_CACHE_SIZE 16
+
+namespace IID {
+
+/**
+ * Computes the score of a vertex given its position in the simulated
+ * cache and the number of triangles that still use it.
+ */
+static float vertexScore(int cachePosition, int remainingTriangles)
+{
+  if (remainingTriangles == 0)
+    return -1.0f;
+  
+  float score = 0.0f;
+  if (cachePosition >= 0) {
+    if (cachePosition < 3) {
+      // The last triangle's vertices are used again right away anyway
+      score = FORSYTH_LAST_TRIANGLE_SCORE;
+    } else {
+      float scaler = 1.0f / (FORSYTH_CACHE_SIZE - 3);
+      score = powf(1.0f - (cachePosition - 3) * scaler, FORSYTH_CACHE_DECAY_POWER);
+    }
+  }
+  
+  // Prefer vertices with few remaining triangles to avoid leaving
+  // lone triangles behind
+  return score + FORSYTH_VALENCE_BOOST_SCALE * powf((float) remainingTriangles, -FORSYTH_VALENCE_BOOST_POWER);
+}
+
+float MeshOptimizer::computeACMR(const unsigned int *indices, int faceCount, int vertexCount, int cacheSize)
+{
+  if (faceCount == 0)
+    return 0.0f;
+  
+  // Vertex timestamps tell whether a vertex is still in the FIFO
+  std::vector<int> timestamps(vertexCount, -cacheSize - 1);
+  int time = 0;
+  int misses = 0;
+  
+  for (int i = 0; i < faceCount * 3; i++) {
+    unsigned int v = indices[i];
+    if (time - timestamps[v] > cacheSize) {
+      timestamps[v] = time++;
+      misses++;
+    }
+  }
+  
+  return (float) misses / faceCount;
+}
+
+void MeshOptimizer::optimizeVertexCache(unsigned int *indices, int faceCount, int vertexCount)
+{
+  if (faceCount == 0)
+    return;
+  
+  // Build vertex to triangle adjacency
+  std::vector<int> remaining(vertexCount, 0);
+  for (int i = 0; i < faceCount * 3; i++)
+    remaining[indices[i]]++;
+  
+  std::vector<int> offsets(vertexCount + 1, 0);
+  for (int v = 0; v < vertexCount; v++)
+    offsets[v + 1] = offsets[v] + remaining[v];
+  
+  std::vector<int> adjacency(faceCount * 3);
+  std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+  for (int i = 0; i < faceCount * 3; i++)
+    adjacency[fill[indices[i]]++] = i / 3;
+  
+  // Initial scores
+  std::vector<int> cachePosition(vertexCount, -1);
+  std::vector<float> scores(vertexCount);
+  for (int v = 0; v < vertexCount; v++)
+    scores[v] = vertexScore(-1, remaining[v]);
+  
+  std::vector<float> triangleScores(faceCount);
+  std::vector<bool> emitted(faceCount, false);
+  for (int t = 0; t < faceCount; t++)
+    triangleScores[t] = scores[indices[3*t]] + scores[indices[3*t + 1]] + scores[indices[3*t + 2]];
+  
+  std::vector<unsigned int> output(faceCount * 3);
+  int cache[FORSYTH_CACHE_SIZE + 3];
+  int cacheCount = 0;
+  int bestTriangle = -1;
+  int scanPosition = 0;
+  
+  for (int out = 0; out < faceCount; out++) {
+    if (bestTriangle < 0) {
+      // Nothing in the cache is usable, take the next triangle in order
+      while (emitted[scanPosition])
+        scanPosition++;
+      
+      bestTriangle = scanPosition;
+    }
+    
+    // Emit the triangle and remove it from adjacency lists
+    emitted[bestTriangle] = true;
+    for (int k = 0; k < 3; k++) {
+      unsigned int v = indices[3*bestTriangle + k];
+      output[3*out + k] = v;
+      
+      int *list = &adjacency[offsets[v]];
+      int *last = list + remaining[v] - 1;
+      *std::find(list, last, bestTriangle) = *last;
+      remaining[v]--;
+    }
+    
+    // Move its vertices to the front of the cache
+    int newCache[FORSYTH_CACHE_SIZE + 3];
+    int newCount = 0;
+    for (int k = 0; k < 3; k++)
+      newCache[newCount++] = indices[3*bestTriangle + k];
+    
+    for (int i = 0; i < cacheCount; i++) {
+      int v = cache[i];
+      if (v != newCache[0] && v != newCache[1] && v != newCache[2])
+        newCache[newCount++] = v;
+    }
+    
+    // Update scores of vertices in the cache and of their triangles;
+    // vertices pushed out of the cache are updated as well
+    bestTriangle = -1;
+    float bestScore = -1.0f;
+    for (int i = 0; i < newCount; i++) {
+      int v = newCache[i];
+      cachePosition[v] = i < FORSYTH_CACHE_SIZE ? i : -1;
+      
+      float score = vertexScore(cachePosition[v], remaining[v]);
+      float delta = score - scores[v];
+      scores[v] = score;
+      
+      for (int j = 0; j < remaining[v]; j++) {
+        int t = adjacency[offsets[v] + j];
+        triangleScores[t] += delta;
+        if (triangleScores[t] > bestScore) {
+          bestScore = triangleScores[t];
+          bestTriangle = t;
+        }
+      }
+    }
+    
+    cacheCount = std::min(newCount, FORSYTH_CACHE_SIZE);
+    memcpy(cache, newCache, cacheCount * sizeof(int));
+  }
+  
+  memcpy(indices, &output[0], faceCount * 3 * sizeof(unsigned int));
+}
+
+/**
+ * A cluster of consecutive triangles and its sort key.
+ */
+struct OverdrawCluster {
+    int first;
+    int count;
+    float key;
+    
+    bool operator<(const OverdrawCluster &other) const
+    {
+      return key > other.key;
+    }
+};
+
+void MeshOptimizer::optimizeOverdraw(unsigned int *indices, int faceCount, const float *vertices, int vertexCount,
+                                     float threshold)
+{
+  if (faceCount == 0)
+    return;
+  
+  // Split into clusters where the cache has just been refilled, as long
+  // as the split keeps the cache efficiency within the threshold
+  float acmr = computeACMR(indices, faceCount, vertexCount, OVERDRAW_CACHE_SIZE);
+  std::vector<OverdrawCluster> clusters;
+  std::vector<int> timestamps(vertexCount, -OVERDRAW_CACHE_SIZE - 1);
+  int time = 0;
+  int clusterStart = 0;
+  int clusterMisses = 0;
+  
+  for (int t = 0; t < faceCount; t++) {
+    int misses = 0;
+    for (int k = 0; k < 3; k++) {
+      unsigned int v = indices[3*t + k];
+      if (time - timestamps[v] > OVERDRAW_CACHE_SIZE) {
+        timestamps[v] = time++;
+        misses++;
+      }
+    }
+    
+    // A triangle missing all its vertices starts over as if the cache
+    // were empty, which is a good place to start a new cluster
+    if (misses == 3 && t > clusterStart && (float) clusterMisses / (t - clusterStart) <= acmr * threshold) {
+      OverdrawCluster cluster = { clusterStart, t - clusterStart, 0.0f };
+      clusters.push_back(cluster);
+      clusterStart = t;
+      clusterMisses = 0;
+    }
+    
+    clusterMisses += misses;
+  }
+  
+  OverdrawCluster last = { clusterStart, faceCount - clusterStart, 0.0f };
+  clusters.push_back(last);
+  
+  // Mesh centroid
+  float center[3] = { 0, 0, 0 };
+  for (int v = 0; v < vertexCount; v++) {
+    for (int j = 0; j < 3; j++)
+      center[j] += vertices[3*v + j] / vertexCount;
+  }
+  
+  // Clusters facing away from the centroid are likely to occlude others
+  for (size_t c = 0; c < clusters.size(); c++) {
+    OverdrawCluster &cluster = clusters[c];
+    float centroid[3] = { 0, 0, 0 };
+    float normal[3] = { 0, 0, 0 };
+    float area = 0;
+    
+    for (int t = cluster.first; t < cluster.first + cluster.count; t++) {
+      const float *a = &vertices[3*indices[3*t]];
+      const float *b = &vertices[3*indices[3*t + 1]];
+      const float *c = &vertices[3*indices[3*t + 2]];
+      float u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+      float w[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+      float n[3] = { u[1]*w[2] - u[2]*w[1], u[2]*w[0] - u[0]*w[2], u[0]*w[1] - u[1]*w[0] };
+      float triangleArea = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+      
+      for (int j = 0; j < 3; j++) {
+        centroid[j] += (a[j] + b[j] + c[j]) / 3.0f * triangleArea;
+        normal[j] += n[j];
+      }
+      area += triangleArea;
+    }
+    
+    if (area > 0) {
+      for (int j = 0; j < 3; j++)
+        centroid[j] /= area;
+    }
+    
+    float length = sqrtf(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+    if (length > 0) {
+      cluster.key = ((centroid[0] - center[0]) * normal[0] +
+                     (centroid[1] - center[1]) * normal[1] +
+                     (centroid[2] - center[2]) * normal[2]) / length;
+    }
+  }
+  
+  std::stable_sort(clusters.begin(), clusters.end());
+  
+  std::vector<unsigned int> output;
+  output.reserve(faceCount * 3);
+  for (size_t c = 0; c < clusters.size(); c++) {
+    output.insert(output.end(), indices + 3*clusters[c].first, indices + 3*(clusters[c].first + clusters[c].count));
+  }
+  
+  memcpy(indices, &output[0], faceCount * 3 * sizeof(unsigned int));
+}
+
+int MeshOptimizer::optimizeVertexFetch(unsigned int *indices, int faceCount, int vertexCount, std::vector<int> &remap)
+{
+  remap.assign(vertexCount, -1);
+  int next = 0;
+  
+  for (int i = 0; i < faceCount * 3; i++) {
+    unsigned int v = indices[i];
+    if (remap[v] < 0)
+      remap[v] = next++;
+    
+    indices[i] = remap[v];
+  }
+  
+  return next;
+}
+
+}
@@ -0,0 +1,351 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "storage/importers/xmlreader.h"
+
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+// Maximum length of a number that does not fit the fast path
+#define XML_MAX_NUMBER_LENGTH 64
+
+namespace IID {
+
+// Exactly representable powers of ten
+static const float gPowersOfTen[] = {
+  1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+inline bool isSpace(char ch)
+{
+  return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
+}
+
+inline bool isDigit(char ch)
+{
+  return (unsigned char) (ch - '0') < 10;
+}
+
+inline bool isNameChar(char ch)
+{
+  return !isSpace(ch) && ch != '>' && ch != '/' && ch != '=';
+}
+
+XmlReader::XmlReader(const char *begin, const char *end)
+  : m_position(begin),
+    m_end(end),
+    m_depth(0),
+    m_selfClosing(false),
+    m_textBegin(0),
+    m_textEnd(0)
+{
+}
+
+bool XmlReader::skipPast(const char *terminator)
+{
+  size_t length = strlen(terminator);
+  const char *found = std::search(m_position, m_end, terminator, terminator + length);
+  if (found == m_end)
+    return false;
+  
+  m_position = found + length;
+  return true;
+}
+
+XmlReader::Token XmlReader::next()
+{
+  // Self-closing elements are ended without consuming input
+  if (m_selfClosing) {
+    m_selfClosing = false;
+    m_depth--;
+    return EndElement;
+  }
+  
+  while (m_position < m_end) {
+    if (*m_position != '<') {
+      // Text runs until the next tag
+      const char *tag = (const char*) memchr(m_position, '<', m_end - m_position);
+      m_textBegin = m_position;
+      m_textEnd = tag ? tag : m_end;
+      m_position = m_textEnd;
+      return Text;
+    }
+    
+    size_t remaining = m_end - m_position;
+    if (remaining >= 4 && memcmp(m_position, "<!--", 4) == 0) {
+      if (!skipPast("-->"))
+        return Error;
+    } else if (remaining >= 9 && memcmp(m_position, "<![CDATA[", 9) == 0) {
+      m_textBegin = m_position + 9;
+      if (!skipPast("]]>"))
+        return Error;
+      
+      m_textEnd = m_position - 3;
+      return Text;
+    } else if (remaining >= 2 && (m_position[1] == '?' || m_position[1] == '!')) {
+      // Processing instructions and declarations
+      if (!skipPast(">"))
+        return Error;
+    } else if (remaining >= 2 && m_position[1] == '/') {
+      // End tag
+      const char *nameBegin = m_position + 2;
+      const char *nameEnd = nameBegin;
+      while (nameEnd < m_end && isNameChar(*nameEnd))
+        nameEnd++;
+      
+      m_name.assign(nameBegin, nameEnd);
+      m_position = nameEnd;
+      if (!skipPast(">") || m_depth == 0)
+        return Error;
+      
+      m_depth--;
+      return EndElement;
+    } else {
+      m_position++;
+      return parseStartTag();
+    }
+  }
+  
+  return m_depth == 0 ? EndOfDocument : Error;
+}
+
+XmlReader::Token XmlReader::parseStartTag()
+{
+  const char *nameEnd = m_position;
+  while (nameEnd < m_end && isNameChar(*nameEnd))
+    nameEnd++;
+  
+  if (nameEnd == m_position)
+    return Error;
+  
+  m_name.assign(m_position, nameEnd);
+  m_position = nameEnd;
+  m_attributes.clear();
+  
+  // Parse attributes until the end of the tag
+  for (;;) {
+    while (m_position < m_end && isSpace(*m_position))
+      m_position++;
+    
+    if (m_position >= m_end)
+      return Error;
+    
+    if (*m_position == '>') {
+      m_position++;
+      break;
+    }
+    
+    if (*m_position == '/') {
+      if (m_end - m_position < 2 || m_position[1] != '>')
+        return Error;
+      
+      m_position += 2;
+      m_selfClosing = true;
+      break;
+    }
+    
+    const char *attrBegin = m_position;
+    while (m_position < m_end && isNameChar(*m_position))
+      m_position++;
+    
+    std::string attrName(attrBegin, m_position);
+    while (m_position < m_end && isSpace(*m_position))
+      m_position++;
+    
+    if (m_position >= m_end || *m_position != '=')
+      return Error;
+    
+    m_position++;
+    while (m_position < m_end && isSpace(*m_position))
+      m_position++;
+    
+    if (m_position >= m_end || (*m_position != '"' && *m_position != '\''))
+      return Error;
+    
+    char quote = *m_position++;
+    const char *valueEnd = (const char*) memchr(m_position, quote, m_end - m_position);
+    if (!valueEnd)
+      return Error;
+    
+    m_attributes.push_back(std::make_pair(attrName, std::string(m_position, valueEnd)));
+    m_position = valueEnd + 1;
+  }
+  
+  m_depth++;
+  return StartElement;
+}
+
+bool XmlReader::skipElement()
+{
+  int depth = m_depth;
+  for (;;) {
+    switch (next()) {
+      case EndElement: {
+        if (m_depth < depth)
+          return true;
+        break;
+      }
+      case EndOfDocument:
+      case Error: return false;
+      default: break;
+    }
+  }
+}
+
+std::string XmlReader::attribute(const std::string &name, const std::string &defaultValue) const
+{
+  typedef std::pair<std::string, std::string> Attribute;
+  BOOST_FOREACH(const Attribute &attribute, m_attributes) {
+    if (attribute.first == name)
+      return attribute.second;
+  }
+  
+  return defaultValue;
+}
+
+/**
+ * Parses a single number that the fast path could not handle (such as
+ * infinities, long mantissas or large exponents).
+ */
+static const char *parseFloatSlow(const char *begin, const char *end, float &value)
+{
+  const char *tokenEnd = begin;
+  while (tokenEnd < end && !isSpace(*tokenEnd))
+    tokenEnd++;
+  
+  size_t length = tokenEnd - begin;
+  if (length >= XML_MAX_NUMBER_LENGTH)
+    return 0;
+  
+  char buffer[XML_MAX_NUMBER_LENGTH];
+  memcpy(buffer, begin, length);
+  buffer[length] = 0;
+  
+  char *parsed;
+  value = strtof(buffer, &parsed);
+  if (parsed != buffer + length)
+    return 0;
+  
+  return tokenEnd;
+}
+
+int readFloats(const char *begin, const char *end, float *values, int count)
+{
+  const char *p = begin;
+  int parsed = 0;
+  
+  while (parsed < count) {
+    while (p < end && isSpace(*p))
+      p++;
+    
+    if (p >= end)
+      break;
+    
+    // Accumulate up to 19 significant digits into an integer mantissa
+    const char *token = p;
+    bool negative = false;
+    if (*p == '-' || *p == '+')
+      negative = *p++ == '-';
+    
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool valid = false;
+    
+    for (; p < end && isDigit(*p); p++, valid = true) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        if (mantissa)
+          digits++;
+      } else {
+        exponent++;
+      }
+    }
+    
+    if (p < end && *p == '.') {
+      for (p++; p < end && isDigit(*p); p++, valid = true) {
+        if (digits < 19) {
+          mantissa = mantissa * 10 + (*p - '0');
+          exponent--;
+          if (mantissa)
+            digits++;
+        }
+      }
+    }
+    
+    if (valid && p < end && (*p == 'e' || *p == 'E')) {
+      p++;
+      bool negativeExponent = false;
+      if (p < end && (*p == '-' || *p == '+'))
+        negativeExponent = *p++ == '-';
+      
+      int e = 0;
+      if (p >= end || !isDigit(*p))
+        valid = false;
+      
+      for (; p < end && isDigit(*p); p++) {
+        if (e < 10000)
+          e = e * 10 + (*p - '0');
+      }
+      
+      exponent += negativeExponent ? -e : e;
+    }
+    
+    // The fast path is only taken when the mantissa and the power of ten
+    // are both exact floats, so a single operation rounds correctly
+    if (!valid || (p < end && !isSpace(*p)) || mantissa > (1 << 24) ||
+        exponent < -10 || exponent > 10) {
+      // Anything else is handed to the C library
+      float value;
+      p = parseFloatSlow(token, end, value);
+      if (!p)
+        break;
+      
+      values[parsed++] = value;
+      continue;
+    }
+    
+    float value = (float) mantissa;
+    if (exponent < 0)
+      value /= gPowersOfTen[-exponent];
+    else if (exponent > 0)
+      value *= gPowersOfTen[exponent];
+    
+    values[parsed++] = negative ? -value : value;
+  }
+  
+  return parsed;
+}
+
+int readIndices(const char *begin, const char *end, unsigned int *values, int count)
+{
+  const char *p = begin;
+  int parsed = 0;
+  
+  while (parsed < count) {
+    while (p < end && isSpace(*p))
+      p++;
+    
+    if (p >= end || !isDigit(*p))
+      break;
+    
+    unsigned int value = 0;
+    for (; p < end && isDigit(*p); p++)
+      value = value * 10 + (*p - '0');
+    
+    if (p < end && !isSpace(*p))
+      break;
+    
+    values[parsed++] = value;
+  }
+  
+  return parsed;
+}
+
+}
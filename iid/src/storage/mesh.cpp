@@ -7,77 +7,263 @@
 #include "storage/mesh.h"
 #include "drivers/base.h"
 #include "context.h"
+#include "logger.h"
 
 #include <BulletCollision/CollisionShapes/btConvexHullShape.h>
 #include <BulletCollision/CollisionShapes/btShapeHull.h>
 
+#include <algorithm>
 #include <iostream>
-#define RECORD_SIZE 32
+#include <vector>
+#include <math.h>
+#include <string.h>
 
 namespace IID {
 
+const int Mesh::RecordSize;
+
+/**
+ * Converts a float to a half-float, rounding to nearest.
+ */
+static unsigned short floatToHalf(float value)
+{
+  unsigned int bits;
+  memcpy(&bits, &value, 4);
+  
+  unsigned int sign = (bits >> 16) & 0x8000;
+  unsigned int mantissa = bits & 0x7fffff;
+  int exponent = (int) ((bits >> 23) & 0xff) - 127 + 15;
+  
+  if (((bits >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  
+  if (exponent >= 31)
+    return sign | 0x7c00;
+  
+  if (exponent <= 0) {
+    // Subnormal or zero
+    if (exponent < -10)
+      return sign;
+    
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    unsigned int half = mantissa >> shift;
+    if ((mantissa >> (shift - 1)) & 1)
+      half++;
+    
+    return sign | half;
+  }
+  
+  // A carry out of the mantissa correctly increments the exponent
+  unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+  if (mantissa & 0x1000)
+    half++;
+  
+  return half;
+}
+
+/**
+ * Encodes a unit vector into two normalized shorts using the octahedral
+ * mapping.
+ */
+static void encodeOctahedral(const float *normal, short *result)
+{
+  float length = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+  float x = length > 0 ? normal[0] / length : 0;
+  float y = length > 0 ? normal[1] / length : 0;
+  
+  // Fold the lower hemisphere over the diagonals
+  if (normal[2] < 0) {
+    float fx = (1.0f - fabsf(y)) * (x >= 0 ? 1.0f : -1.0f);
+    float fy = (1.0f - fabsf(x)) * (y >= 0 ? 1.0f : -1.0f);
+    x = fx;
+    y = fy;
+  }
+  
+  result[0] = (short) floorf(std::max(-1.0f, std::min(1.0f, x)) * 32767.0f + 0.5f);
+  result[1] = (short) floorf(std::max(-1.0f, std::min(1.0f, y)) * 32767.0f + 0.5f);
+}
+
 Mesh::Mesh(Storage *storage, const std::string &itemId, Item *parent)
   : Item(storage, "Mesh", itemId, "", parent),
+    Resident(storage ? storage->residency() : 0, "Mesh"),
     m_attributes(0),
     m_indices(0),
-    m_rawVertices(0),
-    m_rawIndices(0),
+    m_driver(0),
+    m_vertexFormat(FullFormat),
+    m_vertexSize(RecordSize),
+    m_normalOffset(12),
+    m_texOffset(24),
+    m_halfTexCoords(false),
+    m_indexType(Driver::UnsignedIntIndex),
+    m_vertexCount(0),
+    m_indexCount(0),
     m_primitive(Driver::Triangles)
 {
 }
 
 Mesh::~Mesh()
 {
-  delete m_rawVertices;
-  delete m_rawIndices;
-  delete m_attributes;
-  delete m_indices;
+  evictCpu();
+  evictGpu();
 }
 
 void Mesh::setMesh(int vertexCount, int indexCount, unsigned char *vertices, unsigned char *normals,
                    unsigned char *tex, unsigned char *indices, Driver::DrawPrimitive primitive)
 {
-  // Copy raw vertices
-  m_rawVertices = new float[vertexCount * 3];
-  memcpy(m_rawVertices, vertices, sizeof(float) * vertexCount * 3);
+  // Combine everything into one big array that is only used for upload
+  unsigned char *records = new unsigned char[vertexCount * RecordSize];
+  interleaveRecords(vertexCount, vertices, normals, tex, records);
+  setMeshRecords(vertexCount, indexCount, records, (unsigned int*) indices, primitive);
+  delete[] records;
+}
+
+void Mesh::setMeshRecords(int vertexCount, int indexCount, const unsigned char *records,
+                          const unsigned int *indices, Driver::DrawPrimitive primitive)
+{
+  // Free previously specified mesh
+  evictCpu();
+  evictGpu();
   
-  m_rawIndices = new unsigned int[indexCount];
-  memcpy(m_rawIndices, indices, sizeof(unsigned int) * indexCount);
-  
-  // Combine everything into one big array
-  unsigned char *attributes = new unsigned char[vertexCount * RECORD_SIZE];
-  for (int i = 0; i < vertexCount; i++) {
-    memcpy(attributes + i*32, vertices + i*12, 12);
-    
-    if (normals)
-      memcpy(attributes + i*32 + 12, normals + i*12, 12);
-    else
-      memset(attributes + i*32 + 12, 0, 12);
-    
-    if (tex)
-      memcpy(attributes + i*32 + 24, tex + i*8, 8);
-    else
-      memset(attributes + i*32 + 24, 0, 8);
-  }
+  // Positions and indices are the only CPU-side copy; records are
+  // uploaded straight from the caller's buffer
+  m_geometry = Geometry::fromRecords(vertexCount, indexCount, records, RecordSize, indices);
   
   m_primitive = primitive;
   m_driver = m_storage->context()->driver();
   m_vertexCount = vertexCount;
   m_indexCount = indexCount;
+  
+  // Convert records into the vertex format
+  setupLayout();
+  std::vector<unsigned char> encoded;
+  if (m_vertexFormat != FullFormat) {
+    encoded.resize(vertexCount * m_vertexSize);
+    if (vertexCount > 0) {
+      encodeRecords(records, &encoded[0]);
+      records = &encoded[0];
+    }
+  }
+  
+  // Small meshes only need 16-bit indices
+  std::vector<unsigned short> shortIndices;
+  const unsigned char *indexData = (const unsigned char*) indices;
+  int indexSize = 4;
+  m_indexType = Driver::UnsignedIntIndex;
+  
+  if (vertexCount <= 65536 && indexCount > 0) {
+    shortIndices.assign(indices, indices + indexCount);
+    indexData = (const unsigned char*) &shortIndices[0];
+    indexSize = 2;
+    m_indexType = Driver::UnsignedShortIndex;
+  }
+  
   m_attributes = m_driver->createVertexBuffer(
-    vertexCount * RECORD_SIZE,
-    attributes,
+    vertexCount * m_vertexSize,
+    const_cast<unsigned char*>(records),
     DVertexBuffer::StaticDraw,
     DVertexBuffer::VertexArray
   );
   m_indices = m_driver->createVertexBuffer(
-    indexCount * 4,
-    indices,
+    indexCount * indexSize,
+    const_cast<unsigned char*>(indexData),
     DVertexBuffer::StaticDraw,
     DVertexBuffer::ElementArray
   );
+}
+
+void Mesh::interleaveRecords(int vertexCount, const unsigned char *vertices, const unsigned char *normals,
+                             const unsigned char *tex, unsigned char *records)
+{
+  for (int i = 0; i < vertexCount; i++) {
+    memcpy(records + i*RecordSize, vertices + i*12, 12);
+    
+    if (normals)
+      memcpy(records + i*RecordSize + 12, normals + i*12, 12);
+    else
+      memset(records + i*RecordSize + 12, 0, 12);
+    
+    if (tex)
+      memcpy(records + i*RecordSize + 24, tex + i*8, 8);
+    else
+      memset(records + i*RecordSize + 24, 0, 8);
+  }
+}
+
+void Mesh::setupLayout()
+{
+  // Half-float texture coordinates need driver support
+  m_halfTexCoords = m_vertexFormat != FullFormat && m_driver->hasHalfFloatVertices();
   
-  delete attributes;
+  switch (m_vertexFormat) {
+    case CompressedFormat: m_normalOffset = 12; break;
+    case QuantizedFormat: m_normalOffset = 8; break;
+    default: m_normalOffset = 12; break;
+  }
+  
+  m_texOffset = m_normalOffset + (m_vertexFormat == FullFormat ? 12 : 4);
+  m_vertexSize = m_texOffset + (m_halfTexCoords ? 4 : 8);
+  
+  for (int j = 0; j < 3; j++) {
+    m_positionOffset[j] = 0.0f;
+    m_positionScale[j] = 1.0f;
+  }
+}
+
+void Mesh::encodeRecords(const unsigned char *records, unsigned char *encoded)
+{
+  // Quantization range is the bounding box of all vertices
+  if (m_vertexFormat == QuantizedFormat) {
+    float mind[3];
+    float maxd[3];
+    const float *positions = m_geometry->positions();
+    for (int j = 0; j < 3; j++) {
+      mind[j] = m_vertexCount ? positions[j] : 0;
+      maxd[j] = mind[j];
+    }
+    
+    for (int i = 0; i < m_vertexCount * 3; i++) {
+      mind[i % 3] = std::min(mind[i % 3], positions[i]);
+      maxd[i % 3] = std::max(maxd[i % 3], positions[i]);
+    }
+    
+    for (int j = 0; j < 3; j++) {
+      m_positionOffset[j] = mind[j];
+      m_positionScale[j] = maxd[j] - mind[j];
+    }
+  }
+  
+  for (int i = 0; i < m_vertexCount; i++) {
+    const unsigned char *record = records + i*RecordSize;
+    unsigned char *out = encoded + i*m_vertexSize;
+    float attributes[8];
+    memcpy(attributes, record, RecordSize);
+    
+    // Position
+    if (m_vertexFormat == QuantizedFormat) {
+      unsigned short position[4] = { 0, 0, 0, 0 };
+      for (int j = 0; j < 3; j++) {
+        float t = m_positionScale[j] > 0 ? (attributes[j] - m_positionOffset[j]) / m_positionScale[j] : 0;
+        position[j] = (unsigned short) floorf(std::max(0.0f, std::min(1.0f, t)) * 65535.0f + 0.5f);
+      }
+      memcpy(out, position, 8);
+    } else {
+      memcpy(out, attributes, 12);
+    }
+    
+    // Normal
+    short normal[2];
+    encodeOctahedral(attributes + 3, normal);
+    memcpy(out + m_normalOffset, normal, 4);
+    
+    // Texture coordinates
+    if (m_halfTexCoords) {
+      unsigned short tex[2] = { floatToHalf(attributes[6]), floatToHalf(attributes[7]) };
+      memcpy(out + m_texOffset, tex, 4);
+    } else {
+      memcpy(out + m_texOffset, attributes + 6, 8);
+    }
+  }
 }
 
 void Mesh::setBounds(const Vector3f &min, const Vector3f &max)
@@ -87,35 +273,119 @@ void Mesh::setBounds(const Vector3f &min, const Vector3f &max)
 
 void Mesh::bind() const
 {
+  touch();
+  if (!m_attributes) {
+    restore();
+    
+    // Meshes that could not be restored are not drawn
+    if (!m_attributes) {
+      m_storage->logger()->warning("Unable to restore mesh '" + getId() + "', skipping it!");
+      return;
+    }
+  }
+  
   m_attributes->bind();
   m_indices->bind();
   
   DShader *shader = m_driver->currentShader();
   if (shader) {
-    shader->bindAttributePointer("Vertex", 3, RECORD_SIZE, 0);
-    shader->bindAttributePointer("Normal", 3, RECORD_SIZE, 12);
-    shader->bindAttributePointer("TexCoord", 2, RECORD_SIZE, 24);
+    bool quantized = m_vertexFormat == QuantizedFormat;
+    bool packedNormals = m_vertexFormat != FullFormat;
+    
+    if (quantized)
+      shader->bindAttributePointer("Vertex", 3, DShader::UnsignedShort, true, m_vertexSize, 0);
+    else
+      shader->bindAttributePointer("Vertex", 3, m_vertexSize, 0);
+    
+    if (packedNormals)
+      shader->bindAttributePointer("Normal", 2, DShader::Short, true, m_vertexSize, m_normalOffset);
+    else
+      shader->bindAttributePointer("Normal", 3, m_vertexSize, m_normalOffset);
+    
+    if (m_halfTexCoords)
+      shader->bindAttributePointer("TexCoord", 2, DShader::HalfFloat, false, m_vertexSize, m_texOffset);
+    else
+      shader->bindAttributePointer("TexCoord", 2, m_vertexSize, m_texOffset);
+    
+    // Parameters for unpacking attributes in shaders
+    float flags[2] = { quantized ? 1.0f : 0.0f, packedNormals ? 1.0f : 0.0f };
+    shader->setUniform("QuantizedPositions", 1, &flags[0]);
+    shader->setUniform("PackedNormals", 1, &flags[1]);
+    shader->setUniform("PositionOffset", 3, const_cast<float*>(m_positionOffset));
+    shader->setUniform("PositionScale", 3, const_cast<float*>(m_positionScale));
   }
 }
 
 void Mesh::unbind() const
 {
+  if (!m_attributes)
+    return;
+  
   m_attributes->unbind();
   m_indices->unbind();
 }
 
 void Mesh::draw() const
 {
-  m_driver->drawElements(m_indexCount, 0, m_primitive);
+  if (!m_attributes)
+    return;
+  
+  m_driver->drawElements(m_indexCount, 0, m_primitive, m_indexType);
+}
+
+void Mesh::drawInstanced(int instances) const
+{
+  if (!m_attributes)
+    return;
+  
+  m_driver->drawElementsInstanced(m_indexCount, 0, m_primitive, m_indexType, instances);
+}
+
+GeometryPtr Mesh::geometry() const
+{
+  touch();
+  if (!m_geometry)
+    restore();
+  
+  return m_geometry;
+}
+
+void Mesh::restore() const
+{
+  // Evicted data is only restored by loading the mesh again
+  m_storage->reload(const_cast<Mesh*>(this));
+}
+
+size_t Mesh::cpuMemoryUsage() const
+{
+  return m_geometry ? m_geometry->memoryUsage() : 0;
+}
+
+size_t Mesh::gpuMemoryUsage() const
+{
+  int indexSize = m_indexType == Driver::UnsignedShortIndex ? 2 : 4;
+  return m_attributes ? m_vertexCount * m_vertexSize + m_indexCount * indexSize : 0;
+}
+
+void Mesh::evictCpu()
+{
+  m_geometry.reset();
+}
+
+void Mesh::evictGpu()
+{
+  delete m_attributes;
+  delete m_indices;
+  m_attributes = 0;
+  m_indices = 0;
 }
 
 void Mesh::getConvexHullShape(btConvexHullShape *shape) const
 {
-  for (int i = 0; i < m_vertexCount; i++) {
-    float a = m_rawVertices[3*i];
-    float b = m_rawVertices[3*i + 1];
-    float c = m_rawVertices[3*i + 2];
-    shape->addPoint(btVector3(a, b, c));
+  GeometryPtr geometry = this->geometry();
+  for (int i = 0; i < geometry->vertexCount(); i++) {
+    const float *p = geometry->position(i);
+    shape->addPoint(btVector3(p[0], p[1], p[2]));
   }
 }
 
@@ -0,0 +1,184 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "storage/residency.h"
+#include "logger.h"
+
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+
+#include <algorithm>
+
+using boost::format;
+
+// Number of frames between budget checks
+#define RESIDENCY_CHECK_INTERVAL 30
+
+// Items used within this many frames are never evicted
+#define RESIDENCY_MIN_AGE 120
+
+namespace IID {
+
+const size_t ResidencyManager::Unlimited = (size_t) -1;
+
+/**
+ * Orders resident items from least to most recently used.
+ */
+struct ResidentLruLess {
+    bool operator()(const Resident *a, const Resident *b) const
+    {
+      return a->lastUse() < b->lastUse();
+    }
+};
+
+Resident::Resident(ResidencyManager *manager, const std::string &type)
+  : m_manager(manager),
+    m_residentType(type),
+    m_references(0),
+    m_lastUse(manager ? manager->frame() : 0)
+{
+  if (m_manager)
+    m_manager->add(this);
+}
+
+Resident::~Resident()
+{
+  if (m_manager)
+    m_manager->remove(this);
+}
+
+void Resident::touch() const
+{
+  if (m_manager)
+    m_lastUse = m_manager->frame();
+}
+
+ResidencyManager::ResidencyManager(Logger *logger)
+  : m_logger(logger),
+    m_frame(0)
+{
+}
+
+void ResidencyManager::setBudget(const std::string &type, size_t cpuBytes, size_t gpuBytes)
+{
+  m_budgets[type] = std::make_pair(cpuBytes, gpuBytes);
+}
+
+void ResidencyManager::add(Resident *resident)
+{
+  m_residents.push_back(resident);
+}
+
+void ResidencyManager::remove(Resident *resident)
+{
+  std::vector<Resident*>::iterator i = std::find(m_residents.begin(), m_residents.end(), resident);
+  if (i == m_residents.end())
+    return;
+  
+  *i = m_residents.back();
+  m_residents.pop_back();
+}
+
+void ResidencyManager::update()
+{
+  if (++m_frame % RESIDENCY_CHECK_INTERVAL)
+    return;
+  
+  typedef std::pair<std::string, std::pair<size_t, size_t> > Budget;
+  BOOST_FOREACH(const Budget &budget, m_budgets) {
+    if (budget.second.first != Unlimited)
+      evict(budget.first, false, budget.second.first);
+    
+    if (budget.second.second != Unlimited)
+      evict(budget.first, true, budget.second.second);
+  }
+}
+
+void ResidencyManager::evict(const std::string &type, bool gpu, size_t budget)
+{
+  // Determine usage and candidates for eviction
+  size_t usage = 0;
+  std::vector<Resident*> candidates;
+  BOOST_FOREACH(Resident *resident, m_residents) {
+    if (resident->residentType() != type)
+      continue;
+    
+    size_t bytes = gpu ? resident->gpuMemoryUsage() : resident->cpuMemoryUsage();
+    usage += bytes;
+    if (bytes && !resident->references() && resident->lastUse() + RESIDENCY_MIN_AGE < m_frame)
+      candidates.push_back(resident);
+  }
+  
+  bool &overBudget = m_overBudget[std::make_pair(type, gpu)];
+  if (usage <= budget) {
+    overBudget = false;
+    return;
+  }
+  
+  std::sort(candidates.begin(), candidates.end(), ResidentLruLess());
+  BOOST_FOREACH(Resident *resident, candidates) {
+    if (usage <= budget)
+      break;
+    
+    if (gpu) {
+      usage -= resident->gpuMemoryUsage();
+      resident->evictGpu();
+    } else {
+      usage -= resident->cpuMemoryUsage();
+      resident->evictCpu();
+    }
+  }
+  
+  if (usage > budget && !overBudget)
+    m_logger->warning(str(format("%s %s memory is over budget (%d of %d bytes) with all unused copies evicted.") % type % (gpu ? "GPU" : "CPU") % usage % budget));
+  
+  overBudget = usage > budget;
+}
+
+void ResidencyManager::getUsage(std::vector<ResidencyUsage> &usage) const
+{
+  boost::unordered_map<std::string, ResidencyUsage> types;
+  BOOST_FOREACH(Resident *resident, m_residents) {
+    const std::string &type = resident->residentType();
+    if (types.find(type) == types.end()) {
+      ResidencyUsage &entry = types[type];
+      entry.type = type;
+      entry.items = 0;
+      entry.cpuBytes = 0;
+      entry.gpuBytes = 0;
+      entry.cpuBudget = Unlimited;
+      entry.gpuBudget = Unlimited;
+      
+      if (m_budgets.find(type) != m_budgets.end()) {
+        entry.cpuBudget = m_budgets.at(type).first;
+        entry.gpuBudget = m_budgets.at(type).second;
+      }
+    }
+    
+    ResidencyUsage &entry = types[type];
+    entry.items++;
+    entry.cpuBytes += resident->cpuMemoryUsage();
+    entry.gpuBytes += resident->gpuMemoryUsage();
+  }
+  
+  usage.clear();
+  typedef std::pair<std::string, ResidencyUsage> TypeUsage;
+  BOOST_FOREACH(const TypeUsage &entry, types) {
+    usage.push_back(entry.second);
+  }
+}
+
+void ResidencyManager::logUsage() const
+{
+  std::vector<ResidencyUsage> usage;
+  getUsage(usage);
+  
+  BOOST_FOREACH(const ResidencyUsage &entry, usage) {
+    m_logger->info(str(format("%s: %d items, %d KiB CPU, %d KiB GPU.") % entry.type % entry.items % (entry.cpuBytes / 1024) % (entry.gpuBytes / 1024)));
+  }
+}
+
+}
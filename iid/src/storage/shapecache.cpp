@@ -0,0 +1,214 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "storage/shapecache.h"
+#include "storage/storage.h"
+#include "storage/arguments.h"
+#include "storage/mesh.h"
+#include "storage/compositemesh.h"
+#include "mappedfile.h"
+#include "logger.h"
+
+// Bullet
+#include <BulletCollision/CollisionShapes/btBoxShape.h>
+#include <BulletCollision/CollisionShapes/btConvexHullShape.h>
+#include <BulletCollision/CollisionShapes/btShapeHull.h>
+
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/filesystem.hpp>
+
+#include <fstream>
+#include <vector>
+#include <stdio.h>
+
+namespace fs = boost::filesystem;
+using boost::format;
+
+// Hull file identification; the version must be incremented whenever the
+// layout or hull construction changes
+#define HULL_CACHE_MAGIC 0x48444949
+#define HULL_CACHE_VERSION 1
+
+namespace IID {
+
+/**
+ * Persisted hull file header, followed by packed points.
+ */
+struct HullCacheHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long fingerprint;
+    unsigned int pointCount;
+    unsigned int reserved;
+};
+
+ShapeCache::ShapeCache(Logger *logger, const std::string &directory)
+  : m_logger(logger),
+    m_directory(directory)
+{
+}
+
+ShapeCache::~ShapeCache()
+{
+  typedef std::pair<ShapeKey, btCollisionShape*> Shape;
+  BOOST_FOREACH(Shape shape, m_shapes) {
+    delete shape.second;
+  }
+}
+
+btCollisionShape *ShapeCache::get(Item *mesh, ShapeType type)
+{
+  ShapeKey key(mesh, type);
+  if (m_shapes.find(key) != m_shapes.end())
+    return m_shapes[key];
+  
+  bool composite = mesh->getType() == "CompositeMesh";
+  if (!composite && mesh->getType() != "Mesh")
+    return 0;
+  
+  btCollisionShape *shape;
+  if (type == BoxShape) {
+    AxisAlignedBox box = composite ? static_cast<CompositeMesh*>(mesh)->getAABB() : static_cast<Mesh*>(mesh)->getAABB();
+    Vector3f hs = box.getHalfSize();
+    shape = new btBoxShape(btVector3(hs[0], hs[1], hs[2]));
+  } else {
+    // Hulls are only built when no valid persisted hull exists
+    std::string path = filename(mesh, type);
+    size_t hash = fingerprint(mesh);
+    btConvexHullShape *hull = loadHull(path, hash);
+    if (!hull) {
+      hull = buildHull(mesh, type == SimplifiedHullShape);
+      storeHull(path, hash, hull);
+      m_logger->info(str(format("Built collision hull for '%s' with %d points.") % storagePath(mesh) % hull->getNumPoints()));
+    }
+    
+    shape = hull;
+  }
+  
+  m_shapes[key] = shape;
+  return shape;
+}
+
+btConvexHullShape *ShapeCache::buildHull(Item *mesh, bool simplified) const
+{
+  btConvexHullShape *hull = new btConvexHullShape();
+  if (mesh->getType() == "CompositeMesh") {
+    typedef std::pair<std::string, Item*> Child;
+    BOOST_FOREACH(Child c, *mesh->children()) {
+      static_cast<Mesh*>(c.second)->getConvexHullShape(hull);
+    }
+  } else {
+    static_cast<Mesh*>(mesh)->getConvexHullShape(hull);
+  }
+  
+  if (!simplified)
+    return hull;
+  
+  // Reduce the hull to its significant vertices
+  btShapeHull *reduced = new btShapeHull(hull);
+  reduced->buildHull(hull->getMargin());
+  btConvexHullShape *shape = new btConvexHullShape();
+  for (int i = 0; i < reduced->numVertices(); i++) {
+    shape->addPoint(reduced->getVertexPointer()[i]);
+  }
+  
+  delete reduced;
+  delete hull;
+  return shape;
+}
+
+size_t ShapeCache::fingerprint(Item *mesh) const
+{
+  size_t seed = 0;
+  if (mesh->getType() == "CompositeMesh") {
+    typedef std::pair<std::string, Item*> Child;
+    BOOST_FOREACH(Child c, *mesh->children()) {
+      boost::hash_combine(seed, c.first);
+      boost::hash_combine(seed, static_cast<Mesh*>(c.second)->geometry()->hash());
+    }
+  } else {
+    boost::hash_combine(seed, static_cast<Mesh*>(mesh)->geometry()->hash());
+  }
+  
+  return seed;
+}
+
+std::string ShapeCache::filename(Item *mesh, ShapeType type) const
+{
+  boost::hash<std::string> hasher;
+  std::string key = str(format("%s:%d") % storagePath(mesh) % type);
+  return (fs::path(m_directory) / str(format("%016x.hull") % (unsigned long long) hasher(key))).string();
+}
+
+btConvexHullShape *ShapeCache::loadHull(const std::string &filename, size_t fingerprint) const
+{
+  MappedFile file;
+  if (!file.open(filename))
+    return 0;
+  
+  // Stale or invalid files are ignored and will be overwritten
+  const HullCacheHeader *header = reinterpret_cast<const HullCacheHeader*>(file.data());
+  if (file.size() < sizeof(HullCacheHeader) || header->magic != HULL_CACHE_MAGIC ||
+      header->version != HULL_CACHE_VERSION || header->fingerprint != fingerprint ||
+      (file.size() - sizeof(HullCacheHeader)) / 12 < header->pointCount)
+    return 0;
+  
+  const float *points = reinterpret_cast<const float*>(header + 1);
+  btConvexHullShape *hull = new btConvexHullShape();
+  for (unsigned int i = 0; i < header->pointCount; i++) {
+    hull->addPoint(btVector3(points[3*i], points[3*i + 1], points[3*i + 2]));
+  }
+  
+  return hull;
+}
+
+void ShapeCache::storeHull(const std::string &filename, size_t fingerprint, btConvexHullShape *hull) const
+{
+  HullCacheHeader header;
+  header.magic = HULL_CACHE_MAGIC;
+  header.version = HULL_CACHE_VERSION;
+  header.fingerprint = fingerprint;
+  header.pointCount = hull->getNumPoints();
+  header.reserved = 0;
+  
+  std::vector<float> points(3 * header.pointCount);
+  for (unsigned int i = 0; i < header.pointCount; i++) {
+    const btVector3 &point = hull->getUnscaledPoints()[i];
+    points[3*i] = point.x();
+    points[3*i + 1] = point.y();
+    points[3*i + 2] = point.z();
+  }
+  
+  try {
+    fs::create_directories(m_directory);
+  } catch (fs::filesystem_error &e) {
+    m_logger->warning("Unable to create hull cache directory '" + m_directory + "'!");
+    return;
+  }
+  
+  // Write into a temporary file first so a partially written file is never
+  // picked up by the loader
+  std::string tmpFilename = filename + ".tmp";
+  std::ofstream out(tmpFilename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out) {
+    m_logger->warning("Unable to write hull cache file '" + tmpFilename + "'!");
+    return;
+  }
+  
+  out.write((const char*) &header, sizeof(header));
+  if (!points.empty())
+    out.write((const char*) &points[0], points.size() * sizeof(float));
+  
+  out.close();
+  if (!out || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    m_logger->warning("Unable to write hull cache file '" + filename + "'!");
+    remove(tmpFilename.c_str());
+  }
+}
+
+}
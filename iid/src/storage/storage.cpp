@@ -6,7 +6,12 @@
  */
 #include "storage/storage.h"
 #include "storage/importers/base.h"
+#include "storage/archive.h"
+#include "storage/residency.h"
+#include "storage/shapecache.h"
+#include "storage/arguments.h"
 #include "context.h"
+#include "threadpool.h"
 #include "logger.h"
 #include "exceptions.h"
 
@@ -16,9 +21,17 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <algorithm>
 #include <boost/foreach.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/classification.hpp>
+#include <boost/format.hpp>
+#include <boost/bind.hpp>
+
+// Maximum number of prefetched files finished by a single update
+#define STORAGE_LOADS_PER_UPDATE 4
+
+using boost::format;
 
 namespace IID {
 
@@ -86,15 +99,57 @@ Item *Item::child(const std::string &itemId)
   return m_children.at(itemId);
 }
 
+AssetHandle::AssetHandle()
+  : m_storage(0),
+    m_item(0)
+{
+}
+
+AssetHandle::AssetHandle(Storage *storage, Item *item)
+  : m_storage(storage),
+    m_item(item)
+{
+}
+
+bool AssetHandle::isReady() const
+{
+  return m_item && m_storage->isLoaded(m_item);
+}
+
+Item *AssetHandle::wait()
+{
+  if (m_item)
+    m_storage->waitLoaded(m_item);
+  
+  return m_item;
+}
+
 Storage::Storage(Context *context)
   : m_context(context),
-    m_logger(context->logger("iid.storage")),
-    m_root(new Item(this, "root"))
+    m_logger(context ? context->logger("iid.storage") : new Logger("iid.storage")),
+    m_root(new Item(this, "root")),
+    m_archive(0),
+    m_lazyLoading(true)
 {
+  m_residency = new ResidencyManager(m_logger);
+  m_shapes = new ShapeCache(m_logger);
 }
 
 Storage::~Storage()
 {
+  // Wait for files still being prepared and drop the rest; this must be
+  // done first as workers may still be using the importers
+  typedef std::pair<Item*, std::vector<PendingLoad*> > ItemLoads;
+  BOOST_FOREACH(ItemLoads loads, m_pendingLoads) {
+    BOOST_FOREACH(PendingLoad *load, loads.second) {
+      boost::mutex::scoped_lock lock(m_loadMutex);
+      while (load->submitted && !load->prepared)
+        m_loadPrepared.wait(lock);
+      
+      delete load;
+    }
+  }
+  
   // Delete all registred type factories
   typedef std::pair<std::string, ItemFactory*> Child;
   BOOST_FOREACH(Child child, m_types) {
@@ -107,7 +162,10 @@ Storage::~Storage()
     delete child.second;
   }
   
+  delete m_shapes;
   delete m_root;
+  delete m_residency;
+  delete m_archive;
   delete m_logger;
 }
 
@@ -117,7 +175,15 @@ void Storage::load()
   
   try {
     ticpp::Document manifest("manifest.xml");
-    manifest.LoadFile();
+    std::vector<unsigned char> buffer;
+    const unsigned char *data;
+    size_t size;
+    
+    if (m_archive && m_archive->read("manifest.xml", buffer, data, size))
+      manifest.Parse(std::string((const char*) data, size));
+    else
+      manifest.LoadFile();
+    
     std::string version;
     
     if (manifest.FirstChildElement()->Value() != "manifest") {
@@ -140,9 +206,291 @@ void Storage::load()
     m_logger->error("Unable to open 'manifest.xml' storage descriptor!");
   }
   
+  // Other files are loaded on first use or when prefetched
+  std::vector<AssetHandle> handles;
+  if (m_lazyLoading) {
+    BOOST_FOREACH(Item *item, m_preloadItems) {
+      handles.push_back(prefetch(item));
+    }
+  } else {
+    handles.push_back(prefetch(m_root));
+  }
+  
+  BOOST_FOREACH(AssetHandle &handle, handles) {
+    handle.wait();
+  }
+  
+  m_preloadItems.clear();
+  m_logger->info(str(format("%d items remain to be loaded on demand.") % m_pendingLoads.size()));
+  
   m_logger->info("Storage system initialized.");
 }
 
+bool Storage::mount(const std::string &filename)
+{
+  Archive *archive = new Archive();
+  if (!archive->mount(filename)) {
+    m_logger->error("Unable to mount archive '" + filename + "'!");
+    delete archive;
+    return false;
+  }
+  
+  delete m_archive;
+  m_archive = archive;
+  m_logger->info(str(format("Mounted archive '%s' with %d entries.") % filename % archive->size()));
+  return true;
+}
+
+void Storage::setLazyLoading(bool lazy)
+{
+  m_lazyLoading = lazy;
+}
+
+void Storage::queueLoad(Item *item, Importer *importer, const std::string &filename)
+{
+  m_sources[item].push_back(std::make_pair(importer, filename));
+  addPendingLoad(item, importer, filename);
+}
+
+void Storage::addPendingLoad(Item *item, Importer *importer, const std::string &filename)
+{
+  PendingLoad *load = new PendingLoad();
+  load->item = item;
+  load->importer = importer;
+  load->filename = filename;
+  load->data = 0;
+  load->size = 0;
+  load->submitted = false;
+  load->prepared = false;
+  load->compiled = false;
+  m_pendingLoads[item].push_back(load);
+}
+
+bool Storage::reload(Item *item)
+{
+  // Find the nearest item that has files
+  Item *owner = item;
+  while (owner && m_sources.find(owner) == m_sources.end())
+    owner = owner->parent();
+  
+  if (!owner) {
+    m_logger->warning("Unable to reload item '" + item->getId() + "' as it has no files!");
+    return false;
+  }
+  
+  // Files that are still pending will restore the item anyway
+  if (m_pendingLoads.find(owner) == m_pendingLoads.end()) {
+    typedef std::pair<Importer*, std::string> Source;
+    BOOST_FOREACH(const Source &source, m_sources[owner]) {
+      addPendingLoad(owner, source.first, source.second);
+    }
+    
+    m_logger->info("Reloading evicted item '" + storagePath(owner) + "'.");
+  }
+  
+  ensureLoaded(owner);
+  return true;
+}
+
+void Storage::addDependency(Item *item, const std::string &path)
+{
+  m_dependencies[item].push_back(path);
+}
+
+void Storage::orderLoads(Item *item, std::vector<PendingLoad*> &order, boost::unordered_map<Item*, int> &state)
+{
+  // State is 1 while dependencies are being visited and 2 once done
+  if (state[item] == 2)
+    return;
+  
+  if (state[item] == 1) {
+    m_logger->warning("Circular dependency involving item '" + item->getId() + "'!");
+    return;
+  }
+  
+  state[item] = 1;
+  if (m_dependencies.find(item) != m_dependencies.end()) {
+    BOOST_FOREACH(const std::string &path, m_dependencies[item]) {
+      Item *dependency = lookup(path, false);
+      if (!dependency) {
+        m_logger->warning("Item '" + item->getId() + "' depends on unknown item '" + path + "'!");
+        continue;
+      }
+      
+      orderLoads(dependency, order, state);
+    }
+  }
+  
+  if (m_pendingLoads.find(item) != m_pendingLoads.end()) {
+    BOOST_FOREACH(PendingLoad *load, m_pendingLoads[item]) {
+      if (!load->submitted)
+        order.push_back(load);
+    }
+  }
+  
+  state[item] = 2;
+}
+
+void Storage::submitLoads(Item *item)
+{
+  std::vector<PendingLoad*> order;
+  boost::unordered_map<Item*, int> state;
+  orderLoads(item, order, state);
+  submitLoads(order);
+}
+
+void Storage::submitLoads(const std::vector<PendingLoad*> &order)
+{
+  // Files are finished in submission order, which puts dependencies first;
+  // preparation runs at background priority so frame work never queues
+  // behind it
+  ThreadPool *pool = m_context ? m_context->getThreadPool() : 0;
+  BOOST_FOREACH(PendingLoad *load, order) {
+    load->submitted = true;
+    m_submittedLoads.push_back(load);
+    
+    if (pool)
+      pool->submit(boost::bind(&Storage::prepareLoad, this, load), 0, ThreadPool::Background);
+    else
+      prepareLoad(load);
+  }
+}
+
+void Storage::prepareLoad(PendingLoad *load)
+{
+  // Prefer preprocessed data from a mounted archive
+  if (m_archive && m_archive->read(storagePath(load->item), load->buffer, load->data, load->size)) {
+    load->compiled = true;
+  } else if (load->importer->prepare(load->item, load->filename, load->buffer, load->file)) {
+    if (load->file.isOpen()) {
+      load->data = load->file.data();
+      load->size = load->file.size();
+    } else {
+      load->data = load->buffer.empty() ? 0 : &load->buffer[0];
+      load->size = load->buffer.size();
+    }
+    load->compiled = true;
+  }
+  
+  boost::mutex::scoped_lock lock(m_loadMutex);
+  load->prepared = true;
+  m_loadPrepared.notify_all();
+}
+
+void Storage::finishLoad(PendingLoad *load)
+{
+  m_submittedLoads.erase(std::find(m_submittedLoads.begin(), m_submittedLoads.end(), load));
+  
+  {
+    boost::mutex::scoped_lock lock(m_loadMutex);
+    while (!load->prepared)
+      m_loadPrepared.wait(lock);
+  }
+  
+  // Files that could not be prepared are loaded entirely on this thread
+  if (load->compiled)
+    load->importer->loadCompiled(this, load->item, load->data, load->size);
+  else
+    load->importer->load(this, load->item, load->filename);
+  
+  std::vector<PendingLoad*> &loads = m_pendingLoads[load->item];
+  loads.erase(std::find(loads.begin(), loads.end(), load));
+  if (loads.empty())
+    m_pendingLoads.erase(load->item);
+  
+  delete load;
+}
+
+void Storage::ensureLoaded(Item *item)
+{
+  if (m_pendingLoads.find(item) == m_pendingLoads.end())
+    return;
+  
+  // Only files of the item and its dependencies are finished here, so
+  // restoring an item in the middle of rendering does not upload unrelated
+  // prefetched items and disturb the render state
+  std::vector<PendingLoad*> order;
+  boost::unordered_map<Item*, int> state;
+  orderLoads(item, order, state);
+  submitLoads(order);
+  
+  while (m_pendingLoads.find(item) != m_pendingLoads.end()) {
+    // Submission order still puts dependencies first
+    PendingLoad *next = 0;
+    BOOST_FOREACH(PendingLoad *load, m_submittedLoads) {
+      if (state.find(load->item) != state.end()) {
+        next = load;
+        break;
+      }
+    }
+    
+    finishLoad(next);
+  }
+}
+
+bool Storage::isLoaded(Item *item)
+{
+  if (m_pendingLoads.find(item) != m_pendingLoads.end())
+    return false;
+  
+  typedef std::pair<std::string, Item*> Child;
+  BOOST_FOREACH(Child child, *item->children()) {
+    if (!isLoaded(child.second))
+      return false;
+  }
+  
+  return true;
+}
+
+void Storage::waitLoaded(Item *item)
+{
+  ensureLoaded(item);
+  
+  typedef std::pair<std::string, Item*> Child;
+  BOOST_FOREACH(Child child, *item->children()) {
+    waitLoaded(child.second);
+  }
+}
+
+AssetHandle Storage::prefetch(Item *item)
+{
+  submitLoads(item);
+  
+  typedef std::pair<std::string, Item*> Child;
+  BOOST_FOREACH(Child child, *item->children()) {
+    prefetch(child.second);
+  }
+  
+  return AssetHandle(this, item);
+}
+
+AssetHandle Storage::prefetch(const std::string &path)
+{
+  Item *item = lookup(path, false);
+  if (!item) {
+    m_logger->warning("Unable to prefetch unknown item '" + path + "'!");
+    return AssetHandle();
+  }
+  
+  return prefetch(item);
+}
+
+void Storage::update()
+{
+  m_residency->update();
+  
+  // Finish prefetched files whose CPU stage has completed
+  for (int i = 0; i < STORAGE_LOADS_PER_UPDATE && !m_submittedLoads.empty(); i++) {
+    {
+      boost::mutex::scoped_lock lock(m_loadMutex);
+      if (!m_submittedLoads.front()->prepared)
+        return;
+    }
+    
+    finishLoad(m_submittedLoads.front());
+  }
+}
+
 void Storage::loadContainer(Item *parent, ticpp::Element *element)
 {
   ticpp::Iterator<ticpp::Element> child;
@@ -178,6 +526,10 @@ void Storage::loadContainer(Item *parent, ticpp::Element *element)
       
       m_logger->info("Creating an item '" + item->getId() + "' (container = " + parent->getId() + ").");
       
+      // Items needed right away can be marked to skip lazy loading
+      if ((*child).GetAttributeOrDefault("preload", "false") == "true")
+        m_preloadItems.push_back(item);
+      
       // Process arguments
       ticpp::Iterator<ticpp::Element> arg;
       for (arg = arg.begin(&*child); arg != arg.end(); arg++) {
@@ -229,6 +581,11 @@ void Storage::registerImporter(const std::string &name, Importer *importer)
 }
 
 Item *Storage::get(const std::string &path)
+{
+  return lookup(path, true);
+}
+
+Item *Storage::lookup(const std::string &path, bool load)
 {
   Item *item = m_root;
   std::vector<std::string> parts;
@@ -238,11 +595,18 @@ Item *Storage::get(const std::string &path)
     if (!(*i).length())
       continue;
     
+    // Children of some items are only created when they are loaded
+    if (load)
+      ensureLoaded(item);
+    
     item = item->child(*i);
     if (!item)
       return 0;
   }
   
+  if (load)
+    ensureLoaded(item);
+  
   return item;
 }
 
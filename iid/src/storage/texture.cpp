@@ -7,6 +7,7 @@
 #include "storage/texture.h"
 #include "drivers/base.h"
 #include "context.h"
+#include "logger.h"
 
 #include <string.h>
 
@@ -14,7 +15,12 @@ namespace IID {
 
 Texture::Texture(Storage *storage, const std::string &itemId, Item *parent)
   : Item(storage, "Texture", itemId, "", parent),
+    Resident(storage ? storage->residency() : 0, "Texture"),
+    m_format(RGB),
+    m_width(0),
+    m_height(0),
     m_image(0),
+    m_lastTextureUnit(0),
     m_texture(0)
 {
 }
@@ -22,63 +28,106 @@ Texture::Texture(Storage *storage, const std::string &itemId, Item *parent)
 Texture::~Texture()
 {
   delete m_texture;
-  delete m_image;
+  delete[] m_image;
 }
 
 void Texture::setImage(Format fmt, int width, int height, unsigned char *image)
 {
-  // Free previously allocated image
-  delete m_image;
+  // Free previously allocated image and texture
+  delete[] m_image;
+  delete m_texture;
+  m_texture = 0;
   
   // Copy image data
-  int components;
-  DTexture::PixelFormat pformat;
-  switch (fmt) {
-    case RGBA: {
-      components = 4;
-      pformat = DTexture::RGBA;
-      break;
-    }
-    default: {
-      components = 3;
-      pformat = DTexture::RGB;
-      break;
-    }
-  }
-  
-  m_image = new unsigned char[width * height * components];
-  memcpy(m_image, image, width * height * sizeof(unsigned char) * components);
   m_format = fmt;
   m_width = width;
   m_height = height;
+  m_image = new unsigned char[width * height * components()];
+  memcpy(m_image, image, width * height * sizeof(unsigned char) * components());
   
   // Load texture
+  upload(image);
+}
+
+void Texture::upload(const unsigned char *image)
+{
   m_texture = m_storage->context()->driver()->createTexture(DTexture::Texture2D);
   m_texture->bind(0);
   m_texture->setParameter(DTexture::WrapS, DTexture::Repeat);
   m_texture->setParameter(DTexture::WrapT, DTexture::Repeat);
   m_texture->setParameter(DTexture::MagFilter, DTexture::Linear);
   m_texture->setParameter(DTexture::MinFilter, DTexture::LinearMipmapNearest);
-  m_texture->buildMipMaps2D(components, width, height, pformat, image);
+  m_texture->buildMipMaps2D(components(), m_width, m_height, m_format == RGBA ? DTexture::RGBA : DTexture::RGB,
+                            const_cast<unsigned char*>(image));
   m_texture->unbind(0);
 }
 
+void Texture::restore()
+{
+  // Reupload a retained image or load the whole item again
+  if (m_image)
+    upload(m_image);
+  else
+    m_storage->reload(this);
+}
+
 void Texture::bind(int textureUnit)
 {
+  touch();
+  if (!m_texture) {
+    restore();
+    
+    // Textures that could not be restored are left unbound
+    if (!m_texture) {
+      m_storage->logger()->warning("Unable to restore texture '" + getId() + "', skipping it!");
+      return;
+    }
+  }
+  
   m_texture->bind(textureUnit);
   m_lastTextureUnit = textureUnit;
 }
 
 void Texture::unbind() const
 {
+  if (!m_texture)
+    return;
+  
   m_texture->unbind(m_lastTextureUnit);
 }
 
 DTexture *Texture::getTexture() const
 {
+  touch();
+  if (!m_texture)
+    const_cast<Texture*>(this)->restore();
+  
   return m_texture;
 }
 
+size_t Texture::cpuMemoryUsage() const
+{
+  return m_image ? m_width * m_height * components() : 0;
+}
+
+size_t Texture::gpuMemoryUsage() const
+{
+  // Mipmaps add a third to the base level
+  return m_texture ? m_width * m_height * components() * 4 / 3 : 0;
+}
+
+void Texture::evictCpu()
+{
+  delete[] m_image;
+  m_image = 0;
+}
+
+void Texture::evictGpu()
+{
+  delete m_texture;
+  m_texture = 0;
+}
+
 Item *TextureFactory::create(Storage *storage, const std::string &itemId, Item *parent)
 {
   return new Texture(storage, itemId, parent);
@@ -0,0 +1,167 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "threadpool.h"
+
+#include <boost/bind.hpp>
+
+namespace IID {
+
+JobGroup::JobGroup()
+  : m_pending(0),
+    m_pool(0)
+{
+}
+
+void JobGroup::jobSubmitted()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_pending++;
+}
+
+void JobGroup::jobFinished()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  if (--m_pending == 0)
+    m_finished.notify_all();
+}
+
+void JobGroup::wait()
+{
+  // Help with queued jobs instead of idling; once the queue is empty all
+  // of our jobs have been picked up and we only need to wait for them
+  for (;;) {
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      if (m_pending == 0)
+        return;
+    }
+    
+    if (!m_pool || !m_pool->runJob())
+      break;
+  }
+  
+  boost::mutex::scoped_lock lock(m_mutex);
+  while (m_pending > 0)
+    m_finished.wait(lock);
+}
+
+ThreadPool::ThreadPool(unsigned int threads)
+  : m_size(threads),
+    m_backgroundRunning(0),
+    m_shutdown(false)
+{
+  if (!m_size)
+    m_size = boost::thread::hardware_concurrency();
+  
+  // Keep one worker available for normal jobs
+  m_backgroundLimit = m_size > 1 ? m_size - 1 : 1;
+  
+  for (unsigned int i = 0; i < m_size; i++)
+    m_threads.create_thread(boost::bind(&ThreadPool::worker, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_shutdown = true;
+    m_jobAvailable.notify_all();
+  }
+  
+  m_threads.join_all();
+}
+
+void ThreadPool::submit(const Job &job, JobGroup *group, Priority priority)
+{
+  if (group) {
+    group->m_pool = this;
+    group->jobSubmitted();
+  }
+  
+  // Without any workers, jobs are executed immediately
+  if (!m_size) {
+    job();
+    if (group)
+      group->jobFinished();
+    return;
+  }
+  
+  boost::mutex::scoped_lock lock(m_mutex);
+  if (priority == Background)
+    m_backgroundJobs.push_back(QueuedJob(job, group));
+  else
+    m_jobs.push_back(QueuedJob(job, group));
+  
+  m_jobAvailable.notify_one();
+}
+
+bool ThreadPool::runJob()
+{
+  QueuedJob job;
+  
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_jobs.empty())
+      return false;
+    
+    job = m_jobs.front();
+    m_jobs.pop_front();
+  }
+  
+  job.first();
+  if (job.second)
+    job.second->jobFinished();
+  
+  return true;
+}
+
+void ThreadPool::worker()
+{
+  for (;;) {
+    QueuedJob job;
+    bool background = false;
+    
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      for (;;) {
+        // Normal jobs always go first
+        if (!m_jobs.empty()) {
+          job = m_jobs.front();
+          m_jobs.pop_front();
+          break;
+        }
+        
+        if (!m_backgroundJobs.empty() && m_backgroundRunning < m_backgroundLimit) {
+          job = m_backgroundJobs.front();
+          m_backgroundJobs.pop_front();
+          m_backgroundRunning++;
+          background = true;
+          break;
+        }
+        
+        // Drain the queues before shutting down
+        if (m_shutdown && m_backgroundJobs.empty())
+          return;
+        
+        m_jobAvailable.wait(lock);
+      }
+    }
+    
+    job.first();
+    if (job.second)
+      job.second->jobFinished();
+    
+    if (background) {
+      // Another worker might be waiting for a background slot
+      boost::mutex::scoped_lock lock(m_mutex);
+      m_backgroundRunning--;
+      m_jobAvailable.notify_one();
+    }
+  }
+}
+
+}
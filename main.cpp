@@ -15,6 +15,7 @@
 #include "storage/shader.h"
 #include "storage/sound.h"
 #include "storage/font.h"
+#include "storage/residency.h"
 
 // Scene
 #include "scene/scene.h"
@@ -23,6 +24,7 @@
 #include "scene/camera.h"
 #include "scene/light.h"
 #include "scene/geometrymeta.h"
+#include "scene/staticgeometry.h"
 
 // Events
 #include "events/dispatcher.h"
@@ -179,6 +181,16 @@ public:
     {
       m_inGame = (fromState == "play");
       
+      // Load level assets in the background while the menu is shown
+      if (!m_inGame) {
+        Storage *storage = m_context->storage();
+        storage->prefetch("/Levels");
+        storage->prefetch("/Models");
+        storage->prefetch("/Textures");
+        storage->prefetch("/Shaders");
+        storage->prefetch("/Sounds");
+      }
+      
       Font *font = m_context->storage()->get<Font>("/Fonts/verdana");
       Texture *logoImage = m_context->storage()->get<Texture>("/GUI/Images/logo");
       
@@ -309,8 +321,7 @@ public:
         m_soundPlayer(0),
         m_robot(0),
         m_staticGeometry(0),
-        m_staticGeometryMeta(0),
-        m_staticShape(0),
+        m_staticBody(0),
         m_ai(0)
     {
     }
@@ -353,13 +364,10 @@ public:
       lnode->child("object3")->setTexture(metal);
       m_scene->attachNode(lnode);
       
-      // Generate static geometry shape
-      btVector3 aabbMin(-100, -100, -100), aabbMax(100, 100, 100);
+      // Generate static geometry shape (baked on first use)
       m_scene->update();
-      m_staticGeometry = new btTriangleIndexVertexMaterialArray();
-      m_scene->getRootNode()->batchStaticGeometry(m_staticGeometry);
-      m_staticGeometryMeta = new GeometryMetadata(m_staticGeometry);
-      m_staticShape = new btMultimaterialTriangleMeshShape(m_staticGeometry, true, aabbMin, aabbMax);
+      m_staticGeometry = new StaticGeometry(m_context);
+      m_staticGeometry->build(m_scene->getRootNode(), "/Levels/first");
       
       // Load static geometry into the physics engine
       btTransform startTransform;
@@ -367,11 +375,11 @@ public:
       startTransform.setOrigin(btVector3(0, 0, 0));
       
       btDefaultMotionState *motionState = new btDefaultMotionState(startTransform);
-      btRigidBody::btRigidBodyConstructionInfo cInfo(0.0, motionState, m_staticShape, btVector3(0, 0, 0));
-      btRigidBody *body = new btRigidBody(cInfo);
-      m_context->getDynamicsWorld()->addRigidBody(body);
-      body->setCollisionFlags(body->getCollisionFlags() | btCollisionObject::CF_STATIC_OBJECT);
-      body->setCollisionFlags(body->getCollisionFlags() | btCollisionObject::CF_CUSTOM_MATERIAL_CALLBACK);
+      btRigidBody::btRigidBodyConstructionInfo cInfo(0.0, motionState, m_staticGeometry->shape(), btVector3(0, 0, 0));
+      m_staticBody = new btRigidBody(cInfo);
+      m_context->getDynamicsWorld()->addRigidBody(m_staticBody);
+      m_staticBody->setCollisionFlags(m_staticBody->getCollisionFlags() | btCollisionObject::CF_STATIC_OBJECT);
+      m_staticBody->setCollisionFlags(m_staticBody->getCollisionFlags() | btCollisionObject::CF_CUSTOM_MATERIAL_CALLBACK);
       
       // Create the sliding door
       new SlidingDoor(m_context);
@@ -444,6 +452,12 @@ public:
               m_context->setDebug(!m_context->isDebug());
             break;
           }
+          // Log asset memory usage with 'm'
+          case 'm': {
+            if (!ev->isReleased())
+              m_context->storage()->residency()->logUsage();
+            break;
+          }
           case 't': {
             // Taunt the enemy by squeaking
             m_robot->taunt();
@@ -526,14 +540,20 @@ public:
      */
     void leave(const std::string &toState)
     {
-      delete m_staticGeometryMeta;
+      // The static shape may only go away together with its body
+      if (m_staticBody) {
+        m_context->getDynamicsWorld()->removeRigidBody(m_staticBody);
+        delete m_staticBody->getMotionState();
+        delete m_staticBody;
+      }
+      
       delete m_staticGeometry;
       delete m_robot;
       delete m_soundPlayer;
       delete m_ai;
       
-      m_staticGeometryMeta = 0;
       m_staticGeometry = 0;
+      m_staticBody = 0;
       m_robot = 0;
       m_soundPlayer = 0;
       m_ai = 0;
@@ -551,9 +571,8 @@ private:
     Robot *m_robot;
     
     // Phsyics
-    btTriangleIndexVertexMaterialArray *m_staticGeometry;
-    GeometryMetadata *m_staticGeometryMeta;
-    btBvhTriangleMeshShape *m_staticShape;
+    StaticGeometry *m_staticGeometry;
+    btRigidBody *m_staticBody;
     
     // AI
     AIController *m_ai;
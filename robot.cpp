@@ -12,6 +12,7 @@
 // IID includes
 #include "context.h"
 #include "scene/camera.h"
+#include "scene/particlemanager.h"
 
 // Storage
 #include "storage/mesh.h"
@@ -95,7 +96,7 @@ Robot::Robot(Context *context, Camera *camera, AIController *ai)
   m_sceneNode->getSoundPlayer("ThrustersPlayer")->setMode(Player::Looped);
   m_sceneNode->getSoundPlayer("ThrustersPlayer")->queue(m_sounds["Thrusters"]);
   
-  m_exhaust = new ParticleEmitter("Exhaust", 100);
+  m_exhaust = scene->getParticleManager()->createEmitter("Exhaust", 100);
   m_exhaust->setTexture(storage->get<Texture>("/Textures/particle"));
   m_exhaust->setPosition(0, 0, -0.5);
   m_exhaust->setOrientation(
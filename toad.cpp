@@ -16,13 +16,12 @@
 #include "storage/compositemesh.h"
 #include "storage/texture.h"
 #include "storage/shader.h"
+#include "storage/shapecache.h"
 #include "drivers/openal.h"
 
 #include <boost/lexical_cast.hpp>
 #include <boost/foreach.hpp>
 
-#include <BulletCollision/CollisionShapes/btShapeHull.h>
-
 using namespace IID;
 
 Toad::Toad(const Vector3f &pos, IID::Context *context, Robot *target, AIController *ai)
@@ -55,10 +54,7 @@ Toad::Toad(const Vector3f &pos, IID::Context *context, Robot *target, AIControll
   scene->update();
   
   // Create the toad's physical shape and body
-  Vector3f hs = frogMesh->getAABB().getHalfSize();
-  btConvexHullShape *shape = new btConvexHullShape();
-  frogMesh->getConvexHullShape(shape);
-  m_shape = shape;
+  m_shape = storage->shapes()->get(frogMesh, ShapeCache::SimplifiedHullShape);
 
   float mass = 10.0;
   btVector3 localInertia(0, 0, 0);
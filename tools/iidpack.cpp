@@ -0,0 +1,171 @@
+/*
+ * This file is part of the Infinite Improbability Drive.
+ *
+ * Copyright (C) 2009 by Jernej Kos <kostko@unimatrix-one.org>
+ * Copyright (C) 2009 by Anze Vavpetic <anze.vavpetic@gmail.com>
+ */
+#include "storage/storage.h"
+#include "storage/arguments.h"
+#include "storage/archive.h"
+#include "storage/importers/base.h"
+#include "storage/importers/image.h"
+#include "storage/importers/3ds.h"
+#include "storage/importers/collada.h"
+#include "storage/importers/glsl.h"
+#include "storage/importers/audio.h"
+#include "storage/importers/truetype.h"
+#include "exceptions.h"
+#include "logger.h"
+
+#include <AL/alut.h>
+
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string.h>
+
+using namespace IID;
+using boost::format;
+
+/**
+ * Creates plain items of the given type. Compilation only needs item
+ * types and attributes, so no driver resources are ever created.
+ */
+class PackItemFactory : public ItemFactory {
+public:
+    PackItemFactory(const std::string &type)
+      : m_type(type)
+    {}
+    
+    Item *create(Storage *storage, const std::string &itemId, Item *parent)
+    {
+      return new Item(storage, m_type, itemId, "", parent);
+    }
+private:
+    std::string m_type;
+};
+
+/**
+ * Compiles files referenced by the manifest and collects the payloads
+ * into an archive.
+ */
+class Packer {
+public:
+    Packer(ArchiveWriter *writer, bool compress)
+      : m_writer(writer),
+        m_compress(compress),
+        m_logger(new Logger("iid.pack")),
+        m_packed(0),
+        m_skipped(0)
+    {}
+    
+    ~Packer()
+    {
+      delete m_logger;
+    }
+    
+    /**
+     * An argument handler that replaces load_file.
+     */
+    void loadFile(Storage *storage, Item *item, StringMap arguments)
+    {
+      if (arguments.find("loader") == arguments.end())
+        throw Exception("Missing 'loader' parameter for load_file!");
+      
+      if (arguments.find("path") == arguments.end())
+        throw Exception("Missing 'path' parameter for load_file!");
+      
+      Importer *importer = storage->importer(arguments["loader"]);
+      if (!importer)
+        throw Exception("No importer named '" + arguments["loader"] + "' can be found!");
+      
+      // Items that can not be compiled are loaded from the filesystem at runtime
+      std::string path = resolveFilePath(item, arguments["path"]);
+      std::vector<unsigned char> data;
+      if (!importer->compile(item, path, data)) {
+        m_logger->warning("Not packing '" + path + "', it will be loaded from the filesystem.");
+        m_skipped++;
+        return;
+      }
+      
+      m_writer->add(storagePath(item), data, m_compress);
+      m_logger->info(str(format("Packed '%s' (%d bytes).") % path % data.size()));
+      m_packed++;
+    }
+    
+    int packed() const { return m_packed; }
+    int skipped() const { return m_skipped; }
+private:
+    ArchiveWriter *m_writer;
+    bool m_compress;
+    Logger *m_logger;
+    int m_packed;
+    int m_skipped;
+};
+
+int main(int argc, char **argv)
+{
+  bool compress = false;
+  std::string output = "data.iidpak";
+  
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-z") == 0) {
+      compress = true;
+    } else if (argv[i][0] == '-') {
+      std::cerr << "Usage: " << argv[0] << " [-z] [output]" << std::endl;
+      std::cerr << "Packs manifest.xml in the current directory and all files it references." << std::endl;
+      return 1;
+    } else {
+      output = argv[i];
+    }
+  }
+  
+  // Sound decoding needs ALUT, but no audio device
+  alutInitWithoutContext(&argc, argv);
+  
+  ArchiveWriter writer;
+  Packer packer(&writer, compress);
+  
+  // The manifest is packed as-is
+  std::ifstream manifest("manifest.xml", std::ios::in | std::ios::binary);
+  if (!manifest) {
+    std::cerr << "Unable to open 'manifest.xml'!" << std::endl;
+    return 1;
+  }
+  
+  std::vector<unsigned char> data((std::istreambuf_iterator<char>(manifest)), std::istreambuf_iterator<char>());
+  writer.add("manifest.xml", data, compress);
+  
+  // Walk the manifest with the regular storage, but compile instead of load
+  {
+    Storage storage(0);
+    const char *types[] = { "Texture", "Mesh", "CompositeMesh", "Shader", "Material", "Sound", "Font" };
+    for (unsigned int i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+      storage.registerType(types[i], new PackItemFactory(types[i]));
+    
+    storage.registerArgument("load_file", boost::bind(&Packer::loadFile, &packer, _1, _2, _3));
+    storage.registerArgument("attribute", &argumentAttribute);
+    storage.registerArgument("depends", &argumentDepends);
+    
+    storage.registerImporter("iid.ImageImporter", new ImageImporter(0));
+    storage.registerImporter("iid.3DSMeshImporter", new ThreeDSMeshImporter(0));
+    storage.registerImporter("iid.ColladaMeshImporter", new ColladaMeshImporter(0));
+    storage.registerImporter("iid.GLSLImporter", new GLSLImporter(0));
+    storage.registerImporter("iid.SoundImporter", new SoundImporter(0));
+    storage.registerImporter("iid.TrueTypeImporter", new TrueTypeImporter(0));
+    storage.load();
+  }
+  
+  alutExit();
+  
+  if (!writer.write(output)) {
+    std::cerr << "Unable to write archive '" << output << "'!" << std::endl;
+    return 1;
+  }
+  
+  std::cout << str(format("Wrote '%s' with %d packed and %d skipped items.") % output % packer.packed() % packer.skipped()) << std::endl;
+  return 0;
+}
@@ -16,12 +16,14 @@
 #include "storage/texture.h"
 #include "storage/shader.h"
 #include "storage/sound.h"
+#include "storage/shapecache.h"
 #include "entities/entity.h"
 #include "context.h"
 
 // IID includes
 #include "drivers/openal.h"
 #include "scene/particles.h"
+#include "scene/particlemanager.h"
 
 #include <boost/lexical_cast.hpp>
 
@@ -153,7 +155,6 @@ public:
       Shader *shader = storage->get<Shader>("/Shaders/material");
       
       Vector3f whs = launcher->m_sceneNode->getLocalBoundingBox().getHalfSize();
-      Vector3f hs = missileMesh->getAABB().getHalfSize();
       
       // Create the missile's scene node
       m_sceneNode = m_scene->createNodeFromStorage(missileMesh, "rocket" + boost::lexical_cast<std::string>(m_rocketId++));
@@ -168,7 +169,7 @@ public:
       m_sceneNode->separateNodeFromParent();
       
       // Create the missile's physical shape and body
-      m_shape = new btBoxShape(btVector3(hs[0], hs[1], hs[2]));
+      m_shape = storage->shapes()->get(missileMesh, ShapeCache::BoxShape);
       float mass = 1.0;
       btVector3 localInertia(0, 0, 0);
       m_shape->calculateLocalInertia(mass, localInertia);
@@ -187,7 +188,8 @@ public:
       setTriggerFilter(Entity::CollisionTrigger);
       
       // Some eye-candy for when a rocket launches
-      m_exhaust = new Explosion("Exhaust " + boost::lexical_cast<std::string>(m_rocketId), 20);
+      ParticleManager *particles = m_scene->getParticleManager();
+      m_exhaust = particles->createExplosion("Exhaust " + boost::lexical_cast<std::string>(m_rocketId), 20);
       m_exhaust->setTexture(storage->get<Texture>("/Textures/particle"));
       m_exhaust->setPosition(0, 0, 0);
       m_exhaust->setOrientation(
@@ -209,7 +211,7 @@ public:
       m_sceneNode->attachChild(m_exhaust);
       
       // Prepare the explosion instance
-      m_boom = new Explosion("Explosion "+ boost::lexical_cast<std::string>(m_rocketId), 200);
+      m_boom = particles->createExplosion("Explosion "+ boost::lexical_cast<std::string>(m_rocketId), 200);
       m_boom->setTexture(storage->get<Texture>("/Textures/particle"));
       m_boom->setPosition(0, 0, 0);
       m_boom->setOrientation(
@@ -228,6 +230,7 @@ public:
       m_exhaust->boostSpeed(1000.0);
       
       m_boom->init();
+      m_boom->setAutoRelease(true);
       m_scene->attachNode(m_boom);
       
       // Prepare an explosion sound
@@ -247,7 +250,6 @@ public:
       delete m_motionState;
       delete m_sceneNode;
       delete m_body;
-      delete m_shape;
     }
     
     /**
@@ -266,6 +268,10 @@ public:
     
     void trigger(Entity *entity, TriggerType type)
     {
+      // Ignore further collisions once the rocket has exploded
+      if (!m_sceneNode)
+        return;
+      
       // Check if the weapon is already armed (it arms after 1 second); if it
       // impacts a toad it arms immediately
       if (m_armTimer.getTimeMilliseconds() < 1000 && (!entity || entity->getType() != "toad"))
@@ -292,7 +298,8 @@ public:
       // Remove rocket from the scene
       setCollisionObject(0);
       m_world->removeRigidBody(m_body);
-      m_scene->detachNode(m_sceneNode);
+      m_scene->queueDestroy(m_sceneNode);
+      m_sceneNode = 0;
       
       // We must not delete this object here as it could cause crashes in further
       // trigger processing